@@ -0,0 +1,280 @@
+#include "MailListView.hpp"
+#include <algorithm>
+#include <climits>
+#include <ctime>
+
+using namespace std;
+using namespace finalcut;
+
+void MailListView::setSession(IMAP::Session* session, set<uint32_t> const* marked) {
+	this->session = session;
+	this->marked = marked;
+	rows.clear();
+	top = current = 0;
+	currentUID = prefetchUID = 0;
+	refresh();
+}
+
+void MailListView::refresh() {
+	if(session) {
+		auto lock = session->lock();
+		size_t n = count();
+		// In UID order, find the cursor's message (or the one after it if it is gone); in other orders a message gone
+		// from them leaves the cursor where it was:
+		if(currentUID && showThreads()) {
+			size_t position = session->listThreads().position(currentUID);
+			if(position < n)
+				current = position;
+		} else if(currentUID && filtered)
+			current = lower_bound(filter.begin(), filter.end(), currentUID) - filter.begin();
+		else if(currentUID) {
+			size_t position = session->listMessages().position(currentUID, sortKey);
+			if(position < n)
+				current = descending ? n - 1 - position : position;
+			else if(sortKey == IMAP::MessageStore::BY_UID && !descending)
+				current = position;
+		}
+		current = n ? min(current, n - 1) : 0;
+		currentUID = n ? uidAt(current) : 0;
+	}
+	moveTo(current);
+}
+
+MailListView::Row const& MailListView::row(size_t index) {
+	auto& store = session->listMessages();
+	bool byUID = !showSorted();
+	auto message = byUID ? store.find(uidAt(index)) : store.at(storeIndex(index), sortKey);
+	auto& row = rows[index % rows.size()];
+	uint32_t uid = byUID ? uidAt(index) : store.uid(message);
+	uint32_t depth = showThreads() ? session->listThreads().list()[index].depth : 0;
+	bool stored = store.valid(message);
+	auto attributes = stored ? store.attributes(message) : IMAP::MessageAttributes();
+	if(row.index != index || row.uid != uid || row.depth != depth || row.stored != stored || row.flags != attributes.flags) {
+		row.index = index;
+		row.uid = uid;
+		row.depth = depth;
+		row.flags = attributes.flags;
+		// A search hit is shown blank until its envelope has been fetched (or if it has been expunged since):
+		row.stored = stored;
+		row.from = stored ? FString(string(store.from(message))) : FString();
+		row.subject = stored ? FString(string(2 * min(depth, MAX_INDENT), ' ') + string(store.subject(message))) : FString();
+		// Flagged before unread before answered, a single character:
+		row.status = "";
+		if(stored && (attributes.flags & IMAP::MessageAttributes::FLAGGED))
+			row.status = "!";
+		else if(stored && !(attributes.flags & IMAP::MessageAttributes::SEEN))
+			row.status = "N";
+		else if(stored && (attributes.flags & IMAP::MessageAttributes::ANSWERED))
+			row.status = "A";
+		char date[16] = "";
+		time_t time = attributes.date;
+		tm local;
+		if(attributes.date && localtime_r(&time, &local))
+			strftime(date, sizeof(date), "%Y-%m-%d", &local);
+		row.date = date;
+		row.size = stored ? formatSize(attributes.size) : FString();
+	}
+	return row;
+}
+
+FString MailListView::formatSize(uint32_t bytes) {
+	// At most SIZE_COLUMN characters: 999, 1.2K, 120K, 3.4M...
+	char const* units = "BKMG";
+	double size = bytes;
+	int unit = 0;
+	while(size >= 1000 && unit < 3) {
+		size /= 1024;
+		unit++;
+	}
+	char text[16];
+	if(unit == 0)
+		snprintf(text, sizeof(text), "%u", bytes);
+	else
+		snprintf(text, sizeof(text), size < 10 ? "%.1f%c" : "%.0f%c", size, units[unit]);
+	return text;
+}
+
+FString MailListView::heading(char const* title, IMAP::MessageStore::SortKey key) const {
+	string text = title;
+	if(showSorted() && key == sortKey)
+		text += descending ? " v" : " ^";
+	return FString(text);
+}
+
+void MailListView::setFilter(vector<uint32_t> uids) {
+	filter = move(uids);
+	filtered = true;
+	refresh();
+}
+
+void MailListView::clearFilter() {
+	filter.clear();
+	filtered = false;
+	refresh();
+}
+
+void MailListView::setThreaded(bool enable) {
+	threaded = enable;
+	refresh();
+}
+
+void MailListView::setSortOrder(IMAP::MessageStore::SortKey key, bool descending) {
+	sortKey = key;
+	this->descending = descending;
+	refresh();
+}
+
+vector<uint32_t> MailListView::around(size_t n, bool down) const {
+	vector<uint32_t> uids;
+	size_t depth = session->getPrefetchDepth();
+	if(!n || !depth)
+		return uids;
+	uids.push_back(uidAt(current));
+	for(size_t distance = 1; distance <= depth; distance++) {
+		for(bool after : {down, !down}) {
+			if(after && current + distance < n)
+				uids.push_back(uidAt(current + distance));
+			else if(!after && current >= distance)
+				uids.push_back(uidAt(current - distance));
+		}
+	}
+	return uids;
+}
+
+void MailListView::moveTo(long index) {
+	size_t n = 0;
+	vector<uint32_t> prefetch;
+	if(session) {
+		auto lock = session->lock();
+		n = count();
+		size_t previous = current;
+		current = n ? size_t(clamp<long>(index, 0, long(n) - 1)) : 0;
+		currentUID = n ? uidAt(current) : 0;
+		if(currentUID != prefetchUID)
+			prefetch = around(n, current >= previous);
+	}
+	// Only a move to another message starts a new round, which cancels what is left of the previous one:
+	if(session && currentUID != prefetchUID) {
+		prefetchUID = currentUID;
+		session->prefetchBodies(move(prefetch));
+	}
+	// Scroll just enough to keep the cursor in view:
+	if(current < top)
+		top = current;
+	else if(current >= top + pageSize())
+		top = current - pageSize() + 1;
+	redraw();
+}
+
+void MailListView::printCell(FString const& text, size_t width) {
+	if(text.getLength() >= width)
+		print(text.left(width));
+	else {
+		print(text);
+		print(FString(width - text.getLength(), L' '));
+	}
+}
+
+void MailListView::draw() {
+	using IMAP::MessageStore;
+	size_t width = getWidth();
+	// Date and Size only fit into a wide list:
+	bool wide = width >= WIDE_LIST;
+	size_t fixed = 5 + (wide ? DATE_COLUMN + SIZE_COLUMN + 2 : 0);
+	size_t fromWidth = width / 3;
+	size_t subjectWidth = width > fromWidth + fixed ? width - fromWidth - fixed : 0;
+	setColor();
+	setPrintPos(1, 1);
+	setBold();
+	printCell("*", 1);
+	print(" ");
+	printCell("", 1);
+	print(" ");
+	printCell(heading("From", MessageStore::BY_FROM), fromWidth);
+	print(" ");
+	printCell(heading("Subject", MessageStore::BY_SUBJECT), subjectWidth);
+	if(wide) {
+		print(" ");
+		printCell(heading("Date", MessageStore::BY_DATE), DATE_COLUMN);
+		print(" ");
+		printCell(heading("Size", MessageStore::BY_SIZE), SIZE_COLUMN);
+	}
+	unsetBold();
+
+	// The ring buffer holds the visible rows and the overscan on both sides:
+	size_t page = pageSize();
+	if(rows.size() != page + 2 * OVERSCAN)
+		rows.assign(page + 2 * OVERSCAN, Row{});
+	auto lock = session ? session->lock() : unique_lock<mutex>();
+	size_t n = count();
+	for(size_t y = 0; y < page; y++) {
+		size_t index = top + y;
+		setPrintPos(1, int(y) + 2);
+		if(index >= n) {
+			printCell("", width);
+			continue;
+		}
+		auto& r = row(index);
+		if(index == current)
+			setReverse();
+		printCell(marked && marked->count(r.uid) ? "*" : "", 1);
+		print(" ");
+		printCell(r.status, 1);
+		print(" ");
+		printCell(r.from, fromWidth);
+		print(" ");
+		printCell(r.subject, subjectWidth);
+		if(wide) {
+			print(" ");
+			printCell(r.date, DATE_COLUMN);
+			print(" ");
+			printCell(r.size, SIZE_COLUMN);
+		}
+		if(index == current)
+			unsetReverse();
+	}
+	// Materialize the overscan now, so scrolling a few lines does not touch the message store:
+	for(size_t index = top > OVERSCAN ? top - OVERSCAN : 0; index < min(n, top + page + OVERSCAN); index++)
+		row(index);
+}
+
+void MailListView::onKeyPress(FKeyEvent* ev) {
+	long page = pageSize();
+	switch(ev->key()) {
+	case fc::Fkey_up: moveTo(long(current) - 1); break;
+	case fc::Fkey_down: moveTo(long(current) + 1); break;
+	case fc::Fkey_page_up: moveTo(long(current) - page); break;
+	case fc::Fkey_page_down: moveTo(long(current) + page); break;
+	case fc::Fkey_home: moveTo(0); break;
+	case fc::Fkey_end: moveTo(LONG_MAX); break;
+	case fc::Fkey_return:
+	case fc::Fkey_enter: emitCallback("clicked"); break;
+	default: ev->ignore(); return;
+	}
+	ev->accept();
+}
+
+void MailListView::onMouseDown(FMouseEvent* ev) {
+	setFocus();
+	// Line 1 is the header:
+	if(ev->getY() >= 2)
+		moveTo(long(top) + ev->getY() - 2);
+}
+
+void MailListView::onMouseDoubleClick(FMouseEvent* ev) {
+	if(ev->getY() >= 2 && currentUID)
+		emitCallback("clicked");
+}
+
+void MailListView::onWheel(FWheelEvent* ev) {
+	// Scroll the window by a few lines, dragging the cursor along if it would leave the view:
+	long lines = ev->getWheel() == fc::WheelUp ? -4 : 4;
+	top = size_t(max<long>(long(top) + lines, 0));
+	size_t n = 0;
+	if(session) {
+		auto lock = session->lock();
+		n = count();
+	}
+	top = min(top, n > pageSize() ? n - pageSize() : 0);
+	moveTo(clamp<long>(current, top, long(top + pageSize()) - 1));
+}
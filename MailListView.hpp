@@ -0,0 +1,102 @@
+#ifndef MAILLISTVIEW_H
+#define MAILLISTVIEW_H
+#include "imap.hpp"
+#include <final/final.h>
+#include <cstdint>
+#include <set>
+#include <vector>
+
+// List of the messages held by a session that only materializes the rows in view plus an overscan above and below,
+// so scrolling and redrawing cost the same for 100 or 1M messages. Rows live in a ring buffer indexed by position
+// and are recycled as the window moves; a row is refilled when the message at its position has changed. Whenever the
+// cursor reaches another message, the session is asked to prefetch the bodies around it.
+struct MailListView : finalcut::FWidget {
+	explicit MailListView(finalcut::FWidget* parent = nullptr) : FWidget(parent) {}
+	void setSession(IMAP::Session* session, std::set<uint32_t> const* marked);
+	// UID of the message under the cursor, 0 if the list is empty:
+	uint32_t getCurrentUID() const { return currentUID; }
+	// To be called after the session's messages changed, keeps the cursor on the same message if it still exists:
+	void refresh();
+	// Show only the messages with the given (ascending) UIDs, e.g. search results, or all messages again:
+	void setFilter(std::vector<uint32_t> uids);
+	void clearFilter();
+	// Show the messages in conversation threads (replies indented below what they answer) or in UID order; a filter
+	// is always shown in UID order:
+	void setThreaded(bool enable);
+	bool isThreaded() const { return threaded; }
+	// Order the messages by key, largest first if descending; the store keeps every order, so switching is immediate.
+	// Filters and threads keep their own order:
+	void setSortOrder(IMAP::MessageStore::SortKey key, bool descending);
+	IMAP::MessageStore::SortKey getSortKey() const { return sortKey; }
+	bool isDescending() const { return descending; }
+
+protected:
+	void draw() override;
+	void onKeyPress(finalcut::FKeyEvent* ev) override;
+	void onMouseDown(finalcut::FMouseEvent* ev) override;
+	void onMouseDoubleClick(finalcut::FMouseEvent* ev) override;
+	void onWheel(finalcut::FWheelEvent* ev) override;
+
+private:
+	struct Row {
+		size_t index = SIZE_MAX;
+		uint32_t uid = 0;
+		uint32_t depth = 0;
+		uint32_t flags = 0;
+		bool stored = false;
+		finalcut::FString status;
+		finalcut::FString from;
+		finalcut::FString subject;
+		finalcut::FString date;
+		finalcut::FString size;
+	};
+	// Rows materialized above and below the visible ones:
+	static size_t const OVERSCAN = 16;
+	// Thread depth beyond which replies are not indented further:
+	static constexpr uint32_t MAX_INDENT = 12;
+	// Widths of the Date and Size columns, shown if the list is at least WIDE_LIST wide:
+	static constexpr size_t DATE_COLUMN = 10;
+	static constexpr size_t SIZE_COLUMN = 5;
+	static constexpr size_t WIDE_LIST = 60;
+	IMAP::Session* session{};
+	std::set<uint32_t> const* marked{};
+	std::vector<Row> rows{};
+	size_t top = 0;
+	size_t current = 0;
+	uint32_t currentUID = 0;
+	// Message the bodies were last prefetched around:
+	uint32_t prefetchUID = 0;
+	std::vector<uint32_t> filter{};
+	bool filtered = false;
+	bool threaded = false;
+	IMAP::MessageStore::SortKey sortKey = IMAP::MessageStore::BY_UID;
+	bool descending = false;
+	size_t pageSize() const { return getHeight() > 1 ? getHeight() - 1 : 1; }
+	bool showThreads() const { return threaded && !filtered; }
+	bool showSorted() const { return !threaded && !filtered; }
+	// Position in the store's order of the message at index (the session lock must be held):
+	size_t storeIndex(size_t index) const { return descending ? session->getNumMessages() - 1 - index : index; }
+	// Number of messages, the UID and the row at index (filled from the session if necessary), the session lock must
+	// be held:
+	size_t count() const {
+		return filtered ? filter.size() : !session ? 0 : threaded ? session->listThreads().list().size() : session->getNumMessages();
+	}
+	uint32_t uidAt(size_t index) const {
+		return filtered ? filter[index]
+									: threaded ? session->listThreads().list()[index].uid
+														 : session->listMessages().uidAt(storeIndex(index), sortKey);
+	}
+	Row const& row(size_t index);
+	// UIDs to prefetch for the cursor: its own, then alternately the next ones in the direction it moved (down if
+	// down is set) and those behind it, up to the session's prefetch depth on each side (the session lock must be
+	// held):
+	std::vector<uint32_t> around(size_t n, bool down) const;
+	void moveTo(long index);
+	void printCell(finalcut::FString const& text, size_t width);
+	// Function to format a size for the Size column:
+	static finalcut::FString formatSize(uint32_t bytes);
+	// Function to return the header of a column, marked if the list is sorted by key:
+	finalcut::FString heading(char const* title, IMAP::MessageStore::SortKey key) const;
+};
+
+#endif /* MAILLISTVIEW_H */
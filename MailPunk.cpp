@@ -1,8 +1,136 @@
+#include "engine.hpp"
+#include "exporter.hpp"
 #include "imap.hpp"
 #include "UI.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <fstream>
 #include <memory>
+#include <mutex>
+#include <sstream>
+
+// Headless backup: logs in with SERVER, USER and PASSWORD from the environment (as the login dialog does) and
+// exports mailboxes - every one unless some are named - without starting the UI.
+static int exportMailboxes(int argc, char** argv) {
+	IMAP::ExportOptions options;
+	std::vector<std::string> mailboxes;
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool value = i + 1 < argc;
+		if(arg == "--export" && value)
+			options.destination = argv[++i];
+		else if(arg == "--mbox")
+			options.format = IMAP::ExportOptions::MBOX;
+		else if(arg == "--mailbox" && value)
+			mailboxes.push_back(argv[++i]);
+		else if(arg == "--writers" && value)
+			options.writers = strtoul(argv[++i], nullptr, 10);
+		else if(arg == "--sync")
+			options.sync = true;
+		else {
+			fprintf(stderr, "Usage: %s --export DIR [--mbox] [--mailbox NAME]... [--writers N] [--sync]\n", argv[0]);
+			return 2;
+		}
+	}
+	// Not USER, which the shell sets to the local login:
+	auto server = getenv("MAILPUNK_SERVER");
+	auto user = getenv("MAILPUNK_USER");
+	auto password = getenv("MAILPUNK_PASSWORD");
+	if(!server || !user || !password) {
+		fprintf(stderr, "Set MAILPUNK_SERVER, MAILPUNK_USER and MAILPUNK_PASSWORD to log in.\n");
+		return 2;
+	}
+
+	try {
+		IMAP::Session session([](IMAP::SyncDelta const&) {});
+		if(auto compress = getenv("MAILPUNK_COMPRESS"))
+			session.setCompression(strcmp(compress, "0") != 0);
+		if(auto trace = getenv("MAILPUNK_TRACE"))
+			session.getMetrics().startTrace(trace);
+		session.connect(server);
+		session.login(user, password);
+		IMAP::Exporter exporter(session, options, [](IMAP::ExportProgress const& progress) {
+			if(progress.messages % 100 == 0 || progress.messages == progress.mailbox_total)
+				fprintf(stderr, "\r%s: %llu/%llu messages, %.1f MiB fetched", progress.mailbox.c_str(),
+								(unsigned long long)progress.messages, (unsigned long long)progress.mailbox_total,
+								progress.total_bytes / 1048576.0);
+		});
+		auto total = exporter.run(mailboxes);
+		fprintf(stderr, "\nExported %llu messages (%.1f MiB).\n", (unsigned long long)total.total_messages,
+						total.total_bytes / 1048576.0);
+	} catch(std::exception const& error) {
+		fprintf(stderr, "\n%s\n", error.what());
+		return 1;
+	}
+	return 0;
+}
+
+// Headless watch of many accounts on one connection each (and one thread for all): reads the accounts from a file
+// with a line "server[:port] user password [mailbox]" per account and prints their changes until interrupted.
+static int watchAccounts(int argc, char** argv) {
+	if(argc != 3) {
+		fprintf(stderr, "Usage: %s --watch FILE\n", argv[0]);
+		return 2;
+	}
+	std::ifstream file(argv[2]);
+	if(!file) {
+		fprintf(stderr, "Unable to read %s.\n", argv[2]);
+		return 1;
+	}
+	std::vector<IMAP::AccountConfig> accounts;
+	std::string line;
+	while(std::getline(file, line)) {
+		std::istringstream words(line);
+		IMAP::AccountConfig account;
+		if(line.empty() || line[0] == '#' || !(words >> account.server >> account.user >> account.password))
+			continue;
+		words >> account.mailbox;
+		auto colon = account.server.rfind(':');
+		if(colon != std::string::npos) {
+			account.port = strtoul(account.server.c_str() + colon + 1, nullptr, 10);
+			account.server.erase(colon);
+		}
+		accounts.push_back(account);
+	}
+
+	// Block the signals before the engine starts its threads, so only sigwait sees them:
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	std::mutex output;
+	{
+		IMAP::AccountEngine engine;
+		for(auto& account : accounts) {
+			auto name = account.user + "@" + account.server + "/" + account.mailbox;
+			engine.add(account, [name, &output](IMAP::AccountEvent const& event) {
+				std::lock_guard<std::mutex> guard(output);
+				if(event.kind == IMAP::AccountEvent::CONNECTED)
+					printf("%s: %u messages\n", name.c_str(), event.exists);
+				else if(event.kind == IMAP::AccountEvent::CHANGED)
+					printf("%s: %u new, %zu expunged, %zu changed (%u messages)\n", name.c_str(), event.added,
+								 event.expunged.size(), event.flagged.size(), event.exists);
+				else
+					printf("%s: %s\n", name.c_str(), event.error.c_str());
+				fflush(stdout);
+			});
+		}
+		int signal;
+		sigwait(&signals, &signal);
+	}
+	return 0;
+}
 
 int main(int argc, char** argv) {
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--export") == 0)
+			return exportMailboxes(argc, argv);
+		if(strcmp(argv[i], "--watch") == 0)
+			return watchAccounts(argc, argv);
+	}
 	auto elements = std::make_unique<UI>(argc, argv);
 	return elements->exec();
 }
@@ -0,0 +1,265 @@
+#include "MessageView.hpp"
+#include "mime.hpp"
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace finalcut;
+
+void MessageView::setMessage(IMAP::Session* session, uint32_t uid) {
+	this->session = session;
+	this->uid = uid;
+	window = string();
+	start = size = top = 0;
+	sized = pending = atEnd = decoded = false;
+	error.clear();
+	alive = make_shared<bool>(true);
+	if(session)
+		request(0);
+	redraw();
+}
+
+void MessageView::request(uint32_t offset) {
+	if(pending)
+		return;
+	pending = true;
+	auto view = this;
+	auto session = this->session;
+	auto uid = this->uid;
+	weak_ptr<bool> token = alive;
+	session->async([session, uid, offset]() { return session->fetchBodyRange(uid, offset, CHUNK); },
+								 [view, token](IMAP::BodyRange const& range) {
+									 if(!token.expired())
+										 view->received(range);
+								 },
+								 [view, token](string const& error) {
+									 if(token.expired())
+										 return;
+									 view->pending = false;
+									 view->error = error;
+									 view->redraw();
+								 });
+}
+
+void MessageView::received(IMAP::BodyRange const& range) {
+	pending = false;
+	size = range.size;
+	sized = true;
+	// Extend the window by the chunk if it is adjacent, otherwise (after a jump) start over from it:
+	if(range.offset == end() && !window.empty())
+		window += range.data;
+	else if(range.offset + range.data.size() == start && !window.empty()) {
+		window.insert(0, range.data);
+		start = range.offset;
+	} else {
+		window = range.data;
+		start = range.offset;
+	}
+	// Chunks start at multiples of CHUNK, drop whole ones on the side away from the view until we are within WINDOW:
+	while(window.size() > WINDOW) {
+		if(top >= start + window.size() / 2) {
+			window.erase(0, CHUNK);
+			start += CHUNK;
+		} else
+			window.resize((end() - 1) / CHUNK * CHUNK - start);
+	}
+	if(size <= DECODE_LIMIT && start == 0 && end() == size) {
+		decode();
+		return;
+	}
+	if(atEnd && end() == size) {
+		atEnd = false;
+		top = size;
+		scroll(-long(getHeight()));
+		return;
+	}
+	prefetch();
+	redraw();
+}
+
+void MessageView::decode() {
+	using IMAP::MimePart;
+	auto message = MimePart::parse(window);
+	string text;
+	for(auto name : {"From", "To", "Cc", "Date", "Subject"}) {
+		auto value = MimePart::header(message.headers, name);
+		if(!value.empty())
+			text += string(name) + ": " + MimePart::decodeHeader(value) + "\n";
+	}
+	text += "\n";
+	// Only the part shown is decoded, the others are just listed:
+	auto shown = message.findText();
+	if(shown)
+		text += shown->decode();
+	vector<MimePart const*> stack{&message};
+	while(!stack.empty()) {
+		auto part = stack.back();
+		stack.pop_back();
+		for(auto child = part->parts.rbegin(); child != part->parts.rend(); ++child)
+			stack.push_back(&*child);
+		if(part != shown && part->parts.empty() && part->isAttachment())
+			text += "\n[" + string(part->type) + "/" + string(part->subtype) + " " + string(part->filename) + "]";
+	}
+	window = move(text);
+	start = top = 0;
+	size = uint32_t(window.size());
+	decoded = true;
+	atEnd = false;
+	redraw();
+}
+
+void MessageView::prefetch() {
+	if(!session || pending || !sized || decoded)
+		return;
+	// After a jump the view may be outside the window altogether:
+	if((top < start || top >= end()) && top < size) {
+		request(top / CHUNK * CHUNK);
+		return;
+	}
+	uint32_t bottom = top;
+	for(size_t y = 0; y < getHeight(); y++)
+		if(!nextLine(bottom)) {
+			bottom = end();
+			break;
+		}
+	// Small messages are fetched completely to be decoded:
+	if(end() < size && (size <= DECODE_LIMIT || end() - bottom < CHUNK / 2))
+		request(end());
+	else if(start > 0 && top - start < CHUNK / 2)
+		request(start - CHUNK);
+}
+
+bool MessageView::nextLine(uint32_t& offset) const {
+	if(offset < start || offset >= end())
+		return false;
+	size_t rel = offset - start;
+	size_t limit = rel + MAX_LINE;
+	size_t i = window.find('\n', rel);
+	if(i != string::npos && i < limit)
+		offset = start + uint32_t(i) + 1;
+	else if(limit <= window.size())
+		offset = start + uint32_t(limit);
+	else if(end() >= size)
+		offset = size;
+	else
+		return false;
+	return true;
+}
+
+bool MessageView::previousLine(uint32_t& offset) const {
+	if(offset == 0 || offset <= start || offset > end())
+		return false;
+	// The previous line starts after the line break before offset - 1, or at the start of the body:
+	size_t rel = offset - start;
+	size_t i = rel >= 2 ? window.rfind('\n', rel - 2) : string::npos;
+	uint32_t lineStart;
+	if(i != string::npos)
+		lineStart = start + uint32_t(i) + 1;
+	else if(start == 0)
+		lineStart = 0;
+	else
+		return false;
+	// Account for long lines broken every MAX_LINE bytes:
+	offset = lineStart + (offset - 1 - lineStart) / MAX_LINE * MAX_LINE;
+	return true;
+}
+
+string_view MessageView::lineAt(uint32_t offset) const {
+	string_view rest = string_view(window).substr(offset - start, MAX_LINE);
+	return rest.substr(0, rest.find('\n'));
+}
+
+void MessageView::scroll(long lines) {
+	for(; lines > 0; lines--) {
+		uint32_t next = top;
+		if(!nextLine(next) || next >= size)
+			break;
+		top = next;
+	}
+	for(; lines < 0 && previousLine(top); lines++)
+		;
+	prefetch();
+	redraw();
+}
+
+void MessageView::printCell(FString const& text, size_t width) {
+	if(text.getLength() >= width)
+		print(text.left(width));
+	else {
+		print(text);
+		print(FString(width - text.getLength(), L' '));
+	}
+}
+
+void MessageView::draw() {
+	size_t width = getWidth();
+	setColor();
+	uint32_t offset = top;
+	bool blank = false;
+	for(size_t y = 0; y < getHeight(); y++) {
+		setPrintPos(1, int(y) + 1);
+		if(blank || (sized && offset >= size)) {
+			printCell("", width);
+			continue;
+		}
+		// The rest of the screen waits for the next chunk:
+		if(offset < start || offset >= end()) {
+			printCell(error.empty() ? "Loading..." : FString(error), width);
+			blank = true;
+			continue;
+		}
+		// Expand tabs and drop carriage returns and other control characters, only as much as fits:
+		string text;
+		for(char c : lineAt(offset)) {
+			if(text.size() >= 4 * width)
+				break;
+			if(c == '\t')
+				text.append(8 - text.size() % 8, ' ');
+			else if((unsigned char)c >= 0x20)
+				text += c;
+		}
+		printCell(FString(text), width);
+		if(!nextLine(offset))
+			offset = end();
+	}
+}
+
+void MessageView::onKeyPress(FKeyEvent* ev) {
+	long page = max<long>(long(getHeight()) - 1, 1);
+	switch(ev->key()) {
+	case fc::Fkey_up: scroll(-1); break;
+	case fc::Fkey_down: scroll(1); break;
+	case fc::Fkey_page_up: scroll(-page); break;
+	case fc::Fkey_page_down:
+	case fc::Fkey_space: scroll(page); break;
+	case fc::Fkey_home:
+		top = 0;
+		scroll(0);
+		break;
+	case fc::Fkey_end:
+		// Small messages jump to their end once decoded:
+		if(!sized || (size <= DECODE_LIMIT && !decoded))
+			break;
+		// Show the last screen once the last chunk is there:
+		if(end() == size) {
+			top = size;
+			scroll(-long(getHeight()));
+		} else {
+			atEnd = true;
+			top = size ? (size - 1) / CHUNK * CHUNK : 0;
+			scroll(0);
+		}
+		break;
+	case fc::Fkey_escape:
+		// Drop the body right away, the dialog may outlive the view:
+		setMessage(nullptr, 0);
+		emitCallback("closed");
+		break;
+	default: ev->ignore(); return;
+	}
+	ev->accept();
+}
+
+void MessageView::onWheel(FWheelEvent* ev) {
+	scroll(ev->getWheel() == fc::WheelUp ? -4 : 4);
+}
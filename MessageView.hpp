@@ -0,0 +1,64 @@
+#ifndef MESSAGEVIEW_H
+#define MESSAGEVIEW_H
+#include "imap.hpp"
+#include <final/final.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Viewer of a message body that fetches it in ranges of CHUNK bytes as the user scrolls, so the first screen shows
+// after one small FETCH whatever the size of the message. At most WINDOW bytes of the body are held at a time: chunks
+// far from the view are dropped, and fetched again if the user scrolls back to them. Messages up to DECODE_LIMIT are
+// fetched completely and then replaced by their main headers and decoded text part; larger ones stay raw.
+struct MessageView : finalcut::FWidget {
+	explicit MessageView(finalcut::FWidget* parent = nullptr) : FWidget(parent) {}
+	// Show the body of the message with the given UID, or nothing (dropping the held body) if session is null:
+	void setMessage(IMAP::Session* session, uint32_t uid);
+
+protected:
+	void draw() override;
+	void onKeyPress(finalcut::FKeyEvent* ev) override;
+	void onWheel(finalcut::FWheelEvent* ev) override;
+
+private:
+	static constexpr uint32_t CHUNK = 64 * 1024;
+	static constexpr uint32_t WINDOW = 16 * CHUNK;
+	// Lines longer than this are broken, so a body without line breaks still scrolls:
+	static constexpr uint32_t MAX_LINE = 4096;
+	static constexpr uint32_t DECODE_LIMIT = WINDOW / 2;
+	IMAP::Session* session{};
+	uint32_t uid = 0;
+	// Bytes [start, end()) of the body, whose size is known once the first chunk has arrived:
+	std::string window{};
+	uint32_t start = 0;
+	uint32_t size = 0;
+	bool sized = false;
+	// Offset of the first line shown:
+	uint32_t top = 0;
+	// A chunk is being fetched, the last chunk was asked for by End:
+	bool pending = false;
+	bool atEnd = false;
+	// The window holds the decoded text rather than the raw body:
+	bool decoded = false;
+	std::string error{};
+	// Replaced whenever the message changes, so chunks of a previous message (or arriving after the view is gone)
+	// are dropped:
+	std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+	uint32_t end() const { return start + uint32_t(window.size()); }
+	// Move offset (a line start in the window) to the next or previous line start, false if the window does not
+	// reach it:
+	bool nextLine(uint32_t& offset) const;
+	bool previousLine(uint32_t& offset) const;
+	std::string_view lineAt(uint32_t offset) const;
+	void scroll(long lines);
+	void request(uint32_t offset);
+	void received(IMAP::BodyRange const& range);
+	// Replace the (complete) raw body by its decoded text:
+	void decode();
+	// Fetch the chunk the view is about to need, if any:
+	void prefetch();
+	void printCell(finalcut::FString const& text, size_t width);
+};
+
+#endif /* MESSAGEVIEW_H */
@@ -1,73 +1,496 @@
 #include "UI.hpp"
+#include <cstring>
+#include <filesystem>
 
 using namespace std;
 using namespace finalcut;
+void UIPump::onTimer(FTimerEvent*) {
+	delete ui->retiredSession;
+	ui->retiredSession = nullptr;
+	if(ui->imapSession)
+		ui->imapSession->dispatch();
+}
+
+function<void(string const&)> UI::showError() {
+	auto elements = this;
+	return [elements](string const& error) { FMessageBox::info(elements->mailDialog, "Error", error); };
+}
+
 void UI::refreshMailList() {
-	auto oldMailDialog = mailDialog;
+	if(!mailDialog)
+		createMailList();
+	auto elements = this;
+	auto session = imapSession;
+	statusBar->setMessage("Loading " + session->getMailbox() + "...");
+	statusBar->drawMessage();
+	// Messages stream into the list through applyDelta while they are loaded:
+	session->async([session]() { session->getMessages(); },
+								 [elements, session]() {
+									 // Tell how much compression saved, if it is on, and where the time went:
+									 auto traffic = session->getTraffic();
+									 char message[96] = "";
+									 if(session->isCompressed())
+										 snprintf(message, sizeof(message), "%.1f MiB received, compressed %.1fx; ",
+															traffic.wire_read / 1048576.0, traffic.ratio());
+									 elements->statusBar->setMessage(message + session->getMetrics().summary());
+									 elements->statusBar->drawMessage();
+								 },
+								 showError());
+}
+
+void UI::applyDelta(IMAP::SyncDelta const& delta) {
+	for(auto uid : delta.removed)
+		markedUIDs.erase(uid);
+	// The list reads the session's messages itself, it only has to redraw the rows in view (or search again; server
+	// results stay as they are while their envelopes stream in):
+	auto items = delta.added.size() + delta.removed.size() + delta.changed.size();
+	imapSession->getMetrics().time(IMAP::Metrics::LIST_REBUILD, nullptr, [this]() {
+		if(mailListView && !searchQuery.empty() && !serverSearch)
+			applySearch();
+		else if(mailListView)
+			mailListView->refresh();
+	}, items);
+}
+
+void UI::showMetrics() {
+	auto dialog = new FDialog("Metrics", app);
+	dialog->setGeometry(2, 2, 78, 20);
+	auto view = new FListView(dialog);
+	view->setGeometry(1, 1, 74, 17);
+	view->addColumn("Operation", 16);
+	view->addColumn("Count");
+	view->addColumn("p50 ms");
+	view->addColumn("p99 ms");
+	view->addColumn("Total ms");
+	view->addColumn("KiB in");
+	view->addColumn("KiB out");
+	view->addColumn("Items");
+	auto ms = [](uint64_t micros) {
+		char text[32];
+		snprintf(text, sizeof(text), "%.1f", micros / 1e3);
+		return string(text);
+	};
+	for(auto& stats : imapSession->getMetrics().snapshot())
+		view->insert({stats.name, to_string(stats.count), ms(stats.percentile(0.5)), ms(stats.percentile(0.99)),
+									ms(stats.micros), to_string(stats.bytes_in / 1024), to_string(stats.bytes_out / 1024),
+									to_string(stats.items)});
+	// Enter goes back to the list:
+	view->addCallback("clicked", [](FWidget* widget, void* ptr) {
+		auto elements = static_cast<UI*>(ptr);
+		widget->getParentWidget()->close();
+		elements->mailListView->setFocus();
+		elements->app->redraw();
+	}, this);
+	dialog->show();
+	view->setFocus();
+	app->redraw();
+}
+
+void UI::openFolders() {
+	if(folderDialog)
+		return;
+	folderDialog = new FDialog("Folders", app);
+	folderDialog->setGeometry(2, 2, 72, 20);
+	folderView = new FListView(folderDialog);
+	folderView->setGeometry(1, 1, 68, 17);
+	folderView->addColumn("Folder", 36);
+	folderView->addColumn("Messages");
+	folderView->addColumn("Unseen");
+	folderView->addColumn("Path", 24);
+	// Show the tree as last known (from disk at first) right away, then ask the server for a fresh one:
+	fillFolders();
+	auto session = imapSession;
+	session->async([session]() { session->fetchFolders(); }, []() {}, showError());
+	// Enter opens the selected folder:
+	folderView->addCallback("clicked", [](FWidget* widget, void* ptr) {
+		auto elements = static_cast<UI*>(ptr);
+		auto item = static_cast<FListView*>(widget)->getCurrentItem();
+		auto name = item ? item->getText(4).toString() : ""s;
+		elements->switchFolder(name);
+	}, this);
+	folderDialog->show();
+	folderView->setFocus();
+	app->redraw();
+}
+
+void UI::fillFolders() {
+	if(!folderView)
+		return;
+	folderView->clear();
+	auto guard = imapSession->lock();
+	for(auto& folder : imapSession->listFolders().list()) {
+		auto count = [&folder](uint32_t n) { return folder.has_status ? to_string(n) : ""s; };
+		folderView->insert({string(2 * IMAP::FolderTree::depth(folder), ' ') + IMAP::FolderTree::leaf(folder),
+												count(folder.status.messages), count(folder.status.unseen), folder.name});
+	}
+	guard.unlock();
+	app->redraw();
+}
+
+void UI::switchFolder(string const& name) {
+	folderDialog->close();
+	folderDialog = nullptr;
+	folderView = nullptr;
+	auto guard = imapSession->lock();
+	auto folder = imapSession->listFolders().find(name);
+	bool selectable = folder && folder->selectable;
+	guard.unlock();
+	if(!selectable || name == imapSession->getMailbox()) {
+		mailListView->setFocus();
+		app->redraw();
+		return;
+	}
+	mailDialog->setText(name);
+	markedUIDs.clear();
+	searchQuery.clear();
+	serverSearch = false;
+	statusBar->setMessage("Loading " + name + "...");
+	statusBar->drawMessage();
+	mailListView->setFocus();
+	// Cached envelopes of the folder stream into the list before the server is asked what changed:
+	auto elements = this;
+	auto session = imapSession;
+	session->async([session, name]() {
+		session->selectMailbox(name);
+		session->getMessages();
+	}, [elements]() {
+		elements->statusBar->setMessage(elements->imapSession->getMetrics().summary());
+		elements->statusBar->drawMessage();
+	}, showError());
+	app->redraw();
+}
+
+void UI::openSearch(bool server) {
+	if(searchDialog)
+		return;
+	serverSearch = server;
+	searchDialog = new FDialog(server ? "Search on server" : "Search", app);
+	searchDialog->setGeometry(4, 2, 50, 4);
+	auto input = new FLineEdit(searchDialog);
+	input->setGeometry(2, 1, 44, 1);
+	input->unsetShadow();
+	input->setText(searchQuery);
+	// Filter the list while typing, Enter goes back to the list (and starts a server search):
+	input->addCallback("changed", [](FWidget* widget, void* ptr) {
+		auto elements = static_cast<UI*>(ptr);
+		elements->searchQuery = static_cast<FLineEdit*>(widget)->getText().toString();
+		if(!elements->serverSearch)
+			elements->applySearch();
+	}, this);
+	input->addCallback("activate", [](FWidget*, void* ptr) {
+		auto elements = static_cast<UI*>(ptr);
+		if(elements->serverSearch)
+			elements->runServerSearch();
+		elements->searchDialog->close();
+		elements->searchDialog = nullptr;
+		elements->mailListView->setFocus();
+		elements->app->redraw();
+	}, this);
+	searchDialog->show();
+	input->setFocus();
+	app->redraw();
+}
+
+void UI::runServerSearch() {
+	if(searchQuery.empty()) {
+		serverSearch = false;
+		applySearch();
+		return;
+	}
+	auto elements = this;
+	auto session = imapSession;
+	statusBar->setMessage("Searching " + session->getMailbox() + "...");
+	statusBar->drawMessage();
+	// Show the hits as soon as the server names them, their envelopes follow chunk by chunk:
+	session->async(
+			[session, elements, query = searchQuery]() {
+				return session->searchServer(query, true, [elements](vector<uint32_t> const& uids) {
+					elements->mailListView->setFilter(uids);
+					elements->statusBar->setMessage(to_string(uids.size()) + " matching messages, loading...");
+					elements->statusBar->drawMessage();
+				}).size();
+			},
+			[elements](size_t matches) {
+				elements->statusBar->setMessage(to_string(matches) + " matching messages");
+				elements->statusBar->drawMessage();
+			},
+			showError());
+}
+
+void UI::applySearch() {
+	if(searchQuery.empty()) {
+		mailListView->clearFilter();
+		statusBar->setMessage("");
+	} else {
+		// The local index answers without contacting the server:
+		auto uids = imapSession->searchLocal(searchQuery);
+		statusBar->setMessage(to_string(uids.size()) + " matching messages");
+		mailListView->setFilter(move(uids));
+	}
+	statusBar->drawMessage();
+}
+
+void UI::toggleMark() {
+	auto uid = mailListView->getCurrentUID();
+	if(!uid)
+		return;
+	if(!markedUIDs.erase(uid))
+		markedUIDs.insert(uid);
+	mailListView->redraw();
+}
+
+void UI::createMailList() {
 	mailDialog = new FDialog(app);
 	app->setMainWidget(mailDialog);
 	app->setActiveWindow(mailDialog);
-	if(oldMailDialog)
-		oldMailDialog->close();
 
-	mailDialog->setText("INBOX");
+	mailDialog->setText(imapSession->getMailbox());
 	mailDialog->zoomWindow();
 
-	auto oldmailListView = mailListView;
-	// mailListView->unsetFocus();
-	mailListView = new FListView(mailDialog);
+	mailListView = new MailListView(mailDialog);
 	mailListView->setGeometry(mailDialog->getGeometry());
-	mailListView->addColumn("From");
-	mailListView->addColumn("Subject");
-	auto messages = imapSession->getMessages();
-	if(!viewToMessageMap)
-		viewToMessageMap = new map<FObject*, IMAP::Message*>();
-	viewToMessageMap->clear();
-
-	for(size_t i = 0; messages[i]; i++) {
-		(*(viewToMessageMap))[*mailListView->insert(
-				{messages[i]->getField("From"), messages[i]->getField("Subject")})] = messages[i];
-	}
-	mailListView->addCallback("clicked", [](FWidget* view, void* ptr) {
-		auto elements = static_cast<UI*>(ptr);
-		auto listView = static_cast<FListView*>(view);
-		auto item = listView->getCurrentItem();
-		auto message = (*(elements->viewToMessageMap))[item];
-		auto body = message->getBody();
-		FMessageBox::info(elements->mailDialog, listView->getCurrentItem()->getText(2), body);
-	}, this);
+	mailListView->setSession(imapSession, &markedUIDs);
+	mailListView->addCallback("clicked", [](FWidget*, void* ptr) { static_cast<UI*>(ptr)->openMessage(); }, this);
 	mailDialog->activateDialog();
 	mailListView->setFocus();
 	mailDialog->show();
 	app->redraw();
 }
 
+void UI::openMessage() {
+	auto uid = mailListView->getCurrentUID();
+	if(!uid || messageDialog)
+		return;
+	string subject;
+	{
+		auto lock = imapSession->lock();
+		if(auto message = imapSession->findMessage(uid))
+			subject = string(message->getField("Subject"));
+	}
+	messageDialog = new FDialog(subject, app);
+	messageDialog->zoomWindow();
+	// The view fetches the body chunk by chunk while it is shown, Escape goes back to the list:
+	auto view = new MessageView(messageDialog);
+	view->setGeometry(messageDialog->getGeometry());
+	view->addCallback("closed", [](FWidget*, void* ptr) {
+		auto elements = static_cast<UI*>(ptr);
+		elements->messageDialog->close();
+		elements->messageDialog = nullptr;
+		elements->mailListView->setFocus();
+		elements->app->redraw();
+	}, this);
+	view->setMessage(imapSession, uid);
+	// Opening the message is what reads it, the body itself is only peeked at:
+	auto session = imapSession;
+	session->async([session, uid]() { session->markSeen(uid); }, []() {}, showError());
+	messageDialog->show();
+	view->setFocus();
+	app->redraw();
+}
+
+void UI::openAttachments() {
+	auto uid = mailListView->getCurrentUID();
+	if(!uid)
+		return;
+	auto elements = this;
+	auto session = imapSession;
+	statusBar->setMessage("Loading attachments...");
+	statusBar->drawMessage();
+	// Only the structure of the message is fetched:
+	session->async([session, uid]() { return session->fetchAttachments(uid); },
+								 [elements, uid](vector<IMAP::Attachment> const& list) { elements->showAttachments(uid, list); },
+								 showError());
+}
+
+void UI::showAttachments(uint32_t uid, vector<IMAP::Attachment> const& list) {
+	statusBar->setMessage(list.empty() ? "No attachments" : "");
+	statusBar->drawMessage();
+	if(list.empty())
+		return;
+	attachments = list;
+	attachmentUID = uid;
+	auto dialog = new FDialog("Attachments", app);
+	dialog->setGeometry(4, 2, 72, 12);
+	auto view = new FListView(dialog);
+	view->setGeometry(1, 1, 68, 9);
+	view->addColumn("Part");
+	view->addColumn("Name", 32);
+	view->addColumn("Type", 20);
+	view->addColumn("Size");
+	for(auto& attachment : attachments)
+		view->insert({attachment.section, attachment.filename.empty() ? "(unnamed)" : attachment.filename, attachment.type,
+									to_string(attachment.size)});
+	// Enter saves the selected attachment and goes back to the list:
+	view->addCallback("clicked", [](FWidget* widget, void* ptr) {
+		auto elements = static_cast<UI*>(ptr);
+		auto item = static_cast<FListView*>(widget)->getCurrentItem();
+		auto part = item ? item->getText(1).toString() : ""s;
+		for(auto& attachment : elements->attachments)
+			if(attachment.section == part)
+				elements->saveAttachment(attachment);
+		widget->getParentWidget()->close();
+		elements->mailListView->setFocus();
+		elements->app->redraw();
+	}, this);
+	dialog->show();
+	view->setFocus();
+	app->redraw();
+}
+
+void UI::saveAttachment(IMAP::Attachment const& attachment) {
+	// Save into the download directory, under the attachment's own name without any directories:
+	auto dir = getenv("XDG_DOWNLOAD_DIR") ? string(getenv("XDG_DOWNLOAD_DIR"))
+																				: getenv("HOME") ? string(getenv("HOME")) + "/Downloads" : "."s;
+	auto name = filesystem::path(attachment.filename).filename().string();
+	if(name.empty() || name == "." || name == "..")
+		name = "part-" + attachment.section;
+	error_code ec;
+	filesystem::create_directories(dir, ec);
+	auto path = dir + "/" + name;
+	auto elements = this;
+	auto session = imapSession;
+	auto uid = attachmentUID;
+	statusBar->setMessage("Saving " + name + "...");
+	statusBar->drawMessage();
+	session->async(
+			[session, elements, uid, attachment, path, name]() {
+				return session->saveAttachment(uid, attachment, path, [elements, name](uint64_t fetched, uint64_t size) {
+					auto percent = size ? min<uint64_t>(100, fetched * 100 / size) : 100;
+					elements->statusBar->setMessage("Saving " + name + "... " + to_string(percent) + "%");
+					elements->statusBar->drawMessage();
+				});
+			},
+			[elements, path](uint64_t bytes) {
+				elements->statusBar->setMessage("Saved " + path + " (" + to_string(bytes) + " bytes)");
+				elements->statusBar->drawMessage();
+			},
+			showError());
+}
+
 void UI::loginClicked(FWidget*) {
+	// A login is already in progress or done:
+	if(imapSession)
+		return;
 	auto elements = this;
 	auto& session =
-			*(elements->imapSession = new IMAP::Session([elements]() { elements->refreshMailList(); }));
-	try {
-		session.connect(elements->inputFields["server"]->getText().toString());
-		session.login(elements->inputFields["user"]->getText().toString(),
-									elements->inputFields["password"]->getText().toString());
-		session.selectMailbox("INBOX");
-	} catch(runtime_error const& exception) {
-		FMessageBox::info(elements->initDialog, "Error", exception.what());
-		return;
-	}
+			*(elements->imapSession = new IMAP::Session([elements](IMAP::SyncDelta const& delta) { elements->applyDelta(delta); }));
+	// Counters and folders changed by the I/O thread show up in an open folder browser:
+	session.updateFolders = [elements]() { elements->fillFolders(); };
+	if(auto budget = getenv("MAILPUNK_BODY_CACHE_MB"))
+		session.setBodyCacheBudget(strtoul(budget, nullptr, 10) * 1024 * 1024);
+	if(auto depth = getenv("MAILPUNK_PREFETCH"))
+		session.setPrefetchDepth(strtoul(depth, nullptr, 10));
+	if(auto rate = getenv("MAILPUNK_PREFETCH_KBPS"))
+		session.setPrefetchRate(strtoul(rate, nullptr, 10) * 1024);
+	if(auto poolSize = getenv("MAILPUNK_POOL_SIZE"))
+		session.setPoolSize(strtoul(poolSize, nullptr, 10));
+	if(auto compress = getenv("MAILPUNK_COMPRESS"))
+		session.setCompression(strcmp(compress, "0") != 0);
+	if(auto trace = getenv("MAILPUNK_TRACE"))
+		session.getMetrics().startTrace(trace);
+	if(!engine)
+		engine = make_unique<IMAP::AccountEngine>();
+	session.setEngine(engine.get());
+	auto server = elements->inputFields["server"]->getText().toString();
+	auto user = elements->inputFields["user"]->getText().toString();
+	auto password = elements->inputFields["password"]->getText().toString();
+	auto cacheHome = getenv("XDG_CACHE_HOME") ? string(getenv("XDG_CACHE_HOME"))
+																					: getenv("HOME") ? string(getenv("HOME")) + "/.cache" : ""s;
+	auto cacheDir = cacheHome.empty() ? ""s : cacheHome + "/mailpunk/" + user + "@" + server;
+	statusBar->setMessage("Logging in...");
+	statusBar->drawMessage();
+
+	session.async(
+			[&session, server, user, password, cacheDir]() {
+				session.connect(server);
+				session.login(user, password);
+				if(!cacheDir.empty())
+					session.setCacheDirectory(cacheDir);
+				session.selectMailbox("INBOX");
+			},
+			[elements]() { elements->loggedIn(); },
+			[elements](string const& error) {
+				// Throw the failed session away (once its callbacks have run), the next click starts over:
+				elements->retiredSession = elements->imapSession;
+				elements->imapSession = nullptr;
+				elements->statusBar->setMessage("");
+				FMessageBox::info(elements->initDialog, "Error", error);
+			});
+}
 
+void UI::loggedIn() {
+	auto elements = this;
 	elements->initDialog->hide();
 	elements->initDialog->unsetFocus();
 	// delCallback(nullptr)
 	elements->refreshMailList();
+	// New mail, expunges and flag changes from now on show up by themselves:
+	auto session = elements->imapSession;
+	session->async([session]() { session->watch(true); }, []() {}, elements->showError());
+
+	auto markKey = new FStatusKey(fc::Fmkey_m, "Mark", elements->statusBar);
+	markKey->addCallback("activate", [](auto*, auto* _) { static_cast<UI*>(_)->toggleMark(); }, elements);
 
 	auto deleteKey = new FStatusKey(fc::Fckey_d, "Delete", elements->statusBar);
 	deleteKey->addCallback("activate", [](auto*, auto* _) {
 		auto elements = static_cast<UI*>(_);
-		auto item = elements->mailListView->getCurrentItem();
-		auto message = (*(elements->viewToMessageMap))[item];
-		message->deleteFromMailbox();
+		// Delete all marked messages in one go, or the current one if nothing is marked:
+		vector<uint32_t> uids(elements->markedUIDs.begin(), elements->markedUIDs.end());
+		if(uids.empty() && elements->mailListView->getCurrentUID())
+			uids.push_back(elements->mailListView->getCurrentUID());
+		elements->markedUIDs.clear();
+		auto session = elements->imapSession;
+		session->async([session, uids]() { session->deleteMessages(uids); }, []() {}, elements->showError());
+
+	}, elements);
+
+	auto searchKey = new FStatusKey(fc::Fckey_f, "Search", elements->statusBar);
+	searchKey->addCallback("activate", [](auto*, auto* _) { static_cast<UI*>(_)->openSearch(false); }, elements);
+
+	auto serverSearchKey = new FStatusKey(fc::Fmkey_f, "Search server", elements->statusBar);
+	serverSearchKey->addCallback("activate", [](auto*, auto* _) { static_cast<UI*>(_)->openSearch(true); }, elements);
+
+	auto attachmentsKey = new FStatusKey(fc::Fmkey_a, "Attachments", elements->statusBar);
+	attachmentsKey->addCallback("activate", [](auto*, auto* _) { static_cast<UI*>(_)->openAttachments(); }, elements);
+
+	auto metricsKey = new FStatusKey(fc::Fmkey_i, "Metrics", elements->statusBar);
+	metricsKey->addCallback("activate", [](auto*, auto* _) { static_cast<UI*>(_)->showMetrics(); }, elements);
+
+	auto foldersKey = new FStatusKey(fc::Fmkey_o, "Folders", elements->statusBar);
+	foldersKey->addCallback("activate", [](auto*, auto* _) { static_cast<UI*>(_)->openFolders(); }, elements);
+
+	auto threadsKey = new FStatusKey(fc::Fmkey_t, "Threads", elements->statusBar);
+	threadsKey->addCallback("activate", [](auto*, auto* _) {
+		auto view = static_cast<UI*>(_)->mailListView;
+		if(view)
+			view->setThreaded(!view->isThreaded());
+	}, elements);
+
+	// Ctrl-S steps through the columns (UID order after the last), Meta-S reverses; later downloads follow the order:
+	auto sortKey = new FStatusKey(fc::Fckey_s, "Sort", elements->statusBar);
+	sortKey->addCallback("activate", [](auto*, auto* _) {
+		auto elements = static_cast<UI*>(_);
+		if(auto view = elements->mailListView) {
+			auto key = IMAP::MessageStore::SortKey((view->getSortKey() + 1) % IMAP::MessageStore::SORT_KEYS);
+			view->setSortOrder(key, view->isDescending());
+			elements->imapSession->setSortOrder(key, view->isDescending());
+		}
+	}, elements);
+
+	auto reverseKey = new FStatusKey(fc::Fmkey_s, "Reverse", elements->statusBar);
+	reverseKey->addCallback("activate", [](auto*, auto* _) {
+		auto elements = static_cast<UI*>(_);
+		if(auto view = elements->mailListView) {
+			view->setSortOrder(view->getSortKey(), !view->isDescending());
+			elements->imapSession->setSortOrder(view->getSortKey(), view->isDescending());
+		}
+	}, elements);
 
+	auto refreshKey = new FStatusKey(fc::Fckey_r, "Refresh", elements->statusBar);
+	refreshKey->addCallback("activate", [](auto*, auto* _) {
+		auto elements = static_cast<UI*>(_);
+		auto session = elements->imapSession;
+		session->async([session]() { session->sync(); }, []() {}, elements->showError());
 	}, elements);
 	elements->app->redraw();
 }
@@ -83,6 +506,7 @@ void UI::quitKeyActivated(FWidget*) {
 int UI::exec() {
 	auto elements = this;
 	app = new FApplication(argc, argv);
+	pump = new UIPump(app, this);
 	initDialog = new FDialog(app);
 	auto status = statusBar = new FStatusBar(initDialog);
 	auto quitKey = new FStatusKey(fc::Fmkey_x, "Quit", status);
@@ -127,8 +551,8 @@ int UI::exec() {
 
 UI::~UI() {
 	delete imapSession;
+	delete retiredSession;
 	delete mailDialog;
 	// delete mailListView;
 	delete app;
-	delete viewToMessageMap;
 }
@@ -1,7 +1,20 @@
 #ifndef UI_H
 #define UI_H
 #include "imap.hpp"
+#include "MailListView.hpp"
+#include "MessageView.hpp"
 #include <final/final.h>
+#include <set>
+#include <vector>
+
+struct UI;
+
+// Runs the callbacks posted by the session's I/O thread on the FinalCut event thread.
+struct UIPump : finalcut::FObject {
+	UI* ui;
+	UIPump(finalcut::FObject* parent, UI* ui) : FObject(parent), ui(ui) { addTimer(50); }
+	void onTimer(finalcut::FTimerEvent*) override;
+};
 
 struct UI {
 	int argc;
@@ -10,14 +23,43 @@ struct UI {
 	std::map<std::string, finalcut::FLineEdit*> inputFields{};
 	finalcut::FApplication* app{};
 	finalcut::FDialog* initDialog{};
-	finalcut::FListView* mailListView{};
+	MailListView* mailListView{};
 	finalcut::FDialog* mailDialog{};
-	std::map<finalcut::FObject*, IMAP::Message*>* viewToMessageMap{};
+	finalcut::FDialog* searchDialog{};
+	finalcut::FDialog* messageDialog{};
+	finalcut::FDialog* folderDialog{};
+	finalcut::FListView* folderView{};
+	std::string searchQuery{};
+	bool serverSearch = false;
+	std::set<uint32_t> markedUIDs{};
+	// Attachments listed for the message with attachmentUID:
+	std::vector<IMAP::Attachment> attachments{};
+	uint32_t attachmentUID = 0;
 	finalcut::FButton* loginButton{};
 	finalcut::FStatusBar* statusBar{};
 	IMAP::Session* imapSession{};
+	IMAP::Session* retiredSession{};
+	// Watches the mailbox of the session (and of any future ones) on a single thread:
+	std::unique_ptr<IMAP::AccountEngine> engine{};
+	UIPump* pump{};
+	std::function<void(std::string const&)> showError();
 	void refreshMailList();
+	void createMailList();
+	void applyDelta(IMAP::SyncDelta const& delta);
+	void toggleMark();
+	void openMessage();
+	void openAttachments();
+	void showAttachments(uint32_t uid, std::vector<IMAP::Attachment> const& list);
+	void saveAttachment(IMAP::Attachment const& attachment);
+	void showMetrics();
+	void openFolders();
+	void fillFolders();
+	void switchFolder(std::string const& name);
+	void openSearch(bool server);
+	void applySearch();
+	void runServerSearch();
 	void loginClicked(finalcut::FWidget*);
+	void loggedIn();
 	void quitKeyActivated(finalcut::FWidget*);
 	void loginFieldActivated() {}
 	int exec();
@@ -0,0 +1,769 @@
+// MailPunkBench: end-to-end benchmarks of the IMAP layer against the in-process stand-in server.
+//
+// Every benchmark runs the real Session code over a loopback socket to a Server holding a synthetic mailbox, so
+// results only depend on the options below (and the machine): the same seed always generates the same mailbox.
+// Results go to stdout (or --output) as JSON, progress to stderr.
+//
+//   MailPunkBench [--sizes 1000,10000,100000] [--bodies small|mixed|large] [--text DIST] [--attachments RATE:DIST]
+//                 [--seed N] [--latency MS] [--bandwidth KIB_PER_S] [--repeat N] [--only NAME,...] [--corpus DIR]
+//                 [--output FILE]
+//
+// DIST is fixed:N, uniform:LOW:HIGH or lognormal:MEDIAN:SIGMA (bytes). Benchmarks: login, load, load_cached,
+// compression, open, delete, resync, search, index, mime, threads and sort. mime runs on the .eml files under the
+// --corpus directory, or on synthetic base64 and quoted-printable text without one.
+#include "imap.hpp"
+#include "mime.hpp"
+#include "search.hpp"
+#include "server.hpp"
+#include "threads.hpp"
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace Bench;
+using namespace std;
+
+namespace {
+
+/* ----- Options ----- */
+struct Options {
+  vector<uint32_t> sizes{1000, 10000, 100000};
+  string bodies = "mixed";
+  string text;
+  string attachments;
+  uint64_t seed = 1;
+  double latency_ms = 0;
+  double bandwidth_kib = 0;
+  int repeat = 3;
+  vector<string> only;
+  string corpus;
+  string output;
+};
+
+/* ----- Result ----- */
+// One line of the report: what was measured (params), the time of every run and what the last run counted.
+struct Result {
+  string name;
+  vector<pair<string, string>> params; // values already written as JSON
+  vector<double> seconds;
+  vector<pair<string, double>> metrics;
+};
+
+/* ----- json ----- */
+string json(string const& s) {
+  string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {quoted += '\\';}
+    if ((unsigned char)c < 0x20) {quoted += ' '; continue;}
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+string json(double value) {
+  ostringstream stream;
+  stream.precision(9);
+  stream << value;
+  return stream.str();
+}
+
+/* ----- Clock ----- */
+double now() {
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* ----- temporaryDirectory ----- */
+// Function to create an empty directory for an on-disk cache or index.
+string temporaryDirectory() {
+  string pattern = (filesystem::temp_directory_path() / "mailpunk-bench-XXXXXX").string();
+  if (!mkdtemp(pattern.data())) {throw runtime_error("Bench Error: Unable to create a temporary directory.");}
+  return pattern;
+}
+
+/* ----- Report ----- */
+class Report {
+private:
+  Options const& options;
+  MailboxSpec spec;
+  vector<Result> results;
+
+public:
+  Report(Options const& options, MailboxSpec const& spec) : options(options), spec(spec) {}
+
+  void add(Result result) {
+    // Progress for whoever watches: name, params and the median time:
+    vector<double> sorted = result.seconds;
+    sort(sorted.begin(), sorted.end());
+    cerr << result.name;
+    for (auto const& param : result.params) {cerr << " " << param.first << "=" << param.second;}
+    if (!sorted.empty()) {cerr << " median=" << sorted[sorted.size() / 2] * 1000 << "ms";}
+    for (auto const& metric : result.metrics) {cerr << " " << metric.first << "=" << json(metric.second);}
+    cerr << endl;
+    results.push_back(move(result));
+  }
+
+  void write(ostream& out) const {
+    out << "{\n  \"benchmark\": \"MailPunkBench\",\n  \"config\": {";
+    out << "\"seed\": " << options.seed << ", \"bodies\": " << json(options.bodies);
+    out << ", \"text\": " << json(spec.text.str()) << ", \"attachment_rate\": " << json(spec.attachment_rate);
+    if (spec.attachment_rate > 0) {out << ", \"attachment\": " << json(spec.attachment.str());}
+    out << ", \"latency_ms\": " << json(options.latency_ms) << ", \"bandwidth_kib\": " << json(options.bandwidth_kib);
+    out << ", \"repeat\": " << options.repeat << "},\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      auto const& result = results[i];
+      out << (i ? ",\n" : "\n") << "    {\"name\": " << json(result.name);
+      for (auto const& param : result.params) {out << ", " << json(param.first) << ": " << param.second;}
+      if (!result.seconds.empty()) {
+        vector<double> sorted = result.seconds;
+        sort(sorted.begin(), sorted.end());
+        out << ", \"seconds\": {\"min\": " << json(sorted.front()) << ", \"median\": " << json(sorted[sorted.size() / 2])
+            << ", \"max\": " << json(sorted.back()) << "}";
+      }
+      for (auto const& metric : result.metrics) {out << ", " << json(metric.first) << ": " << json(metric.second);}
+      out << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+};
+
+/* ----- Suite ----- */
+// Benchmarks of one mailbox size against one server.
+class Suite {
+private:
+  Options const& options;
+  Server& server;
+  Report& report;
+  uint32_t messages;
+
+  // Function to open a session logged in to the server with INBOX selected:
+  unique_ptr<IMAP::Session> open(size_t pool = 1, bool compress = true, string const& cache_dir = "") {
+    auto session = make_unique<IMAP::Session>([](IMAP::SyncDelta const&) {});
+    session->setCompression(compress);
+    session->setPoolSize(pool);
+    if (!cache_dir.empty()) {session->setCacheDirectory(cache_dir);}
+    session->connect("127.0.0.1", server.getPort());
+    session->login("bench", "bench");
+    session->selectMailbox("INBOX");
+    return session;
+  }
+
+  // Function to load the mailbox into a session, dropping the updates it posts for a UI:
+  static void load(IMAP::Session& session) {
+    session.getMessages();
+    session.dispatch();
+  }
+
+  // Function to add what the server counted since resetStats to result:
+  void addServerMetrics(Result& result) {
+    ServerStats stats = server.getStats();
+    result.metrics.emplace_back("commands", stats.total());
+    result.metrics.emplace_back("logins", stats.logins);
+    result.metrics.emplace_back("wire_bytes_sent", stats.bytes_sent);
+    result.metrics.emplace_back("wire_bytes_received", stats.bytes_received);
+  }
+
+  Result result(string const& name) {
+    Result r;
+    r.name = name;
+    r.params.emplace_back("messages", to_string(messages));
+    return r;
+  }
+
+  // Function to pick count UIDs spread evenly over the mailbox, starting at the offset-th:
+  vector<uint32_t> spread(size_t count, size_t offset = 0) {
+    vector<uint32_t> all = server.uids(), picked;
+    if (all.empty()) {return picked;}
+    size_t step = max<size_t>(1, all.size() / max<size_t>(count, 1));
+    for (size_t i = offset % step; i < all.size() && picked.size() < count; i += step) {picked.push_back(all[i]);}
+    return picked;
+  }
+
+public:
+  Suite(Options const& options, Server& server, Report& report, uint32_t messages)
+    : options(options), server(server), report(report), messages(messages) {}
+
+  /* ----- login ----- */
+  // Connect, log in (with COMPRESS) and select: the latency before anything else can happen.
+  void login() {
+    Result r = result("login");
+    for (int run = 0; run < options.repeat; run++) {
+      server.resetStats();
+      double start = now();
+      auto session = open();
+      r.seconds.push_back(now() - start);
+      if (run == options.repeat - 1) {addServerMetrics(r);}
+    }
+    report.add(r);
+  }
+
+  /* ----- load ----- */
+  // Download every envelope without a cache, with 1 to 8 connections (setPoolSize).
+  void load() {
+    for (size_t pool : {1, 2, 4, 8}) {
+      Result r = result("load");
+      r.params.emplace_back("pool", to_string(pool));
+      for (int run = 0; run < options.repeat; run++) {
+        auto session = open(pool);
+        server.resetStats();
+        double start = now();
+        load(*session);
+        r.seconds.push_back(now() - start);
+        if (run == options.repeat - 1) {
+          addServerMetrics(r);
+          r.metrics.emplace_back("loaded", session->getNumMessages());
+          // Where the client spent the time (the pool's fetches overlap, so they add up to more than the run):
+          auto& metrics = session->getMetrics();
+          r.metrics.emplace_back("fetch_seconds", metrics.get(IMAP::Metrics::FETCH_LIST).micros / 1e6);
+          r.metrics.emplace_back("fetch_p99_seconds", metrics.get(IMAP::Metrics::FETCH_LIST).percentile(0.99) / 1e6);
+          r.metrics.emplace_back("parse_seconds", metrics.get(IMAP::Metrics::PARSE).micros / 1e6);
+          r.metrics.emplace_back("merge_seconds", metrics.get(IMAP::Metrics::MERGE).micros / 1e6);
+        }
+      }
+      report.add(r);
+    }
+  }
+
+  /* ----- load_cached ----- */
+  // Load with the on-disk cache: first into an empty cache, then again from it (only the UID list is fetched).
+  void loadCached() {
+    Result cold = result("load_cached"), warm = result("load_cached");
+    cold.params.emplace_back("cache", json("cold"));
+    warm.params.emplace_back("cache", json("warm"));
+    for (int run = 0; run < options.repeat; run++) {
+      string dir = temporaryDirectory();
+      bool last = run == options.repeat - 1;
+      {
+        auto session = open(1, true, dir);
+        server.resetStats();
+        double start = now();
+        load(*session);
+        cold.seconds.push_back(now() - start);
+        if (last) {addServerMetrics(cold);}
+      }
+      {
+        auto session = open(1, true, dir);
+        server.resetStats();
+        double start = now();
+        load(*session);
+        warm.seconds.push_back(now() - start);
+        if (last) {addServerMetrics(warm); warm.metrics.emplace_back("loaded", session->getNumMessages());}
+      }
+      filesystem::remove_all(dir);
+    }
+    report.add(cold);
+    report.add(warm);
+  }
+
+  /* ----- compression ----- */
+  // Load with and without COMPRESS=DEFLATE: time, wire bytes and protocol bytes.
+  void compression() {
+    for (bool compress : {false, true}) {
+      Result r = result("compression");
+      r.params.emplace_back("compress", compress ? "true" : "false");
+      for (int run = 0; run < options.repeat; run++) {
+        auto session = open(1, compress);
+        IMAP::Traffic before = session->getTraffic();
+        server.resetStats();
+        double start = now();
+        load(*session);
+        r.seconds.push_back(now() - start);
+        if (run == options.repeat - 1) {
+          IMAP::Traffic after = session->getTraffic();
+          addServerMetrics(r);
+          r.metrics.emplace_back("plain_bytes_read", after.plain_read - before.plain_read);
+          r.metrics.emplace_back("wire_bytes_read", after.wire_read - before.wire_read);
+          r.metrics.emplace_back("ratio", after.ratio());
+        }
+      }
+      report.add(r);
+    }
+  }
+
+  /* ----- open ----- */
+  // Open messages as MessageView does (the first 64 KiB range) and as a whole (fetchBody), a fresh session each so
+  // nothing comes from a cache.
+  void openMessages() {
+    vector<uint32_t> uids = spread(50);
+    for (bool whole : {false, true}) {
+      Result r = result("open");
+      r.params.emplace_back("fetch", json(whole ? "body" : "first_range"));
+      r.params.emplace_back("count", to_string(uids.size()));
+      uint64_t bytes = 0;
+      for (int run = 0; run < options.repeat; run++) {
+        auto session = open();
+        load(*session);
+        server.resetStats();
+        bytes = 0;
+        double start = now();
+        for (auto uid : uids) {
+          if (whole) {bytes += session->fetchBody(uid).size();}
+          else {bytes += session->fetchBodyRange(uid, 0, 64 * 1024).data.size();}
+        }
+        r.seconds.push_back(now() - start);
+        session->dispatch();
+        if (run == options.repeat - 1) {addServerMetrics(r);}
+      }
+      r.metrics.emplace_back("body_bytes", bytes);
+      report.add(r);
+    }
+  }
+
+  /* ----- delete ----- */
+  // Delete batches of messages (one UID STORE, one UID EXPUNGE and a sync each), on a fresh mailbox every run.
+  void remove() {
+    for (size_t batch : {size_t(1), size_t(100), size_t(1000)}) {
+      if (batch > messages / 2) {continue;}
+      Result r = result("delete");
+      r.params.emplace_back("batch", to_string(batch));
+      for (int run = 0; run < options.repeat; run++) {
+        server.reset();
+        auto session = open();
+        load(*session);
+        vector<uint32_t> uids = spread(batch, run);
+        server.resetStats();
+        double start = now();
+        session->deleteMessages(uids);
+        r.seconds.push_back(now() - start);
+        session->dispatch();
+        if (run == options.repeat - 1) {
+          addServerMetrics(r);
+          r.metrics.emplace_back("remaining", session->getNumMessages());
+        }
+      }
+      report.add(r);
+    }
+    server.reset();
+  }
+
+  /* ----- resync ----- */
+  // Incremental sync after nothing changed, and after another client delivered, expunged and flagged 1% each.
+  void resync() {
+    for (bool changes : {false, true}) {
+      Result r = result("resync");
+      r.params.emplace_back("changes", changes ? "true" : "false");
+      for (int run = 0; run < options.repeat; run++) {
+        server.reset();
+        auto session = open();
+        load(*session);
+        size_t percent = max<uint32_t>(1, messages / 100);
+        if (changes) {
+          server.expunge(spread(percent, 1));
+          server.touch(spread(percent, 2));
+          server.deliver(percent);
+        }
+        server.resetStats();
+        double start = now();
+        IMAP::SyncDelta delta = session->sync();
+        r.seconds.push_back(now() - start);
+        session->dispatch();
+        if (run == options.repeat - 1) {
+          addServerMetrics(r);
+          r.metrics.emplace_back("added", delta.added.size());
+          r.metrics.emplace_back("removed", delta.removed.size());
+          r.metrics.emplace_back("changed", delta.changed.size());
+        }
+      }
+      report.add(r);
+    }
+    server.reset();
+  }
+
+  /* ----- search ----- */
+  // The same queries on the local index (envelopes only) and on the server (ESEARCH, nothing left to fetch).
+  void search() {
+    vector<string> queries{"budget", "quarterly report", "ada", "lovelace meeting", "nothingmatches"};
+    auto session = open();
+    load(*session);
+    for (bool remote : {false, true}) {
+      Result r = result("search");
+      r.params.emplace_back("where", json(remote ? "server" : "local"));
+      r.params.emplace_back("queries", to_string(queries.size()));
+      size_t hits = 0;
+      for (int run = 0; run < options.repeat; run++) {
+        server.resetStats();
+        hits = 0;
+        double start = now();
+        for (auto const& query : queries) {
+          hits += remote ? session->searchServer(query, false).size() : session->searchLocal(query).size();
+        }
+        r.seconds.push_back(now() - start);
+        session->dispatch();
+        if (run == options.repeat - 1) {addServerMetrics(r);}
+      }
+      r.metrics.emplace_back("hits", hits);
+      report.add(r);
+    }
+  }
+};
+
+/* ----- mime ----- */
+// Transfer decoding throughput of the SIMD decoders against the scalar ones, on 16 MiB of base64 and
+// quoted-printable text (independent of the mailbox), when there is no --corpus of real messages.
+void mime(Options const& options, Report& report) {
+  Random random(options.seed);
+  size_t const SIZE = 16 * 1024 * 1024;
+  static char const* const alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string base64, qp;
+  while (base64.size() < SIZE) {
+    for (int i = 0; i < 76; i++) {base64 += alphabet[random.next() & 63];}
+    base64 += "\r\n";
+  }
+  // Mostly plain text with an escape now and then and soft line breaks, as mail in a Latin alphabet looks:
+  while (qp.size() < SIZE) {
+    for (int i = 0; i < 72; i++) {
+      uint64_t r = random.next();
+      if (r % 16 == 0) {char escape[4]; snprintf(escape, sizeof(escape), "=%02X", unsigned(r >> 8) & 0xFF); qp += escape;}
+      else {qp += char('a' + (r >> 8) % 26);}
+    }
+    qp += "=\r\n";
+  }
+  string out(SIZE, '\0');
+  for (string encoding : {"base64", "quoted-printable"}) {
+    for (bool vectorized : {false, true}) {
+      Result r;
+      r.name = "mime";
+      r.params.emplace_back("encoding", json(encoding));
+      r.params.emplace_back("vectorized", vectorized ? "true" : "false");
+      string const& in = encoding == "base64" ? base64 : qp;
+      size_t decoded = 0;
+      for (int run = 0; run < options.repeat; run++) {
+        double start = now();
+        decoded = encoding == "base64" ? IMAP::MimePart::decodeBase64(in, out.data(), vectorized)
+                                       : IMAP::MimePart::decodeQuotedPrintable(in, out.data(), vectorized);
+        r.seconds.push_back(now() - start);
+      }
+      double best = *min_element(r.seconds.begin(), r.seconds.end());
+      r.metrics.emplace_back("input_bytes", in.size());
+      r.metrics.emplace_back("decoded_bytes", decoded);
+      r.metrics.emplace_back("mb_per_s", in.size() / best / 1e6);
+      report.add(r);
+    }
+  }
+}
+
+/* ----- mimeCorpus ----- */
+// Parsing and decoding of real messages: every .eml file under the corpus directory is parsed into its MIME tree
+// and every leaf part decoded (transfer encoding, then charset for text), with the scalar and the SIMD decoders.
+void mimeCorpus(Options const& options, Report& report) {
+  vector<string> messages;
+  size_t input_bytes = 0;
+  for (auto const& entry : filesystem::recursive_directory_iterator(options.corpus)) {
+    if (!entry.is_regular_file() || entry.path().extension() != ".eml") {continue;}
+    ifstream file(entry.path(), ios::binary);
+    messages.emplace_back(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    input_bytes += messages.back().size();
+  }
+  if (messages.empty()) {throw runtime_error("Bench Error: No .eml files in " + options.corpus + ".");}
+  for (bool vectorized : {false, true}) {
+    Result r;
+    r.name = "mime";
+    r.params.emplace_back("corpus", json(options.corpus));
+    r.params.emplace_back("vectorized", vectorized ? "true" : "false");
+    size_t parts = 0, decoded = 0;
+    double parse_seconds = 0;
+    for (int run = 0; run < options.repeat; run++) {
+      parts = decoded = 0;
+      parse_seconds = 0;
+      double start = now();
+      for (auto const& message : messages) {
+        double parse_start = now();
+        IMAP::MimePart root = IMAP::MimePart::parse(message);
+        parse_seconds += now() - parse_start;
+        vector<IMAP::MimePart const*> stack{&root};
+        while (!stack.empty()) {
+          auto part = stack.back();
+          stack.pop_back();
+          for (auto const& child : part->parts) {stack.push_back(&child);}
+          if (!part->parts.empty()) {continue;}
+          decoded += part->decode(vectorized).size();
+          parts++;
+        }
+      }
+      r.seconds.push_back(now() - start);
+    }
+    double best = *min_element(r.seconds.begin(), r.seconds.end());
+    r.metrics.emplace_back("messages", messages.size());
+    r.metrics.emplace_back("parts", parts);
+    r.metrics.emplace_back("input_bytes", input_bytes);
+    r.metrics.emplace_back("decoded_bytes", decoded);
+    r.metrics.emplace_back("parse_seconds", parse_seconds);
+    r.metrics.emplace_back("mb_per_s", input_bytes / best / 1e6);
+    report.add(r);
+  }
+}
+
+/* ----- index ----- */
+// Full-text indexing of a synthetic mailbox of every size (independent of the server), with the body mix of spec:
+// times indexing every envelope and text as a session does while loading and opening messages, then saving the
+// index to disk and loading it back.
+void index(Options const& options, MailboxSpec spec, Report& report) {
+  for (uint32_t size : options.sizes) {
+    spec.messages = size;
+    Mailbox mailbox(spec);
+    vector<string> from, subject, body;
+    size_t bytes = 0;
+    for (auto const& message : mailbox.list()) {
+      RenderedMessage rendered = mailbox.render(message, Mailbox::TEXT);
+      from.push_back(rendered.from_name + " <" + rendered.from_mailbox + "@" + rendered.from_host + ">");
+      subject.push_back(rendered.subject);
+      body.push_back(rendered.raw.substr(rendered.text_offset, rendered.text_size));
+      bytes += from.back().size() + subject.back().size() + body.back().size();
+    }
+    Result r;
+    r.name = "index";
+    r.params.emplace_back("messages", to_string(size));
+    double save_seconds = 0, load_seconds = 0, file_bytes = 0;
+    string dir = temporaryDirectory(), path = dir + "/index";
+    for (int run = 0; run < options.repeat; run++) {
+      filesystem::remove(path);
+      IMAP::SearchIndex index(path, Mailbox::UIDVALIDITY);
+      double start = now();
+      for (size_t i = 0; i < from.size(); i++) {
+        index.add(mailbox.list()[i].uid, from[i], subject[i]);
+        index.addBody(mailbox.list()[i].uid, body[i]);
+      }
+      r.seconds.push_back(now() - start);
+      start = now();
+      index.save();
+      save_seconds = now() - start;
+      file_bytes = filesystem::file_size(path);
+      start = now();
+      IMAP::SearchIndex loaded(path, Mailbox::UIDVALIDITY);
+      load_seconds = now() - start;
+      if (loaded.size() != index.size()) {throw runtime_error("Bench Error: index did not load back.");}
+    }
+    filesystem::remove_all(dir);
+    double seconds = r.seconds.back();
+    r.metrics.emplace_back("input_bytes", bytes);
+    r.metrics.emplace_back("messages_per_s", seconds > 0 ? size / seconds : 0);
+    r.metrics.emplace_back("mb_per_s", seconds > 0 ? bytes / seconds / (1024 * 1024) : 0);
+    r.metrics.emplace_back("save_seconds", save_seconds);
+    r.metrics.emplace_back("load_seconds", load_seconds);
+    r.metrics.emplace_back("file_bytes", file_bytes);
+    report.add(r);
+  }
+}
+
+/* ----- threads ----- */
+// Conversation threading of a synthetic mailbox of every size (independent of the server): two in three messages
+// reply to one of the last thousand, with the References chain a mail client would write. Times threading it all
+// and listing the threads, then adding and removing single messages as syncs do, each followed by listing the threads
+// and finding a message in them as the mail list does.
+void threads(Options const& options, Report& report) {
+  size_t const CHANGES = 1000;
+  for (uint32_t size : options.sizes) {
+    Random random(options.seed);
+    vector<string> ids(size + CHANGES), references(size + CHANGES);
+    for (uint32_t i = 0; i < size + CHANGES; i++) {
+      ids[i] = "<" + to_string(i) + "@bench.mailpunk>";
+      if (i == 0 || random.next() % 3 == 0) {continue;}
+      uint32_t parent = i - 1 - random.next() % min<uint32_t>(i, 1000);
+      // Clients keep the start of the chain and its last few messages:
+      references[i] = references[parent];
+      size_t count = count_if(references[i].begin(), references[i].end(), [](char c) {return c == '<';});
+      if (count >= 10) {
+        size_t second = references[i].find('<', 1);
+        references[i].erase(second, references[i].find('<', second + 1) - second);
+      }
+      references[i] += (references[i].empty() ? "" : " ") + ids[parent];
+    }
+    Result r;
+    r.name = "threads";
+    r.params.emplace_back("messages", to_string(size));
+    double list_seconds = 0, add_seconds = 0, remove_seconds = 0;
+    size_t roots = 0;
+    for (int run = 0; run < options.repeat; run++) {
+      IMAP::ThreadIndex index;
+      double start = now();
+      for (uint32_t i = 0; i < size; i++) {index.add(i + 1, ids[i], references[i]);}
+      double built = now();
+      roots = count_if(index.list().begin(), index.list().end(), [](IMAP::ThreadIndex::Row const& row) {return !row.depth;});
+      r.seconds.push_back(built - start);
+      list_seconds = now() - built;
+      // New mail arriving and old mail expunged, one message at a time:
+      size_t found = 0;
+      start = now();
+      for (uint32_t i = size; i < size + CHANGES; i++) {
+        index.add(i + 1, ids[i], references[i]);
+        found += index.position(i + 1) < index.list().size();
+      }
+      add_seconds = now() - start;
+      start = now();
+      for (uint32_t i = 0; i < CHANGES && i < size; i++) {
+        index.remove(i * max<uint32_t>(size / CHANGES, 1) + 1);
+        found += index.position(size + 1) < index.list().size();
+      }
+      remove_seconds = now() - start;
+      if (found != CHANGES + min<size_t>(CHANGES, size)) {throw runtime_error("Bench Error: message missing from threads.");}
+    }
+    r.metrics.emplace_back("list_seconds", list_seconds);
+    r.metrics.emplace_back("add_us", add_seconds / CHANGES * 1e6);
+    r.metrics.emplace_back("remove_us", remove_seconds / min<size_t>(CHANGES, size) * 1e6);
+    r.metrics.emplace_back("threads", roots);
+    report.add(r);
+  }
+}
+
+/* ----- sort ----- */
+// Sort orders of a synthetic store of every size (independent of the server): subjects with reply prefixes and list
+// tags, a few thousand senders. Times adding it all and merging the orders, switching to each order (walking it
+// end to end), then adding and removing single messages as syncs do.
+void sort(Options const& options, Report& report) {
+  size_t const CHANGES = 1000;
+  char const* const PREFIXES[] = {"", "", "Re: ", "RE: Re: ", "Fwd: ", "[list] ", "Re: [list] "};
+  for (uint32_t size : options.sizes) {
+    Random random(options.seed);
+    vector<string> from(size + CHANGES), subject(size + CHANGES);
+    vector<IMAP::MessageAttributes> attributes(size + CHANGES);
+    for (uint32_t i = 0; i < size + CHANGES; i++) {
+      uint32_t sender = random.next() % 5000;
+      from[i] = "Sender " + to_string(sender) + ", <sender" + to_string(sender) + "@bench.mailpunk>; ";
+      subject[i] = string(PREFIXES[random.next() % 7]) + "Topic " + to_string(random.next() % (size / 4 + 1));
+      attributes[i].date = 1700000000 + i * 60 - int64_t(random.next() % 3600);
+      attributes[i].size = 1000 + random.next() % 100000;
+    }
+    Result r;
+    r.name = "sort";
+    r.params.emplace_back("messages", to_string(size));
+    double switch_seconds = 0, add_seconds = 0, remove_seconds = 0;
+    for (int run = 0; run < options.repeat; run++) {
+      IMAP::MessageStore store;
+      double start = now();
+      for (uint32_t i = 0; i < size; i++) {store.add(i + 1, from[i], subject[i], attributes[i]);}
+      store.sort();
+      r.seconds.push_back(now() - start);
+      // Switching only walks a permutation that is already there:
+      start = now();
+      uint64_t sum = 0;
+      for (int key = IMAP::MessageStore::BY_DATE; key < IMAP::MessageStore::SORT_KEYS; key++) {
+        for (size_t i = 0; i < store.size(); i++) {sum += store.uidAt(i, IMAP::MessageStore::SortKey(key));}
+      }
+      switch_seconds = (now() - start) / (IMAP::MessageStore::SORT_KEYS - 1);
+      if (sum == 0) {throw runtime_error("Bench Error: empty sort order.");}
+      // New mail arriving and old mail expunged, one message at a time:
+      start = now();
+      for (uint32_t i = size; i < size + CHANGES; i++) {
+        store.add(i + 1, from[i], subject[i], attributes[i]);
+        store.sort();
+      }
+      add_seconds = now() - start;
+      start = now();
+      for (uint32_t i = 0; i < CHANGES && i < size; i++) {store.remove({i * max<uint32_t>(size / CHANGES, 1) + 1});}
+      remove_seconds = now() - start;
+    }
+    r.metrics.emplace_back("switch_seconds", switch_seconds);
+    r.metrics.emplace_back("add_us", add_seconds / CHANGES * 1e6);
+    r.metrics.emplace_back("remove_us", remove_seconds / min<size_t>(CHANGES, size) * 1e6);
+    report.add(r);
+  }
+}
+
+/* ----- parseOptions ----- */
+Options parseOptions(int argc, char** argv) {
+  Options options;
+  auto list = [](string const& value) {
+    vector<string> items;
+    stringstream stream(value);
+    for (string item; getline(stream, item, ',');) {
+      if (!item.empty()) {items.push_back(item);}
+    }
+    return items;
+  };
+  for (int i = 1; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--help" || option == "-h") {
+      cout << "Usage: MailPunkBench [--sizes 1000,10000,100000] [--bodies small|mixed|large] [--text DIST]\n"
+              "                     [--attachments RATE:DIST] [--seed N] [--latency MS] [--bandwidth KIB_PER_S]\n"
+              "                     [--repeat N] [--only login,load,load_cached,compression,open,delete,resync,search,index,\n"
+              "                     mime,threads,sort]\n"
+              "                     [--corpus DIR] [--output FILE]\n"
+              "DIST is fixed:N, uniform:LOW:HIGH or lognormal:MEDIAN:SIGMA (bytes). mime parses and decodes the .eml\n"
+              "files under DIR, or synthetic text without --corpus.\n";
+      exit(0);
+    }
+    if (i + 1 >= argc) {throw runtime_error("Bench Error: Missing value for " + option + ".");}
+    string value = argv[++i];
+    if (option == "--sizes") {
+      options.sizes.clear();
+      for (auto const& size : list(value)) {options.sizes.push_back(stoul(size));}
+    }
+    else if (option == "--bodies") {options.bodies = value;}
+    else if (option == "--text") {options.text = value;}
+    else if (option == "--attachments") {options.attachments = value;}
+    else if (option == "--seed") {options.seed = stoull(value);}
+    else if (option == "--latency") {options.latency_ms = stod(value);}
+    else if (option == "--bandwidth") {options.bandwidth_kib = stod(value);}
+    else if (option == "--repeat") {options.repeat = max(1, stoi(value));}
+    else if (option == "--only") {options.only = list(value);}
+    else if (option == "--corpus") {options.corpus = value;}
+    else if (option == "--output") {options.output = value;}
+    else {throw runtime_error("Bench Error: Unknown option " + option + ".");}
+  }
+  return options;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  try {
+    Options options = parseOptions(argc, argv);
+    auto enabled = [&options](string const& name) {
+      return options.only.empty() || find(options.only.begin(), options.only.end(), name) != options.only.end();
+    };
+
+    // The body mix, with the text and attachment distributions overridden if given:
+    MailboxSpec spec = MailboxSpec::preset(options.bodies, 0, options.seed);
+    if (!options.text.empty()) {spec.text = SizeDistribution::parse(options.text);}
+    if (!options.attachments.empty()) {
+      size_t colon = options.attachments.find(':');
+      if (colon == string::npos) {throw runtime_error("Bench Error: --attachments takes RATE:DIST.");}
+      spec.attachment_rate = stod(options.attachments.substr(0, colon));
+      spec.attachment = SizeDistribution::parse(options.attachments.substr(colon + 1));
+    }
+    Shaping shaping;
+    shaping.latency = chrono::microseconds(int64_t(options.latency_ms * 1000));
+    shaping.bandwidth = options.bandwidth_kib * 1024;
+
+    Report report(options, spec);
+    if (enabled("mime") && !options.corpus.empty()) {mimeCorpus(options, report);}
+    else if (enabled("mime")) {mime(options, report);}
+    if (enabled("index")) {index(options, spec, report);}
+    if (enabled("threads")) {threads(options, report);}
+    if (enabled("sort")) {sort(options, report);}
+    for (uint32_t size : options.sizes) {
+      spec.messages = size;
+      cerr << "Generating " << size << " messages..." << endl;
+      Server server(spec, shaping);
+      Suite bench(options, server, report, size);
+      if (enabled("login")) {bench.login();}
+      if (enabled("load")) {bench.load();}
+      if (enabled("load_cached")) {bench.loadCached();}
+      if (enabled("compression")) {bench.compression();}
+      if (enabled("open")) {bench.openMessages();}
+      if (enabled("search")) {bench.search();}
+      if (enabled("resync")) {bench.resync();}
+      if (enabled("delete")) {bench.remove();}
+    }
+
+    if (options.output.empty()) {report.write(cout);}
+    else {
+      ofstream file(options.output);
+      report.write(file);
+      if (!file) {throw runtime_error("Bench Error: Unable to write " + options.output + ".");}
+    }
+  } catch (exception const& error) {
+    cerr << error.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,335 @@
+#include "mailbox.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+using namespace Bench;
+using namespace std;
+
+/* ----------------- Random Functions ---------------- */
+/* ----- next ----- */
+uint64_t Random::next() {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+/* ----- normal ----- */
+double Random::normal() {
+  // Box-Muller, 1 - uniform() keeps the logarithm finite:
+  double u = 1.0 - uniform(), v = uniform();
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/* ----------------- SizeDistribution Functions ---------------- */
+/* ----- parse ----- */
+SizeDistribution SizeDistribution::parse(string const& spec) {
+  SizeDistribution distribution;
+  string kind = spec.substr(0, spec.find(':'));
+  vector<double> values;
+  try {
+    for (size_t colon = spec.find(':'); colon != string::npos; colon = spec.find(':', colon + 1)) {
+      values.push_back(stod(spec.substr(colon + 1)));
+    }
+  } catch (exception const&) {values.clear();}
+  if (kind == "fixed" && values.size() == 1) {distribution.kind = FIXED;}
+  else if (kind == "uniform" && values.size() == 2 && values[0] <= values[1]) {distribution.kind = UNIFORM;}
+  else if (kind == "lognormal" && values.size() == 2) {distribution.kind = LOGNORMAL;}
+  else {throw runtime_error("Bench Error: Unknown size distribution " + spec + ".");}
+  distribution.a = values[0];
+  distribution.b = values.size() > 1 ? values[1] : 0;
+  return distribution;
+}
+
+/* ----- draw ----- */
+uint32_t SizeDistribution::draw(Random& random) const {
+  double size = a;
+  if (kind == UNIFORM) {size = random.between(uint32_t(a), uint32_t(b));}
+  else if (kind == LOGNORMAL) {size = a * exp(b * random.normal());}
+  return uint32_t(min(max(size, 1.0), 64.0 * 1024 * 1024));
+}
+
+/* ----- str ----- */
+string SizeDistribution::str() const {
+  auto number = [](double value) {
+    string s = to_string(value);
+    s.erase(s.find_last_not_of('0') + 1);
+    if (s.back() == '.') {s.pop_back();}
+    return s;
+  };
+  switch (kind) {
+    case FIXED: return "fixed:" + number(a);
+    case UNIFORM: return "uniform:" + number(a) + ":" + number(b);
+    default: return "lognormal:" + number(a) + ":" + number(b);
+  }
+}
+
+/* ----------------- MailboxSpec Functions ---------------- */
+/* ----- preset ----- */
+MailboxSpec MailboxSpec::preset(string const& name, uint32_t messages, uint64_t seed) {
+  MailboxSpec spec;
+  spec.messages = messages;
+  spec.seed = seed;
+  if (name == "small") {
+    spec.text = SizeDistribution::parse("lognormal:2048:0.8");
+  } else if (name == "mixed") {
+    spec.text = SizeDistribution::parse("lognormal:4096:1.0");
+    spec.attachment_rate = 0.1;
+    spec.attachment = SizeDistribution::parse("lognormal:262144:1.2");
+  } else if (name == "large") {
+    spec.text = SizeDistribution::parse("lognormal:16384:1.0");
+    spec.attachment_rate = 0.5;
+    spec.attachment = SizeDistribution::parse("lognormal:2097152:1.0");
+  } else {throw runtime_error("Bench Error: Unknown body mix " + name + ".");}
+  return spec;
+}
+
+/* ----------------- RenderedMessage Functions ---------------- */
+/* ----- section ----- */
+bool RenderedMessage::section(string_view name, string_view& out) const {
+  string_view all(raw);
+  if (name.empty()) {out = all;}
+  else if (name == "HEADER") {out = all.substr(0, header_size);}
+  else if (name == "TEXT") {out = all.substr(header_size);}
+  else if (name == "1") {out = all.substr(text_offset, text_size);}
+  else if (name == "2" && multipart) {out = all.substr(attachment_offset, attachment_size);}
+  else {return false;}
+  return true;
+}
+
+/* ----- headerFields ----- */
+string RenderedMessage::headerFields(string_view fields) const {
+  // Field names, uppercased:
+  vector<string> names;
+  for (size_t at = 0; at < fields.size();) {
+    size_t end = min(fields.find(' ', at), fields.size());
+    if (end > at) {
+      names.emplace_back(fields.substr(at, end - at));
+      for (auto& c : names.back()) {c = toupper((unsigned char)c);}
+    }
+    at = end + 1;
+  }
+  // Copy the lines of those fields (the synthetic headers are never folded):
+  string out;
+  string_view header(raw.data(), header_size);
+  for (size_t at = 0; at < header.size();) {
+    size_t end = header.find("\r\n", at);
+    if (end == string_view::npos || end == at) {break;}
+    string_view line = header.substr(at, end + 2 - at);
+    string name(line.substr(0, line.find(':')));
+    for (auto& c : name) {c = toupper((unsigned char)c);}
+    if (find(names.begin(), names.end(), name) != names.end()) {out.append(line);}
+    at = end + 2;
+  }
+  return out + "\r\n";
+}
+
+/* ----------------- Mailbox Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+Mailbox::Mailbox(MailboxSpec const& spec) : spec(spec), random(spec.seed) {
+  reset();
+}
+
+/* ----- reset ----- */
+void Mailbox::reset() {
+  random = Random(spec.seed);
+  messages.clear();
+  messages.reserve(spec.messages);
+  uidnext = 1;
+  highest_modseq = 1;
+  for (uint32_t i = 0; i < spec.messages; i++) {messages.push_back(generate());}
+  // A third of the mailbox has been read:
+  for (size_t i = 0; i < messages.size(); i += 3) {messages[i].seen = true;}
+  version++;
+}
+
+/* ----- generate ----- */
+SyntheticMessage Mailbox::generate() {
+  SyntheticMessage message;
+  // Leave gaps in the UIDs now and then, as expunges do on real servers:
+  if (random.uniform() < 0.05) {uidnext += random.between(1, 20);}
+  message.uid = uidnext++;
+  message.text_size = spec.text.draw(random);
+  if (spec.attachment_rate > 0 && random.uniform() < spec.attachment_rate) {
+    message.attachment_size = spec.attachment.draw(random);
+  }
+  message.modseq = highest_modseq;
+  return message;
+}
+
+/* ----- deliver ----- */
+void Mailbox::deliver(uint32_t count) {
+  highest_modseq++;
+  for (uint32_t i = 0; i < count; i++) {messages.push_back(generate());}
+  version++;
+}
+
+/* ----- expunge ----- */
+size_t Mailbox::expunge(vector<uint32_t> uids) {
+  sort(uids.begin(), uids.end());
+  size_t before = messages.size();
+  messages.erase(remove_if(messages.begin(), messages.end(), [&uids](SyntheticMessage const& m) {
+    return binary_search(uids.begin(), uids.end(), m.uid);
+  }), messages.end());
+  if (messages.size() != before) {highest_modseq++; version++;}
+  return before - messages.size();
+}
+
+/* ----- touch ----- */
+void Mailbox::touch(vector<uint32_t> const& uids) {
+  for (auto uid : uids) {
+    if (auto message = find(uid)) {
+      message->seen = !message->seen;
+      bump(*message);
+    }
+  }
+}
+
+/* ----- removeDeleted ----- */
+vector<uint32_t> Mailbox::removeDeleted(vector<uint32_t> const* uids) {
+  vector<uint32_t> removed;
+  auto gone = [&](SyntheticMessage const& m) {
+    if (!m.deleted || (uids && !binary_search(uids->begin(), uids->end(), m.uid))) {return false;}
+    removed.push_back(m.uid);
+    return true;
+  };
+  messages.erase(remove_if(messages.begin(), messages.end(), gone), messages.end());
+  if (!removed.empty()) {highest_modseq++; version++;}
+  return removed;
+}
+
+/* ----- find ----- */
+SyntheticMessage* Mailbox::find(uint32_t uid) {
+  auto it = lower_bound(messages.begin(), messages.end(), uid, [](SyntheticMessage const& m, uint32_t u) {return m.uid < u;});
+  return it != messages.end() && it->uid == uid ? &*it : nullptr;
+}
+
+/* ----- unseen ----- */
+uint32_t Mailbox::unseen() const {
+  return uint32_t(count_if(messages.begin(), messages.end(), [](SyntheticMessage const& m) {return !m.seen;}));
+}
+
+/* ----- render ----- */
+RenderedMessage Mailbox::render(SyntheticMessage const& message, Detail detail) const {
+  static char const* const first[] = {"Ada", "Alan", "Barbara", "Claude", "Donald", "Edsger", "Frances", "Grace",
+                                      "Ivan", "John", "Ken", "Leslie", "Margaret", "Niklaus", "Radia", "Tony"};
+  static char const* const last[] = {"Lovelace", "Turing", "Liskov", "Shannon", "Knuth", "Dijkstra", "Allen", "Hopper",
+                                     "Sutherland", "Backus", "Thompson", "Lamport", "Hamilton", "Wirth", "Perlman", "Hoare"};
+  static char const* const words[] = {
+    "meeting", "report", "budget", "release", "schedule", "review", "server", "update", "invoice", "project",
+    "deadline", "draft", "agenda", "quarterly", "summary", "proposal", "contract", "feedback", "question", "status",
+    "migration", "backup", "network", "outage", "ticket", "customer", "design", "launch", "training", "holiday",
+    "travel", "expense", "payment", "account", "password", "security", "patch", "kernel", "compiler", "benchmark",
+    "latency", "throughput", "memory", "cache", "index", "search", "mailbox", "message", "thread", "archive",
+    "the", "a", "and", "of", "to", "for", "with", "on", "in", "is", "this", "that", "we", "please"};
+  size_t const num_words = sizeof(words) / sizeof(words[0]);
+
+  // Everything about a message comes from the seed and its UID, whichever order messages are rendered in:
+  Random r(spec.seed * 0x100000001B3ull ^ message.uid);
+  RenderedMessage out;
+  auto person = r.next();
+  out.from_name = string(first[person % 16]) + " " + last[(person >> 8) % 16];
+  out.from_mailbox = first[person % 16];
+  transform(out.from_mailbox.begin(), out.from_mailbox.end(), out.from_mailbox.begin(), ::tolower);
+  out.from_mailbox += "." + to_string((person >> 16) % 100);
+  out.from_host = "example.com";
+  size_t subject_words = r.between(2, 7);
+  for (size_t i = 0; i < subject_words; i++) {
+    if (i) {out.subject += ' ';}
+    out.subject += words[r.next() % 50];
+  }
+  time_t date = 1704067200 + time_t(message.uid) * 3600 + r.between(0, 3599);
+  tm utc;
+  gmtime_r(&date, &utc);
+  char date_buffer[64];
+  strftime(date_buffer, sizeof(date_buffer), "%a, %d %b %Y %H:%M:%S +0000", &utc);
+  out.date = date_buffer;
+  strftime(date_buffer, sizeof(date_buffer), "%d-%b-%Y %H:%M:%S +0000", &utc);
+  out.internal_date = date_buffer;
+  out.message_id = "<" + to_string(message.uid) + "." + to_string(spec.seed) + "@bench.invalid>";
+  // Two in three messages reply to one of the 200 before them (drawn apart, so the rest of the message does not
+  // depend on it):
+  Random reply(spec.seed * 0x100000001B3ull ^ message.uid ^ 0x5EEDull);
+  if (message.uid > 1 && reply.next() % 3) {
+    uint32_t parent = message.uid - 1 - uint32_t(reply.next() % min<uint32_t>(message.uid - 1, 200));
+    out.in_reply_to = "<" + to_string(parent) + "." + to_string(spec.seed) + "@bench.invalid>";
+  }
+  out.multipart = message.attachment_size && detail != TEXT;
+  string boundary = "=_bench_" + to_string(message.uid);
+
+  string& raw = out.raw;
+  raw.reserve(message.text_size + (out.multipart ? message.attachment_size / 3 * 4 + message.attachment_size / 57 * 2 + 1024 : 512));
+  raw += "Date: " + out.date + "\r\n";
+  raw += "From: \"" + out.from_name + "\" <" + out.from_mailbox + "@" + out.from_host + ">\r\n";
+  raw += "To: bench@example.com\r\n";
+  raw += "Subject: " + out.subject + "\r\n";
+  raw += "Message-ID: " + out.message_id + "\r\n";
+  if (!out.in_reply_to.empty()) {raw += "In-Reply-To: " + out.in_reply_to + "\r\nReferences: " + out.in_reply_to + "\r\n";}
+  raw += "MIME-Version: 1.0\r\n";
+  if (out.multipart) {raw += "Content-Type: multipart/mixed; boundary=\"" + boundary + "\"\r\n\r\n";}
+  else {raw += "Content-Type: text/plain; charset=utf-8\r\nContent-Transfer-Encoding: 7bit\r\n\r\n";}
+  out.header_size = raw.size();
+  string preamble = "This is a multi-part message in MIME format.\r\n\r\n--" + boundary + "\r\n"
+                    "Content-Type: text/plain; charset=utf-8\r\nContent-Transfer-Encoding: 7bit\r\n\r\n";
+  out.filename = "file" + to_string(message.uid) + ".bin";
+  string attachment_header = "\r\n--" + boundary + "\r\n"
+                             "Content-Type: application/octet-stream; name=\"" + out.filename + "\"\r\n"
+                             "Content-Transfer-Encoding: base64\r\n"
+                             "Content-Disposition: attachment; filename=\"" + out.filename + "\"\r\n\r\n";
+  string closing = "\r\n--" + boundary + "--\r\n";
+  // The size follows from the parts' sizes (base64 in lines of 19 groups), so RFC822.SIZE needs no full render:
+  out.size = out.header_size + message.text_size;
+  if (message.attachment_size) {
+    size_t groups = (message.attachment_size + 2) / 3;
+    out.size += preamble.size() + attachment_header.size() + groups * 4 + (groups + 18) / 19 * 2 + closing.size();
+  }
+  if (detail == HEADER) {return out;}
+  if (out.multipart) {raw += preamble;}
+
+  // Text: lines of words of at most 72 characters, exactly text_size bytes long:
+  out.text_offset = raw.size();
+  size_t line = 0;
+  while (raw.size() - out.text_offset < message.text_size) {
+    size_t left = message.text_size - (raw.size() - out.text_offset);
+    char const* word = words[r.next() % num_words];
+    size_t length = strlen(word);
+    if (left <= 2) {raw.append(left, '.'); break;}
+    if (line + length + 1 > 72 || length + 3 > left) {
+      if (length + 3 > left) {raw.append(left - 2, '.');}
+      raw += "\r\n";
+      line = 0;
+      out.text_lines++;
+      continue;
+    }
+    if (line) {raw += ' '; line++;}
+    raw += word;
+    line += length;
+  }
+  out.text_size = raw.size() - out.text_offset;
+  if (!out.multipart || detail != FULL) {return out;}
+
+  // Attachment: random bytes in base64 lines of 76 characters:
+  raw += attachment_header;
+  out.attachment_offset = raw.size();
+  static char const* const alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t left = message.attachment_size;
+  while (left) {
+    for (int group = 0; group < 19 && left; group++) {
+      uint64_t bits = r.next();
+      int bytes = min<uint32_t>(3, left);
+      left -= bytes;
+      char quad[4] = {alphabet[bits & 63], alphabet[(bits >> 6) & 63], alphabet[(bits >> 12) & 63], alphabet[(bits >> 18) & 63]};
+      // The last group is padded, its unused bits are zero:
+      if (bytes == 2) {quad[2] = alphabet[(bits >> 12) & 0x3C]; quad[3] = '=';}
+      if (bytes == 1) {quad[1] = alphabet[(bits >> 6) & 0x30]; quad[2] = quad[3] = '=';}
+      raw.append(quad, 4);
+    }
+    raw += "\r\n";
+  }
+  out.attachment_size = raw.size() - out.attachment_offset;
+  raw += closing;
+  return out;
+}
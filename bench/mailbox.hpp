@@ -0,0 +1,175 @@
+#ifndef BENCH_MAILBOX_H
+#define BENCH_MAILBOX_H
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Bench {
+
+/* -------------------- Class: Random -------------------- */
+// SplitMix64 generator with its own distributions, so a seed gives the same mailbox with every compiler and standard
+// library (the std distributions are implementation-defined).
+class Random {
+private:
+        uint64_t state;
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+        explicit Random(uint64_t seed) : state(seed) {}
+
+  /* ----- next ----- */
+  // Function to return the next 64 random bits.
+        uint64_t next();
+
+  /* ----- uniform / between / normal ----- */
+  // Functions to draw from [0, 1), from [low, high] and from the standard normal distribution.
+        double uniform() {return (next() >> 11) * 0x1.0p-53;}
+        uint32_t between(uint32_t low, uint32_t high) {return low + uint32_t(next() % (uint64_t(high) - low + 1));}
+        double normal();
+};
+
+/* -------------------- Struct: SizeDistribution -------------------- */
+// Distribution of the sizes of message texts or attachments, written as "fixed:N", "uniform:LOW:HIGH" or
+// "lognormal:MEDIAN:SIGMA" (sizes in bytes).
+struct SizeDistribution {
+        enum Kind {FIXED, UNIFORM, LOGNORMAL};
+        Kind kind = FIXED;
+        double a = 0;
+        double b = 0;
+
+  /* ----- parse ----- */
+  // Function to read a distribution, throwing a runtime_error if spec is not one.
+        static SizeDistribution parse(std::string const& spec);
+
+  /* ----- draw ----- */
+  // Function to draw a size (at least 1 byte, at most 64 MiB).
+        uint32_t draw(Random& random) const;
+
+  /* ----- str ----- */
+  // Function to write the distribution back as parse reads it.
+        std::string str() const;
+};
+
+/* -------------------- Struct: MailboxSpec -------------------- */
+// What a synthetic mailbox looks like: the same spec always generates the same messages.
+struct MailboxSpec {
+        uint32_t messages = 1000;
+        uint64_t seed = 1;
+        SizeDistribution text;
+        // Share of messages carrying one attachment, and the (decoded) sizes of attachments:
+        double attachment_rate = 0;
+        SizeDistribution attachment;
+
+  /* ----- preset ----- */
+  // Function to return the spec of a named body mix: "small" (short texts only), "mixed" (a tenth of the messages with
+  // an attachment) or "large" (long texts, half with multi-megabyte attachments). Throws a runtime_error otherwise.
+        static MailboxSpec preset(std::string const& name, uint32_t messages, uint64_t seed);
+};
+
+/* -------------------- Struct: SyntheticMessage -------------------- */
+// What the mailbox stores per message, everything else (addresses, subject, text, attachment) is generated from the
+// mailbox seed and the UID whenever it is needed.
+struct SyntheticMessage {
+        uint32_t uid = 0;
+        uint32_t text_size = 0;
+        uint32_t attachment_size = 0; // 0 without attachment
+        uint64_t modseq = 1;
+        bool seen = false;
+        bool deleted = false;
+        bool flagged = false;
+};
+
+/* -------------------- Struct: RenderedMessage -------------------- */
+// A message generated in full, with the offsets of its MIME parts in raw.
+struct RenderedMessage {
+        std::string raw;
+        std::string date;
+        std::string internal_date; // the same as an IMAP date-time
+        std::string from_name, from_mailbox, from_host;
+        std::string subject;
+        std::string message_id;
+        std::string in_reply_to; // empty unless the message is a reply
+        size_t header_size = 0;
+        size_t size = 0; // of raw when fully rendered (set by HEADER renders too)
+        // Text part (part 1) and, for a multipart, the base64 attachment (part 2):
+        size_t text_offset = 0, text_size = 0, text_lines = 0;
+        size_t attachment_offset = 0, attachment_size = 0;
+        std::string filename;
+        bool multipart = false;
+
+  /* ----- section ----- */
+  // Function to return the contents of a BODY[section] ("", "HEADER", "TEXT", "1" or "2") of a fully rendered
+  // message, false if the message has no such section.
+        bool section(std::string_view name, std::string_view& out) const;
+
+  /* ----- headerFields ----- */
+  // Function to return the header lines of a BODY[HEADER.FIELDS (...)] section (fields being what is between the
+  // parentheses) followed by the empty line.
+        std::string headerFields(std::string_view fields) const;
+};
+
+/* -------------------- Class: Mailbox -------------------- */
+// Deterministic synthetic mailbox. Not thread-safe: the server guards it.
+class Mailbox {
+private:
+        MailboxSpec spec;
+        std::vector<SyntheticMessage> messages; // ascending UIDs
+        uint32_t uidnext = 1;
+        uint64_t highest_modseq = 1;
+        // Incremented by every change, so connections can tell they have to report something:
+        uint64_t version = 0;
+        Random random;
+
+  /* ----- generate ----- */
+  // Function to draw the sizes of a new message with the next UID.
+        SyntheticMessage generate();
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+        explicit Mailbox(MailboxSpec const& spec);
+
+  /* ----- UIDVALIDITY ----- */
+        static uint32_t const UIDVALIDITY = 1000;
+
+  /* ----- reset ----- */
+  // Function to regenerate the mailbox of the spec, undoing every change.
+        void reset();
+
+  /* ----- deliver / expunge / touch ----- */
+  // Functions to change the mailbox as another client would: add count new messages, remove messages (returning how
+  // many existed) and toggle the \Seen flag of messages (bumping their modification sequence).
+        void deliver(uint32_t count);
+        size_t expunge(std::vector<uint32_t> uids);
+        void touch(std::vector<uint32_t> const& uids);
+
+  /* ----- removeDeleted ----- */
+  // Function to remove the messages flagged \Deleted (only those in the sorted uids unless it is null), returning
+  // their UIDs.
+        std::vector<uint32_t> removeDeleted(std::vector<uint32_t> const* uids = nullptr);
+
+  /* ----- find ----- */
+  // Function to return the message with the given UID, nullptr if there is none.
+        SyntheticMessage* find(uint32_t uid);
+
+  /* ----- bump ----- */
+  // Function to record a change to the flags of message.
+        void bump(SyntheticMessage& message) {message.modseq = ++highest_modseq; version++;}
+
+  /* ----- render ----- */
+  // Function to generate a message up to detail: its header only (for envelopes), the header and text without the
+  // attachment (for searching) or all of it.
+        enum Detail {HEADER, TEXT, FULL};
+        RenderedMessage render(SyntheticMessage const& message, Detail detail = FULL) const;
+
+  /* ----- accessors ----- */
+        std::vector<SyntheticMessage> const& list() const {return messages;}
+        uint32_t getUIDNext() const {return uidnext;}
+        uint64_t getHighestModSeq() const {return highest_modseq;}
+        uint64_t getVersion() const {return version;}
+        MailboxSpec const& getSpec() const {return spec;}
+        uint32_t unseen() const;
+};
+}
+
+#endif /* BENCH_MAILBOX_H */
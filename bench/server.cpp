@@ -0,0 +1,1107 @@
+#include "server.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+
+using namespace Bench;
+using namespace std;
+
+namespace {
+
+/* ----- Token ----- */
+// Word of a command line: an atom (including "(" and ")", and anything in brackets such as BODY[1]<0.100>) or the
+// contents of a quoted string or literal.
+struct Token {
+  string text;
+  bool quoted = false;
+  bool is(char const* atom) const {return !quoted && strcasecmp(text.c_str(), atom) == 0;}
+};
+
+/* ----- tokenize ----- */
+// Function to append the tokens of (a piece of) a command line to tokens.
+void tokenize(string_view line, vector<Token>& tokens) {
+  for (size_t i = 0; i < line.size();) {
+    char c = line[i];
+    if (c == ' ') {i++; continue;}
+    if (c == '(' || c == ')') {tokens.push_back({string(1, c)}); i++; continue;}
+    if (c == '"') {
+      Token token{"", true};
+      for (i++; i < line.size() && line[i] != '"'; i++) {
+        if (line[i] == '\\' && i + 1 < line.size()) {i++;}
+        token.text += line[i];
+      }
+      tokens.push_back(move(token));
+      i++;
+      continue;
+    }
+    // An atom ends at a space or parenthesis, except inside brackets (BODY[HEADER.FIELDS (FROM)]):
+    size_t end = i;
+    for (int depth = 0; end < line.size(); end++) {
+      char d = line[end];
+      if (d == '[') {depth++;}
+      else if (d == ']') {depth--;}
+      else if (depth <= 0 && (d == ' ' || d == '(' || d == ')')) {break;}
+    }
+    tokens.push_back({string(line.substr(i, end - i))});
+    i = end;
+  }
+}
+
+/* ----- SequenceSet ----- */
+// Set such as "1:3,7,9:*" as sorted, merged ranges.
+struct SequenceSet {
+  vector<pair<uint32_t, uint32_t>> ranges;
+
+  // Function to parse text, star being the value of "*": false if it is not a set.
+  static bool parse(string const& text, uint32_t star, SequenceSet& set) {
+    set.ranges.clear();
+    auto number = [star](string const& s, uint32_t& value) {
+      if (s == "*") {value = star; return true;}
+      if (s.empty() || s.find_first_not_of("0123456789") != string::npos) {return false;}
+      value = uint32_t(stoul(s));
+      return true;
+    };
+    for (size_t start = 0; start <= text.size();) {
+      size_t comma = text.find(',', start);
+      if (comma == string::npos) {comma = text.size();}
+      string item = text.substr(start, comma - start);
+      size_t colon = item.find(':');
+      uint32_t low, high;
+      if (!number(item.substr(0, colon), low)) {return false;}
+      if (colon == string::npos) {high = low;}
+      else if (!number(item.substr(colon + 1), high)) {return false;}
+      // "7:3" is "3:7", and "9:*" still matches the last message if it is below 9:
+      set.ranges.emplace_back(min(low, high), max(low, high));
+      start = comma + 1;
+    }
+    sort(set.ranges.begin(), set.ranges.end());
+    vector<pair<uint32_t, uint32_t>> merged;
+    for (auto const& range : set.ranges) {
+      if (!merged.empty() && range.first <= uint64_t(merged.back().second) + 1) {
+        merged.back().second = max(merged.back().second, range.second);
+      } else {merged.push_back(range);}
+    }
+    set.ranges.swap(merged);
+    return true;
+  }
+
+  bool contains(uint32_t value) const {
+    auto it = upper_bound(ranges.begin(), ranges.end(), make_pair(value, UINT32_MAX));
+    return it != ranges.begin() && prev(it)->second >= value;
+  }
+};
+
+/* ----- formatSet ----- */
+// Function to write ascending values as a compact set ("1:3,7").
+string formatSet(vector<uint32_t> const& values) {
+  string set;
+  for (size_t i = 0; i < values.size();) {
+    size_t j = i;
+    while (j + 1 < values.size() && values[j + 1] == values[j] + 1) {j++;}
+    if (!set.empty()) {set += ',';}
+    set += to_string(values[i]);
+    if (j > i) {set += ':' + to_string(values[j]);}
+    i = j + 1;
+  }
+  return set;
+}
+
+/* ----- quote ----- */
+// Function to write s as an IMAP string: quoted if it can be, a literal otherwise.
+string quote(string_view s) {
+  bool literal = s.size() > 1024;
+  for (unsigned char c : s) {literal = literal || c == '\r' || c == '\n' || c == 0 || c >= 0x80;}
+  if (literal) {return "{" + to_string(s.size()) + "}\r\n" + string(s);}
+  string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {quoted += '\\';}
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+/* ----- upper ----- */
+string upper(string s) {
+  transform(s.begin(), s.end(), s.begin(), ::toupper);
+  return s;
+}
+
+/* ----- containsNoCase ----- */
+bool containsNoCase(string_view haystack, string_view needle) {
+  if (needle.empty()) {return true;}
+  auto it = search(haystack.begin(), haystack.end(), needle.begin(), needle.end(),
+                   [](char a, char b) {return tolower((unsigned char)a) == tolower((unsigned char)b);});
+  return it != haystack.end();
+}
+
+/* ----- headerValue ----- */
+// Function to return the value of the first header field called name in header, empty if missing.
+string_view headerValue(string_view header, string_view name) {
+  for (size_t start = 0; start < header.size();) {
+    size_t end = header.find("\r\n", start);
+    if (end == string_view::npos) {end = header.size();}
+    string_view line = header.substr(start, end - start);
+    if (line.size() > name.size() && line[name.size()] == ':' && strncasecmp(line.data(), name.data(), name.size()) == 0) {
+      line.remove_prefix(name.size() + 1);
+      while (!line.empty() && line.front() == ' ') {line.remove_prefix(1);}
+      return line;
+    }
+    start = end + 2;
+  }
+  return {};
+}
+
+/* ----- SearchKey ----- */
+// Node of a SEARCH program: children hold the keys of AND (a parenthesized list or the whole program), OR and NOT.
+struct SearchKey {
+  enum Kind {ALL, AND, OR, NOT, SEEN, UNSEEN, DELETED, UNDELETED, FLAGGED, UNFLAGGED, HEADER, BODY, TEXT, LARGER,
+             SMALLER, UID, SEQUENCE, MODSEQ, NONE};
+  Kind kind = ALL;
+  string field; // header field of HEADER (FROM, SUBJECT... are HEADER keys)
+  string value;
+  uint64_t number = 0;
+  SequenceSet set;
+  vector<SearchKey> children;
+};
+
+} // namespace
+
+/* -------------------- Class: Server::Connection -------------------- */
+// One client: reads its commands, runs them against the shared mailbox and writes the responses (compressed once
+// COMPRESS DEFLATE is on). The sequence numbers of the client are those of view, brought up to date with
+// EXPUNGE/EXISTS responses whenever the mailbox has changed.
+class Server::Connection {
+private:
+        Server& server;
+        int fd;
+        bool alive = true;
+        string in;
+        size_t in_pos = 0;
+        string out;
+        bool compressed = false;
+        z_stream inflater{};
+        z_stream deflater{};
+        bool authenticated = false;
+        bool selected = false;
+        bool read_only = false;
+        bool condstore = false;
+        vector<uint32_t> view;
+        uint64_t seen_version = 0;
+        // Last message rendered in full, fetched again range by range by MessageView and saveAttachment:
+        optional<RenderedMessage> rendered;
+        SyntheticMessage rendered_message;
+
+  /* ----- input ----- */
+        bool fill();
+        bool readLine(string& line);
+        bool readBytes(size_t count, string& data);
+        bool readCommand(vector<Token>& tokens);
+
+  /* ----- output ----- */
+  // Function to send out (compressed if need be) through the shaped link.
+        void flush();
+        void send(string const& wire);
+
+  /* ----- helpers ----- */
+        static Token const& arg(vector<Token> const& tokens, size_t& at);
+        static vector<Token> list(vector<Token> const& tokens, size_t& at);
+        string capabilities();
+        string flags(SyntheticMessage const& message);
+        RenderedMessage const& render(SyntheticMessage const& message, Mailbox::Detail detail, optional<RenderedMessage>& local);
+        string envelope(RenderedMessage const& message);
+        string structure(SyntheticMessage const& message, bool extensions);
+        // Function to report changes of the mailbox made by others (or by EXPUNGE) to the client:
+        void report();
+        // Function to collect the messages of a set, with the sequence number of each:
+        vector<pair<uint32_t, SyntheticMessage*>> targets(string const& set, bool uid);
+
+  /* ----- commands ----- */
+  // Function to run one command, writing its responses: false once the connection is to be closed.
+        bool execute(string const& tag, string const& name, vector<Token> const& tokens, size_t at);
+        void select(string const& tag, string const& name, vector<Token> const& tokens, size_t at);
+        void status(string const& tag, vector<Token> const& tokens, size_t at);
+        void fetch(string const& tag, bool uid, vector<Token> const& tokens, size_t at);
+        void store(string const& tag, bool uid, vector<Token> const& tokens, size_t at);
+        void search(string const& tag, bool uid, vector<Token> const& tokens, size_t at);
+        SearchKey parseKey(vector<Token> const& tokens, size_t& at);
+        bool matches(SearchKey const& key, uint32_t seq, SyntheticMessage const& message, RenderedMessage const* rendered);
+        bool idle(string const& tag);
+        void compress(string const& tag, vector<Token> const& tokens, size_t at);
+
+public:
+        atomic<bool> done{false};
+
+  /* ----- CONSTRUCTOR / DESTRUCTOR ----- */
+        Connection(Server& server, int fd) : server(server), fd(fd) {}
+        ~Connection() {
+          if (compressed) {inflateEnd(&inflater); deflateEnd(&deflater);}
+          close(fd);
+        }
+
+  /* ----- run ----- */
+  // Function run by the connection thread: greets the client and serves it until it logs out or the server stops.
+        void run();
+
+  /* ----- shutdown ----- */
+  // Function to interrupt the connection (from another thread).
+        void shutdown() {::shutdown(fd, SHUT_RDWR);}
+};
+
+/* ----- run ----- */
+void Server::Connection::run() {
+  // Connecting costs a round trip like any command:
+  this_thread::sleep_for(server.getShaping().latency);
+  out += "* OK [CAPABILITY " + capabilities() + "] MailPunk bench server ready\r\n";
+  flush();
+
+  vector<Token> tokens;
+  while (alive && !server.stopping && readCommand(tokens)) {
+    if (tokens.empty()) {continue;}
+    if (tokens.size() < 2 || tokens[0].quoted) {out += "* BAD Missing command\r\n"; flush(); continue;}
+    string tag = tokens[0].text;
+    string name = upper(tokens[1].text);
+    size_t at = 2;
+    if (name == "UID" && tokens.size() > 2) {name += " " + upper(tokens[2].text); at = 3;}
+    server.count(name, name == "LOGIN");
+    this_thread::sleep_for(server.getShaping().latency);
+    bool keep = true;
+    try {
+      keep = execute(tag, name, tokens, at);
+    } catch (exception const& error) {
+      out += tag + " BAD " + error.what() + "\r\n";
+    }
+    flush();
+    if (!keep) {break;}
+  }
+  ::shutdown(fd, SHUT_RDWR);
+  done = true;
+}
+
+/* ----- fill ----- */
+bool Server::Connection::fill() {
+  char buffer[64 * 1024];
+  ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+  if (n <= 0) {return false;}
+  server.countBytes(n, 0);
+  if (in_pos > 0 && in_pos == in.size()) {in.clear(); in_pos = 0;}
+  if (!compressed) {in.append(buffer, n); return true;}
+  // Inflate everything that arrived, so a poll on the socket never misses buffered input:
+  inflater.next_in = (Bytef*)buffer;
+  inflater.avail_in = uInt(n);
+  char plain[64 * 1024];
+  do {
+    inflater.next_out = (Bytef*)plain;
+    inflater.avail_out = sizeof(plain);
+    int r = inflate(&inflater, Z_SYNC_FLUSH);
+    if (r != Z_OK && r != Z_BUF_ERROR) {return false;}
+    in.append(plain, sizeof(plain) - inflater.avail_out);
+  } while (inflater.avail_in > 0 || inflater.avail_out == 0);
+  return true;
+}
+
+/* ----- readLine ----- */
+bool Server::Connection::readLine(string& line) {
+  size_t end;
+  while ((end = in.find("\r\n", in_pos)) == string::npos) {
+    if (in.size() - in_pos > 1024 * 1024 || !fill()) {return false;}
+  }
+  line.assign(in, in_pos, end - in_pos);
+  in_pos = end + 2;
+  return true;
+}
+
+/* ----- readBytes ----- */
+bool Server::Connection::readBytes(size_t count, string& data) {
+  while (in.size() - in_pos < count) {
+    if (!fill()) {return false;}
+  }
+  data.assign(in, in_pos, count);
+  in_pos += count;
+  return true;
+}
+
+/* ----- readCommand ----- */
+bool Server::Connection::readCommand(vector<Token>& tokens) {
+  // A line ending in {n} (or {n+} with LITERAL+) continues after n bytes of literal:
+  tokens.clear();
+  string line;
+  while (true) {
+    if (!readLine(line)) {return false;}
+    if (line.empty()) {continue;}
+    size_t open = line.rfind('{');
+    string length = open != string::npos && line.back() == '}' ? line.substr(open + 1, line.size() - open - 2) : "";
+    bool plus = !length.empty() && length.back() == '+';
+    if (plus) {length.pop_back();}
+    if (length.empty() || length.size() > 9 || length.find_first_not_of("0123456789") != string::npos) {
+      tokenize(line, tokens);
+      return true;
+    }
+    tokenize(string_view(line).substr(0, open), tokens);
+    if (!plus) {out += "+ Ready for literal data\r\n"; flush();}
+    Token literal{"", true};
+    if (!readBytes(stoul(length), literal.text)) {return false;}
+    tokens.push_back(move(literal));
+  }
+}
+
+/* ----- flush ----- */
+void Server::Connection::flush() {
+  if (out.empty() || !alive) {out.clear(); return;}
+  if (!compressed) {send(out); out.clear(); return;}
+  string wire;
+  deflater.next_in = (Bytef*)out.data();
+  deflater.avail_in = uInt(out.size());
+  char buffer[64 * 1024];
+  do {
+    deflater.next_out = (Bytef*)buffer;
+    deflater.avail_out = sizeof(buffer);
+    deflate(&deflater, Z_SYNC_FLUSH);
+    wire.append(buffer, sizeof(buffer) - deflater.avail_out);
+  } while (deflater.avail_out == 0);
+  out.clear();
+  send(wire);
+}
+
+/* ----- send ----- */
+void Server::Connection::send(string const& wire) {
+  // Slices of the link are reserved one at a time, so large responses of several connections interleave:
+  size_t const SLICE = 16 * 1024;
+  for (size_t offset = 0; offset < wire.size() && alive;) {
+    size_t size = min(SLICE, wire.size() - offset);
+    server.transmit(size);
+    ssize_t n = ::send(fd, wire.data() + offset, size, MSG_NOSIGNAL);
+    if (n <= 0) {alive = false; break;}
+    server.countBytes(0, n);
+    offset += n;
+  }
+}
+
+/* ----- arg / list ----- */
+Token const& Server::Connection::arg(vector<Token> const& tokens, size_t& at) {
+  if (at >= tokens.size()) {throw runtime_error("Missing argument");}
+  return tokens[at++];
+}
+
+vector<Token> Server::Connection::list(vector<Token> const& tokens, size_t& at) {
+  // A parenthesized list (without its parentheses, nested ones kept) or a single token:
+  Token const& first = arg(tokens, at);
+  if (!first.quoted && first.text == "(") {
+    vector<Token> items;
+    for (int depth = 1; at < tokens.size(); at++) {
+      if (!tokens[at].quoted && tokens[at].text == "(") {depth++;}
+      if (!tokens[at].quoted && tokens[at].text == ")" && --depth == 0) {at++; return items;}
+      items.push_back(tokens[at]);
+    }
+    throw runtime_error("Unterminated list");
+  }
+  return {first};
+}
+
+/* ----- capabilities ----- */
+string Server::Connection::capabilities() {
+  Capabilities offered = server.getCapabilities();
+  string list = "IMAP4rev1 LITERAL+ ENABLE UNSELECT";
+  if (offered.uidplus) {list += " UIDPLUS";}
+  if (offered.esearch) {list += " ESEARCH";}
+  if (offered.condstore) {list += " CONDSTORE";}
+  if (offered.idle) {list += " IDLE";}
+  if (offered.compress && !compressed) {list += " COMPRESS=DEFLATE";}
+  return list;
+}
+
+/* ----- flags ----- */
+string Server::Connection::flags(SyntheticMessage const& message) {
+  string list;
+  if (message.seen) {list += "\\Seen";}
+  if (message.deleted) {list += list.empty() ? "\\Deleted" : " \\Deleted";}
+  if (message.flagged) {list += list.empty() ? "\\Flagged" : " \\Flagged";}
+  return "(" + list + ")";
+}
+
+/* ----- render ----- */
+RenderedMessage const& Server::Connection::render(SyntheticMessage const& message, Mailbox::Detail detail,
+                                                 optional<RenderedMessage>& local) {
+  // Full messages are kept until another one is rendered in full, anything less is rendered into local. The mailbox
+  // spec never changes, so rendering needs no lock:
+  auto same = [&message](SyntheticMessage const& other) {
+    return other.uid == message.uid && other.text_size == message.text_size && other.attachment_size == message.attachment_size;
+  };
+  if (rendered && same(rendered_message)) {return *rendered;}
+  if (detail == Mailbox::FULL) {
+    rendered = server.mailbox.render(message, detail);
+    rendered_message = message;
+    return *rendered;
+  }
+  local = server.mailbox.render(message, detail);
+  return *local;
+}
+
+/* ----- envelope ----- */
+string Server::Connection::envelope(RenderedMessage const& message) {
+  string address = "((" + quote(message.from_name) + " NIL " + quote(message.from_mailbox) + " " + quote(message.from_host) + "))";
+  return "(" + quote(message.date) + " " + quote(message.subject) + " " + address + " " + address + " " + address
+         + " ((NIL NIL \"bench\" \"example.com\")) NIL NIL " + (message.in_reply_to.empty() ? "NIL" : quote(message.in_reply_to))
+         + " " + quote(message.message_id) + ")";
+}
+
+/* ----- structure ----- */
+string Server::Connection::structure(SyntheticMessage const& message, bool extensions) {
+  optional<RenderedMessage> local;
+  auto const& r = render(message, message.attachment_size ? Mailbox::FULL : Mailbox::TEXT, local);
+  string text = "(\"TEXT\" \"PLAIN\" (\"CHARSET\" \"UTF-8\") NIL NIL \"7BIT\" " + to_string(r.text_size) + " "
+                + to_string(r.text_lines) + (extensions ? " NIL NIL NIL NIL)" : ")");
+  if (!r.multipart) {return text;}
+  string attachment = "(\"APPLICATION\" \"OCTET-STREAM\" (\"NAME\" " + quote(r.filename) + ") NIL NIL \"BASE64\" "
+                      + to_string(r.attachment_size);
+  if (extensions) {attachment += " NIL (\"ATTACHMENT\" (\"FILENAME\" " + quote(r.filename) + ")) NIL NIL";}
+  attachment += ")";
+  string boundary = "=_bench_" + to_string(message.uid);
+  return "(" + text + attachment + " \"MIXED\"" + (extensions ? " (\"BOUNDARY\" " + quote(boundary) + ") NIL NIL NIL)" : ")");
+}
+
+/* ----- report ----- */
+void Server::Connection::report() {
+  if (!selected) {return;}
+  vector<uint32_t> current;
+  {
+    lock_guard<mutex> guard(server.mailbox_mutex);
+    if (server.mailbox.getVersion() == seen_version) {return;}
+    seen_version = server.mailbox.getVersion();
+    current.reserve(server.mailbox.list().size());
+    for (auto const& message : server.mailbox.list()) {current.push_back(message.uid);}
+  }
+  // Expunges are reported from the highest sequence number down, so the numbers still to report do not shift:
+  size_t remaining = view.size();
+  for (size_t i = view.size(); i-- > 0;) {
+    if (!binary_search(current.begin(), current.end(), view[i])) {
+      out += "* " + to_string(i + 1) + " EXPUNGE\r\n";
+      remaining--;
+    }
+  }
+  if (current.size() != remaining) {out += "* " + to_string(current.size()) + " EXISTS\r\n";}
+  view.swap(current);
+}
+
+/* ----- targets ----- */
+vector<pair<uint32_t, SyntheticMessage*>> Server::Connection::targets(string const& text, bool uid) {
+  // Hold mailbox_mutex: the pointers are only valid as long as it is held.
+  SequenceSet set;
+  uint32_t star = uid ? (view.empty() ? 0 : view.back()) : uint32_t(view.size());
+  if (!SequenceSet::parse(text, star, set)) {throw runtime_error("Invalid sequence set");}
+  vector<pair<uint32_t, SyntheticMessage*>> found;
+  for (uint32_t seq = 1; seq <= view.size(); seq++) {
+    if (!set.contains(uid ? view[seq - 1] : seq)) {continue;}
+    // Messages expunged by others since the last report are gone:
+    if (auto message = server.mailbox.find(view[seq - 1])) {found.emplace_back(seq, message);}
+  }
+  return found;
+}
+
+/* ----- execute ----- */
+bool Server::Connection::execute(string const& tag, string const& name, vector<Token> const& tokens, size_t at) {
+  auto ok = [&](string const& text) {out += tag + " OK " + text + "\r\n";};
+  bool needs_auth = name != "CAPABILITY" && name != "NOOP" && name != "LOGOUT" && name != "LOGIN" && name != "COMPRESS";
+  bool needs_selection = name == "FETCH" || name == "STORE" || name == "SEARCH" || name == "EXPUNGE" || name == "CLOSE"
+                         || name == "UNSELECT" || name.compare(0, 4, "UID ") == 0;
+  if ((needs_auth && !authenticated) || (needs_selection && !selected)) {
+    out += tag + " BAD Command not allowed in this state\r\n";
+    return true;
+  }
+
+  if (name == "CAPABILITY") {out += "* CAPABILITY " + capabilities() + "\r\n"; ok("CAPABILITY completed");}
+  else if (name == "NOOP" || name == "CHECK") {report(); ok(name + " completed");}
+  else if (name == "LOGOUT") {out += "* BYE Logging out\r\n"; ok("LOGOUT completed"); return false;}
+  else if (name == "LOGIN") {
+    arg(tokens, at);
+    arg(tokens, at);
+    authenticated = true;
+    ok("[CAPABILITY " + capabilities() + "] LOGIN completed");
+  }
+  else if (name == "ENABLE") {
+    string enabled;
+    while (at < tokens.size()) {
+      if (tokens[at++].is("CONDSTORE") && server.getCapabilities().condstore) {condstore = true; enabled = " CONDSTORE";}
+    }
+    out += "* ENABLED" + enabled + "\r\n";
+    ok("ENABLE completed");
+  }
+  else if (name == "SELECT" || name == "EXAMINE") {select(tag, name, tokens, at);}
+  else if (name == "STATUS") {status(tag, tokens, at);}
+  else if (name == "LIST" || name == "LSUB") {
+    arg(tokens, at);
+    string pattern = arg(tokens, at).text;
+    if (pattern.empty()) {out += "* " + name + " (\\Noselect) \"/\" \"\"\r\n";}
+    else if (pattern == "*" || pattern == "%" || upper(pattern) == "INBOX") {out += "* " + name + " (\\HasNoChildren) \"/\" INBOX\r\n";}
+    ok(name + " completed");
+  }
+  else if (name == "CLOSE" || name == "UNSELECT") {
+    if (name == "CLOSE" && !read_only) {
+      lock_guard<mutex> guard(server.mailbox_mutex);
+      server.mailbox.removeDeleted();
+    }
+    selected = false;
+    view.clear();
+    ok(name + " completed");
+    return true;
+  }
+  else if (name == "EXPUNGE" || name == "UID EXPUNGE") {
+    if (read_only) {out += tag + " NO Mailbox is read-only\r\n"; return true;}
+    vector<uint32_t> uids;
+    if (name == "UID EXPUNGE") {
+      SequenceSet set;
+      uint32_t star = view.empty() ? 0 : view.back();
+      if (!SequenceSet::parse(arg(tokens, at).text, star, set)) {throw runtime_error("Invalid sequence set");}
+      for (auto uid : view) {
+        if (set.contains(uid)) {uids.push_back(uid);}
+      }
+    }
+    {
+      lock_guard<mutex> guard(server.mailbox_mutex);
+      server.mailbox.removeDeleted(name == "UID EXPUNGE" ? &uids : nullptr);
+    }
+    report();
+    ok(name + " completed");
+    return true;
+  }
+  else if (name == "FETCH" || name == "UID FETCH") {fetch(tag, name == "UID FETCH", tokens, at);}
+  else if (name == "STORE" || name == "UID STORE") {store(tag, name == "UID STORE", tokens, at);}
+  else if (name == "SEARCH" || name == "UID SEARCH") {search(tag, name == "UID SEARCH", tokens, at);}
+  else if (name == "IDLE") {return idle(tag);}
+  else if (name == "COMPRESS") {compress(tag, tokens, at); return true;}
+  else {out += tag + " BAD Unknown command\r\n"; return true;}
+
+  // Only FETCH, STORE and SEARCH by sequence number must not be answered with EXPUNGE responses (RFC 3501 7.4.1):
+  if (selected && name != "FETCH" && name != "STORE" && name != "SEARCH") {
+    // The tagged response must come last:
+    size_t tagged = out.size() > 2 ? out.rfind("\r\n" + tag + " ", out.size() - 3) : string::npos;
+    tagged = tagged == string::npos ? 0 : tagged + 2;
+    string final_line = out.substr(tagged);
+    out.resize(tagged);
+    report();
+    out += final_line;
+  }
+  return true;
+}
+
+/* ----- select ----- */
+void Server::Connection::select(string const& tag, string const& name, vector<Token> const& tokens, size_t at) {
+  string mb = arg(tokens, at).text;
+  if (upper(mb) != "INBOX") {selected = false; out += tag + " NO [NONEXISTENT] No such mailbox\r\n"; return;}
+  if (at < tokens.size()) {
+    for (auto const& parameter : list(tokens, at)) {
+      if (parameter.is("CONDSTORE") && server.getCapabilities().condstore) {condstore = true;}
+    }
+  }
+  selected = true;
+  read_only = name == "EXAMINE";
+  lock_guard<mutex> guard(server.mailbox_mutex);
+  Mailbox& mailbox = server.mailbox;
+  view.clear();
+  for (auto const& message : mailbox.list()) {view.push_back(message.uid);}
+  seen_version = mailbox.getVersion();
+  out += "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n";
+  out += read_only ? "* OK [PERMANENTFLAGS ()] Read-only\r\n" : "* OK [PERMANENTFLAGS (\\Deleted \\Seen \\Flagged)] Limited\r\n";
+  out += "* " + to_string(view.size()) + " EXISTS\r\n";
+  out += "* 0 RECENT\r\n";
+  out += "* OK [UIDVALIDITY " + to_string(Mailbox::UIDVALIDITY) + "] UIDs valid\r\n";
+  out += "* OK [UIDNEXT " + to_string(mailbox.getUIDNext()) + "] Predicted next UID\r\n";
+  if (server.getCapabilities().condstore) {
+    out += "* OK [HIGHESTMODSEQ " + to_string(mailbox.getHighestModSeq()) + "] Highest\r\n";
+  }
+  out += tag + (read_only ? " OK [READ-ONLY] " : " OK [READ-WRITE] ") + name + " completed\r\n";
+}
+
+/* ----- status ----- */
+void Server::Connection::status(string const& tag, vector<Token> const& tokens, size_t at) {
+  string mb = arg(tokens, at).text;
+  auto items = list(tokens, at);
+  if (upper(mb) != "INBOX") {out += tag + " NO [NONEXISTENT] No such mailbox\r\n"; return;}
+  string counters;
+  {
+    lock_guard<mutex> guard(server.mailbox_mutex);
+    Mailbox const& mailbox = server.mailbox;
+    for (auto const& item : items) {
+      string value;
+      if (item.is("MESSAGES")) {value = to_string(mailbox.list().size());}
+      else if (item.is("RECENT")) {value = "0";}
+      else if (item.is("UIDNEXT")) {value = to_string(mailbox.getUIDNext());}
+      else if (item.is("UIDVALIDITY")) {value = to_string(Mailbox::UIDVALIDITY);}
+      else if (item.is("UNSEEN")) {value = to_string(mailbox.unseen());}
+      else if (item.is("HIGHESTMODSEQ")) {value = to_string(mailbox.getHighestModSeq());}
+      else {throw runtime_error("Unknown status item " + item.text);}
+      counters += (counters.empty() ? "" : " ") + upper(item.text) + " " + value;
+    }
+  }
+  out += "* STATUS INBOX (" + counters + ")\r\n";
+  out += tag + " OK STATUS completed\r\n";
+}
+
+/* ----- fetch ----- */
+void Server::Connection::fetch(string const& tag, bool uid, vector<Token> const& tokens, size_t at) {
+  // Items of a FETCH, BODY[...] ones with their section and range:
+  struct Item {
+    enum Kind {UID, FLAGS, INTERNALDATE, SIZE, ENVELOPE, BODYSTRUCTURE, BODY, MODSEQ, SECTION};
+    Kind kind;
+    string section;
+    string response; // name in the response, e.g. BODY[1]<0>
+    bool peek = true;
+    bool partial = false;
+    uint32_t offset = 0, length = 0;
+    Item(Kind kind, string section = "", string response = "", bool peek = true)
+      : kind(kind), section(move(section)), response(move(response)), peek(peek) {}
+  };
+  string set = arg(tokens, at).text;
+  vector<Token> names = list(tokens, at);
+  uint64_t changedsince = 0;
+  if (at < tokens.size()) {
+    auto modifiers = list(tokens, at);
+    for (size_t i = 0; i + 1 < modifiers.size(); i++) {
+      if (modifiers[i].is("CHANGEDSINCE")) {changedsince = stoull(modifiers[i + 1].text);}
+    }
+  }
+
+  vector<Item> items;
+  auto add = [&items](Item::Kind kind) {
+    for (auto const& item : items) {
+      if (item.kind == kind) {return;}
+    }
+    items.push_back({kind});
+  };
+  if (uid) {add(Item::UID);}
+  for (auto const& token : names) {
+    string n = upper(token.text);
+    if (n == "ALL" || n == "FAST" || n == "FULL") {
+      add(Item::FLAGS); add(Item::INTERNALDATE); add(Item::SIZE);
+      if (n != "FAST") {add(Item::ENVELOPE);}
+      if (n == "FULL") {add(Item::BODY);}
+    }
+    else if (n == "UID") {add(Item::UID);}
+    else if (n == "FLAGS") {add(Item::FLAGS);}
+    else if (n == "INTERNALDATE") {add(Item::INTERNALDATE);}
+    else if (n == "RFC822.SIZE") {add(Item::SIZE);}
+    else if (n == "ENVELOPE") {add(Item::ENVELOPE);}
+    else if (n == "BODYSTRUCTURE") {add(Item::BODYSTRUCTURE);}
+    else if (n == "BODY") {add(Item::BODY);}
+    else if (n == "MODSEQ") {add(Item::MODSEQ);}
+    else if (n == "RFC822") {items.push_back({Item::SECTION, "", "RFC822", false});}
+    else if (n == "RFC822.HEADER") {items.push_back({Item::SECTION, "HEADER", "RFC822.HEADER", true});}
+    else if (n == "RFC822.TEXT") {items.push_back({Item::SECTION, "TEXT", "RFC822.TEXT", false});}
+    else if (n.compare(0, 5, "BODY[") == 0 || n.compare(0, 10, "BODY.PEEK[") == 0) {
+      Item item{Item::SECTION};
+      item.peek = n[4] == '.';
+      size_t open = n.find('['), close = n.find(']');
+      if (close == string::npos) {throw runtime_error("Invalid section");}
+      item.section = n.substr(open + 1, close - open - 1);
+      item.response = "BODY[" + item.section + "]";
+      if (close + 1 < n.size()) {
+        if (sscanf(n.c_str() + close + 1, "<%u.%u>", &item.offset, &item.length) != 2) {throw runtime_error("Invalid range");}
+        item.partial = true;
+        item.response += "<" + to_string(item.offset) + ">";
+      }
+      items.push_back(item);
+    }
+    else {throw runtime_error("Unknown fetch item " + token.text);}
+  }
+  if (changedsince) {add(Item::MODSEQ);}
+
+  // Collect the messages (marking those whose body is fetched without PEEK as seen), then render them unlocked:
+  vector<pair<uint32_t, SyntheticMessage>> found;
+  {
+    lock_guard<mutex> guard(server.mailbox_mutex);
+    bool marks = !read_only && any_of(items.begin(), items.end(), [](Item const& i) {return i.kind == Item::SECTION && !i.peek;});
+    for (auto& target : targets(set, uid)) {
+      if (changedsince && target.second->modseq <= changedsince) {continue;}
+      if (marks && !target.second->seen) {
+        target.second->seen = true;
+        server.mailbox.bump(*target.second);
+      }
+      found.emplace_back(target.first, *target.second);
+    }
+  }
+  // What the list fetches (envelope, date, size and the References header) only needs the header rendered:
+  auto header_section = [](Item const& i) {return i.kind == Item::SECTION && i.section.compare(0, 6, "HEADER") == 0;};
+  bool needs_full = any_of(items.begin(), items.end(), [&](Item const& i) {return i.kind == Item::SECTION && !header_section(i);});
+  bool needs_header = any_of(items.begin(), items.end(), [&](Item const& i) {
+    return i.kind == Item::ENVELOPE || i.kind == Item::INTERNALDATE || i.kind == Item::SIZE || header_section(i);
+  });
+  for (auto const& [seq, message] : found) {
+    optional<RenderedMessage> local;
+    RenderedMessage const* r = nullptr;
+    if (needs_full || needs_header) {r = &render(message, needs_full ? Mailbox::FULL : Mailbox::HEADER, local);}
+    string response = "* " + to_string(seq) + " FETCH (";
+    bool first = true;
+    for (auto const& item : items) {
+      if (!first) {response += ' ';}
+      first = false;
+      switch (item.kind) {
+        case Item::UID: response += "UID " + to_string(message.uid); break;
+        case Item::FLAGS: response += "FLAGS " + flags(message); break;
+        case Item::INTERNALDATE: response += "INTERNALDATE " + quote(r->internal_date); break;
+        case Item::SIZE: response += "RFC822.SIZE " + to_string(r->size); break;
+        case Item::ENVELOPE: response += "ENVELOPE " + envelope(*r); break;
+        case Item::BODYSTRUCTURE: response += "BODYSTRUCTURE " + structure(message, true); break;
+        case Item::BODY: response += "BODY " + structure(message, false); break;
+        case Item::MODSEQ: response += "MODSEQ (" + to_string(message.modseq) + ")"; break;
+        case Item::SECTION: {
+          string_view data;
+          string fields;
+          response += item.response + " ";
+          if (upper(item.section).compare(0, 15, "HEADER.FIELDS (") == 0) {
+            fields = r->headerFields(string_view(item.section).substr(15, item.section.size() - 16));
+            data = fields;
+          }
+          else if (!r->section(item.section, data)) {response += "NIL"; break;}
+          if (item.partial) {data = data.substr(min<size_t>(item.offset, data.size()), item.length);}
+          response += "{" + to_string(data.size()) + "}\r\n";
+          response.append(data);
+          break;
+        }
+      }
+    }
+    out += response + ")\r\n";
+    // Stream large responses rather than building them whole:
+    if (out.size() > 256 * 1024) {flush();}
+  }
+  out += tag + " OK " + (uid ? "UID FETCH" : "FETCH") + " completed\r\n";
+}
+
+/* ----- store ----- */
+void Server::Connection::store(string const& tag, bool uid, vector<Token> const& tokens, size_t at) {
+  if (read_only) {out += tag + " NO Mailbox is read-only\r\n"; return;}
+  string set = arg(tokens, at).text;
+  uint64_t unchangedsince = UINT64_MAX;
+  if (at < tokens.size() && tokens[at].text == "(" && !tokens[at].quoted) {
+    auto modifiers = list(tokens, at);
+    for (size_t i = 0; i + 1 < modifiers.size(); i++) {
+      if (modifiers[i].is("UNCHANGEDSINCE")) {unchangedsince = stoull(modifiers[i + 1].text);}
+    }
+  }
+  string action = upper(arg(tokens, at).text);
+  bool silent = action.size() > 7 && action.compare(action.size() - 7, 7, ".SILENT") == 0;
+  if (silent) {action.resize(action.size() - 7);}
+  if (action != "FLAGS" && action != "+FLAGS" && action != "-FLAGS") {throw runtime_error("Unknown store action");}
+  bool seen = false, deleted = false, flagged = false;
+  for (auto const& flag : list(tokens, at)) {
+    seen = seen || flag.is("\\Seen");
+    deleted = deleted || flag.is("\\Deleted");
+    flagged = flagged || flag.is("\\Flagged");
+  }
+
+  vector<uint32_t> modified;
+  {
+    lock_guard<mutex> guard(server.mailbox_mutex);
+    for (auto& [seq, message] : targets(set, uid)) {
+      if (message->modseq > unchangedsince) {modified.push_back(uid ? message->uid : seq); continue;}
+      SyntheticMessage before = *message;
+      if (action == "FLAGS") {message->seen = seen; message->deleted = deleted; message->flagged = flagged;}
+      else {
+        bool value = action[0] == '+';
+        if (seen) {message->seen = value;}
+        if (deleted) {message->deleted = value;}
+        if (flagged) {message->flagged = value;}
+      }
+      if (before.seen != message->seen || before.deleted != message->deleted || before.flagged != message->flagged) {
+        server.mailbox.bump(*message);
+      }
+      if (!silent) {
+        out += "* " + to_string(seq) + " FETCH (FLAGS " + flags(*message);
+        if (uid) {out += " UID " + to_string(message->uid);}
+        if (condstore) {out += " MODSEQ (" + to_string(message->modseq) + ")";}
+        out += ")\r\n";
+      }
+    }
+  }
+  string code = modified.empty() ? "" : "[MODIFIED " + formatSet(modified) + "] ";
+  out += tag + " OK " + code + (uid ? "UID STORE" : "STORE") + " completed\r\n";
+}
+
+/* ----- parseKey ----- */
+SearchKey Server::Connection::parseKey(vector<Token> const& tokens, size_t& at) {
+  SearchKey key;
+  Token const& token = arg(tokens, at);
+  string name = token.quoted ? "" : upper(token.text);
+  auto header = [&](string field) {
+    key.kind = SearchKey::HEADER;
+    key.field = move(field);
+    key.value = arg(tokens, at).text;
+  };
+  if (name == "(") {
+    key.kind = SearchKey::AND;
+    while (at < tokens.size() && !(tokens[at].text == ")" && !tokens[at].quoted)) {key.children.push_back(parseKey(tokens, at));}
+    arg(tokens, at);
+  }
+  else if (name == "ALL") {key.kind = SearchKey::ALL;}
+  else if (name == "SEEN" || name == "OLD") {key.kind = SearchKey::SEEN;}
+  else if (name == "UNSEEN" || name == "NEW") {key.kind = SearchKey::UNSEEN;}
+  else if (name == "DELETED") {key.kind = SearchKey::DELETED;}
+  else if (name == "UNDELETED") {key.kind = SearchKey::UNDELETED;}
+  else if (name == "FLAGGED") {key.kind = SearchKey::FLAGGED;}
+  else if (name == "UNFLAGGED") {key.kind = SearchKey::UNFLAGGED;}
+  else if (name == "RECENT" || name == "ANSWERED" || name == "DRAFT") {key.kind = SearchKey::NONE;}
+  else if (name == "UNANSWERED" || name == "UNDRAFT") {key.kind = SearchKey::ALL;}
+  else if (name == "FROM" || name == "TO" || name == "CC" || name == "BCC" || name == "SUBJECT") {header(name);}
+  else if (name == "HEADER") {header(upper(arg(tokens, at).text));}
+  else if (name == "BODY") {key.kind = SearchKey::BODY; key.value = arg(tokens, at).text;}
+  else if (name == "TEXT") {key.kind = SearchKey::TEXT; key.value = arg(tokens, at).text;}
+  else if (name == "LARGER") {key.kind = SearchKey::LARGER; key.number = stoull(arg(tokens, at).text);}
+  else if (name == "SMALLER") {key.kind = SearchKey::SMALLER; key.number = stoull(arg(tokens, at).text);}
+  else if (name == "MODSEQ") {key.kind = SearchKey::MODSEQ; key.number = stoull(arg(tokens, at).text);}
+  else if (name == "NOT") {key.kind = SearchKey::NOT; key.children.push_back(parseKey(tokens, at));}
+  else if (name == "OR") {
+    key.kind = SearchKey::OR;
+    key.children.push_back(parseKey(tokens, at));
+    key.children.push_back(parseKey(tokens, at));
+  }
+  else if (name == "UID") {
+    key.kind = SearchKey::UID;
+    if (!SequenceSet::parse(arg(tokens, at).text, view.empty() ? 0 : view.back(), key.set)) {throw runtime_error("Invalid sequence set");}
+  }
+  else if (SequenceSet::parse(token.text, uint32_t(view.size()), key.set) && !token.quoted) {key.kind = SearchKey::SEQUENCE;}
+  else {throw runtime_error("Unsupported search key " + token.text);}
+  return key;
+}
+
+/* ----- matches ----- */
+bool Server::Connection::matches(SearchKey const& key, uint32_t seq, SyntheticMessage const& message, RenderedMessage const* r) {
+  switch (key.kind) {
+    case SearchKey::ALL: return true;
+    case SearchKey::NONE: return false;
+    case SearchKey::AND:
+      for (auto const& child : key.children) {
+        if (!matches(child, seq, message, r)) {return false;}
+      }
+      return true;
+    case SearchKey::OR: return matches(key.children[0], seq, message, r) || matches(key.children[1], seq, message, r);
+    case SearchKey::NOT: return !matches(key.children[0], seq, message, r);
+    case SearchKey::SEEN: return message.seen;
+    case SearchKey::UNSEEN: return !message.seen;
+    case SearchKey::DELETED: return message.deleted;
+    case SearchKey::UNDELETED: return !message.deleted;
+    case SearchKey::FLAGGED: return message.flagged;
+    case SearchKey::UNFLAGGED: return !message.flagged;
+    case SearchKey::UID: return key.set.contains(message.uid);
+    case SearchKey::SEQUENCE: return key.set.contains(seq);
+    case SearchKey::MODSEQ: return message.modseq >= key.number;
+    case SearchKey::HEADER:
+      return containsNoCase(headerValue(string_view(r->raw).substr(0, r->header_size), key.field), key.value);
+    case SearchKey::BODY: return containsNoCase(string_view(r->raw).substr(r->header_size), key.value);
+    case SearchKey::TEXT: return containsNoCase(r->raw, key.value);
+    case SearchKey::LARGER: return r->raw.size() > key.number;
+    case SearchKey::SMALLER: return r->raw.size() < key.number;
+  }
+  return false;
+}
+
+/* ----- search ----- */
+void Server::Connection::search(string const& tag, bool uid, vector<Token> const& tokens, size_t at) {
+  // RETURN (...) asks for an ESEARCH response (RFC 4731), RETURN () meaning ALL:
+  bool extended = false;
+  vector<string> options;
+  if (at < tokens.size() && tokens[at].is("RETURN")) {
+    at++;
+    if (!server.getCapabilities().esearch) {throw runtime_error("ESEARCH is not supported");}
+    extended = true;
+    for (auto const& option : list(tokens, at)) {options.push_back(upper(option.text));}
+    if (options.empty()) {options.push_back("ALL");}
+  }
+  if (at < tokens.size() && tokens[at].is("CHARSET")) {at += 2;}
+  SearchKey program;
+  program.kind = SearchKey::AND;
+  while (at < tokens.size()) {program.children.push_back(parseKey(tokens, at));}
+
+  // Keys on the header or text need the message rendered that far, the size needs all of it:
+  Mailbox::Detail detail = Mailbox::HEADER;
+  bool render_needed = false;
+  function<void(SearchKey const&)> inspect = [&](SearchKey const& key) {
+    if (key.kind == SearchKey::HEADER) {render_needed = true;}
+    if (key.kind == SearchKey::BODY || key.kind == SearchKey::TEXT) {render_needed = true; detail = max(detail, Mailbox::TEXT);}
+    if (key.kind == SearchKey::LARGER || key.kind == SearchKey::SMALLER) {render_needed = true; detail = Mailbox::FULL;}
+    for (auto const& child : key.children) {inspect(child);}
+  };
+  inspect(program);
+
+  vector<pair<uint32_t, SyntheticMessage>> candidates;
+  {
+    lock_guard<mutex> guard(server.mailbox_mutex);
+    for (auto const& [seq, message] : targets("1:*", false)) {candidates.emplace_back(seq, *message);}
+  }
+  vector<uint32_t> hits;
+  for (auto const& [seq, message] : candidates) {
+    optional<RenderedMessage> local;
+    RenderedMessage const* r = render_needed ? &render(message, detail, local) : nullptr;
+    if (matches(program, seq, message, r)) {hits.push_back(uid ? message.uid : seq);}
+  }
+
+  if (!extended) {
+    out += "* SEARCH";
+    for (auto hit : hits) {out += " " + to_string(hit);}
+    out += "\r\n";
+  } else {
+    out += "* ESEARCH (TAG " + quote(tag) + ")" + (uid ? " UID" : "");
+    for (auto const& option : options) {
+      if (option == "MIN" && !hits.empty()) {out += " MIN " + to_string(hits.front());}
+      else if (option == "MAX" && !hits.empty()) {out += " MAX " + to_string(hits.back());}
+      else if (option == "COUNT") {out += " COUNT " + to_string(hits.size());}
+      else if (option == "ALL" && !hits.empty()) {out += " ALL " + formatSet(hits);}
+    }
+    out += "\r\n";
+  }
+  out += tag + " OK " + (uid ? "UID SEARCH" : "SEARCH") + " completed\r\n";
+}
+
+/* ----- idle ----- */
+bool Server::Connection::idle(string const& tag) {
+  if (!server.getCapabilities().idle) {out += tag + " BAD IDLE is not supported\r\n"; return true;}
+  out += "+ idling\r\n";
+  flush();
+  // Report changes as they happen until the client sends DONE:
+  while (alive && !server.stopping) {
+    if (in.find("\r\n", in_pos) != string::npos) {
+      string line;
+      readLine(line);
+      if (upper(line) == "DONE") {break;}
+      out += tag + " BAD Expected DONE\r\n";
+      return true;
+    }
+    pollfd p{fd, POLLIN, 0};
+    int r = poll(&p, 1, 50);
+    if (r > 0 && !fill()) {return false;}
+    report();
+    flush();
+  }
+  if (!alive || server.stopping) {return false;}
+  report();
+  out += tag + " OK IDLE terminated\r\n";
+  return true;
+}
+
+/* ----- compress ----- */
+void Server::Connection::compress(string const& tag, vector<Token> const& tokens, size_t at) {
+  if (!arg(tokens, at).is("DEFLATE") || !server.getCapabilities().compress) {out += tag + " NO Unsupported compression\r\n"; return;}
+  if (compressed) {out += tag + " NO [COMPRESSIONACTIVE] Already compressed\r\n"; return;}
+  // The response goes out uncompressed, everything after it in raw DEFLATE (RFC 4978):
+  out += tag + " OK DEFLATE active\r\n";
+  flush();
+  deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  inflateInit2(&inflater, -15);
+  compressed = true;
+}
+
+/* ----------------- Server Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+Server::Server(MailboxSpec const& spec, Shaping shaping, Capabilities capabilities)
+  : mailbox(spec), shaping(shaping), capabilities(capabilities) {
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {throw runtime_error("Bench Error: Unable to create the server socket.");}
+  int yes = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t length = sizeof(address);
+  if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0
+      || getsockname(listener, (sockaddr*)&address, &length) != 0) {
+    close(listener);
+    throw runtime_error("Bench Error: Unable to listen on 127.0.0.1.");
+  }
+  port = ntohs(address.sin_port);
+  acceptor = thread(&Server::accept, this);
+}
+
+/* ----- accept ----- */
+void Server::accept() {
+  while (!stopping) {
+    pollfd p{listener, POLLIN, 0};
+    if (poll(&p, 1, 100) <= 0) {continue;}
+    int fd = ::accept(listener, nullptr, nullptr);
+    if (fd < 0) {continue;}
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    auto connection = make_shared<Connection>(*this, fd);
+    lock_guard<mutex> guard(clients_mutex);
+    reap(false);
+    clients.push_back({connection, thread([connection]() {connection->run();})});
+  }
+}
+
+/* ----- reap ----- */
+void Server::reap(bool all) {
+  // Hold clients_mutex.
+  for (auto it = clients.begin(); it != clients.end();) {
+    if (all) {it->connection->shutdown();}
+    if (!all && !it->connection->done) {it++; continue;}
+    it->thread.join();
+    it = clients.erase(it);
+  }
+}
+
+/* ----- stop ----- */
+void Server::stop() {
+  if (stopping.exchange(true)) {return;}
+  if (acceptor.joinable()) {acceptor.join();}
+  close(listener);
+  lock_guard<mutex> guard(clients_mutex);
+  reap(true);
+}
+
+/* ----- transmit ----- */
+void Server::transmit(size_t size) {
+  Shaping current = getShaping();
+  if (current.bandwidth <= 0) {return;}
+  chrono::steady_clock::time_point done;
+  {
+    lock_guard<mutex> guard(link_mutex);
+    auto start = max(chrono::steady_clock::now(), link_free);
+    link_free = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(size / current.bandwidth));
+    done = link_free;
+  }
+  this_thread::sleep_until(done);
+}
+
+/* ----- settings ----- */
+void Server::setShaping(Shaping s) {lock_guard<mutex> guard(settings_mutex); shaping = s;}
+void Server::setCapabilities(Capabilities c) {lock_guard<mutex> guard(settings_mutex); capabilities = c;}
+Shaping Server::getShaping() {lock_guard<mutex> guard(settings_mutex); return shaping;}
+Capabilities Server::getCapabilities() {lock_guard<mutex> guard(settings_mutex); return capabilities;}
+
+/* ----- mailbox scripting ----- */
+void Server::reset() {lock_guard<mutex> guard(mailbox_mutex); mailbox.reset();}
+void Server::deliver(uint32_t count) {lock_guard<mutex> guard(mailbox_mutex); mailbox.deliver(count);}
+size_t Server::expunge(vector<uint32_t> const& uids) {lock_guard<mutex> guard(mailbox_mutex); return mailbox.expunge(uids);}
+void Server::touch(vector<uint32_t> const& uids) {lock_guard<mutex> guard(mailbox_mutex); mailbox.touch(uids);}
+
+/* ----- uids ----- */
+vector<uint32_t> Server::uids() {
+  lock_guard<mutex> guard(mailbox_mutex);
+  vector<uint32_t> list;
+  list.reserve(mailbox.list().size());
+  for (auto const& message : mailbox.list()) {list.push_back(message.uid);}
+  return list;
+}
+
+/* ----- statistics ----- */
+void Server::count(string const& command, bool login) {
+  lock_guard<mutex> guard(stats_mutex);
+  stats.commands[command]++;
+  if (login) {stats.logins++;}
+}
+
+void Server::countBytes(uint64_t received, uint64_t sent) {
+  lock_guard<mutex> guard(stats_mutex);
+  stats.bytes_received += received;
+  stats.bytes_sent += sent;
+}
+
+ServerStats Server::getStats() {lock_guard<mutex> guard(stats_mutex); return stats;}
+void Server::resetStats() {lock_guard<mutex> guard(stats_mutex); stats = ServerStats();}
@@ -0,0 +1,140 @@
+#ifndef BENCH_SERVER_H
+#define BENCH_SERVER_H
+#include "mailbox.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Bench {
+
+/* -------------------- Struct: Shaping -------------------- */
+// Network the server pretends to sit behind: every command waits latency (the round trip) before its response, and
+// responses share a link of bandwidth bytes per second (0 for unlimited), counted in wire (compressed) bytes.
+struct Shaping {
+        std::chrono::microseconds latency{0};
+        double bandwidth = 0;
+};
+
+/* -------------------- Struct: Capabilities -------------------- */
+// Extensions the server advertises, so the fallbacks of the client can be measured too.
+struct Capabilities {
+        bool condstore = true;
+        bool esearch = true;
+        bool uidplus = true;
+        bool idle = true;
+        bool compress = true;
+};
+
+/* -------------------- Struct: ServerStats -------------------- */
+// What the clients did since the last resetStats: commands by name (e.g. "UID FETCH"), logins and bytes on the wire.
+struct ServerStats {
+        std::map<std::string, uint64_t> commands;
+        uint64_t logins = 0;
+        uint64_t bytes_received = 0;
+        uint64_t bytes_sent = 0;
+
+  /* ----- total ----- */
+  // Function to return the number of commands, i.e. of round trips.
+        uint64_t total() const {
+          uint64_t sum = 0;
+          for (auto const& command : commands) {sum += command.second;}
+          return sum;
+        }
+};
+
+/* -------------------- Class: Server -------------------- */
+// IMAP4rev1 stand-in server on 127.0.0.1 serving one synthetic mailbox (INBOX) to any number of connections, each
+// on its own thread. It speaks what MailPunk uses - LOGIN, SELECT/EXAMINE, STATUS, FETCH (envelopes, BODYSTRUCTURE,
+// partial bodies and sections), SEARCH with ESEARCH, STORE, EXPUNGE/UID EXPUNGE, CONDSTORE, IDLE and
+// COMPRESS=DEFLATE - and accepts any credentials. The mailbox can be changed while clients are connected (as another
+// client would), which they see as EXISTS/EXPUNGE responses.
+class Server {
+private:
+        class Connection;
+        struct Client {
+          std::shared_ptr<Connection> connection;
+          std::thread thread;
+        };
+
+        Mailbox mailbox;
+        std::mutex mailbox_mutex;
+        Shaping shaping;
+        Capabilities capabilities;
+        std::mutex settings_mutex;
+        // Time at which the shared link is free again:
+        std::chrono::steady_clock::time_point link_free{};
+        std::mutex link_mutex;
+        ServerStats stats;
+        std::mutex stats_mutex;
+        int listener = -1;
+        uint16_t port = 0;
+        std::atomic<bool> stopping{false};
+        std::vector<Client> clients;
+        std::mutex clients_mutex;
+        std::thread acceptor;
+
+  /* ----- accept ----- */
+  // Function run by the acceptor thread: starts a connection thread for every client until stopped.
+        void accept();
+
+  /* ----- reap ----- */
+  // Function to join the threads of closed connections.
+        void reap(bool all);
+
+  /* ----- transmit ----- */
+  // Function to wait for the shaped link to carry size bytes, called by connections before they send them.
+        void transmit(size_t size);
+
+  /* ----- count ----- */
+  // Function to add a command (and its wire bytes) to the statistics.
+        void count(std::string const& command, bool login);
+        void countBytes(uint64_t received, uint64_t sent);
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // Starts listening on an ephemeral port of 127.0.0.1, throws a runtime_error if it cannot.
+        explicit Server(MailboxSpec const& spec, Shaping shaping = {}, Capabilities capabilities = {});
+        Server(Server const&) = delete;
+        Server& operator=(Server const&) = delete;
+
+  /* ----- getPort ----- */
+        uint16_t getPort() const {return port;}
+
+  /* ----- setShaping / setCapabilities ----- */
+  // Functions to change the network and the extensions, for the commands (respectively connections) from now on.
+        void setShaping(Shaping shaping);
+        void setCapabilities(Capabilities capabilities);
+        Shaping getShaping();
+        Capabilities getCapabilities();
+
+  /* ----- reset / deliver / expunge / touch ----- */
+  // Functions to script the mailbox: regenerate it, or change it as another client would (see Mailbox).
+        void reset();
+        void deliver(uint32_t count);
+        size_t expunge(std::vector<uint32_t> const& uids);
+        void touch(std::vector<uint32_t> const& uids);
+
+  /* ----- uids ----- */
+  // Function to return the (ascending) UIDs currently in the mailbox.
+        std::vector<uint32_t> uids();
+
+  /* ----- getStats / resetStats ----- */
+        ServerStats getStats();
+        void resetStats();
+
+  /* ----- stop ----- */
+  // Function to stop listening, close every connection and wait for their threads.
+        void stop();
+
+  /* ----- DESTRUCTOR ----- */
+        ~Server() {stop();}
+};
+}
+
+#endif /* BENCH_SERVER_H */
@@ -0,0 +1,83 @@
+#ifndef BODYCACHE_H
+#define BODYCACHE_H
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace IMAP {
+
+/* -------------------- Class: BodyCache -------------------- */
+// Least-recently-used cache of message bodies keyed by UID, bounded by a byte budget.
+class BodyCache {
+private:
+        typedef std::list<std::pair<uint32_t, std::string>> Entries;
+        Entries entries; // most recently used at the front
+        std::unordered_map<uint32_t, Entries::iterator> index;
+        size_t budget;
+        size_t bytes = 0;
+
+  /* ----- evict ----- */
+  // Function to drop least recently used bodies until we are within budget.
+        void evict() {
+          while (bytes > budget && !entries.empty()) {
+            bytes -= entries.back().second.size();
+            index.erase(entries.back().first);
+            entries.pop_back();
+          }
+        }
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+        explicit BodyCache(size_t budget) : budget(budget) {}
+
+  /* ----- get ----- */
+  // Function to return the cached body for uid (marking it as recently used), or nullptr if not cached.
+        std::string const* get(uint32_t uid) {
+          auto it = index.find(uid);
+          if (it == index.end()) {return nullptr;}
+          entries.splice(entries.begin(), entries, it->second);
+          return &it->second->second;
+        }
+
+  /* ----- contains ----- */
+  // Function to check whether the body of uid is cached, without marking it as recently used.
+        bool contains(uint32_t uid) const {return index.count(uid) != 0;}
+
+  /* ----- put ----- */
+  // Function to cache a body, bodies larger than the whole budget are not kept.
+        void put(uint32_t uid, std::string body) {
+          erase(uid);
+          if (body.size() > budget) {return;}
+          bytes += body.size();
+          entries.emplace_front(uid, std::move(body));
+          index[uid] = entries.begin();
+          evict();
+        }
+
+  /* ----- erase ----- */
+  // Function to drop the body of uid (e.g. after it has been deleted).
+        void erase(uint32_t uid) {
+          auto it = index.find(uid);
+          if (it == index.end()) {return;}
+          bytes -= it->second->second.size();
+          entries.erase(it->second);
+          index.erase(it);
+        }
+
+  /* ----- clear ----- */
+  // Function to drop every cached body (e.g. when switching mailboxes).
+        void clear() {entries.clear(); index.clear(); bytes = 0;}
+
+  /* ----- setBudget ----- */
+  // Function to change the byte budget, evicting immediately if necessary.
+        void setBudget(size_t new_budget) {budget = new_budget; evict();}
+
+  /* ----- getBudget / getBytes ----- */
+        size_t getBudget() const {return budget;}
+        size_t getBytes() const {return bytes;}
+};
+}
+
+#endif /* BODYCACHE_H */
@@ -0,0 +1,311 @@
+#include "cache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace IMAP;
+using namespace std;
+
+namespace {
+  char const MAGIC[8] = {'M', 'P', 'K', 'C', 'A', 'C', 'H', 'E'};
+  // 2: Message-ID and References, 3: INTERNALDATE, RFC822.SIZE and FLAGS
+  uint32_t const VERSION = 3;
+  // Number of records the index has room for when it is created:
+  size_t const INITIAL_CAPACITY = 1024;
+  // Caches with fewer records than this are never compacted:
+  uint32_t const COMPACT_THRESHOLD = 1024;
+}
+
+/* ----------------- MessageCache Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+MessageCache::MessageCache(string dir, uint32_t uidvalidity) : dir(move(dir)), uidvalidity(uidvalidity) {
+  open();
+}
+
+/* ----- DESTRUCTOR ----- */
+MessageCache::~MessageCache() {
+  close();
+}
+
+/* ----- open ----- */
+void MessageCache::open() {
+  // Create the cache directory and open (or create) the three cache files:
+  error_code ec;
+  filesystem::create_directories(dir, ec);
+  index_fd = ::open((dir + "/index").c_str(), O_RDWR | O_CREAT, 0600);
+  strings_fd = ::open((dir + "/strings").c_str(), O_RDWR | O_CREAT, 0600);
+  bodies_fd = ::open((dir + "/bodies").c_str(), O_RDWR | O_CREAT, 0600);
+  if (index_fd < 0 || strings_fd < 0 || bodies_fd < 0) {
+    close();
+    throw runtime_error("Cache Error: Unable to open message cache in " + dir + ".");
+  }
+
+  // Retrieve the current file sizes:
+  struct stat st;
+  fstat(index_fd, &st); size_t index_size = st.st_size;
+  fstat(strings_fd, &st); strings_size = st.st_size;
+  fstat(bodies_fd, &st); bodies_size = st.st_size;
+
+  // A new cache, start from an empty index:
+  if (index_size < sizeof(Header)) {wipe(); return;}
+
+  // Map the existing index and check it belongs to this UIDVALIDITY and is intact, otherwise discard it:
+  mapIndex((index_size - sizeof(Header)) / sizeof(Record));
+  if (!verify()) {reset = true; wipe(); return;}
+
+  // Build the UID lookup table:
+  for (uint32_t i = 0; i < header->count; i++) {
+    if (!records()[i].deleted) {slots[records()[i].uid] = i;}
+  }
+
+  // Reclaim space if most of the cache consists of deleted messages:
+  if (header->count > COMPACT_THRESHOLD && header->count - header->live > header->live) {compact();}
+}
+
+/* ----- close ----- */
+void MessageCache::close() {
+  if (header) {munmap(header, sizeof(Header) + index_capacity * sizeof(Record));}
+  if (strings) {munmap(const_cast<char*>(strings), strings_mapped);}
+  header = nullptr; index_capacity = 0;
+  strings = nullptr; strings_mapped = 0;
+  if (index_fd >= 0) {::close(index_fd);}
+  if (strings_fd >= 0) {::close(strings_fd);}
+  if (bodies_fd >= 0) {::close(bodies_fd);}
+  index_fd = strings_fd = bodies_fd = -1;
+  slots.clear();
+}
+
+/* ----- verify ----- */
+bool MessageCache::verify() const {
+  // Check the header:
+  if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {return false;}
+  if (header->version != VERSION || header->uidvalidity != uidvalidity) {return false;}
+  if (header->count > index_capacity || header->live > header->count) {return false;}
+
+  // Check every record points into the data files and the checksum matches:
+  uint64_t checksum = 0;
+  uint32_t live = 0;
+  for (uint32_t i = 0; i < header->count; i++) {
+    Record const& record = records()[i];
+    if (record.from_off + record.from_len > strings_size) {return false;}
+    if (record.subject_off + record.subject_len > strings_size) {return false;}
+    if (record.ids_off + record.message_id_len + record.references_len > strings_size) {return false;}
+    if (record.body_off + record.body_len > bodies_size) {return false;}
+    if (!record.deleted) {live++;}
+    checksum += hash(record);
+  }
+  return live == header->live && checksum == header->checksum;
+}
+
+/* ----- wipe ----- */
+void MessageCache::wipe() {
+  // Unmap and truncate everything:
+  if (header) {munmap(header, sizeof(Header) + index_capacity * sizeof(Record));}
+  if (strings) {munmap(const_cast<char*>(strings), strings_mapped);}
+  header = nullptr; index_capacity = 0;
+  strings = nullptr; strings_mapped = 0;
+  if (ftruncate(index_fd, 0) != 0 || ftruncate(strings_fd, 0) != 0 || ftruncate(bodies_fd, 0) != 0) {
+    throw runtime_error("Cache Error: Unable to reset message cache in " + dir + ".");
+  }
+  strings_size = bodies_size = 0;
+  slots.clear();
+
+  // Write a fresh header for the current UIDVALIDITY:
+  mapIndex(INITIAL_CAPACITY);
+  memcpy(header->magic, MAGIC, sizeof(MAGIC));
+  header->version = VERSION;
+  header->uidvalidity = uidvalidity;
+  header->count = header->live = 0;
+  header->checksum = 0;
+}
+
+/* ----- compact ----- */
+void MessageCache::compact() {
+  // Copy every live message into a fresh cache next to this one:
+  string compact_dir = dir + ".compact";
+  error_code ec;
+  filesystem::remove_all(compact_dir, ec);
+  {
+    MessageCache fresh(compact_dir, uidvalidity);
+    string body;
+    forEach([&](uint32_t uid, string_view from, string_view subject, string_view message_id, string_view references,
+                MessageAttributes const& attributes) {
+      fresh.add(uid, from, subject, message_id, references, attributes);
+      if (getBody(uid, body)) {fresh.putBody(uid, body);}
+    });
+  }
+
+  // Replace our files by the compacted ones and reopen:
+  close();
+  for (char const* name : {"/strings", "/bodies", "/index"}) {
+    filesystem::rename(compact_dir + name, dir + name, ec);
+  }
+  filesystem::remove_all(compact_dir, ec);
+  open();
+}
+
+/* ----- mapIndex ----- */
+void MessageCache::mapIndex(size_t capacity) {
+  size_t size = sizeof(Header) + capacity * sizeof(Record);
+  // Grow the file if necessary (new records are zero-filled):
+  struct stat st;
+  fstat(index_fd, &st);
+  if ((size_t)st.st_size < size && ftruncate(index_fd, size) != 0) {
+    throw runtime_error("Cache Error: Unable to grow message cache index in " + dir + ".");
+  }
+  // Replace the old mapping:
+  if (header) {munmap(header, sizeof(Header) + index_capacity * sizeof(Record));}
+  void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+  if (map == MAP_FAILED) {
+    header = nullptr; index_capacity = 0;
+    throw runtime_error("Cache Error: Unable to map message cache index in " + dir + ".");
+  }
+  header = static_cast<Header*>(map);
+  index_capacity = capacity;
+}
+
+/* ----- mapStrings ----- */
+void MessageCache::mapStrings() {
+  // Only remap if strings have been appended since the last mapping:
+  if (strings_size == strings_mapped) {return;}
+  if (strings) {munmap(const_cast<char*>(strings), strings_mapped);}
+  strings = nullptr; strings_mapped = 0;
+  if (strings_size == 0) {return;}
+  void* map = mmap(nullptr, strings_size, PROT_READ, MAP_SHARED, strings_fd, 0);
+  if (map == MAP_FAILED) {
+    throw runtime_error("Cache Error: Unable to map message cache strings in " + dir + ".");
+  }
+  strings = static_cast<char const*>(map);
+  strings_mapped = strings_size;
+}
+
+/* ----- append ----- */
+uint64_t MessageCache::append(int fd, uint64_t& size, char const* data, size_t len) {
+  uint64_t offset = size;
+  while (len > 0) {
+    ssize_t written = pwrite(fd, data, len, size);
+    if (written <= 0) {throw runtime_error("Cache Error: Unable to write to message cache.");}
+    data += written; len -= written; size += written;
+  }
+  return offset;
+}
+
+/* ----- hash ----- */
+uint64_t MessageCache::hash(Record const& record) {
+  // FNV-1a over the record's bytes:
+  uint64_t h = 14695981039346656037ULL;
+  auto bytes = reinterpret_cast<unsigned char const*>(&record);
+  for (size_t i = 0; i < sizeof(Record); i++) {h = (h ^ bytes[i]) * 1099511628211ULL;}
+  return h;
+}
+
+/* ----- setRecord ----- */
+void MessageCache::setRecord(uint32_t slot, Record const& record) {
+  header->checksum += hash(record) - hash(records()[slot]);
+  records()[slot] = record;
+}
+
+/* ----- add ----- */
+void MessageCache::add(uint32_t uid, string_view from, string_view subject, string_view message_id,
+                       string_view references, MessageAttributes const& attributes) {
+  if (contains(uid)) {return;}
+  // Make room in the index:
+  if (header->count == index_capacity) {mapIndex(index_capacity * 2);}
+
+  // Append the strings first, so a crash never leaves a record pointing past the end of the file:
+  Record record{};
+  record.uid = uid;
+  record.from_len = from.size();
+  record.from_off = append(strings_fd, strings_size, from.data(), from.size());
+  record.subject_len = subject.size();
+  record.subject_off = append(strings_fd, strings_size, subject.data(), subject.size());
+  record.message_id_len = message_id.size();
+  record.ids_off = append(strings_fd, strings_size, message_id.data(), message_id.size());
+  record.references_len = references.size();
+  append(strings_fd, strings_size, references.data(), references.size());
+  record.date = attributes.date;
+  record.size = attributes.size;
+  record.flags = attributes.flags;
+
+  // Append the record:
+  uint32_t slot = header->count;
+  records()[slot] = record;
+  header->checksum += hash(record);
+  header->count++; header->live++;
+  slots[uid] = slot;
+}
+
+/* ----- remove ----- */
+void MessageCache::remove(uint32_t uid) {
+  auto it = slots.find(uid);
+  if (it == slots.end()) {return;}
+  Record record = records()[it->second];
+  record.deleted = 1;
+  setRecord(it->second, record);
+  header->live--;
+  slots.erase(it);
+}
+
+/* ----- setFlags ----- */
+void MessageCache::setFlags(uint32_t uid, uint32_t flags) {
+  auto it = slots.find(uid);
+  if (it == slots.end()) {return;}
+  Record record = records()[it->second];
+  record.flags = flags;
+  setRecord(it->second, record);
+}
+
+/* ----- getBody ----- */
+bool MessageCache::getBody(uint32_t uid, string& body) const {
+  auto it = slots.find(uid);
+  if (it == slots.end()) {return false;}
+  Record const& record = records()[it->second];
+  if (record.body_len == 0) {return false;}
+  body.resize(record.body_len);
+  size_t done = 0;
+  while (done < record.body_len) {
+    ssize_t got = pread(bodies_fd, &body[done], record.body_len - done, record.body_off + done);
+    if (got <= 0) {return false;}
+    done += got;
+  }
+  return true;
+}
+
+/* ----- hasBody ----- */
+bool MessageCache::hasBody(uint32_t uid) const {
+  auto it = slots.find(uid);
+  return it != slots.end() && records()[it->second].body_len != 0;
+}
+
+/* ----- getBodyRange ----- */
+bool MessageCache::getBodyRange(uint32_t uid, uint32_t offset, uint32_t length, string& data, uint32_t& size) const {
+  auto it = slots.find(uid);
+  if (it == slots.end()) {return false;}
+  Record const& record = records()[it->second];
+  if (record.body_len == 0) {return false;}
+  // Only read the requested part, the rest of the body stays on disk:
+  size = record.body_len;
+  data.resize(offset < size ? min(length, size - offset) : 0);
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t got = pread(bodies_fd, &data[done], data.size() - done, record.body_off + offset + done);
+    if (got <= 0) {return false;}
+    done += got;
+  }
+  return true;
+}
+
+/* ----- putBody ----- */
+void MessageCache::putBody(uint32_t uid, string const& body) {
+  auto it = slots.find(uid);
+  if (it == slots.end() || body.empty()) {return;}
+  Record record = records()[it->second];
+  record.body_off = append(bodies_fd, bodies_size, body.data(), body.size());
+  record.body_len = body.size();
+  setRecord(it->second, record);
+}
@@ -0,0 +1,171 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include "store.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace IMAP {
+
+/* -------------------- Class: MessageCache -------------------- */
+// Persistent cache of a single mailbox, stored in its own directory:
+//   index   - memory-mapped header plus one fixed-size record per UID (envelope offsets, body offset),
+//   strings - append-only envelope strings (From, Subject, Message-ID, References) referenced by the index,
+//   bodies  - append-only blob of message bodies referenced by the index.
+// The cache is tagged with the mailbox's UIDVALIDITY and checksummed; a cache that was written for a
+// different UIDVALIDITY or fails the integrity check is discarded and rebuilt from scratch.
+class MessageCache {
+private:
+  /* ----- Header / Record ----- */
+  // On-disk layout of the index file.
+        struct Header {
+          char magic[8];
+          uint32_t version;
+          uint32_t uidvalidity;
+          uint32_t count; // records in use, including deleted ones
+          uint32_t live;  // records not deleted
+          uint64_t checksum; // sum of the hashes of all records
+        };
+        struct Record {
+          uint32_t uid;
+          uint32_t deleted;
+          uint64_t from_off;
+          uint64_t subject_off;
+          uint64_t body_off;
+          uint32_t from_len;
+          uint32_t subject_len;
+          uint32_t body_len; // 0 if the body has not been cached
+          uint32_t message_id_len;
+          uint64_t ids_off; // Message-ID followed by References
+          uint32_t references_len;
+          uint32_t reserved;
+          int64_t date; // INTERNALDATE, seconds since the epoch
+          uint32_t size; // RFC822.SIZE
+          uint32_t flags; // MessageAttributes::Flag bits
+        };
+
+        std::string dir;
+        uint32_t uidvalidity;
+        int index_fd = -1;
+        int strings_fd = -1;
+        int bodies_fd = -1;
+        // Mapped index (header followed by records) and mapped strings file:
+        Header* header = nullptr;
+        size_t index_capacity = 0; // records that fit in the current mapping
+        char const* strings = nullptr;
+        size_t strings_mapped = 0;
+        uint64_t strings_size = 0;
+        uint64_t bodies_size = 0;
+        // UID -> record number:
+        std::unordered_map<uint32_t, uint32_t> slots;
+        bool reset = false;
+
+        Record* records() const {return reinterpret_cast<Record*>(header + 1);}
+
+  /* ----- open / close ----- */
+  // Functions to open (creating if necessary) and close the three cache files.
+        void open();
+        void close();
+
+  /* ----- verify ----- */
+  // Function to check the integrity of the opened cache against the expected UIDVALIDITY.
+        bool verify() const;
+
+  /* ----- wipe ----- */
+  // Function to truncate the cache to an empty one for the current UIDVALIDITY.
+        void wipe();
+
+  /* ----- compact ----- */
+  // Function to rewrite the cache without deleted records (and their strings and bodies).
+        void compact();
+
+  /* ----- mapIndex / mapStrings ----- */
+  // Functions to (re)map the index with room for at least the given number of records, and the strings file.
+        void mapIndex(size_t capacity);
+        void mapStrings();
+
+  /* ----- append ----- */
+  // Function to append data to an append-only file, returning its offset.
+        static uint64_t append(int fd, uint64_t& size, char const* data, size_t len);
+
+  /* ----- hash ----- */
+  // Function to hash a record for the index checksum.
+        static uint64_t hash(Record const& record);
+
+  /* ----- setRecord ----- */
+  // Function to overwrite a record in place, keeping the checksum up to date.
+        void setRecord(uint32_t slot, Record const& record);
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // Opens the cache in dir for a mailbox with the given UIDVALIDITY, throws a runtime_error if it cannot be created.
+        MessageCache(std::string dir, uint32_t uidvalidity);
+        MessageCache(MessageCache const&) = delete;
+        MessageCache& operator=(MessageCache const&) = delete;
+
+  /* ----- forEach ----- */
+  // Function to call f(uid, from, subject, message_id, references, attributes) for every cached message in UID order;
+  // the views are only valid during the call.
+        template <typename F> void forEach(F f) {
+          mapStrings();
+          for (uint32_t i = 0; i < header->count; i++) {
+            Record const& record = records()[i];
+            if (record.deleted) {continue;}
+            f(record.uid, std::string_view(strings + record.from_off, record.from_len),
+              std::string_view(strings + record.subject_off, record.subject_len),
+              std::string_view(strings + record.ids_off, record.message_id_len),
+              std::string_view(strings + record.ids_off + record.message_id_len, record.references_len),
+              MessageAttributes{record.date, record.size, record.flags});
+          }
+        }
+
+  /* ----- contains ----- */
+  // Function to check whether the envelope of uid is cached.
+        bool contains(uint32_t uid) const {return slots.count(uid) != 0;}
+
+  /* ----- size ----- */
+  // Function to return the number of cached messages.
+        size_t size() const {return slots.size();}
+
+  /* ----- wasReset ----- */
+  // Function to check whether an existing cache was discarded on open (UIDVALIDITY change or failed integrity check).
+        bool wasReset() const {return reset;}
+
+  /* ----- add ----- */
+  // Function to cache the envelope fields of a message, with what threading needs (references being its References
+  // or In-Reply-To) and what sorting needs.
+        void add(uint32_t uid, std::string_view from, std::string_view subject, std::string_view message_id = {},
+                 std::string_view references = {}, MessageAttributes const& attributes = {});
+
+  /* ----- setFlags ----- */
+  // Function to update the cached flags of a message (e.g. after a CONDSTORE sync).
+        void setFlags(uint32_t uid, uint32_t flags);
+
+  /* ----- remove ----- */
+  // Function to drop a message from the cache (e.g. after it has been expunged).
+        void remove(uint32_t uid);
+
+  /* ----- getBody ----- */
+  // Function to read the cached body of uid into body, returns false if it is not cached.
+        bool getBody(uint32_t uid, std::string& body) const;
+
+  /* ----- hasBody ----- */
+  // Function to check whether the body of uid is cached.
+        bool hasBody(uint32_t uid) const;
+
+  /* ----- getBodyRange ----- */
+  // Function to read at most length bytes of the cached body of uid from offset on into data and its total size into
+  // size, returns false if it is not cached.
+        bool getBodyRange(uint32_t uid, uint32_t offset, uint32_t length, std::string& data, uint32_t& size) const;
+
+  /* ----- putBody ----- */
+  // Function to cache the body of a message whose envelope is cached.
+        void putBody(uint32_t uid, std::string const& body);
+
+  /* ----- DESTRUCTOR ----- */
+        ~MessageCache();
+};
+}
+
+#endif /* CACHE_H */
@@ -0,0 +1,640 @@
+#include "engine.hpp"
+#include "imaputils.hpp"
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace IMAP;
+using namespace std;
+
+/* ----------------- EventLoop Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+EventLoop::EventLoop(function<void(string const&)> failed) : failed(move(failed)) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || wake_fd < 0) {
+    if (epoll_fd >= 0) {::close(epoll_fd);}
+    if (wake_fd >= 0) {::close(wake_fd);}
+    throw runtime_error("Event Loop Error: Unable to create the epoll instance.");
+  }
+  // The wake-up descriptor has handle 0:
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u64 = 0;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+  thread = std::thread(&EventLoop::run, this);
+}
+
+/* ----- DESTRUCTOR ----- */
+EventLoop::~EventLoop() {
+  stop();
+  ::close(epoll_fd);
+  ::close(wake_fd);
+}
+
+/* ----- stop ----- */
+void EventLoop::stop() {
+  if (!stopping.exchange(true)) {
+    uint64_t one = 1;
+    while (write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+  }
+  if (thread.joinable()) {thread.join();}
+  lock_guard<std::mutex> guard(post_mutex);
+  posted.clear();
+}
+
+/* ----- post ----- */
+bool EventLoop::post(function<void()> f) {
+  {
+    lock_guard<std::mutex> guard(post_mutex);
+    if (stopping) {return false;}
+    posted.push_back(move(f));
+  }
+  uint64_t one = 1;
+  while (write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+  return true;
+}
+
+/* ----- add ----- */
+uint64_t EventLoop::add(int fd, uint32_t events, function<void(uint32_t)> handler) {
+  uint64_t handle = next_handle++;
+  epoll_event event{};
+  event.events = events;
+  event.data.u64 = handle;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {return 0;}
+  handlers[handle] = move(handler);
+  return handle;
+}
+
+/* ----- modify ----- */
+void EventLoop::modify(int fd, uint64_t handle, uint32_t events) {
+  epoll_event event{};
+  event.events = events;
+  event.data.u64 = handle;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/* ----- remove ----- */
+void EventLoop::remove(int fd, uint64_t handle) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  handlers.erase(handle);
+}
+
+/* ----- addTimer ----- */
+uint64_t EventLoop::addTimer(chrono::milliseconds delay, function<void()> f) {
+  uint64_t timer = next_handle++;
+  auto deadline = deadlines.emplace(chrono::steady_clock::now() + delay, timer);
+  timers[timer] = {deadline, move(f)};
+  return timer;
+}
+
+/* ----- cancelTimer ----- */
+void EventLoop::cancelTimer(uint64_t timer) {
+  auto it = timers.find(timer);
+  if (it == timers.end()) {return;}
+  deadlines.erase(it->second.first);
+  timers.erase(it);
+}
+
+/* ----- run ----- */
+void EventLoop::run() {
+  epoll_event events[64];
+  while (!stopping) {
+    // Sleep until an event or the next deadline:
+    int timeout = -1;
+    if (!deadlines.empty()) {
+      auto wait = chrono::ceil<chrono::milliseconds>(deadlines.begin()->first - chrono::steady_clock::now());
+      timeout = (int)max<int64_t>(0, min<int64_t>(wait.count(), INT32_MAX));
+    }
+    int n = epoll_wait(epoll_fd, events, 64, timeout);
+    if (n < 0 && errno != EINTR) {
+      // The loop cannot wait any more: tell the owner (still on the loop thread), then end as stop() would, dropping
+      // what was posted so nobody waits for it:
+      string error = string("Event Loop Error: epoll_wait failed: ") + strerror(errno);
+      if (failed) {failed(error);}
+      deque<function<void()>> dropped;
+      lock_guard<std::mutex> guard(post_mutex);
+      stopping = true;
+      dropped.swap(posted);
+      return;
+    }
+    for (int i = 0; i < n && !stopping; i++) {
+      if (events[i].data.u64 == 0) {
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) > 0) {}
+        continue;
+      }
+      // A handler may remove itself (or others handled in this round), so look it up and call a copy:
+      auto it = handlers.find(events[i].data.u64);
+      if (it == handlers.end()) {continue;}
+      auto handler = it->second;
+      handler(events[i].events);
+    }
+
+    // Functions posted from other threads:
+    deque<function<void()>> ready;
+    {
+      lock_guard<std::mutex> guard(post_mutex);
+      ready.swap(posted);
+    }
+    for (auto& f : ready) {
+      if (stopping) {break;}
+      f();
+    }
+
+    // Timers due (each taken out before it runs, so it may set new ones):
+    auto now = chrono::steady_clock::now();
+    while (!stopping && !deadlines.empty() && deadlines.begin()->first <= now) {
+      auto timer = timers.find(deadlines.begin()->second);
+      auto f = move(timer->second.second);
+      deadlines.erase(deadlines.begin());
+      timers.erase(timer);
+      f();
+    }
+  }
+}
+
+/* ----------------- ResponseParser Functions ---------------- */
+/* ----- feed ----- */
+bool ResponseParser::feed(char const* data, size_t size) {
+  size_t i = 0;
+  while (i < size) {
+    if (state == LITERAL) {
+      size_t take = min(literal_left, size - i);
+      literal.append(data + i, take);
+      i += take;
+      literal_left -= take;
+      // The literal is complete, the line goes on after it:
+      if (literal_left == 0) {
+        response += quote_string(literal);
+        literal = string();
+        state = LINE;
+      }
+      continue;
+    }
+    auto newline = static_cast<char const*>(memchr(data + i, '\n', size - i));
+    size_t end = newline ? newline - data : size;
+    response.append(data + i, end - i);
+    if (response.size() > MAX_RESPONSE) {return false;}
+    if (!newline) {break;}
+    i = end + 1;
+    if (!response.empty() && response.back() == '\r') {response.pop_back();}
+    if (!endLine()) {return false;}
+  }
+  return true;
+}
+
+/* ----- endLine ----- */
+bool ResponseParser::endLine() {
+  // A line ending in {n} (or {n+}) goes on with n bytes of literal:
+  size_t open = response.rfind('{');
+  if (!response.empty() && response.back() == '}' && open != string::npos) {
+    string count = response.substr(open + 1, response.size() - open - 2);
+    if (!count.empty() && count.back() == '+') {count.pop_back();}
+    if (!count.empty() && count.size() < 12 && count.find_first_not_of("0123456789") == string::npos) {
+      literal_left = stoull(count);
+      if (literal_left > MAX_RESPONSE) {return false;}
+      response.erase(open);
+      if (literal_left == 0) {response += "\"\"";}
+      else {state = LITERAL;}
+      return true;
+    }
+  }
+  complete.push_back(move(response));
+  // Keep a small buffer for the next response, give a large one back:
+  response = string();
+  return true;
+}
+
+/* ----- next ----- */
+bool ResponseParser::next(string& out) {
+  if (complete.empty()) {return false;}
+  out = move(complete.front());
+  complete.pop_front();
+  return true;
+}
+
+/* ----- reset ----- */
+void ResponseParser::reset() {
+  state = LINE;
+  response = string();
+  literal = string();
+  literal_left = 0;
+  complete.clear();
+}
+
+/* ----------------- AccountEngine Functions ---------------- */
+/* ----- Account ----- */
+// A watched account: its connection (touched by the loop thread only) and the state of the parsing job on the pool.
+struct AccountEngine::Account {
+        enum State {WAITING, RESOLVING, CONNECTING, GREETING, OPENING, IDLING, DONE_SENT, POLLING, NOOP_SENT};
+        // What the loop hands to the pool: an untagged response, the mailbox being examined, the connection lost:
+        enum Incoming {RESPONSE, SELECTED, LOST};
+
+        uint64_t id;
+        AccountConfig config;
+        std::function<void(AccountEvent const&)> callback;
+
+        // Loop thread:
+        State state = WAITING;
+        bool removed = false;
+        int fd = -1;
+        uint64_t handle = 0;
+        uint64_t timer = 0;
+        // Attempts to connect so far (so a lookup finishing late is ignored) and failures since the last success:
+        uint64_t attempt = 0;
+        unsigned failures = 0;
+        std::vector<std::pair<sockaddr_storage, socklen_t>> addresses;
+        size_t address = 0;
+        ResponseParser parser;
+        std::string output;
+        uint32_t tag = 0;
+        uint32_t pending_tag = 0;
+        bool has_idle = false;
+
+        // Pool: responses waiting to be parsed, and whether a job is parsing them:
+        std::mutex strand_mutex;
+        std::deque<std::pair<int, std::string>> incoming;
+        bool scheduled = false;
+        // Parsing job only (one runs at a time):
+        bool selected = false;
+        uint32_t exists = 0;
+        // Held while the callback runs, closed once the account is removed:
+        std::mutex callback_mutex;
+        bool closed = false;
+
+        Account(uint64_t id, AccountConfig config, std::function<void(AccountEvent const&)> callback)
+          : id(id), config(std::move(config)), callback(std::move(callback)) {}
+};
+
+// Function to run f on the loop thread and return its result, waiting for it unless called there. A loop that has
+// stopped (or drops the task, which breaks its promise) leaves its state to us once its thread is gone, so f then
+// runs here.
+template <typename F> static auto runInLoop(EventLoop& loop, F f) -> decltype(f()) {
+  if (loop.inLoop()) {return f();}
+  auto task = make_shared<packaged_task<decltype(f())()>>(f);
+  auto result = task->get_future();
+  if (loop.post([task]() {(*task)();})) {
+    task.reset();
+    try {
+      return result.get();
+    } catch (future_error const& error) {
+      if (error.code() != future_errc::broken_promise) {throw;}
+    }
+  }
+  loop.stop();
+  return f();
+}
+
+/* ----- CONSTRUCTOR ----- */
+AccountEngine::AccountEngine(size_t workers, unsigned poll_interval)
+  : poll_interval(poll_interval), pool(workers), loop([this](string const& error) {
+      // Without its loop nothing can be watched any more: every account is lost for good (no retry timer):
+      for (auto& entry : accounts) {
+        close(*entry.second);
+        deliver(entry.second, Account::LOST, error);
+      }
+    }) {}
+
+/* ----- DESTRUCTOR ----- */
+AccountEngine::~AccountEngine() {
+  // Parsing jobs finish first (handlers posting more are ignored), then the loop stops and the sockets are closed:
+  pool.stop();
+  loop.stop();
+  for (auto& entry : accounts) {close(*entry.second);}
+}
+
+/* ----- add ----- */
+uint64_t AccountEngine::add(AccountConfig config, function<void(AccountEvent const&)> callback) {
+  uint64_t id = next_account++;
+  auto account = make_shared<Account>(id, move(config), move(callback));
+  bool posted = loop.post([this, account]() {
+    accounts[account->id] = account;
+    resolve(account);
+  });
+  if (!posted) {deliver(account, Account::LOST, "Event Loop Error: The event loop has stopped.");}
+  return id;
+}
+
+/* ----- remove ----- */
+void AccountEngine::remove(uint64_t id) {
+  auto account = runInLoop(loop, [this, id]() {
+    auto it = accounts.find(id);
+    if (it == accounts.end()) {return shared_ptr<Account>();}
+    auto account = it->second;
+    accounts.erase(it);
+    account->removed = true;
+    // Log out politely (as far as the socket takes it right away):
+    if (account->state == Account::IDLING) {send(account, "DONE", false);}
+    if (account->state >= Account::OPENING) {send(account, "LOGOUT");}
+    close(*account);
+    return account;
+  });
+  // Wait for a running callback, no new one starts:
+  if (account) {
+    lock_guard<std::mutex> guard(account->callback_mutex);
+    account->closed = true;
+  }
+}
+
+/* ----- size ----- */
+size_t AccountEngine::size() {
+  return runInLoop(loop, [this]() {return accounts.size();});
+}
+
+/* ----- resolve ----- */
+void AccountEngine::resolve(shared_ptr<Account> const& account) {
+  // getaddrinfo blocks, so it runs on the pool:
+  account->state = Account::RESOLVING;
+  uint64_t attempt = ++account->attempt;
+  setTimer(account, RESPONSE_TIMEOUT, [this, account]() {fail(account, "Timed out looking up " + account->config.server);});
+  pool.post([this, account, attempt]() {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int r = getaddrinfo(account->config.server.c_str(), to_string(account->config.port).c_str(), &hints, &result);
+    vector<pair<sockaddr_storage, socklen_t>> addresses;
+    for (auto info = result; info; info = info->ai_next) {
+      sockaddr_storage address{};
+      memcpy(&address, info->ai_addr, info->ai_addrlen);
+      addresses.emplace_back(address, info->ai_addrlen);
+    }
+    if (result) {freeaddrinfo(result);}
+    string error = r == 0 ? "" : "Unable to look up " + account->config.server + ": " + gai_strerror(r);
+    loop.post([this, account, attempt, addresses, error]() {
+      if (account->removed || account->attempt != attempt || account->state != Account::RESOLVING) {return;}
+      if (!error.empty()) {fail(account, error); return;}
+      account->addresses = addresses;
+      account->address = 0;
+      connect(account);
+    });
+  });
+}
+
+/* ----- connect ----- */
+void AccountEngine::connect(shared_ptr<Account> const& account) {
+  for (; account->address < account->addresses.size(); account->address++) {
+    auto& address = account->addresses[account->address];
+    int fd = socket(address.first.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {continue;}
+    if (::connect(fd, (sockaddr*)&address.first, address.second) != 0 && errno != EINPROGRESS) {
+      ::close(fd);
+      continue;
+    }
+    // Connecting goes on in the background, the socket turns writable once it is done:
+    account->fd = fd;
+    account->handle = loop.add(fd, EPOLLOUT, [this, account](uint32_t events) {onEvents(account, events);});
+    account->state = Account::CONNECTING;
+    setTimer(account, RESPONSE_TIMEOUT, [this, account]() {fail(account, "Timed out connecting to " + account->config.server);});
+    return;
+  }
+  fail(account, "Unable to connect to " + account->config.server);
+}
+
+/* ----- onEvents ----- */
+void AccountEngine::onEvents(shared_ptr<Account> const& account, uint32_t events) {
+  if (account->state == Account::CONNECTING) {
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(account->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+    if (error != 0) {
+      // Try the next address:
+      close(*account);
+      account->address++;
+      connect(account);
+      return;
+    }
+    account->state = Account::GREETING;
+    loop.modify(account->fd, account->handle, EPOLLIN);
+    return;
+  }
+
+  // Send what the socket did not take before:
+  if ((events & EPOLLOUT) && !account->output.empty()) {
+    ssize_t n = ::send(account->fd, account->output.data(), account->output.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {fail(account, string("Connection lost: ") + strerror(errno)); return;}
+    if (n > 0) {account->output.erase(0, n);}
+    if (account->output.empty()) {
+      account->output = string();
+      loop.modify(account->fd, account->handle, EPOLLIN);
+    }
+  }
+
+  // Read everything there is, then act on the complete responses:
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    char buffer[65536];
+    while (true) {
+      ssize_t n = recv(account->fd, buffer, sizeof(buffer), 0);
+      if (n > 0) {
+        if (!account->parser.feed(buffer, n)) {fail(account, "Response too large"); return;}
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {continue;}
+      if (n < 0 && errno == EAGAIN) {break;}
+      fail(account, n == 0 ? "Connection closed by the server" : string("Connection lost: ") + strerror(errno));
+      return;
+    }
+    string response;
+    while (account->parser.next(response)) {
+      if (!onResponse(account, response)) {return;}
+    }
+  }
+}
+
+/* ----- onResponse ----- */
+bool AccountEngine::onResponse(shared_ptr<Account> const& account, string const& response) {
+  // Untagged responses:
+  if (response.compare(0, 2, "* ") == 0) {
+    if (strncasecmp(response.c_str() + 2, "BYE", 3) == 0) {
+      fail(account, "The server closed the connection: " + response.substr(2));
+      return false;
+    }
+    if (account->state == Account::GREETING) {
+      // Log in (unless the server did already), learn whether IDLE is there and examine the mailbox in one go:
+      bool preauth = strncasecmp(response.c_str() + 2, "PREAUTH", 7) == 0;
+      if (!preauth && strncasecmp(response.c_str() + 2, "OK", 2) != 0) {
+        fail(account, "Unexpected greeting: " + response);
+        return false;
+      }
+      account->state = Account::OPENING;
+      account->has_idle = false;
+      if (!preauth) {send(account, "LOGIN " + quote_string(account->config.user) + " " + quote_string(account->config.password));}
+      send(account, "CAPABILITY");
+      account->pending_tag = send(account, "EXAMINE " + quote_string(account->config.mailbox));
+      setTimer(account, RESPONSE_TIMEOUT, [this, account]() {fail(account, "Timed out logging in");});
+      return true;
+    }
+    if (strncasecmp(response.c_str() + 2, "CAPABILITY ", 11) == 0) {
+      string capability;
+      istringstream words(response.substr(13));
+      while (words >> capability) {
+        if (strcasecmp(capability.c_str(), "IDLE") == 0) {account->has_idle = true;}
+      }
+      return true;
+    }
+    deliver(account, Account::RESPONSE, response.substr(2));
+    return true;
+  }
+  // Continuation of IDLE:
+  if (response.compare(0, 1, "+") == 0) {return true;}
+
+  // Tagged responses: a refused command ends the connection, the one awaited advances it:
+  size_t space = response.find(' ');
+  if (response.compare(0, 2, "MP") != 0 || space == string::npos) {return true;}
+  if (strncasecmp(response.c_str() + space + 1, "OK", 2) != 0) {
+    fail(account, "The server refused a command: " + response.substr(space + 1));
+    return false;
+  }
+  if (strtoul(response.c_str() + 2, nullptr, 10) != account->pending_tag) {return true;}
+  if (account->state == Account::OPENING) {
+    account->failures = 0;
+    deliver(account, Account::SELECTED);
+  }
+  watch(account);
+  return true;
+}
+
+/* ----- send ----- */
+uint32_t AccountEngine::send(shared_ptr<Account> const& account, string const& command, bool tagged) {
+  string line = tagged ? "MP" + to_string(++account->tag) + " " + command + "\r\n" : command + "\r\n";
+  if (account->output.empty() && account->fd >= 0) {
+    ssize_t n = ::send(account->fd, line.data(), line.size(), MSG_NOSIGNAL);
+    // Errors show up as epoll events:
+    if (n > 0) {line.erase(0, n);}
+    if (line.empty()) {return account->tag;}
+    loop.modify(account->fd, account->handle, EPOLLIN | EPOLLOUT);
+  }
+  account->output += line;
+  return account->tag;
+}
+
+/* ----- watch ----- */
+void AccountEngine::watch(shared_ptr<Account> const& account) {
+  if (account->has_idle) {
+    // Renew IDLE before servers drop the connection (DONE ends it, its tagged OK starts the next):
+    account->state = Account::IDLING;
+    account->pending_tag = send(account, "IDLE");
+    setTimer(account, IDLE_TIMEOUT, [this, account]() {
+      account->state = Account::DONE_SENT;
+      send(account, "DONE", false);
+      setTimer(account, RESPONSE_TIMEOUT, [this, account]() {fail(account, "Timed out renewing IDLE");});
+    });
+    return;
+  }
+  account->state = Account::POLLING;
+  setTimer(account, poll_interval, [this, account]() {
+    account->state = Account::NOOP_SENT;
+    account->pending_tag = send(account, "NOOP");
+    setTimer(account, RESPONSE_TIMEOUT, [this, account]() {fail(account, "Timed out polling");});
+  });
+}
+
+/* ----- setTimer ----- */
+void AccountEngine::setTimer(shared_ptr<Account> const& account, unsigned seconds, function<void()> f) {
+  loop.cancelTimer(account->timer);
+  account->timer = loop.addTimer(chrono::seconds(seconds), [account, f]() {
+    account->timer = 0;
+    f();
+  });
+}
+
+/* ----- fail ----- */
+void AccountEngine::fail(shared_ptr<Account> const& account, string const& error) {
+  close(*account);
+  deliver(account, Account::LOST, error);
+  // Try again later, pausing longer after every failure in a row:
+  unsigned delay = RETRY_INTERVAL << min(account->failures++, 5u);
+  setTimer(account, min(delay, MAX_RETRY_INTERVAL), [this, account]() {resolve(account);});
+}
+
+/* ----- close ----- */
+void AccountEngine::close(Account& account) {
+  loop.cancelTimer(account.timer);
+  account.timer = 0;
+  if (account.fd >= 0) {
+    loop.remove(account.fd, account.handle);
+    ::close(account.fd);
+  }
+  account.fd = -1;
+  account.handle = 0;
+  account.state = Account::WAITING;
+  account.parser.reset();
+  account.output = string();
+}
+
+/* ----- deliver ----- */
+void AccountEngine::deliver(shared_ptr<Account> const& account, int kind, string text) {
+  lock_guard<std::mutex> guard(account->strand_mutex);
+  account->incoming.emplace_back(kind, move(text));
+  if (account->scheduled) {return;}
+  account->scheduled = true;
+  pool.post([account]() {drain(account);});
+}
+
+/* ----- drain ----- */
+void AccountEngine::drain(shared_ptr<Account> const& account) {
+  auto emit = [&account](AccountEvent& event) {
+    event.account = account->id;
+    event.exists = account->exists;
+    lock_guard<std::mutex> guard(account->callback_mutex);
+    if (!account->closed && account->callback) {account->callback(event);}
+  };
+  while (true) {
+    // Take everything that arrived so far, a burst of responses makes a single event:
+    deque<pair<int, string>> batch;
+    {
+      lock_guard<std::mutex> guard(account->strand_mutex);
+      if (account->incoming.empty()) {
+        account->scheduled = false;
+        return;
+      }
+      batch.swap(account->incoming);
+    }
+    AccountEvent changes;
+    bool changed = false;
+    for (auto& item : batch) {
+      if (item.first == Account::SELECTED || item.first == Account::LOST) {
+        // Report the changes so far first, so events keep their order:
+        if (changed) {emit(changes);}
+        changes = AccountEvent();
+        changed = false;
+        AccountEvent event;
+        event.kind = item.first == Account::SELECTED ? AccountEvent::CONNECTED : AccountEvent::DISCONNECTED;
+        event.error = item.second;
+        account->selected = item.first == Account::SELECTED;
+        emit(event);
+        continue;
+      }
+      // "12 EXISTS", "3 EXPUNGE", "4 FETCH (FLAGS (\Seen))"; before the mailbox is examined EXISTS only counts:
+      char const* text = item.second.c_str();
+      char* end;
+      uint32_t number = strtoul(text, &end, 10);
+      if (end == text || *end != ' ') {continue;}
+      end++;
+      if (strncasecmp(end, "EXISTS", 6) == 0) {
+        if (account->selected && number > account->exists) {
+          changes.added += number - account->exists;
+          changed = true;
+        }
+        account->exists = number;
+      }else if (strncasecmp(end, "EXPUNGE", 7) == 0 && account->selected) {
+        changes.expunged.push_back(number);
+        if (account->exists) {account->exists--;}
+        changed = true;
+      }else if (strncasecmp(end, "FETCH", 5) == 0 && account->selected) {
+        changes.flagged.push_back(number);
+        changed = true;
+      }
+    }
+    if (changed) {emit(changes);}
+  }
+}
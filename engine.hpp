@@ -0,0 +1,232 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+#include "worker.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Class: EventLoop -------------------- */
+// A thread waiting on epoll for any number of file descriptors and timers, and running their handlers. Handlers,
+// timers and posted functions all run on the loop thread, one at a time, so the state they share needs no lock.
+class EventLoop {
+private:
+        int epoll_fd = -1;
+        // eventfd written by post() and stop() to interrupt epoll_wait:
+        int wake_fd = -1;
+        std::atomic<bool> stopping{false};
+        std::mutex post_mutex;
+        std::deque<std::function<void()>> posted;
+        // Called on the loop thread if epoll_wait fails, which ends the loop:
+        std::function<void(std::string const&)> failed;
+        // Loop thread only: handlers by the handle given to epoll (not by fd, so a reused fd never gets stale events)
+        // and timers by deadline:
+        uint64_t next_handle = 1;
+        std::unordered_map<uint64_t, std::function<void(uint32_t)>> handlers;
+        std::multimap<std::chrono::steady_clock::time_point, uint64_t> deadlines;
+        std::unordered_map<uint64_t, std::pair<decltype(deadlines)::iterator, std::function<void()>>> timers;
+        std::thread thread;
+
+  /* ----- run ----- */
+  // Function run by the thread: waits for events and the next deadline and runs their handlers until stopped.
+        void run();
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // Starts the loop thread. Throws a runtime_error if epoll is not available. Should epoll_wait fail later, failed
+  // is called with the error on the loop thread, which then ends as stop() would.
+        explicit EventLoop(std::function<void(std::string const&)> failed = {});
+        EventLoop(EventLoop const&) = delete;
+        EventLoop& operator=(EventLoop const&) = delete;
+
+  /* ----- post ----- */
+  // Function to run f on the loop thread (from any thread). Returns false, dropping f, once the loop is stopping;
+  // a function posted in time may still be dropped (unrun, destroyed) if the loop ends before reaching it.
+        bool post(std::function<void()> f);
+
+  /* ----- inLoop ----- */
+  // Function to tell whether the caller runs on the loop thread.
+        bool inLoop() const {return std::this_thread::get_id() == thread.get_id();}
+
+  /* ----- add / modify / remove ----- */
+  // Functions to watch fd for events (EPOLLIN, EPOLLOUT) calling handler with the events that occurred, to change
+  // the events watched and to stop watching (before closing fd). Loop thread only.
+        uint64_t add(int fd, uint32_t events, std::function<void(uint32_t)> handler);
+        void modify(int fd, uint64_t handle, uint32_t events);
+        void remove(int fd, uint64_t handle);
+
+  /* ----- addTimer / cancelTimer ----- */
+  // Functions to call f once after delay and to cancel that (0 and unknown timers are ignored). Loop thread only.
+        uint64_t addTimer(std::chrono::milliseconds delay, std::function<void()> f);
+        void cancelTimer(uint64_t timer);
+
+  /* ----- stop ----- */
+  // Function to end the loop (dropping posted functions and timers) and wait for the thread.
+        void stop();
+
+  /* ----- DESTRUCTOR ----- */
+        ~EventLoop();
+};
+
+/* -------------------- Class: ResponseParser -------------------- */
+// State machine splitting the bytes received on a connection into complete IMAP responses, however they were cut
+// into reads: lines are collected up to CRLF and the literals they announce ({n}) are read as n bytes and written
+// into the response as quoted strings (as Session::command returns them). Holds no more than the response being
+// read, its buffer is released after large ones.
+class ResponseParser {
+private:
+        enum State {LINE, LITERAL};
+        State state = LINE;
+        std::string response;
+        std::string literal;
+        size_t literal_left = 0;
+        std::deque<std::string> complete;
+
+  /* ----- MAX_RESPONSE ----- */
+  // Bytes a single response may take, more means the connection is broken (or hostile).
+        static constexpr size_t MAX_RESPONSE = 64 * 1024 * 1024;
+
+  /* ----- endLine ----- */
+  // Function to finish the line in response: starts reading its literal or queues the response. Returns false if
+  // the literal is too large.
+        bool endLine();
+
+public:
+  /* ----- feed ----- */
+  // Function to parse the next bytes received. Returns false if a response exceeds MAX_RESPONSE.
+        bool feed(char const* data, size_t size);
+
+  /* ----- next ----- */
+  // Function to take the next complete response (without its CRLF), false if there is none yet.
+        bool next(std::string& out);
+
+  /* ----- reset ----- */
+  // Function to drop everything, for a new connection.
+        void reset();
+};
+
+/* -------------------- Struct: AccountConfig -------------------- */
+// Account watched by an AccountEngine: the server and credentials (as Session::connect and login take them) and
+// the mailbox watched.
+struct AccountConfig {
+        std::string server;
+        size_t port = 143;
+        std::string user;
+        std::string password;
+        std::string mailbox = "INBOX";
+};
+
+/* -------------------- Struct: AccountEvent -------------------- */
+// What happened to a watched account. Message numbers are sequence numbers of the watched mailbox.
+struct AccountEvent {
+        enum Kind {CONNECTED, CHANGED, DISCONNECTED};
+        Kind kind = CHANGED;
+        uint64_t account = 0;
+        uint32_t exists = 0;              // messages in the mailbox after the event
+        uint32_t added = 0;               // new messages (CHANGED)
+        std::vector<uint32_t> expunged;   // in the order the server sent them (CHANGED)
+        std::vector<uint32_t> flagged;    // messages whose flags changed (CHANGED)
+        std::string error;                // why the connection was lost (DISCONNECTED)
+};
+
+/* -------------------- Class: AccountEngine -------------------- */
+// Watches many accounts at once on a single EventLoop: every account has one non-blocking connection that logs in,
+// EXAMINEs its mailbox and then waits in IDLE (or sends a NOOP every poll interval without it), driven by a
+// per-connection state machine over a ResponseParser. Lost connections are reopened with a growing pause. Name
+// lookups and the parsing of the untagged responses run on a shared, bounded WorkerPool (one job at a time per
+// account, so its events come in order) and the events are delivered from there too. An idle account costs a
+// socket and a few hundred bytes: no thread, no timer but its IDLE renewal.
+class AccountEngine {
+private:
+        struct Account;
+        unsigned poll_interval;
+        // Stopped before the loop (see the destructor), handlers posting to it afterwards are ignored:
+        WorkerPool pool;
+        std::unordered_map<uint64_t, std::shared_ptr<Account>> accounts; // loop thread only
+        std::atomic<uint64_t> next_account{1};
+        EventLoop loop;
+
+  /* ----- IDLE_TIMEOUT / RESPONSE_TIMEOUT / RETRY_INTERVAL / MAX_RETRY_INTERVAL ----- */
+  // Seconds after which IDLE is renewed (RFC 2177), seconds the server has to answer a command (or to let us
+  // connect), and the first and longest pause before reconnecting.
+        static constexpr unsigned IDLE_TIMEOUT = 29 * 60;
+        static constexpr unsigned RESPONSE_TIMEOUT = 60;
+        static constexpr unsigned RETRY_INTERVAL = 30;
+        static constexpr unsigned MAX_RETRY_INTERVAL = 15 * 60;
+
+  /* ----- resolve / connect ----- */
+  // Functions to look the server up on the pool and to open a non-blocking connection to the first address that
+  // takes it.
+        void resolve(std::shared_ptr<Account> const& account);
+        void connect(std::shared_ptr<Account> const& account);
+
+  /* ----- onEvents ----- */
+  // Function handling the epoll events of a connection: completes connecting, sends what is left and reads.
+        void onEvents(std::shared_ptr<Account> const& account, uint32_t events);
+
+  /* ----- onResponse ----- */
+  // Function advancing the state machine of a connection by one response, false if the connection failed.
+        bool onResponse(std::shared_ptr<Account> const& account, std::string const& response);
+
+  /* ----- send ----- */
+  // Function to send a command (tagged unless it is DONE), queueing what the socket does not take at once.
+  // Returns the tag used.
+        uint32_t send(std::shared_ptr<Account> const& account, std::string const& command, bool tagged = true);
+
+  /* ----- watch ----- */
+  // Function to start waiting for changes on a connection with its mailbox examined: IDLE, or a NOOP timer.
+        void watch(std::shared_ptr<Account> const& account);
+
+  /* ----- setTimer ----- */
+  // Function to replace the timer of a connection.
+        void setTimer(std::shared_ptr<Account> const& account, unsigned seconds, std::function<void()> f);
+
+  /* ----- fail / close ----- */
+  // Functions to drop a connection, reporting why and scheduling the next attempt, and to close it silently.
+        void fail(std::shared_ptr<Account> const& account, std::string const& error);
+        void close(Account& account);
+
+  /* ----- deliver / drain ----- */
+  // Functions to hand untagged responses (or a marker, see Account::Incoming) to the pool, and to parse them there
+  // into events for the callback.
+        void deliver(std::shared_ptr<Account> const& account, int kind, std::string text = {});
+        static void drain(std::shared_ptr<Account> const& account);
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // workers bounds the threads of the shared pool, poll_interval is the NOOP interval on servers without IDLE.
+        explicit AccountEngine(size_t workers = std::max(2u, std::thread::hardware_concurrency()),
+                               unsigned poll_interval = 30);
+        AccountEngine(AccountEngine const&) = delete;
+        AccountEngine& operator=(AccountEngine const&) = delete;
+
+  /* ----- add ----- */
+  // Function to start watching an account and return its id. callback receives its events on a pool thread, one
+  // at a time.
+        uint64_t add(AccountConfig config, std::function<void(AccountEvent const&)> callback);
+
+  /* ----- remove ----- */
+  // Function to stop watching an account (logging out). Once it returns the callback is not running and will not
+  // be called again, so it must not be called from the callback.
+        void remove(uint64_t account);
+
+  /* ----- size ----- */
+  // Function to return the number of accounts watched.
+        size_t size();
+
+  /* ----- DESTRUCTOR ----- */
+        ~AccountEngine();
+};
+}
+
+#endif /* ENGINE_H */
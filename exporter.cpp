@@ -0,0 +1,553 @@
+#include "exporter.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace IMAP;
+using namespace std;
+
+/* ----- writeAll ----- */
+// Function to write size bytes to fd, retrying short writes. Returns false on error (see errno).
+static bool writeAll(int fd, char const* data, size_t size) {
+  while (size > 0) {
+    ssize_t r = ::write(fd, data, size);
+    if (r < 0 && errno == EINTR) {continue;}
+    if (r <= 0) {return false;}
+    data += r;
+    size -= r;
+  }
+  return true;
+}
+
+/* ----- dropCRs ----- */
+// Function to remove every CR before an LF from data[from...].
+static void dropCRs(string& data, size_t from) {
+  size_t out = from;
+  for (size_t in = from; in < data.size(); in++) {
+    if (data[in] == '\r' && in + 1 < data.size() && data[in + 1] == '\n') {continue;}
+    data[out++] = data[in];
+  }
+  data.resize(out);
+}
+
+/* ----------------- Exporter Functions ---------------- */
+char const* const Exporter::CHECKPOINT_FILE = ".mailpunk-export";
+
+/* ----- run ----- */
+ExportProgress Exporter::run(vector<string> mailboxes) {
+  if (mailboxes.empty()) {
+    for (auto const& folder : session.listMailboxes()) {
+      if (folder.selectable) {mailboxes.push_back(folder.name);}
+    }
+  }
+  error_code ec;
+  filesystem::create_directories(options.destination, ec);
+  if (ec) {throw runtime_error("Export Error: Unable to create " + options.destination + ": " + ec.message());}
+  loadCheckpoints();
+  for (auto const& mailbox : mailboxes) {exportMailbox(mailbox);}
+  return state;
+}
+
+/* ----- exportMailbox ----- */
+void Exporter::exportMailbox(string const& mailbox) {
+  // Attempt to examine the mailbox (read-only, flags and \Recent stay as they are):
+  mailimap* imap = session.getIMAP();
+  check(session.getMetrics().time(Metrics::EXAMINE, imap, [&]() {return mailimap_examine(imap, mailbox.c_str());}),
+        "Mailbox Error: Unable to examine mailbox", mailbox);
+
+  // Start over if the UIDs of the checkpoint no longer mean the same messages, then list what is left to export:
+  uint32_t uidvalidity = imap->imap_selection_info->sel_uidvalidity;
+  Checkpoint& checkpoint = checkpoints[mailbox];
+  if (checkpoint.uidvalidity != uidvalidity) {
+    checkpoint = Checkpoint();
+    checkpoint.uidvalidity = uidvalidity;
+  }
+  auto sizes = listSizes(checkpoint.last_uid);
+  {
+    lock_guard<mutex> guard(state_mutex);
+    state.mailbox = mailbox;
+    state.messages = 0;
+    state.mailbox_total = sizes.size();
+    if (progress) {progress(state);}
+  }
+
+  // Prepare the Maildir, or the mbox cut back to what the checkpoint covers (dropping a partly written message):
+  string target = options.destination + "/" + Session::cacheName(mailbox);
+  int mbox = -1;
+  if (options.format == ExportOptions::MAILDIR) {
+    error_code ec;
+    for (char const* sub : {"/tmp", "/new", "/cur"}) {filesystem::create_directories(target + sub, ec);}
+    if (ec) {throw runtime_error("Export Error: Unable to create " + target + ": " + ec.message());}
+  }else {
+    target += ".mbox";
+    mbox = ::open(target.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (mbox < 0 || ftruncate(mbox, checkpoint.offset) != 0 || lseek(mbox, 0, SEEK_END) < 0) {
+      string error = strerror(errno);
+      if (mbox >= 0) {::close(mbox);}
+      throw runtime_error("Export Error: Unable to open " + target + ": " + error);
+    }
+  }
+
+  // Function to record a written message: the checkpoint advances over every message written in fetch order
+  // (caught_up tells a streamed message waiting for its turn, see stream):
+  map<uint64_t, pair<uint32_t, uint64_t>> finished; // sequence -> UID, mbox offset, written ahead of others
+  uint64_t next_sequence = 0;
+  unsigned since_checkpoint = 0;
+  condition_variable caught_up;
+  atomic<bool> failed{false};
+  auto done = [&](Item const& item, uint64_t offset) {
+    lock_guard<mutex> guard(state_mutex);
+    finished[item.sequence] = {item.uid, offset};
+    for (auto it = finished.begin(); it != finished.end() && it->first == next_sequence; it = finished.erase(it)) {
+      checkpoint.last_uid = it->second.first;
+      checkpoint.offset = it->second.second;
+      next_sequence++;
+    }
+    caught_up.notify_all();
+    state.messages++;
+    state.total_messages++;
+    if (++since_checkpoint >= options.checkpoint_interval) {
+      since_checkpoint = 0;
+      saveCheckpoints();
+    }
+    if (progress) {progress(state);}
+  };
+
+  // The first error stops every stage, the queues let nobody wait for it:
+  BoundedQueue<Item> fetched(options.buffer_bytes);
+  BoundedQueue<Item> framed(options.buffer_bytes);
+  exception_ptr error;
+  mutex error_mutex;
+  auto fail = [&]() {
+    {
+      lock_guard<mutex> guard(error_mutex);
+      if (!error) {error = current_exception();}
+    }
+    {
+      lock_guard<mutex> guard(state_mutex);
+      failed = true;
+    }
+    caught_up.notify_all();
+    fetched.cancel();
+    framed.cancel();
+  };
+
+  // An mbox is one stream, so it keeps to one framer and one writer (and thereby to UID order):
+  size_t workers = options.format == ExportOptions::MBOX ? 1 : max<size_t>(1, options.writers);
+  atomic<size_t> framers{workers};
+  uint64_t offset = checkpoint.offset;
+  vector<thread> stages;
+  for (size_t i = 0; i < workers; i++) {
+    stages.emplace_back([&]() {
+      try {
+        Item item;
+        while (fetched.pop(item)) {
+          if (options.format == ExportOptions::MBOX) {frameMbox(item);}
+          else {frameMaildir(item);}
+          size_t weight = item.data.size();
+          if (!framed.push(move(item), weight)) {break;}
+        }
+      } catch (...) {fail();}
+      if (--framers == 0) {framed.close();}
+    });
+    stages.emplace_back([&]() {
+      try {
+        Item item;
+        while (framed.pop(item)) {
+          if (mbox < 0) {
+            writeMaildir(target, uidvalidity, item);
+            done(item, 0);
+            continue;
+          }
+          if (!writeAll(mbox, item.data.data(), item.data.size()) || (options.sync && fsync(mbox) != 0)) {
+            throw runtime_error("Export Error: Unable to write " + target + ": " + strerror(errno));
+          }
+          offset += item.data.size();
+          done(item, offset);
+        }
+      } catch (...) {fail();}
+    });
+  }
+
+  // Function to write a message larger than a batch on this thread, framed range by range as it arrives, so it is
+  // never held whole. Into an mbox it only goes once everything queued before it is written (the writer waits for
+  // the next item meanwhile, and carries on from the new end of the file):
+  auto stream = [&](uint32_t uid, uint64_t& sequence) {
+    Item item = fetchAttributes(uid);
+    if (!item.uid) {return;} // expunged meanwhile
+    item.sequence = sequence++;
+    string partial, out;
+    if (mbox < 0) {
+      writeMaildir(target, uidvalidity, item, [&](int fd) {
+        return streamBody(uid, [&](string const& range, bool last) {
+          out.clear();
+          maildirLines(partial, range, last, out);
+          return writeAll(fd, out.data(), out.size());
+        });
+      });
+      done(item, 0);
+      return;
+    }
+    {
+      unique_lock<mutex> guard(state_mutex);
+      caught_up.wait(guard, [&]() {return failed || next_sequence == item.sequence;});
+      if (failed) {return;}
+    }
+    out = fromLine(item.date);
+    uint64_t end = offset;
+    bool written = streamBody(uid, [&](string const& range, bool last) {
+      mboxLines(partial, range, last, out);
+      if (last) {out += '\n';}
+      if (!writeAll(mbox, out.data(), out.size())) {return false;}
+      end += out.size();
+      out.clear();
+      return true;
+    });
+    if (!written || (options.sync && fsync(mbox) != 0)) {
+      throw runtime_error("Export Error: Unable to write " + target + ": " + strerror(errno));
+    }
+    offset = end;
+    done(item, offset);
+  };
+
+  // Fetch on this thread, in batches of about batch_bytes (a larger message is streamed on its own):
+  try {
+    uint64_t sequence = 0;
+    for (size_t first = 0; first < sizes.size();) {
+      if (sizes[first].second > options.batch_bytes) {
+        stream(sizes[first++].first, sequence);
+        if (failed) {break;}
+        continue;
+      }
+      vector<uint32_t> batch;
+      size_t bytes = 0;
+      while (first < sizes.size() && sizes[first].second <= options.batch_bytes
+             && bytes + sizes[first].second <= options.batch_bytes) {
+        bytes += sizes[first].second;
+        batch.push_back(sizes[first++].first);
+      }
+      if (!fetchBatch(batch, sequence, fetched)) {break;}
+    }
+  } catch (...) {fail();}
+  fetched.close();
+  for (auto& stage : stages) {stage.join();}
+  if (mbox >= 0) {::close(mbox);}
+
+  // Keep what was written, even if something failed:
+  saveCheckpoints();
+  if (error) {rethrow_exception(error);}
+}
+
+/* ----- listSizes ----- */
+vector<pair<uint32_t, uint32_t>> Exporter::listSizes(uint32_t after) {
+  // "n:*" is an error in an empty mailbox with some servers:
+  mailimap* imap = session.getIMAP();
+  vector<pair<uint32_t, uint32_t>> sizes;
+  if (imap->imap_selection_info->sel_has_exists && imap->imap_selection_info->sel_exists == 0) {return sizes;}
+
+  // Create a fetch type with the UID and size only:
+  set_ptr set(mailimap_set_new_interval(after + 1, 0));
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_uid(), mailimap_fetch_att_new_rfc822_size()});
+
+  // Attempt to fetch the sizes:
+  fetch_list_ptr result;
+  check(session.getMetrics().time(Metrics::FETCH_LIST, imap, [&]() {
+    return mailimap_uid_fetch(imap, set.get(), fetch_type.get(), out_ptr(result));
+  }), "Message Retrieval Error: Unable to list the messages of mailbox", state.mailbox);
+
+  // "n:*" always matches the last message, even if its UID is below n:
+  for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+    auto msg_att = (mailimap_msg_att*)clist_content(cur);
+    uint32_t uid = 0, size = 0;
+    for(clistiter* att = clist_begin(msg_att->att_list); att != nullptr; att = clist_next(att)) {
+      auto item = (mailimap_msg_att_item*)clist_content(att);
+      if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+      if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID) {uid = item->att_data.att_static->att_data.att_uid;}
+      else if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_RFC822_SIZE) {
+        size = item->att_data.att_static->att_data.att_rfc822_size;
+      }
+    }
+    if (uid > after) {sizes.emplace_back(uid, size);}
+  }
+  sort(sizes.begin(), sizes.end());
+  return sizes;
+}
+
+/* ----- fetchBatch ----- */
+bool Exporter::fetchBatch(vector<uint32_t> const& uids, uint64_t& sequence, BoundedQueue<Item>& queue) {
+  // Create a fetch type with everything a backup keeps: UID, flags, INTERNALDATE and the whole message (without
+  // setting \Seen):
+  mailimap* imap = session.getIMAP();
+  auto set = compressed_set(uids.data(), uids.size());
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_uid(), mailimap_fetch_att_new_flags(),
+                                    mailimap_fetch_att_new_internaldate(),
+                                    mailimap_fetch_att_new_body_peek_section(mailimap_section_new(NULL))});
+
+  // Attempt to fetch the batch:
+  fetch_list_ptr result;
+  check(session.getMetrics().time(Metrics::FETCH_BODY, imap, [&]() {
+    return mailimap_uid_fetch(imap, set.get(), fetch_type.get(), out_ptr(result));
+  }, uids.size()), "Message Retrieval Error: Unable to fetch messages from mailbox", state.mailbox);
+
+  // Copy the messages out, so the response can go before waiting for room in the queue:
+  vector<Item> items;
+  uint64_t bytes = 0;
+  {
+    Metrics::Scope parse(session.getMetrics(), Metrics::PARSE);
+    for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+      Item item = parseItem((mailimap_msg_att*)clist_content(cur));
+      // Messages expunged meanwhile are simply missing, unsolicited FETCH responses (e.g. flag changes) have no body:
+      if (!item.uid || !binary_search(uids.begin(), uids.end(), item.uid)) {continue;}
+      bytes += item.data.size();
+      items.push_back(move(item));
+    }
+    parse.setItems(items.size());
+  }
+  sort(items.begin(), items.end(), [](Item const& a, Item const& b) {return a.uid < b.uid;});
+  {
+    lock_guard<mutex> guard(state_mutex);
+    state.total_bytes += bytes;
+  }
+  for (auto& item : items) {
+    item.sequence = sequence++;
+    size_t weight = item.data.size();
+    if (!queue.push(move(item), weight)) {return false;}
+  }
+  return true;
+}
+
+/* ----- fetchAttributes ----- */
+Exporter::Item Exporter::fetchAttributes(uint32_t uid) {
+  // Everything fetchBatch fetches but the body:
+  mailimap* imap = session.getIMAP();
+  set_ptr set(mailimap_set_new_single(uid));
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_uid(), mailimap_fetch_att_new_flags(),
+                                    mailimap_fetch_att_new_internaldate()});
+  fetch_list_ptr result;
+  check(session.getMetrics().time(Metrics::FETCH_LIST, imap, [&]() {
+    return mailimap_uid_fetch(imap, set.get(), fetch_type.get(), out_ptr(result));
+  }, 1), "Message Retrieval Error: Unable to fetch messages from mailbox", state.mailbox);
+  for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+    Item item = parseItem((mailimap_msg_att*)clist_content(cur));
+    if (item.uid == uid) {return item;}
+  }
+  return Item();
+}
+
+/* ----- streamBody ----- */
+bool Exporter::streamBody(uint32_t uid, function<bool(string const&, bool)> const& write) {
+  for (uint32_t offset = 0;;) {
+    BodyRange range = session.fetchPartial(uid, section_ptr(mailimap_section_new(NULL)), offset, options.batch_bytes, false);
+    {
+      lock_guard<mutex> guard(state_mutex);
+      state.total_bytes += range.data.size();
+    }
+    if (!write(range.data, range.complete())) {return false;}
+    if (range.complete()) {return true;}
+    offset += range.data.size();
+  }
+}
+
+/* ----- parseItem ----- */
+Exporter::Item Exporter::parseItem(mailimap_msg_att* msg_att) {
+  Item item;
+  bool seen = false, answered = false, flagged = false, deleted = false, draft = false;
+  for(clistiter* cur = clist_begin(msg_att->att_list); cur != nullptr; cur = clist_next(cur)) {
+    auto att_item = (mailimap_msg_att_item*)clist_content(cur);
+    // Flags are the only dynamic attribute:
+    if (att_item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC) {
+      if (!att_item->att_data.att_dyn->att_list) {continue;}
+      for(clistiter* f = clist_begin(att_item->att_data.att_dyn->att_list); f != nullptr; f = clist_next(f)) {
+        auto flag_fetch = (mailimap_flag_fetch*)clist_content(f);
+        if (flag_fetch->fl_type != MAILIMAP_FLAG_FETCH_OTHER || !flag_fetch->fl_flag) {continue;}
+        switch (flag_fetch->fl_flag->fl_type) {
+        case MAILIMAP_FLAG_SEEN: seen = true; break;
+        case MAILIMAP_FLAG_ANSWERED: answered = true; break;
+        case MAILIMAP_FLAG_FLAGGED: flagged = true; break;
+        case MAILIMAP_FLAG_DELETED: deleted = true; break;
+        case MAILIMAP_FLAG_DRAFT: draft = true; break;
+        }
+      }
+      continue;
+    }
+    if (att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+    auto att = att_item->att_data.att_static;
+    if (att->att_type == MAILIMAP_MSG_ATT_UID) {item.uid = att->att_data.att_uid;}
+    else if (att->att_type == MAILIMAP_MSG_ATT_BODY_SECTION && att->att_data.att_body_section->sec_body_part) {
+      item.data.assign(att->att_data.att_body_section->sec_body_part, att->att_data.att_body_section->sec_length);
+    }
+    else if (att->att_type == MAILIMAP_MSG_ATT_INTERNALDATE && att->att_data.att_internal_date) {
+      // The zone is given as +HHMM:
+      auto dt = att->att_data.att_internal_date;
+      struct tm tm = {};
+      tm.tm_year = dt->dt_year - 1900;
+      tm.tm_mon = dt->dt_month - 1;
+      tm.tm_mday = dt->dt_day;
+      tm.tm_hour = dt->dt_hour;
+      tm.tm_min = dt->dt_min;
+      tm.tm_sec = dt->dt_sec;
+      int zone = abs(dt->dt_zone);
+      long zone_seconds = (zone / 100) * 3600L + (zone % 100) * 60L;
+      item.date = timegm(&tm) - (dt->dt_zone < 0 ? -zone_seconds : zone_seconds);
+    }
+  }
+  // Maildir info letters, in ASCII order:
+  if (draft) {item.flags += 'D';}
+  if (flagged) {item.flags += 'F';}
+  if (answered) {item.flags += 'R';}
+  if (seen) {item.flags += 'S';}
+  if (deleted) {item.flags += 'T';}
+  return item;
+}
+
+/* ----- frameMbox ----- */
+void Exporter::frameMbox(Item& item) {
+  string out;
+  out.reserve(item.data.size() + item.data.size() / 64 + 64);
+  out += fromLine(item.date);
+  string partial;
+  mboxLines(partial, item.data, true, out);
+  // An empty line separates the message from the next From_ line:
+  out += '\n';
+  item.data = move(out);
+}
+
+/* ----- frameMaildir ----- */
+void Exporter::frameMaildir(Item& item) {
+  // Maildir files use the local LF line endings, i.e. every CR before an LF goes:
+  dropCRs(item.data, 0);
+}
+
+/* ----- fromLine ----- */
+string Exporter::fromLine(time_t date) {
+  // The INTERNALDATE in asctime format, as mbox readers expect:
+  struct tm tm;
+  gmtime_r(&date, &tm);
+  char from[64];
+  strftime(from, sizeof(from), "From MAILER-DAEMON %a %b %e %H:%M:%S %Y\n", &tm);
+  return from;
+}
+
+/* ----- mboxLines ----- */
+void Exporter::mboxLines(string& partial, string_view text, bool last, string& out) {
+  // An unfinished line of the previous range comes first:
+  string joined;
+  string_view data = text;
+  if (!partial.empty()) {
+    joined = move(partial);
+    joined += text;
+    data = joined;
+  }
+  // Lines are copied with LF endings, "From " after any number of '>' gets one more (mboxrd), so readers can
+  // undo the quoting exactly:
+  size_t start = 0;
+  while (start < data.size()) {
+    size_t end = data.find('\n', start);
+    if (end == string_view::npos) {
+      if (!last) {break;}
+      end = data.size();
+    }
+    string_view line = data.substr(start, end - start);
+    start = end + 1;
+    if (!line.empty() && line.back() == '\r') {line.remove_suffix(1);}
+    size_t quotes = line.find_first_not_of('>');
+    if (quotes != string_view::npos && line.compare(quotes, 5, "From ") == 0) {out += '>';}
+    out += line;
+    out += '\n';
+  }
+  partial.assign(start < data.size() ? data.substr(start) : string_view());
+}
+
+/* ----- maildirLines ----- */
+void Exporter::maildirLines(string& partial, string_view text, bool last, string& out) {
+  // A CR ending the range waits, the LF after it may start the next one:
+  size_t from = out.size();
+  out += partial;
+  out += text;
+  partial.clear();
+  if (!last && out.size() > from && out.back() == '\r') {
+    out.pop_back();
+    partial = "\r";
+  }
+  dropCRs(out, from);
+}
+
+/* ----- writeMaildir ----- */
+void Exporter::writeMaildir(string const& dir, uint32_t uidvalidity, Item const& item,
+                            function<bool(int)> const& contents) {
+  // The name only depends on the message, so a message exported again replaces itself (unless its flags changed):
+  string base = to_string(item.date) + ".U" + to_string(uidvalidity) + "_" + to_string(item.uid) + ".mailpunk";
+  string tmp = dir + "/tmp/" + base;
+  string cur = dir + "/cur/" + base + ":2," + item.flags;
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {throw runtime_error("Export Error: Unable to create " + tmp + ": " + strerror(errno));}
+  bool written;
+  try {
+    written = (contents ? contents(fd) : writeAll(fd, item.data.data(), item.data.size()))
+              && (!options.sync || fsync(fd) == 0);
+  } catch (...) {
+    ::close(fd);
+    unlink(tmp.c_str());
+    throw;
+  }
+  string error = written ? "" : strerror(errno);
+  if (::close(fd) != 0 && written) {
+    written = false;
+    error = strerror(errno);
+  }
+  if (written && rename(tmp.c_str(), cur.c_str()) != 0) {
+    written = false;
+    error = strerror(errno);
+  }
+  if (!written) {
+    unlink(tmp.c_str());
+    throw runtime_error("Export Error: Unable to write " + cur + ": " + error);
+  }
+}
+
+/* ----- loadCheckpoints ----- */
+void Exporter::loadCheckpoints() {
+  // One line per mailbox: UIDVALIDITY, last UID, mbox offset and the name (which may contain spaces):
+  checkpoints.clear();
+  ifstream file(options.destination + "/" + CHECKPOINT_FILE);
+  string line;
+  while (getline(file, line)) {
+    istringstream in(line);
+    Checkpoint checkpoint;
+    string name;
+    if (!(in >> checkpoint.uidvalidity >> checkpoint.last_uid >> checkpoint.offset)) {continue;}
+    in.get();
+    if (getline(in, name) && !name.empty()) {checkpoints[name] = checkpoint;}
+  }
+}
+
+/* ----- saveCheckpoints ----- */
+void Exporter::saveCheckpoints() {
+  // Write a new file and rename it over the old one, so there is always a complete checkpoint:
+  string path = options.destination + "/" + CHECKPOINT_FILE;
+  string tmp = path + ".tmp";
+  string contents;
+  for (auto const& entry : checkpoints) {
+    contents += to_string(entry.second.uidvalidity) + " " + to_string(entry.second.last_uid) + " "
+                + to_string(entry.second.offset) + " " + entry.first + "\n";
+  }
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  bool written = fd >= 0 && writeAll(fd, contents.data(), contents.size()) && (!options.sync || fsync(fd) == 0);
+  if (fd >= 0 && ::close(fd) != 0) {written = false;}
+  if (!written || rename(tmp.c_str(), path.c_str()) != 0) {
+    string error = strerror(errno);
+    unlink(tmp.c_str());
+    throw runtime_error("Export Error: Unable to write " + path + ": " + error);
+  }
+}
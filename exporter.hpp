@@ -0,0 +1,148 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+#include "imap.hpp"
+#include "worker.hpp"
+#include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Struct: ExportOptions -------------------- */
+// Where and how Exporter writes messages.
+struct ExportOptions {
+        enum Format {MAILDIR, MBOX};
+        Format format = MAILDIR;
+        // Directory receiving one Maildir (or mbox file) per mailbox and the checkpoint file:
+        std::string destination;
+        // Threads framing and writing messages (Maildir only: an mbox is framed and written in order by one each):
+        size_t writers = 4;
+        // Bytes of messages requested by one UID FETCH (a larger message is fetched and written in ranges of this
+        // size), and held between two stages of the pipeline:
+        size_t batch_bytes = 8 * 1024 * 1024;
+        size_t buffer_bytes = 64 * 1024 * 1024;
+        // Flush every message (and the checkpoint) to disk before counting it as exported:
+        bool sync = false;
+        // Messages exported between two checkpoints:
+        unsigned checkpoint_interval = 1000;
+};
+
+/* -------------------- Struct: ExportProgress -------------------- */
+// How far an export has come, in the mailbox being exported and in total.
+struct ExportProgress {
+        std::string mailbox;
+        uint64_t messages = 0;       // written from this mailbox (in this run)
+        uint64_t mailbox_total = 0;  // to write from this mailbox (in this run)
+        uint64_t total_messages = 0; // written from all mailboxes
+        uint64_t total_bytes = 0;    // bytes of messages fetched from all mailboxes
+};
+
+/* -------------------- Class: Exporter -------------------- */
+// Backs up mailboxes of a logged in session to Maildirs (one per mailbox, messages in cur/ with their flags) or
+// mboxrd files, as a pipeline of three stages with bounded buffers between them: the calling thread fetches
+// messages in UID order in large batches, framers turn them into the target format and writers put them on disk
+// (in parallel for Maildir). A message larger than a batch is streamed instead, range by range, so memory use is
+// bounded by the batch and buffer sizes, not by the size of the mailbox or of its largest message.
+// Progress is recorded in a checkpoint file in the destination (the highest UID of each mailbox below which
+// everything is written), so an interrupted export resumes where it stopped and a repeated one only adds new
+// messages. The session connection is left with the last exported mailbox EXAMINEd.
+class Exporter {
+private:
+  /* ----- Checkpoint ----- */
+  // State of one mailbox in the checkpoint file: every message up to last_uid is written, the mbox up to offset.
+        struct Checkpoint {
+          uint32_t uidvalidity = 0;
+          uint32_t last_uid = 0;
+          uint64_t offset = 0;
+        };
+
+  /* ----- Item ----- */
+  // Message travelling through the pipeline, numbered in fetch (i.e. UID) order.
+        struct Item {
+          uint64_t sequence = 0;
+          uint32_t uid = 0;
+          std::string flags; // Maildir info letters, e.g. "FS"
+          time_t date = 0;   // INTERNALDATE
+          std::string data;
+        };
+
+        Session& session;
+        ExportOptions options;
+        std::function<void(ExportProgress const&)> progress;
+        // Progress and checkpoints, updated by the fetching thread and the writers under state_mutex:
+        ExportProgress state;
+        std::map<std::string, Checkpoint> checkpoints;
+        std::mutex state_mutex;
+
+  /* ----- CHECKPOINT_FILE ----- */
+        static char const* const CHECKPOINT_FILE;
+
+  /* ----- loadCheckpoints / saveCheckpoints ----- */
+  // Functions to read the checkpoint file of the destination (if any) and to replace it atomically.
+        void loadCheckpoints();
+        void saveCheckpoints();
+
+  /* ----- listSizes ----- */
+  // Function to return the (ascending) UIDs above after in the examined mailbox with their RFC822.SIZE.
+        std::vector<std::pair<uint32_t, uint32_t>> listSizes(uint32_t after);
+
+  /* ----- fetchBatch ----- */
+  // Function to fetch the messages of uids (ascending) with one UID FETCH and queue them, numbered from sequence on.
+  // Returns false if the queue was cancelled.
+        bool fetchBatch(std::vector<uint32_t> const& uids, uint64_t& sequence, BoundedQueue<Item>& queue);
+
+  /* ----- fetchAttributes ----- */
+  // Function to fetch the UID, flags and INTERNALDATE of a message (an item without UID if it is gone).
+        Item fetchAttributes(uint32_t uid);
+
+  /* ----- streamBody ----- */
+  // Function to fetch the body of a message in ranges of batch_bytes, passing each to write(range, last) as it
+  // arrives. Stops and returns false as soon as write does.
+        bool streamBody(uint32_t uid, std::function<bool(std::string const&, bool)> const& write);
+
+  /* ----- parseItem ----- */
+  // Function to fill an item from the attributes of a fetched message.
+        static Item parseItem(mailimap_msg_att* msg_att);
+
+  /* ----- frameMbox / frameMaildir ----- */
+  // Functions to turn a fetched message into an mboxrd entry (From_ line, >From quoting) or a Maildir file, both
+  // with LF line endings.
+        static void frameMbox(Item& item);
+        static void frameMaildir(Item& item);
+
+  /* ----- fromLine / mboxLines / maildirLines ----- */
+  // Functions to frame a message range by range: the From_ line of an mboxrd entry, and text appended to out as
+  // mboxrd or Maildir lines. What may continue in the next range (an unfinished line, a CR) is kept in partial,
+  // unless last is set.
+        static std::string fromLine(time_t date);
+        static void mboxLines(std::string& partial, std::string_view text, bool last, std::string& out);
+        static void maildirLines(std::string& partial, std::string_view text, bool last, std::string& out);
+
+  /* ----- writeMaildir ----- */
+  // Function to write a message into dir/tmp and move it to dir/cur under its unique name with its flags. The
+  // contents are item.data, or written by contents(fd) if given (returning false on a write error, see errno).
+        void writeMaildir(std::string const& dir, uint32_t uidvalidity, Item const& item,
+                          std::function<bool(int)> const& contents = {});
+
+  /* ----- exportMailbox ----- */
+  // Function to export one mailbox from its checkpoint on.
+        void exportMailbox(std::string const& mailbox);
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // progress is called (on the calling thread and the writers, one at a time) whenever messages were written.
+        Exporter(Session& session, ExportOptions options, std::function<void(ExportProgress const&)> progress = {})
+          : session(session), options(std::move(options)), progress(std::move(progress)) {}
+
+  /* ----- run ----- */
+  // Function to export the given mailboxes, or every selectable one if there are none, and return the totals.
+  // Throws a runtime_error if a mailbox cannot be fetched or written, after checkpointing what was written.
+        ExportProgress run(std::vector<std::string> mailboxes = {});
+};
+}
+
+#endif /* EXPORTER_H */
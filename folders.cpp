@@ -0,0 +1,125 @@
+#include "folders.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <strings.h>
+
+using namespace IMAP;
+using namespace std;
+
+/* ----------------- FolderTree Functions ---------------- */
+/* ----- before ----- */
+bool FolderTree::before(Folder const& a, Folder const& b) {
+  // INBOX and its children come first:
+  auto inbox = [](Folder const& folder) {
+    return strncasecmp(folder.name.c_str(), "INBOX", 5) == 0
+           && (folder.name.size() == 5 || (folder.delimiter && folder.name[5] == folder.delimiter));
+  };
+  if (inbox(a) != inbox(b)) {return inbox(a);}
+  // The delimiter sorts before every other character, so children follow their parent directly:
+  auto key = [](unsigned char c, char delimiter) {return delimiter && c == (unsigned char)delimiter ? 0 : int(c) + 1;};
+  size_t n = min(a.name.size(), b.name.size());
+  for (size_t i = 0; i < n; i++) {
+    int ka = key(a.name[i], a.delimiter), kb = key(b.name[i], b.delimiter);
+    if (ka != kb) {return ka < kb;}
+  }
+  return a.name.size() < b.name.size();
+}
+
+/* ----- assign ----- */
+bool FolderTree::assign(vector<Folder> list) {
+  sort(list.begin(), list.end(), before);
+  bool changed = list.size() != folders.size();
+  for (size_t i = 0; i < list.size(); i++) {
+    Folder& folder = list[i];
+    Folder const* old = find(folder.name);
+    if (!folder.has_status && old && old->has_status) {
+      folder.has_status = true;
+      folder.status = old->status;
+    }
+    changed = changed || !old || old != &folders[i] || old->selectable != folder.selectable
+              || old->has_status != folder.has_status || old->status.messages != folder.status.messages
+              || old->status.unseen != folder.status.unseen || old->status.uidnext != folder.status.uidnext
+              || old->status.uidvalidity != folder.status.uidvalidity;
+  }
+  folders = move(list);
+  return changed;
+}
+
+/* ----- setStatus ----- */
+bool FolderTree::setStatus(string const& name, MailboxStatus const& status) {
+  auto folder = const_cast<Folder*>(find(name));
+  if (!folder) {return false;}
+  bool changed = !folder->has_status || folder->status.messages != status.messages
+                 || folder->status.unseen != status.unseen || folder->status.uidnext != status.uidnext
+                 || folder->status.uidvalidity != status.uidvalidity;
+  folder->has_status = true;
+  folder->status = status;
+  return changed;
+}
+
+/* ----- find ----- */
+Folder const* FolderTree::find(string const& name) const {
+  // The delimiter of the folder we look for is the delimiter of its tree:
+  Folder key;
+  key.name = name;
+  key.delimiter = folders.empty() ? 0 : folders.front().delimiter;
+  auto it = lower_bound(folders.begin(), folders.end(), key, before);
+  if (it != folders.end() && it->name == name) {return &*it;}
+  // Mixed delimiters (several namespaces) break the order, fall back to a scan:
+  for (auto const& folder : folders) {
+    if (folder.name == name) {return &folder;}
+  }
+  return nullptr;
+}
+
+/* ----- depth ----- */
+size_t FolderTree::depth(Folder const& folder) {
+  return folder.delimiter ? count(folder.name.begin(), folder.name.end(), folder.delimiter) : 0;
+}
+
+/* ----- leaf ----- */
+string FolderTree::leaf(Folder const& folder) {
+  size_t last = folder.delimiter ? folder.name.rfind(folder.delimiter) : string::npos;
+  return last == string::npos ? folder.name : folder.name.substr(last + 1);
+}
+
+/* ----- load ----- */
+bool FolderTree::load(string const& path) {
+  // One folder per line: flags, counters, the delimiter as a number and the name (which may contain spaces):
+  ifstream file(path);
+  if (!file) {return false;}
+  vector<Folder> list;
+  string line;
+  while (getline(file, line)) {
+    istringstream in(line);
+    Folder folder;
+    int delimiter;
+    if (!(in >> folder.selectable >> folder.has_status >> folder.status.messages >> folder.status.unseen
+             >> folder.status.uidnext >> folder.status.uidvalidity >> delimiter)) {return false;}
+    folder.delimiter = char(delimiter);
+    in.get();
+    if (!getline(in, folder.name) || folder.name.empty()) {return false;}
+    list.push_back(move(folder));
+  }
+  sort(list.begin(), list.end(), before);
+  folders = move(list);
+  return true;
+}
+
+/* ----- save ----- */
+bool FolderTree::save(string const& path) const {
+  // Write a new file and rename it over the old one, so a reader never sees half a tree:
+  string tmp = path + ".tmp";
+  {
+    ofstream file(tmp, ios::trunc);
+    for (auto const& folder : folders) {
+      file << folder.selectable << " " << folder.has_status << " " << folder.status.messages << " "
+           << folder.status.unseen << " " << folder.status.uidnext << " " << folder.status.uidvalidity << " "
+           << int(folder.delimiter) << " " << folder.name << "\n";
+    }
+    if (!file.flush()) {return false;}
+  }
+  return rename(tmp.c_str(), path.c_str()) == 0;
+}
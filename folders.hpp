@@ -0,0 +1,71 @@
+#ifndef FOLDERS_H
+#define FOLDERS_H
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Struct: MailboxStatus -------------------- */
+// Counters of a mailbox as returned by STATUS.
+struct MailboxStatus {
+        uint32_t messages = 0;
+        uint32_t uidnext = 0;
+        uint32_t uidvalidity = 0;
+        uint32_t unseen = 0;
+};
+
+/* -------------------- Struct: Folder -------------------- */
+// Mailbox on the server as returned by LIST, with its counters once known.
+struct Folder {
+        std::string name;       // full name as the server knows it (modified UTF-7)
+        char delimiter = 0;     // hierarchy delimiter, 0 for a flat namespace
+        bool selectable = true; // false for \Noselect placeholders of the hierarchy
+        bool has_status = false;
+        MailboxStatus status;
+};
+
+/* -------------------- Class: FolderTree -------------------- */
+// The mailboxes of an account in tree order (every folder followed by its children, INBOX first), with their
+// counters. Not thread-safe: the session only changes it on its I/O thread under its lock().
+class FolderTree {
+private:
+        std::vector<Folder> folders;
+
+  /* ----- before ----- */
+  // Function to tell whether a comes before b in tree order.
+        static bool before(Folder const& a, Folder const& b);
+
+public:
+  /* ----- assign ----- */
+  // Function to replace the folders with a fresh listing, keeping the counters of folders the listing has none for.
+  // Returns whether anything changed.
+        bool assign(std::vector<Folder> list);
+
+  /* ----- setStatus ----- */
+  // Function to update the counters of one folder, returns whether they changed (false for an unknown folder).
+        bool setStatus(std::string const& name, MailboxStatus const& status);
+
+  /* ----- find ----- */
+  // Function to return the folder with the given name, nullptr if there is none.
+        Folder const* find(std::string const& name) const;
+
+  /* ----- depth / leaf ----- */
+  // Functions to return how deep a folder is in the hierarchy (0 at the top) and its own name without its parents.
+        static size_t depth(Folder const& folder);
+        static std::string leaf(Folder const& folder);
+
+  /* ----- load / save ----- */
+  // Functions to read the tree from the file at path (false if there is none or it is damaged) and to write it there,
+  // so the tree can be shown before the server has been asked.
+        bool load(std::string const& path);
+        bool save(std::string const& path) const;
+
+  /* ----- accessors ----- */
+        std::vector<Folder> const& list() const {return folders;}
+        size_t size() const {return folders.size();}
+        bool empty() const {return folders.empty();}
+};
+}
+
+#endif /* FOLDERS_H */
@@ -0,0 +1,94 @@
+#include "idle.hpp"
+#include "imaputils.hpp"
+#include <cerrno>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace IMAP;
+using namespace std;
+
+/* ----------------- Idler Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+Idler::Idler(function<mailimap*()> open, function<void(mailimap*)> close, function<void()> changed, unsigned poll_interval)
+  : open(move(open)), close(move(close)), changed(move(changed)), poll_interval(poll_interval) {
+  if (pipe(wake) != 0) {throw runtime_error("Idle Error: Unable to create wake-up pipe.");}
+  thread = std::thread(&Idler::run, this);
+}
+
+/* ----- stop ----- */
+void Idler::stop() {
+  if (!stopping.exchange(true) && wake[1] >= 0) {
+    char c = 0;
+    while (write(wake[1], &c, 1) < 0 && errno == EINTR) {}
+  }
+  if (thread.joinable()) {thread.join();}
+  for (int& fd : wake) {
+    if (fd >= 0) {::close(fd);}
+    fd = -1;
+  }
+}
+
+/* ----- run ----- */
+void Idler::run() {
+  while (!stopping) {
+    mailimap* imap = open();
+    bool ok = false;
+    if (imap) {
+      ok = mailimap_has_idle(imap) ? idle(imap) : poll(imap);
+      close(imap);
+    }
+    // Try again later if the connection could not be opened or was lost:
+    if (!ok && wait(-1, RETRY_INTERVAL) < 0) {return;}
+  }
+}
+
+/* ----- idle ----- */
+bool Idler::idle(mailimap* imap) {
+  uint32_t exists = imap->imap_selection_info ? imap->imap_selection_info->sel_exists : 0;
+  while (!stopping) {
+    if (!succeeded(mailimap_idle(imap))) {return false;}
+    // Sleep until the server sends something, IDLE has to be renewed or we are stopped:
+    wait(mailimap_idle_get_fd(imap), IDLE_TIMEOUT);
+    // DONE makes the server finish the command, so the responses it sent are parsed. They are checked whatever woke
+    // us, since one may have arrived just as IDLE was renewed (and would otherwise only be noticed by the next sync):
+    if (!succeeded(mailimap_idle_done(imap))) {return false;}
+    if (hasChanges(imap, exists) && !stopping) {changed();}
+  }
+  return true;
+}
+
+/* ----- poll ----- */
+bool Idler::poll(mailimap* imap) {
+  uint32_t exists = imap->imap_selection_info ? imap->imap_selection_info->sel_exists : 0;
+  while (wait(-1, poll_interval) == 0) {
+    if (!succeeded(mailimap_noop(imap))) {return false;}
+    if (hasChanges(imap, exists)) {changed();}
+  }
+  return true;
+}
+
+/* ----- wait ----- */
+int Idler::wait(int fd, unsigned seconds) {
+  pollfd fds[2] = {{wake[0], POLLIN, 0}, {fd, POLLIN, 0}};
+  int r;
+  while ((r = ::poll(fds, fd >= 0 ? 2 : 1, seconds * 1000)) < 0 && errno == EINTR) {}
+  if (stopping || (fds[0].revents & POLLIN)) {return -1;}
+  return r > 0 && fds[1].revents ? 1 : 0;
+}
+
+/* ----- hasChanges ----- */
+bool Idler::hasChanges(mailimap* imap, uint32_t& exists) {
+  // New mail changes the EXISTS count, expunged and changed messages come as EXPUNGE and FETCH responses
+  // (anything else, e.g. a server's "* OK still here" keepalive, is ignored):
+  bool changes = false;
+  if (imap->imap_selection_info && imap->imap_selection_info->sel_exists != exists) {
+    exists = imap->imap_selection_info->sel_exists;
+    changes = true;
+  }
+  if (auto info = imap->imap_response_info) {
+    if (info->rsp_expunged && !clist_isempty(info->rsp_expunged)) {changes = true;}
+    if (info->rsp_fetch_list && !clist_isempty(info->rsp_fetch_list)) {changes = true;}
+  }
+  return changes;
+}
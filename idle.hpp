@@ -0,0 +1,67 @@
+#ifndef IDLE_H
+#define IDLE_H
+#include <libetpan/libetpan.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace IMAP {
+
+/* -------------------- Class: Idler -------------------- */
+// Thread watching a mailbox on a dedicated connection: with IDLE the server pushes EXISTS/EXPUNGE/FETCH responses
+// as they happen, without it the connection sends a NOOP every poll interval. Whenever a response shows the
+// mailbox changed, changed() is called (on the idler's thread). Lost connections are reopened after a pause.
+class Idler {
+private:
+        std::function<mailimap*()> open;
+        std::function<void(mailimap*)> close;
+        std::function<void()> changed;
+        unsigned poll_interval;
+        // Self-pipe used by stop() to interrupt a wait:
+        int wake[2] = {-1, -1};
+        std::atomic<bool> stopping{false};
+        std::thread thread;
+
+  /* ----- IDLE_TIMEOUT / RETRY_INTERVAL ----- */
+  // Seconds after which IDLE is restarted (servers may drop connections idle for 30 minutes, RFC 2177), and seconds
+  // to wait before reopening a connection that could not be opened or was lost.
+        static unsigned const IDLE_TIMEOUT = 29 * 60;
+        static unsigned const RETRY_INTERVAL = 30;
+
+  /* ----- run ----- */
+  // Function run by the thread: opens the connection and idles (or polls) on it until stopped.
+        void run();
+
+  /* ----- idle / poll ----- */
+  // Functions to watch an open connection with IDLE or NOOP, returning false if the connection failed.
+        bool idle(mailimap* imap);
+        bool poll(mailimap* imap);
+
+  /* ----- wait ----- */
+  // Function to wait up to seconds for fd (none if negative) to become readable: returns 1 if it did, 0 on
+  // timeout and -1 if stop() was called.
+        int wait(int fd, unsigned seconds);
+
+  /* ----- hasChanges ----- */
+  // Function to check the responses of the last command for changes to the mailbox, exists being the message
+  // count seen so far (updated).
+        static bool hasChanges(mailimap* imap, uint32_t& exists);
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // Starts watching. open() returns a logged in connection with the mailbox selected (or nullptr), close() closes it.
+        Idler(std::function<mailimap*()> open, std::function<void(mailimap*)> close, std::function<void()> changed,
+              unsigned poll_interval = 30);
+        Idler(Idler const&) = delete;
+        Idler& operator=(Idler const&) = delete;
+
+  /* ----- stop ----- */
+  // Function to end the watch (leaving IDLE and closing the connection) and wait for the thread.
+        void stop();
+
+  /* ----- DESTRUCTOR ----- */
+        ~Idler() {stop();}
+};
+}
+
+#endif /* IDLE_H */
@@ -1,131 +1,866 @@
 #include "imap.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <strings.h>
 
 using namespace IMAP;
 using namespace std;
 
 /* ----------------- Session Functions ---------------- */
 /* ----- CONSTRUCTOR ----- */
-Session::Session(function<void()> updateUI) : updateUI(updateUI), mailbox("INBOX"), messages(nullptr), num_msgs(0) {
-  imap_session = mailimap_new(0, nullptr);
+Session::Session(function<void(SyncDelta const&)> updateUI)
+  : imap_session(mailimap_new(0, nullptr)), mailbox("INBOX"), updateUI(updateUI) {
 }
 
 /* ----- login ----- */
 void Session::login(string const& userid, string const& password) {
-  // Define error message and attempt to login:
-  string login_err_str = "Login Error: Unable to log in ";
-  login_err_str += userid; login_err_str += ".\n\nError code: ";
-  // Define error message integer:
-  int login_err_int = mailimap_login(imap_session, userid.c_str(), password.c_str());
-  if (login_err_int == 0) {
-    logged_in = true;
-    check_error(login_err_int, login_err_str);
-  }else {delete this;}
+  // Attempt to login (the caller owns this session, so just report the error, the session may run on our own I/O
+  // thread):
+  check(metrics.time(Metrics::LOGIN, imap_session.get(), [&]() {
+    return mailimap_login(imap_session.get(), userid.c_str(), password.c_str());
+  }), "Login Error: Unable to log in", userid);
+  logged_in = true;
+  this->userid = userid;
+  this->password = password;
+
+  // Retrieve the server capabilities, so extensions (e.g. CONDSTORE) can be detected:
+  capability_data_ptr cap_data;
+  check(metrics.time(Metrics::CAPABILITY, imap_session.get(), [&]() {
+    return mailimap_capability(imap_session.get(), out_ptr(cap_data));
+  }), "Capability Error: Unable to retrieve server capabilities");
+  server_threads = mailimap_has_extension(imap_session.get(), (char*)"THREAD=REFERENCES");
+  server_sort = mailimap_has_extension(imap_session.get(), (char*)"SORT");
+
+  // With QRESYNC, syncs learn expunged UIDs from VANISHED instead of comparing UID lists (enabled before any SELECT):
+  qresync = false;
+  if (mailimap_has_qresync(imap_session.get())) {
+    try {
+      command("ENABLE QRESYNC");
+      qresync = true;
+    } catch (runtime_error const&) {}
+  }
+
+  // Everything from here on (envelopes, bodies) compresses well:
+  if (compression) {
+    compressed = metrics.time(Metrics::COMPRESS, imap_session.get(), [this]() {return traffic.compress(imap_session.get());});
+  }
 }
 
 /* ----- connect ----- */
 void Session::connect(string const& server, size_t port) {
-  // Define error message and attempt to connect:
-  string connect_err = "Connection Error: Unable to connect to ";
-  connect_err += server; connect_err += ".\n\nError code: ";
-  check_error(mailimap_socket_connect(imap_session, server.c_str(), port), connect_err);
+  // Attempt to connect:
+  check(metrics.time(Metrics::CONNECT, nullptr, [&]() {
+    return mailimap_socket_connect(imap_session.get(), server.c_str(), port);
+  }), "Connection Error: Unable to connect to", server);
+  traffic.attach(imap_session.get());
+  this->server = server;
+  this->port = port;
 }
 
 /* ----- selectMailbox ----- */
 void Session::selectMailbox(string const& mb) {
-  mailbox = mb;
-  // Define error message and attempt to select mailbox:
-  string mailbox_err = "Mailbox Error: Unable to select mailbox ";
-  mailbox_err += mailbox; mailbox_err += ".\n\nError code: ";
-  check_error(mailimap_select(imap_session, mailbox.c_str()), mailbox_err);
+  // The idler reads mailbox from its own thread, stop it while the mailbox changes (and the UI reads it under the
+  // lock):
+  stopIdler();
+  {
+    auto guard = lock();
+    mailbox = mb;
+  }
+  // Cached bodies belong to the previous mailbox's UIDs, and so does a prefetch round still under way:
+  body_cache.clear();
+  prefetch_generation++;
+  // Attempt to select mailbox; with CONDSTORE, remember the mailbox's HIGHESTMODSEQ so later syncs only ask for what changed:
+  highest_modseq = 0;
+  check(metrics.time(Metrics::SELECT, imap_session.get(), [this]() {
+    if (qresync || mailimap_has_condstore(imap_session.get())) {
+      return mailimap_select_condstore(imap_session.get(), mailbox.c_str(), &highest_modseq);
+    }
+    return mailimap_select(imap_session.get(), mailbox.c_str());
+  }), "Mailbox Error: Unable to select mailbox", mailbox);
+  uidnext = imap_session->imap_selection_info->sel_uidnext;
+
+  // The SELECT response brings most counters of the mailbox (the store still holds the previous one, so unseen
+  // ones are kept from the last STATUS):
+  updateFolderStatus(selectedStatus(false));
+
+  // Open the on-disk cache of this mailbox for its UIDVALIDITY, the session works without one if it cannot be opened:
+  uint32_t uidvalidity = imap_session->imap_selection_info->sel_uidvalidity;
+  cache.reset();
+  if (!cache_dir.empty()) {
+    try {
+      cache = make_unique<MessageCache>(cache_dir + "/" + cacheName(mailbox), uidvalidity);
+    } catch (runtime_error const&) {cache.reset();}
+  }
+  // The search index is kept next to the cache (or only in memory without one):
+  saveIndex(true);
+  auto guard = lock();
+  index = make_unique<SearchIndex>(cache ? cache_dir + "/" + cacheName(mailbox) + "/search" : "", uidvalidity);
+  index_saved = chrono::steady_clock::now();
+  guard.unlock();
+  startIdler();
+}
+
+/* ----- fetchFolders ----- */
+vector<Folder> Session::fetchFolders() {
+  // Every mailbox with its counters, from one LIST-STATUS or from LIST and pipelined STATUS commands:
+  string const counters = "(MESSAGES UNSEEN UIDNEXT UIDVALIDITY)";
+  vector<Folder> list;
+  vector<string> responses;
+  bool selected = imap_session->imap_selection_info && !mailbox.empty();
+  if (mailimap_has_extension(imap_session.get(), (char*)"LIST-STATUS")) {
+    for (auto& response : exchange({"LIST \"\" \"*\" RETURN (STATUS " + counters + ")"}, true, Metrics::LIST)) {
+      Folder folder;
+      if (parseList(response, folder)) {list.push_back(folder);}
+      else {responses.push_back(move(response));}
+    }
+  }else {
+    list = listMailboxes();
+    vector<string> lines;
+    for (auto const& folder : list) {
+      if (!folder.selectable || (selected && folder.name == mailbox)) {continue;}
+      lines.push_back("STATUS " + quote_string(folder.name) + " " + counters);
+    }
+    responses = pipeline(lines);
+  }
+
+  // Attach the counters to their folders. STATUS must not be sent for the selected mailbox (RFC 3501 6.3.10), its
+  // counters are those of SELECT and the syncs, which also win over what LIST-STATUS said:
+  map<string, MailboxStatus> statuses;
+  for (auto const& response : responses) {
+    string name;
+    MailboxStatus status;
+    if (parseStatus(response, name, status)) {statuses[name] = status;}
+  }
+  if (selected) {statuses[mailbox] = selectedStatus(true);}
+  for (auto& folder : list) {
+    auto it = statuses.find(folder.name);
+    if (it == statuses.end()) {continue;}
+    folder.has_status = true;
+    folder.status = it->second;
+  }
+
+  // Replace the tree, keep it for the next start and tell the UI:
+  auto guard = lock();
+  bool changed = folders.assign(move(list));
+  if (changed && !cache_dir.empty()) {folders.save(cache_dir + "/folders");}
+  vector<Folder> result = folders.list();
+  guard.unlock();
+  if (changed) {notifyFolders();}
+  return result;
+}
+
+/* ----- setCacheDirectory ----- */
+void Session::setCacheDirectory(string const& dir) {
+  cache_dir = dir;
+  auto guard = lock();
+  if (folders.empty()) {folders.load(cache_dir + "/folders");}
+}
+
+/* ----- updateFolderStatus ----- */
+void Session::updateFolderStatus(MailboxStatus const& status) {
+  auto guard = lock();
+  bool changed = folders.setStatus(mailbox, status);
+  guard.unlock();
+  if (changed) {notifyFolders();}
+}
+
+/* ----- notifyFolders ----- */
+void Session::notifyFolders() {
+  if (updateFolders) {ui_queue.post([this]() {updateFolders();});}
+}
+
+/* ----- listMailboxes ----- */
+vector<Folder> Session::listMailboxes() {
+  // Attempt to list every mailbox below the root:
+  list_result_ptr result;
+  check(metrics.time(Metrics::LIST, imap_session.get(), [&]() {
+    return mailimap_list(imap_session.get(), "", "*", out_ptr(result));
+  }), "List Error: Unable to list the mailboxes");
+
+  // Copy the names out, noting the placeholders that cannot be selected:
+  vector<Folder> folders;
+  for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+    auto mb_list = (mailimap_mailbox_list*)clist_content(cur);
+    if (!mb_list->mb_name) {continue;}
+    Folder folder;
+    folder.name = mb_list->mb_name;
+    folder.delimiter = mb_list->mb_delimiter;
+    auto flags = mb_list->mb_flag;
+    folder.selectable = !(flags && flags->mbf_type == MAILIMAP_MBX_LIST_FLAGS_SFLAG
+                          && flags->mbf_sflag == MAILIMAP_MBX_LIST_SFLAG_NOSELECT);
+    folders.push_back(folder);
+  }
+  sort(folders.begin(), folders.end(), [](Folder const& a, Folder const& b) {return a.name < b.name;});
+  return folders;
+}
+
+/* ----- cacheName ----- */
+string Session::cacheName(string const& mb) {
+  // Keep safe characters, escape everything else (including the hierarchy delimiter) as %XX:
+  string name;
+  char const* hex = "0123456789ABCDEF";
+  for (unsigned char c : mb) {
+    if (isalnum(c) || c == '.' || c == '_' || c == '-') {name += c;}
+    else {name += '%'; name += hex[c >> 4]; name += hex[c & 15];}
+  }
+  return name;
 }
 
 /* ----- DESTRUCTOR ----- */
 Session::~Session(){
+  // Stop the idler (which posts syncs) and the I/O thread (a running command is finished, queued ones are dropped):
+  cancelled = true;
+  stopIdler();
+  io.stop();
+  saveIndex(true);
   // Check if logged in:
   if(logged_in) {
     // Delete messages:
-    if (num_msgs!=0) {deleteAll();}
-    else {delete messages[0]; delete [] messages;}
-    // Define logout error message and attempt to log out:
-    string logout_err_str = "Logout Error: Unable to log out.\n\nError code: ";
-    int logout_err_int = mailimap_logout(imap_session);
-    // Inherent bug in code causes 4 to be returned always! Check!
-    if (logout_err_int !=4) {
-      // Check to see if we get a logout error! If so, free!
-      if (logout_err_int != 0){mailimap_free(imap_session);}
-      check_error(logout_err_int, logout_err_str);
-    }
+    deleteAll();
+    // Attempt to log out; a failure cannot be reported from here, and the connection is freed with the session:
+    metrics.time(Metrics::LOGOUT, imap_session.get(), [this]() {return mailimap_logout(imap_session.get());});
   }
-
-  // Free imap_session:
-  mailimap_free(imap_session);
 }
 
 /* ----- getMessages function ----- */
-Message** Session::getMessages() {
-  // Retrieve number of message using getNumMessages:
-  num_msgs = fetchNumMessages(mailbox);
+MessageStore const& Session::getMessages() {
+  // Drop the messages of a previous call, telling the UI they are gone:
+  SyncDelta cleared;
+  for (size_t i = 0; i < store.size(); i++) {cleared.removed.push_back(store.uidAt(i));}
+  deleteAll();
+  if (!cleared.empty()) {notify(cleared);}
 
+  // With an on-disk cache only the envelopes it has not seen yet are fetched:
+  if (cache) {getCachedMessages();}
+  else {
+    // Fetch every message by sequence number, as many as the server last reported for the selected mailbox:
+    uint32_t num_messages = imap_session->imap_selection_info->sel_exists;
+    vector<uint32_t> ids(num_messages);
+    for (uint32_t i = 0; i < num_messages; i++) {ids[i] = i + 1;}
+    fetchChunks(displayOrder(move(ids), false), false);
+  }
+  // The server's threads replace ours, a server that fails to thread leaves them as they are:
+  if (server_threads && !cancelled) {
+    try {fetchThreads();} catch (runtime_error const&) {}
+  }
   
-  // Create a new set, fetch type, fetch attribute and result structure:: 
-  auto set = mailimap_set_new_interval(1,0);//mailimap_set_item to retrieve all messages:  
-  auto fetch_att = mailimap_fetch_att_new_uid();//mailimap_fetch_att
-  auto fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();//empty mailimap_fetch_type
-  clist* result;//result structure for mailimap_fetch function
-
-  // Delare and initialise a counter
-  int count = 0;
-  
-  // Define mailimap_fetch_type_new_fetch_att_list_add error and attempt to add to fetch_type:
-  string fetch_add_err_str = "Fetch Type Error: Unable to add fetch uid attribute to fetch type structure.\n\n Error code: ";
-  // Check to see if we're going to return an error, if so then free:
-  int fetch_add_err_int = mailimap_fetch_type_new_fetch_att_list_add(fetch_type, fetch_att);
-  // Delete if necesssary
-  if (fetch_add_err_int != 0) {mailimap_fetch_type_free(fetch_type); mailimap_set_free(set);}
-  // Call check_error
-  check_error(fetch_add_err_int, fetch_add_err_str);
-
-
-  // Check to see if mailbox is empty, if it is, don't try to fetch!
-  if (num_msgs>0) {
-    // Initialise Session attribute list of Messages of size num_messages+1 (add a nullptr to end):
-    messages = new Message*[num_msgs + 1];
-
-    // Define message retrieval error and attempt to retrieve messages:
-    string get_msgs_err_str = "Message Retrieval Error: Unable to retrieve all messages from mailbox ";
-    get_msgs_err_str += mailbox; get_msgs_err_str += ".\n\nError code: ";
-    // Check to see if we're going to return an error, if so then free:
-    int get_msgs_err_int = mailimap_fetch(imap_session, set, fetch_type, &result);
-    // Check to see if we're goign to return an error, if so then free:
-    if (get_msgs_err_int != 0) {mailimap_fetch_list_free(result); mailimap_fetch_type_free(fetch_type); mailimap_set_free(set);}
-    // Call check_error:
-    check_error(get_msgs_err_int, get_msgs_err_str);
-  
-    // Iterate through result list structure and set messages:
-    clistiter* cur;
-    for(cur = clist_begin(result); cur != nullptr; cur = clist_next(cur)) {
+  saveIndex(false);
+  // Return messages
+  return store;
+}
+
+/* ----- getCachedMessages function ----- */
+void Session::getCachedMessages() {
+  // Store every message we know from disk (straight from the mapped cache) and show them all at once, before
+  // asking the server anything, so switching to a cached mailbox is immediate:
+  SyncDelta delta;
+  {
+    auto guard = lock();
+    cache->forEach([&](uint32_t uid, string_view from, string_view subject, string_view message_id, string_view references,
+                       MessageAttributes const& attributes) {
+      store.add(uid, from, subject, attributes);
+      threads.add(uid, message_id, references);
+      if (!index->contains(uid)) {index->add(uid, from, subject);}
+      delta.added.push_back(uid);
+    });
+    store.sort();
+  }
+  if (!delta.added.empty()) {
+    uidnext = max(uidnext, *max_element(delta.added.begin(), delta.added.end()) + 1);
+    notify(delta);
+  }
+
+  // Retrieve the UIDs currently in the mailbox and drop the cached messages expunged in the meantime:
+  vector<uint32_t> uids = fetchUIDs();
+  SyncDelta expunged;
+  for (auto uid : delta.added) {
+    if (!binary_search(uids.begin(), uids.end(), uid)) {expunged.removed.push_back(uid);}
+  }
+  if (!expunged.empty()) {
+    sort(expunged.removed.begin(), expunged.removed.end());
+    {
+      auto guard = lock();
+      store.remove(expunged.removed);
+      for (auto uid : expunged.removed) {
+        threads.remove(uid);
+        index->remove(uid);
+      }
+    }
+    for (auto uid : expunged.removed) {cache->remove(uid);}
+    notify(expunged);
+  }
+
+  // Collect the UIDs the cache has not seen and fetch their envelopes in large chunks:
+  vector<uint32_t> missing;
+  for (auto uid : uids) {
+    if (!cache->contains(uid)) {missing.push_back(uid);}
+  }
+  fetchChunks(displayOrder(move(missing), true), true);
+}
+
+/* ----- fetchChunks function ----- */
+void Session::fetchChunks(vector<uint32_t> const& ids, bool by_uid) {
+  size_t num_chunks = (ids.size() + FETCH_CHUNK_SIZE - 1) / FETCH_CHUNK_SIZE;
+  if (num_chunks == 0) {return;}
+  auto chunkSet = [&ids](size_t chunk) {
+    // The server answers in ascending order anyway, sorting the chunk compresses its set best:
+    auto first = ids.begin() + chunk * FETCH_CHUNK_SIZE;
+    vector<uint32_t> sorted(first, first + min<size_t>(FETCH_CHUNK_SIZE, ids.end() - first));
+    sort(sorted.begin(), sorted.end());
+    return compressed_set(sorted.data(), sorted.size());
+  };
+
+  // Chunks are handed out in order to whichever connection is free; the pool connections pass their results
+  // back through ready, since only this thread may touch the messages and the on-disk cache:
+  atomic<size_t> next{0};
+  atomic<bool> aborted{false};
+  mutex ready_mutex;
+  condition_variable ready_cv;
+  deque<vector<Envelope>> ready;
+  vector<size_t> failed; // chunks a pool connection could not fetch
+  size_t running = min<size_t>(pool_size, num_chunks) - 1;
+  auto fetch_type = newListFetchType();
+
+  // Start the extra connections, each fetching chunks until none are left:
+  vector<thread> pool;
+  for (size_t i = 0; i < running; i++) {
+    pool.emplace_back([&]() {
+      mailimap* imap = openExtraConnection(true);
+      fetch_type_ptr pool_fetch_type;
+      try {pool_fetch_type = newListFetchType();} catch (runtime_error const&) {}
+      size_t chunk;
+      while (imap && pool_fetch_type && !cancelled && !aborted && (chunk = next++) < num_chunks) {
+        vector<Envelope> list;
+        try {
+          fetchMessageSet(imap, chunkSet(chunk).get(), by_uid, pool_fetch_type.get(), list);
+        } catch (runtime_error const&) {
+          // Leave the chunk to the session connection and stop using this one:
+          lock_guard<mutex> guard(ready_mutex);
+          failed.push_back(chunk);
+          break;
+        }
+        lock_guard<mutex> guard(ready_mutex);
+        ready.push_back(move(list));
+        ready_cv.notify_one();
+      }
+      if (imap) {closeExtraConnection(imap);}
+      lock_guard<mutex> guard(ready_mutex);
+      running--;
+      ready_cv.notify_one();
+    });
+  }
+
+  // Function to merge the chunks the pool has fetched so far, optionally waiting for one (or the end of the pool):
+  auto mergeReady = [&](bool wait) {
+    deque<vector<Envelope>> done;
+    bool finished;
+    {
+      unique_lock<mutex> guard(ready_mutex);
+      if (wait) {ready_cv.wait(guard, [&]() {return running == 0 || !ready.empty();});}
+      done.swap(ready);
+      finished = running == 0;
+    }
+    for (auto& list : done) {addMessages(list);}
+    return finished;
+  };
+
+  // Fetch chunks over the session connection too, merging the pool's results in between:
+  exception_ptr error;
+  try {
+    size_t chunk;
+    while (!cancelled && (chunk = next++) < num_chunks) {
+      vector<Envelope> list;
+      fetchMessageSet(imap_session.get(), chunkSet(chunk).get(), by_uid, fetch_type.get(), list);
+      addMessages(list);
+      mergeReady(false);
+    }
+    while (!mergeReady(true)) {}
+    // Fetch the chunks a pool connection gave up on:
+    for (auto chunk : failed) {
+      if (cancelled) {break;}
+      vector<Envelope> list;
+      fetchMessageSet(imap_session.get(), chunkSet(chunk).get(), by_uid, fetch_type.get(), list);
+      addMessages(list);
+    }
+  } catch (...) {error = current_exception();}
+
+  // Stop and wait for the pool before its shared state goes out of scope:
+  aborted = true;
+  for (auto& connection : pool) {connection.join();}
+  for (auto& list : ready) {
+    if (!error) {addMessages(list);}
+  }
+  if (error) {rethrow_exception(error);}
+}
+
+/* ----- watch function ----- */
+void Session::watch(bool enable, unsigned interval) {
+  watching = enable;
+  poll_interval = interval;
+  startIdler();
+}
+
+/* ----- startIdler function ----- */
+void Session::startIdler() {
+  stopIdler();
+  if (!watching || !logged_in) {return;}
+  // Changes only queue a sync if none is queued yet, so a burst of responses costs a single sync:
+  auto changed = [this]() {
+    if (sync_queued.exchange(true)) {return;}
+    io.post([this]() {
+      sync_queued = false;
+      // A failed sync is left to the next change or a manual refresh:
+      try {sync();} catch (runtime_error const&) {}
+    });
+  };
+  if (engine) {
+    // After a lost connection, changes may have been missed while it was down:
+    AccountConfig account{server, port, userid, password, mailbox};
+    watch_account = engine->add(account, [changed, lost = false](AccountEvent const& event) mutable {
+      if (event.kind == AccountEvent::DISCONNECTED) {lost = true;}
+      else if (event.kind == AccountEvent::CHANGED || lost) {
+        lost = false;
+        changed();
+      }
+    });
+    return;
+  }
+  idler = make_unique<Idler>([this]() {return openExtraConnection();}, [this](mailimap* imap) {closeExtraConnection(imap);},
+                             changed, poll_interval);
+}
+
+/* ----- stopIdler function ----- */
+void Session::stopIdler() {
+  idler.reset();
+  if (engine && watch_account) {engine->remove(watch_account);}
+  watch_account = 0;
+}
+
+/* ----- openExtraConnection function ----- */
+mailimap* Session::openExtraConnection(bool compress) {
+  // Connect, log in and EXAMINE (read-only, so the pool never changes flags or the session's \Recent state):
+  mailimap_ptr connection(mailimap_new(0, nullptr));
+  mailimap* imap = connection.get();
+  int r = metrics.time(Metrics::CONNECT, nullptr, [&]() {return mailimap_socket_connect(imap, server.c_str(), port);});
+  if (!succeeded(r)) {return nullptr;}
+  traffic.attach(imap);
+  r = metrics.time(Metrics::LOGIN, imap, [&]() {return mailimap_login(imap, userid.c_str(), password.c_str());});
+  if (!succeeded(r)) {return nullptr;}
+  if (compress && compressed) {
+    // Compress like the session connection (the capabilities are needed to see COMPRESS=DEFLATE):
+    capability_data_ptr cap_data;
+    if (metrics.time(Metrics::CAPABILITY, imap, [&]() {return mailimap_capability(imap, out_ptr(cap_data));}) == MAILIMAP_NO_ERROR) {
+      metrics.time(Metrics::COMPRESS, imap, [&]() {return traffic.compress(imap);});
+    }
+  }
+  r = metrics.time(Metrics::EXAMINE, imap, [&]() {return mailimap_examine(imap, mailbox.c_str());});
+  if (!succeeded(r)) {closeExtraConnection(connection.release()); return nullptr;}
+  return connection.release();
+}
+
+/* ----- closeExtraConnection function ----- */
+void Session::closeExtraConnection(mailimap* imap) {
+  metrics.time(Metrics::LOGOUT, imap, [imap]() {return mailimap_logout(imap);});
+  mailimap_free(imap);
+}
+
+/* ----- addMessages function ----- */
+void Session::addMessages(vector<Envelope> const& chunk) {
+  if (chunk.empty()) {return;}
+
+  // Add the chunk to the store (a chunk from the pool may land between messages we hold):
+  Metrics::Scope merge(metrics, Metrics::MERGE);
+  merge.setItems(chunk.size());
+  SyncDelta delta;
+  {
+    auto guard = lock();
+    for (auto const& envelope : chunk) {
+      store.add(envelope.uid, envelope.from, envelope.subject, envelope.attributes);
+      threads.add(envelope.uid, envelope.message_id, envelope.references);
+      if (index) {index->add(envelope.uid, envelope.from, envelope.subject);}
+    }
+    store.sort();
+  }
+  for (auto const& envelope : chunk) {
+    if (cache) {
+      cache->add(envelope.uid, envelope.from, envelope.subject, envelope.message_id, envelope.references,
+                 envelope.attributes);
+    }
+    delta.added.push_back(envelope.uid);
+    // Messages arriving from now on have UIDs above the ones we hold:
+    uidnext = max(uidnext, envelope.uid + 1);
+  }
+  notify(delta);
+}
+
+/* ----- notify function ----- */
+void Session::notify(SyncDelta const& delta) {
+  if (updateUI) {ui_queue.post([this, delta]() {updateUI(delta);});}
+}
+
+/* ----- findMessage function ----- */
+optional<Message> Session::findMessage(uint32_t uid) {
+  auto handle = store.find(uid);
+  if (!store.valid(handle)) {return nullopt;}
+  return Message(this, uid, store.from(handle), store.subject(handle), store.attributes(handle));
+}
+
+/* ----- sync function ----- */
+SyncDelta Session::sync(vector<uint32_t> const& expunged) {
+  // Messages the caller already knows to be expunged are removed without asking the server:
+  vector<uint32_t> known;
+  for (auto uid : expunged) {
+    if (store.valid(store.find(uid))) {known.push_back(uid);}
+  }
+  sort(known.begin(), known.end());
+
+  // A NOOP brings whatever the server has to report on the selected mailbox: EXISTS, EXPUNGE (VANISHED with QRESYNC)
+  // and FETCH responses for flags other clients changed:
+  check(metrics.time(Metrics::NOOP, imap_session.get(), [this]() {return mailimap_noop(imap_session.get());}),
+        "Sync Error: Unable to poll mailbox", mailbox);
+  vector<uint32_t> numbers;
+  vector<pair<uint32_t, uint32_t>> vanished;
+  readExpunged(numbers, vanished);
+
+  // The remaining messages in server order (ascending UIDs), which sequence numbers refer to:
+  vector<uint32_t> held, removed(known);
+  held.reserve(store.size());
+  for (size_t i = 0; i < store.size(); i++) {
+    uint32_t uid = store.uidAt(i);
+    if (!binary_search(known.begin(), known.end(), uid)) {held.push_back(uid);}
+  }
+  // Function to take the held UIDs in a range out of held, into removed:
+  auto vanish = [&](pair<uint32_t, uint32_t> const& range) {
+    auto first = lower_bound(held.begin(), held.end(), range.first);
+    auto last = upper_bound(first, held.end(), range.second);
+    removed.insert(removed.end(), first, last);
+    held.erase(first, last);
+  };
+  for (auto const& range : vanished) {vanish(range);}
+  for (auto number : numbers) {
+    // A number past the held messages is one that arrived since the last sync:
+    if (number && number <= held.size()) {vanish({held[number - 1], held[number - 1]});}
+  }
+
+  // Flags changed by others, numbered in server order unless the FETCH carries the UID (with CONDSTORE, CHANGEDSINCE
+  // below asks for all of them anyway):
+  vector<pair<uint32_t, uint32_t>> changed;
+  clist* fetched = imap_session->imap_response_info ? imap_session->imap_response_info->rsp_fetch_list : nullptr;
+  if (!highest_modseq && fetched) {
+    for(clistiter* cur = clist_begin(fetched); cur != nullptr; cur = clist_next(cur)) {
       auto msg_att = (mailimap_msg_att*)clist_content(cur);
       uint32_t uid = fetchUID(msg_att);
-      if (uid) {
-        messages[count] = new Message(this, uid);
-        messages[count]->setMessage();
-        count++;
-      } 
+      if (!uid && numbers.empty() && vanished.empty() && msg_att->att_number && msg_att->att_number <= held.size()) {
+        uid = held[msg_att->att_number - 1];
+      }
+      bool has_flags = false;
+      for(clistiter* att = clist_begin(msg_att->att_list); att != nullptr; att = clist_next(att)) {
+        has_flags = has_flags || ((mailimap_msg_att_item*)clist_content(att))->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC;
+      }
+      if (uid && has_flags && binary_search(held.begin(), held.end(), uid)) {
+        changed.emplace_back(uid, parseEnvelope(uid, msg_att).attributes.flags);
+      }
     }
-    // Free result of fetch
-    mailimap_fetch_list_free(result);
-    messages[count] = nullptr;
-  }else {messages = new Message*[1]; messages[0] = nullptr;}
+  }
 
-  
+  // Fetch the envelopes of messages that arrived since the last sync, if the server holds more than we do or
+  // announced a larger UIDNEXT:
+  uint32_t exists = imap_session->imap_selection_info->sel_exists;
+  uint32_t announced = imap_session->imap_selection_info->sel_uidnext;
+  vector<Envelope> added;
+  if (exists > held.size() || announced > uidnext) {
+    set_ptr set(mailimap_set_new_interval(uidnext, 0));
+    fetchMessageSet(imap_session.get(), set.get(), true, newListFetchType().get(), added);
+    // "uidnext:*" always matches the last message, even if its UID is below uidnext:
+    added.erase(remove_if(added.begin(), added.end(), [this](Envelope const& m) {return m.uid < uidnext;}), added.end());
+    for (auto const& envelope : added) {uidnext = max(uidnext, envelope.uid + 1);}
+    uidnext = max(uidnext, announced);
+  }
 
-  // Free associated data structures:
-  mailimap_fetch_type_free(fetch_type);
-  mailimap_set_free(set);
-  
-  // Return messages
-  return messages;
+  // With CONDSTORE, ask for messages whose flags changed since the last sync, with QRESYNC also for the UIDs
+  // expunged since:
+  if (highest_modseq) {
+    vanished.clear();
+    auto flags = fetchChangedFlags(qresync ? &vanished : nullptr);
+    for (auto const& range : vanished) {vanish(range);}
+    for (auto const& [uid, value] : flags) {
+      if (binary_search(held.begin(), held.end(), uid)) {changed.emplace_back(uid, value);}
+    }
+  }
+
+  // If the remaining and the new messages do not add up to the message count (as the last response left it),
+  // expunges went unreported or were numbered against messages we no longer hold: compare UID lists instead.
+  if (held.size() + added.size() != imap_session->imap_selection_info->sel_exists) {
+    vector<uint32_t> uids = fetchUIDs();
+    removed = known;
+    held.clear();
+    for (size_t i = 0; i < store.size(); i++) {
+      uint32_t uid = store.uidAt(i);
+      if (binary_search(known.begin(), known.end(), uid)) {continue;}
+      if (binary_search(uids.begin(), uids.end(), uid)) {held.push_back(uid);}
+      else {removed.push_back(uid);}
+    }
+  }
+  SyncDelta delta;
+  delta.removed = move(removed);
+  sort(delta.removed.begin(), delta.removed.end());
+  sort(changed.begin(), changed.end());
+  changed.erase(unique(changed.begin(), changed.end(), [](auto const& a, auto const& b) {return a.first == b.first;}),
+                changed.end());
+
+  // Apply the delta to the store and the caches:
+  auto guard = lock();
+  store.remove(delta.removed);
+  for (auto uid : delta.removed) {
+    body_cache.erase(uid);
+    threads.remove(uid);
+    if (cache) {cache->remove(uid);}
+    if (index) {index->remove(uid);}
+  }
+  for (auto const& [uid, flags] : changed) {
+    if (!binary_search(held.begin(), held.end(), uid)) {continue;}
+    delta.changed.push_back(uid);
+    store.setFlags(uid, flags);
+    if (cache) {cache->setFlags(uid, flags);}
+  }
+  for (auto const& envelope : added) {
+    store.add(envelope.uid, envelope.from, envelope.subject, envelope.attributes);
+    threads.add(envelope.uid, envelope.message_id, envelope.references);
+    if (index) {index->add(envelope.uid, envelope.from, envelope.subject);}
+    if (cache) {
+      cache->add(envelope.uid, envelope.from, envelope.subject, envelope.message_id, envelope.references,
+                 envelope.attributes);
+    }
+    delta.added.push_back(envelope.uid);
+  }
+  store.sort();
+  guard.unlock();
+  saveIndex(false);
+  updateFolderStatus(selectedStatus(true));
+
+  // Update UI:
+  if (!delta.empty()) {notify(delta);}
+  return delta;
+}
+
+/* ----- fetchChangedFlags function ----- */
+vector<pair<uint32_t, uint32_t>> Session::fetchChangedFlags(vector<pair<uint32_t, uint32_t>>* vanished) {
+  // Create a set of all messages and a fetch type with just the UID and flags:
+  set_ptr set(mailimap_set_new_interval(1, 0));
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_uid(), mailimap_fetch_att_new_flags()});
+
+  // Attempt to fetch the messages changed since highest_modseq (and, with VANISHED, the UIDs expunged since):
+  fetch_list_ptr result;
+  qresync_vanished_ptr earlier;
+  check(metrics.time(Metrics::FETCH_CHANGED, imap_session.get(), [&]() {
+    if (vanished) {
+      return mailimap_uid_fetch_qresync(imap_session.get(), set.get(), fetch_type.get(), highest_modseq, out_ptr(result),
+                                        out_ptr(earlier));
+    }
+    return mailimap_uid_fetch_changedsince(imap_session.get(), set.get(), fetch_type.get(), highest_modseq, out_ptr(result));
+  }), "Message Retrieval Error: Unable to retrieve changed messages from mailbox", mailbox);
+
+  // Collect the UIDs with their flags, and the new highest modification sequence:
+  vector<pair<uint32_t, uint32_t>> changed;
+  for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+    auto msg_att = (mailimap_msg_att*)clist_content(cur);
+    uint32_t uid = fetchUID(msg_att);
+    if (uid) {changed.emplace_back(uid, parseEnvelope(uid, msg_att).attributes.flags);}
+    highest_modseq = max(highest_modseq, fetchModSeq(msg_att));
+  }
+  sort(changed.begin(), changed.end());
+  if (vanished && earlier && earlier->qr_known_uids) {
+    for(clistiter* cur = clist_begin(earlier->qr_known_uids->set_list); cur != nullptr; cur = clist_next(cur)) {
+      auto item = (mailimap_set_item*)clist_content(cur);
+      vanished->emplace_back(min(item->set_first, item->set_last), max(item->set_first, item->set_last));
+    }
+  }
+  return changed;
+}
+
+/* ----- readExpunged function ----- */
+void Session::readExpunged(vector<uint32_t>& numbers, vector<pair<uint32_t, uint32_t>>& vanished) {
+  auto info = imap_session->imap_response_info;
+  if (!info) {return;}
+  if (info->rsp_expunged) {
+    for(clistiter* cur = clist_begin(info->rsp_expunged); cur != nullptr; cur = clist_next(cur)) {
+      numbers.push_back(*(uint32_t*)clist_content(cur));
+    }
+  }
+  if (!info->rsp_extension_list) {return;}
+  for(clistiter* cur = clist_begin(info->rsp_extension_list); cur != nullptr; cur = clist_next(cur)) {
+    auto ext = (mailimap_extension_data*)clist_content(cur);
+    if (ext->ext_extension != &mailimap_extension_qresync || ext->ext_type != MAILIMAP_QRESYNC_TYPE_VANISHED) {continue;}
+    auto response = (mailimap_qresync_vanished*)ext->ext_data;
+    if (!response || !response->qr_known_uids) {continue;}
+    for(clistiter* item_cur = clist_begin(response->qr_known_uids->set_list); item_cur != nullptr; item_cur = clist_next(item_cur)) {
+      auto item = (mailimap_set_item*)clist_content(item_cur);
+      uint32_t first = min(item->set_first, item->set_last), last = max(item->set_first, item->set_last);
+      vanished.emplace_back(first, last);
+      // VANISHED (EARLIER) answers a command, only a plain VANISHED takes messages out of the count:
+      auto& exists = imap_session->imap_selection_info->sel_exists;
+      if (!response->qr_earlier) {exists -= min<uint64_t>(exists, uint64_t(last) - first + 1);}
+    }
+  }
+}
+
+/* ----- selectedStatus function ----- */
+MailboxStatus Session::selectedStatus(bool count_unseen) {
+  MailboxStatus status;
+  {
+    auto guard = lock();
+    if (auto folder = folders.find(mailbox)) {status = folder->status;}
+  }
+  status.messages = imap_session->imap_selection_info->sel_exists;
+  status.uidnext = max(uidnext, imap_session->imap_selection_info->sel_uidnext);
+  status.uidvalidity = imap_session->imap_selection_info->sel_uidvalidity;
+  if (count_unseen && store.size() == status.messages) {
+    status.unseen = 0;
+    for (size_t i = 0; i < store.size(); i++) {
+      status.unseen += !(store.attributes(store.at(i)).flags & MessageAttributes::SEEN);
+    }
+  }
+  return status;
+}
+
+/* ----- parseFlags function ----- */
+uint32_t Session::parseFlags(mailimap_msg_att_dynamic* dynamic) {
+  uint32_t flags = 0;
+  if (!dynamic || !dynamic->att_list) {return flags;}
+  for(clistiter* cur = clist_begin(dynamic->att_list); cur != NULL; cur = clist_next(cur)) {
+    auto flag_fetch = (mailimap_flag_fetch*)clist_content(cur);
+    if (flag_fetch->fl_type == MAILIMAP_FLAG_FETCH_OTHER && flag_fetch->fl_flag) {
+      switch (flag_fetch->fl_flag->fl_type) {
+        case MAILIMAP_FLAG_SEEN: flags |= MessageAttributes::SEEN; break;
+        case MAILIMAP_FLAG_ANSWERED: flags |= MessageAttributes::ANSWERED; break;
+        case MAILIMAP_FLAG_FLAGGED: flags |= MessageAttributes::FLAGGED; break;
+        case MAILIMAP_FLAG_DELETED: flags |= MessageAttributes::DELETED; break;
+        case MAILIMAP_FLAG_DRAFT: flags |= MessageAttributes::DRAFT; break;
+        default: break;
+      }
+    }
+  }
+  return flags;
+}
+
+/* ----- fetchUIDs function ----- */
+vector<uint32_t> Session::fetchUIDs() {
+  // Declare a search key matching every message and attempt to search:
+  search_key_ptr key(mailimap_search_key_new_all());
+  search_result_ptr result;
+  check(metrics.time(Metrics::SEARCH, imap_session.get(), [&]() {
+    return mailimap_uid_search(imap_session.get(), NULL, key.get(), out_ptr(result));
+  }), "Search Error: Unable to retrieve the UIDs of mailbox", mailbox);
+
+  // Copy the UIDs out of the result list:
+  vector<uint32_t> uids;
+  uids.reserve(clist_count(result.get()));
+  for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+    uids.push_back(*(uint32_t*)clist_content(cur));
+  }
+  sort(uids.begin(), uids.end());
+  return uids;
+}
+
+/* ----- newListFetchType function ----- */
+fetch_type_ptr Session::newListFetchType() {
+  // The UID and envelope, and what the sort orders need besides:
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_uid(), mailimap_fetch_att_new_envelope(),
+                                    mailimap_fetch_att_new_internaldate(), mailimap_fetch_att_new_rfc822_size(),
+                                    mailimap_fetch_att_new_flags()});
+  // Threading ourselves needs the whole References chain, the envelope only has In-Reply-To:
+  if (!server_threads) {
+    clist* headers = clist_new();
+    clist_append(headers, strdup("References"));
+    auto section = mailimap_section_new_header_fields(mailimap_header_list_new(headers));
+    add_fetch_att(fetch_type.get(), fetch_att_ptr(mailimap_fetch_att_new_body_peek_section(section)));
+  }
+  return fetch_type;
+}
+
+/* ----- fetchThreads function ----- */
+void Session::fetchThreads() {
+  // One untagged THREAD response holds the whole mailbox:
+  for (auto const& response : exchange({"UID THREAD REFERENCES UTF-8 ALL"}, true, Metrics::THREAD)) {
+    auto guard = lock();
+    if (!threads.assign(response)) {continue;}
+    guard.unlock();
+    // Nothing was added or removed, an empty delta just makes the UI show the new order:
+    notify(SyncDelta());
+    return;
+  }
+}
+
+/* ----- displayOrder function ----- */
+vector<uint32_t> Session::displayOrder(vector<uint32_t> ids, bool by_uid) {
+  MessageStore::SortKey key = sort_key;
+  bool descending = sort_descending;
+  // UID (and sequence number) order needs no server, a single chunk is shown at once whatever its order:
+  if (key != MessageStore::BY_UID && server_sort && ids.size() > FETCH_CHUNK_SIZE) {
+    static char const* const CRITERIA[MessageStore::SORT_KEYS] = {"", "ARRIVAL", "FROM", "SUBJECT", "SIZE"};
+    string line = string(by_uid ? "UID " : "") + "SORT (" + (descending ? "REVERSE " : "") + CRITERIA[key] + ") UTF-8 ALL";
+    vector<uint32_t> sorted;
+    try {
+      for (auto const& response : exchange({line}, true, Metrics::SORT)) {
+        if (response.compare(0, 4, "SORT") != 0) {continue;}
+        // "SORT 3 1 2", keeping only the ids asked for (others may have arrived since):
+        string_view s = string_view(response).substr(4);
+        while (!s.empty()) {
+          while (!s.empty() && s.front() == ' ') {s.remove_prefix(1);}
+          uint32_t id = 0;
+          while (!s.empty() && s.front() >= '0' && s.front() <= '9') {
+            id = id * 10 + (s.front() - '0');
+            s.remove_prefix(1);
+          }
+          if (binary_search(ids.begin(), ids.end(), id)) {sorted.push_back(id);}
+          if (!s.empty() && s.front() != ' ') {break;}
+        }
+      }
+    } catch (runtime_error const&) {sorted.clear();}
+    if (!sorted.empty()) {
+      // Ids the server left out (e.g. expunged meanwhile) are fetched last:
+      vector<uint32_t> seen(sorted);
+      sort(seen.begin(), seen.end());
+      for (auto id : ids) {
+        if (!binary_search(seen.begin(), seen.end(), id)) {sorted.push_back(id);}
+      }
+      return sorted;
+    }
+  }
+  // UIDs follow arrival, so newest first is the one order known without the envelopes:
+  if (descending && (key == MessageStore::BY_UID || key == MessageStore::BY_DATE)) {reverse(ids.begin(), ids.end());}
+  return ids;
+}
+
+/* ----- fetchMessageSet function ----- */
+void Session::fetchMessageSet(mailimap* imap, mailimap_set* set, bool by_uid, mailimap_fetch_type* fetch_type, vector<Envelope>& list) {
+  // Attempt to retrieve the chunk:
+  fetch_list_ptr result;
+  int r;
+  {
+    Metrics::Scope fetch(metrics, Metrics::FETCH_LIST, imap);
+    r = by_uid ? mailimap_uid_fetch(imap, set, fetch_type, out_ptr(result))
+               : mailimap_fetch(imap, set, fetch_type, out_ptr(result));
+    if (r == MAILIMAP_NO_ERROR) {fetch.setItems(clist_count(result.get()));}
+  }
+  check(r, "Message Retrieval Error: Unable to retrieve all messages from mailbox", mailbox);
+
+  // Iterate through result list structure and fill every message from the one response:
+  Metrics::Scope parse(metrics, Metrics::PARSE);
+  parse.setItems(clist_count(result.get()));
+  for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+    auto msg_att = (mailimap_msg_att*)clist_content(cur);
+    uint32_t uid = fetchUID(msg_att);
+    if (uid) {list.push_back(parseEnvelope(uid, msg_att));}
+  }
 }
 
 /* ----- fetchUID function ----- */
@@ -146,137 +881,786 @@ uint32_t Session::fetchUID(struct mailimap_msg_att* msg_att) {
   return 0;
 }
 
-/* ----- fetchNumMessages function ----- */
-uint32_t Session::fetchNumMessages(string mb = "INBOX") {
-  // Declare sa_list variable and define as void:
-  auto sa_list = mailimap_status_att_list_new_empty(); // mailimap_status_att_list*
-  // Declare a result structure:
-  mailimap_mailbox_data_status* result; // mailimap_mailbox_data_status*
-
-  // Define fetch type add  error and attempt to add MAILIMAP_STATUS_ATT_MESSAGES attribute to sa_list,
-  // i.e. we want the number of messages!
-  string status_add_err_str = "Fetch Type Error: Unable to add MAILIMAP_STATUS_ATT_MESSAGES to status attribute structure while getting number of messages in mailbox ";
-  status_add_err_str += mailbox; status_add_err_str += ".\n\n Error code: ";
-  int status_add_err_int = mailimap_status_att_list_add(sa_list, MAILIMAP_STATUS_ATT_MESSAGES);
-  // Check to see if error, if so then free:
-  if (status_add_err_int != 0) {mailimap_status_att_list_free(sa_list);}
-  // Call check_error:
-  check_error(status_add_err_int, status_add_err_str);
-  
-  // Define mailbox status error and attempt to retrieve status of mailbox using sa_list and storing in result (passed by reference as input **):
-  string mailbox_st_err_str = "Mailbox Status Error: Unable to retrieve number of message in  mailbox ";
-  mailbox_st_err_str += mb; mailbox_st_err_str += ".\n\nError code: ";
-  int mailbox_st_err_int =  mailimap_status(imap_session, mailbox.c_str(), sa_list, &result);
-  if(mailbox_st_err_int != 0) {mailimap_status_att_list_free(sa_list); mailimap_mailbox_data_status_free(result);}
-  // Call check_error
-  check_error(mailbox_st_err_int, mailbox_st_err_str);
-
-  // Declare and define info to store the mailimap_status_info-typecasted-first-element of result's info list: 
-  auto info = (struct mailimap_status_info*)clist_content(clist_begin(result->st_info_list));
-  // Declare and set number of messages num_messages from info structure:
-  uint32_t  num_messages = info->st_value;
-  
-  // Free sa_list and result:
-  mailimap_status_att_list_free(sa_list);
-  mailimap_mailbox_data_status_free(result);
+/* ----- fetchModSeq function ----- */
+uint64_t Session::fetchModSeq(struct mailimap_msg_att* msg_att) {
+  // Iterate over the attributes looking for the CONDSTORE MODSEQ extension item:
+  for(clistiter* cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
+    auto item = (mailimap_msg_att_item*)clist_content(cur);
+    if (item->att_type != MAILIMAP_MSG_ATT_ITEM_EXTENSION) {continue;}
+    auto ext = item->att_data.att_extension_data;
+    if (ext->ext_extension != &mailimap_extension_condstore || ext->ext_type != MAILIMAP_CONDSTORE_TYPE_FETCH_DATA) {continue;}
+    return ((mailimap_condstore_fetch_mod_resp*)ext->ext_data)->cs_modseq_value;
+  }
+  // Return 0 otherwise:
+  return 0;
+}
+
+/* ----- fetchStatus function ----- */
+MailboxStatus Session::fetchStatus(string const& mb) {
+  // Declare a status attribute list asking for the MESSAGES, UIDNEXT, UIDVALIDITY and UNSEEN attributes:
+  status_att_list_ptr sa_list(mailimap_status_att_list_new_empty());
+  for (int att : {MAILIMAP_STATUS_ATT_MESSAGES, MAILIMAP_STATUS_ATT_UIDNEXT, MAILIMAP_STATUS_ATT_UIDVALIDITY, MAILIMAP_STATUS_ATT_UNSEEN}) {
+    check(mailimap_status_att_list_add(sa_list.get(), att),
+          "Fetch Type Error: Unable to add attributes to status attribute structure while getting the status of mailbox", mb);
+  }
+
+  // Attempt to retrieve status of mailbox using sa_list:
+  mailbox_data_status_ptr result;
+  check(metrics.time(Metrics::STATUS, imap_session.get(), [&]() {
+    return mailimap_status(imap_session.get(), mb.c_str(), sa_list.get(), out_ptr(result));
+  }), "Mailbox Status Error: Unable to retrieve the status of mailbox", mb);
+
+  // Copy every returned counter into status:
+  MailboxStatus status;
+  for(clistiter* cur = clist_begin(result->st_info_list); cur != nullptr; cur = clist_next(cur)) {
+    auto info = (struct mailimap_status_info*)clist_content(cur);
+    switch (info->st_att) {
+    case MAILIMAP_STATUS_ATT_MESSAGES: status.messages = info->st_value; break;
+    case MAILIMAP_STATUS_ATT_UIDNEXT: status.uidnext = info->st_value; break;
+    case MAILIMAP_STATUS_ATT_UIDVALIDITY: status.uidvalidity = info->st_value; break;
+    case MAILIMAP_STATUS_ATT_UNSEEN: status.unseen = info->st_value; break;
+    }
+  }
 
   // Return value:
-  return num_messages;
+  return status;
 }
 
-/* ----- deleteAllBut ----- */
-void Session::deleteAllBut(uint32_t uid) {
-  for(int count = 0; count < num_msgs; count++) {
-    if (messages[count]->getUID() != uid) {delete messages[count];}
+/* ----- fetchBody ----- */
+string Session::fetchBody(uint32_t uid) {
+  // Check the body cache first, then the on-disk cache:
+  if (auto cached = body_cache.get(uid)) {return *cached;}
+  string body;
+  if (cache && cache->getBody(uid, body)) {
+    body_cache.put(uid, body);
+    indexBody(uid, body);
+    return body;
+  }
+
+  // Declare and initialise a new set and a fetch type for the body section:
+  set_ptr set(mailimap_set_new_single(uid));
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_body_section(mailimap_section_new(NULL))});
+
+  // Attempt to fetch the body:
+  fetch_list_ptr result;
+  check(metrics.time(Metrics::FETCH_BODY, imap_session.get(), [&]() {
+    return mailimap_uid_fetch(imap_session.get(), set.get(), fetch_type.get(), out_ptr(result));
+  }, 1), "UID Fetch Error: Unable to fetch body of message with UID", uid);
+
+  // Extract the body section from the result (the message's own response, others are unsolicited):
+  bool found = false;
+  for(clistiter* response = clist_begin(result.get()); response != NULL; response = clist_next(response)) {
+    auto msg_att = (mailimap_msg_att*)clist_content(response);
+    if (fetchUID(msg_att) != uid) {continue;}
+    for(clistiter* cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
+      auto item = (mailimap_msg_att_item*)clist_content(cur);
+      if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+      if (item->att_data.att_static->att_type != MAILIMAP_MSG_ATT_BODY_SECTION) {continue;}
+      auto section = item->att_data.att_static->att_data.att_body_section;
+      if (section->sec_body_part) {body.assign(section->sec_body_part, section->sec_length);}
+      found = true;
+    }
   }
-  delete [] messages;
+  // Without a body the message was expunged meanwhile, which must not be cached as an empty body:
+  if (!found) {check(MAILIMAP_ERROR_FETCH, "UID Fetch Error: No body returned for message with UID", uid);}
+
+  // Cache, index and return the body:
+  if (cache) {cache->putBody(uid, body);}
+  body_cache.put(uid, body);
+  indexBody(uid, body);
+  return body;
 }
 
-/* ----- deleteAll ----- */
-void Session::deleteAll() {
-  for(int count = 0; count < num_msgs; count++) {
-    delete messages[count];
+/* ----- fetchPartial ----- */
+BodyRange Session::fetchPartial(uint32_t uid, section_ptr section, uint32_t offset, uint32_t length, bool with_size) {
+  // Declare and initialise a new set and a fetch type for the partial body section (with the size if asked for, to
+  // know where the body ends):
+  BodyRange range;
+  range.offset = offset;
+  set_ptr set(mailimap_set_new_single(uid));
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_body_peek_section_partial(section.release(), offset, length)});
+  if (with_size) {add_fetch_att(fetch_type.get(), fetch_att_ptr(mailimap_fetch_att_new_rfc822_size()));}
+
+  // Attempt to fetch the range:
+  fetch_list_ptr result;
+  check(metrics.time(Metrics::FETCH_RANGE, imap_session.get(), [&]() {
+    return mailimap_uid_fetch(imap_session.get(), set.get(), fetch_type.get(), out_ptr(result));
+  }, 1), "UID Fetch Error: Unable to fetch body of message with UID", uid);
+
+  // Extract the size and the body section from the result (the message's own response, others are unsolicited):
+  bool found = false;
+  for(clistiter* response = clist_begin(result.get()); response != NULL; response = clist_next(response)) {
+    auto msg_att = (mailimap_msg_att*)clist_content(response);
+    if (fetchUID(msg_att) != uid) {continue;}
+    for(clistiter* cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
+      auto item = (mailimap_msg_att_item*)clist_content(cur);
+      if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+      auto att = item->att_data.att_static;
+      if (att->att_type == MAILIMAP_MSG_ATT_RFC822_SIZE) {range.size = att->att_data.att_rfc822_size;}
+      else if (att->att_type == MAILIMAP_MSG_ATT_BODY_SECTION) {
+        if (att->att_data.att_body_section->sec_body_part) {
+          range.data.assign(att->att_data.att_body_section->sec_body_part, att->att_data.att_body_section->sec_length);
+        }
+        found = true;
+      }
+    }
   }
-  delete [] messages;
+  // Without a section the message was expunged meanwhile, an empty range would pass for the end of its body:
+  if (!found) {check(MAILIMAP_ERROR_FETCH, "UID Fetch Error: No body returned for message with UID", uid);}
+  // A short range ends the body (or section), whatever RFC822.SIZE said. Without the size (a section has none), a
+  // full range only tells that more may follow:
+  if (range.data.size() < length) {range.size = offset + range.data.size();}
+  else if (!with_size) {range.size = UINT32_MAX;}
+  else if (range.size < offset + range.data.size()) {range.size = offset + range.data.size();}
+  return range;
 }
 
-/* ----------------- Message Functions ---------------- */
-/* ----- setMessage ----- */
-void Message::setMessage() {
-  // Declare and initialise a new set variable with a single message:
-  auto set =  mailimap_set_new_single(uid); // mailimap_set*
-  // Declare and initialise a new fetch_env variable::
-  auto env_att = mailimap_fetch_att_new_envelope(); // mailimap_fetch_att*
-  // Define new section to retrieve message body:
-  auto section = mailimap_section_new(NULL); // mailimap_section*
-  auto body_att = mailimap_fetch_att_new_body_section(section); // mailimap_fetch_att*
-  // Declare and initialise a new empty fetch_type:
-  auto fetch_type = mailimap_fetch_type_new_fetch_att_list_empty(); // mailimap_fetch_type*
-  // Declare and initialise a new clist item to store the results of mailimap_uid_fetch of type mailimap_msg_att:
-  clist* result;
- 
-  // Define mailimap_fetch_type_new_fetch_att_list_add error and attempt to add to fetch_type:
-  string fetch_add_env_err = "Fetch Type Error: Unable to add env_att to fetch type structure in setMessage.\n\nError code: ";
-  check_error(mailimap_fetch_type_new_fetch_att_list_add(fetch_type, env_att), fetch_add_env_err);
-
-  // Define mailimap_fetch_type_new_fetch_att_list_add error and attempt to add to fetch_type:
-  string fetch_add_body_err = "Fetch Type Error: Unable to add body_att to fetch type structure in setMessage.\n\nError code: ";
-  check_error(mailimap_fetch_type_new_fetch_att_list_add(fetch_type, body_att), fetch_add_body_err);
-
-  // Define mailimap_uid_fetch error and attempt to fetch message attributes:
-  string fetch_uid_err = "UID Fetch Error: Unable to fetch message attributes for message with UID ";
-  fetch_uid_err += uid; fetch_uid_err += ".\n\nError code: ";
-  check_error(mailimap_uid_fetch(session->getIMAP(), set, fetch_type, &result), fetch_uid_err);
-
-  // Extract message attributes from result (should be a single message):
-  auto msg_att = (mailimap_msg_att*)clist_content(clist_begin(result));
-
-  // Use setMessageFields to set all the message attributes:
-  setMessageFields(msg_att);
-  
-  // Free set, env_att, body_att, section, fetch_type and result:
-  mailimap_set_free(set);
-  //mailimap_fetch_att_free(env_att);
-  //mailimap_fetch_att_free(body_att);
-  //mailimap_section_free(section);
-  mailimap_fetch_type_free(fetch_type);
-  mailimap_fetch_list_free(result);
+/* ----- fetchBodyRange ----- */
+BodyRange Session::fetchBodyRange(uint32_t uid, uint32_t offset, uint32_t length) {
+  // Check the body cache first, then the on-disk cache (which only reads the range):
+  BodyRange range;
+  range.offset = offset;
+  if (auto cached = body_cache.get(uid)) {
+    range.size = cached->size();
+    if (offset < range.size) {range.data = cached->substr(offset, length);}
+    return range;
+  }
+  if (cache && cache->getBodyRange(uid, offset, length, range.data, range.size)) {return range;}
+
+  range = fetchPartial(uid, section_ptr(mailimap_section_new(NULL)), offset, length, true);
+
+  // The whole body came in one range, cache and index it as fetchBody would:
+  if (offset == 0 && range.complete()) {
+    if (cache) {cache->putBody(uid, range.data);}
+    body_cache.put(uid, range.data);
+    indexBody(uid, range.data);
+  }
+  return range;
+}
+
+/* ----- prefetchBodies ----- */
+void Session::prefetchBodies(vector<uint32_t> uids) {
+  uint64_t generation = ++prefetch_generation;
+  if (uids.empty() || !prefetch_rate) {return;}
+  io.postIdle([this, generation, uids]() {prefetchBatch(generation, uids, 0, 0);});
+}
+
+/* ----- prefetchBatch ----- */
+void Session::prefetchBatch(uint64_t generation, vector<uint32_t> const& uids, size_t next, size_t fetched) {
+  // The cursor has moved on (or the mailbox changed) since the round was queued:
+  if (generation != prefetch_generation) {return;}
+
+  // Refill the token bucket, which holds at most PREFETCH_BURST seconds of downloads:
+  auto now = chrono::steady_clock::now();
+  double rate = prefetch_rate;
+  prefetch_tokens = min(rate * PREFETCH_BURST,
+                        prefetch_tokens + rate * chrono::duration<double>(now - prefetch_refilled).count());
+  prefetch_refilled = now;
+
+  // Pick the next bodies that are neither cached nor too large, while the round and the bucket have room for them
+  // (sizes are RFC822.SIZE, an unknown one counts as the largest allowed):
+  size_t round_budget = body_cache.getBudget() / PREFETCH_SHARE;
+  vector<uint32_t> batch;
+  size_t batch_bytes = 0;
+  {
+    auto guard = lock();
+    for (; next < uids.size() && batch.size() < PREFETCH_BATCH; next++) {
+      uint32_t uid = uids[next];
+      auto message = store.find(uid);
+      if (!store.valid(message) || body_cache.contains(uid) || (cache && cache->hasBody(uid))) {continue;}
+      size_t size = store.attributes(message).size;
+      if (size > PREFETCH_MAX_BODY) {continue;}
+      if (!size) {size = PREFETCH_MAX_BODY;}
+      if (fetched + batch_bytes + size > round_budget || batch_bytes + size > prefetch_tokens) {
+        next = uids.size();
+        break;
+      }
+      batch.push_back(uid);
+      batch_bytes += size;
+    }
+  }
+  if (batch.empty()) {return;}
+  prefetch_tokens -= batch_bytes;
+
+  // Fetch the batch with a single UID FETCH, peeking so nothing is marked \Seen, then cache and index the bodies as
+  // fetchBody would (unsolicited FETCH responses, e.g. flag changes, have none, and a NIL body is left uncached).
+  // Prefetching is only a guess, a failure (of the server, or of the disk cache) ends the round and the message is
+  // fetched when it is opened:
+  sort(batch.begin(), batch.end());
+  try {
+    fetch_list_ptr result;
+    auto set = compressed_set(batch.data(), batch.size());
+    auto fetch_type = new_fetch_type({mailimap_fetch_att_new_uid(),
+                                      mailimap_fetch_att_new_body_peek_section(mailimap_section_new(NULL))});
+    check(metrics.time(Metrics::PREFETCH, imap_session.get(), [&]() {
+      return mailimap_uid_fetch(imap_session.get(), set.get(), fetch_type.get(), out_ptr(result));
+    }, batch.size()), "UID Fetch Error: Unable to prefetch bodies from mailbox", mailbox);
+
+    for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+      auto msg_att = (mailimap_msg_att*)clist_content(cur);
+      uint32_t uid = fetchUID(msg_att);
+      if (!binary_search(batch.begin(), batch.end(), uid)) {continue;}
+      for(clistiter* att = clist_begin(msg_att->att_list); att != nullptr; att = clist_next(att)) {
+        auto item = (mailimap_msg_att_item*)clist_content(att);
+        if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+        if (item->att_data.att_static->att_type != MAILIMAP_MSG_ATT_BODY_SECTION) {continue;}
+        auto section = item->att_data.att_static->att_data.att_body_section;
+        if (!section->sec_body_part) {continue;}
+        string body(section->sec_body_part, section->sec_length);
+        if (cache) {cache->putBody(uid, body);}
+        body_cache.put(uid, body);
+        indexBody(uid, body);
+      }
+    }
+  } catch (exception const&) {return;}
+
+  // Queue the rest of the round behind whatever the user asked for meanwhile:
+  if (next < uids.size()) {
+    fetched += batch_bytes;
+    io.postIdle([this, generation, uids, next, fetched]() {prefetchBatch(generation, uids, next, fetched);});
+  }
+}
+
+/* ----- fetchAttachments ----- */
+vector<Attachment> Session::fetchAttachments(uint32_t uid) {
+  // Declare and initialise a new set and fetch type for the body structure only:
+  set_ptr set(mailimap_set_new_single(uid));
+  auto fetch_type = new_fetch_type({mailimap_fetch_att_new_bodystructure()});
+
+  // Attempt to fetch the body structure:
+  fetch_list_ptr result;
+  check(metrics.time(Metrics::FETCH_STRUCTURE, imap_session.get(), [&]() {
+    return mailimap_uid_fetch(imap_session.get(), set.get(), fetch_type.get(), out_ptr(result));
+  }, 1), "UID Fetch Error: Unable to fetch structure of message with UID", uid);
+
+  // Walk the structure (should be a single message):
+  vector<Attachment> attachments;
+  if (!clist_isempty(result.get())) {
+    auto msg_att = (mailimap_msg_att*)clist_content(clist_begin(result.get()));
+    for(clistiter* cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
+      auto item = (mailimap_msg_att_item*)clist_content(cur);
+      if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+      if (item->att_data.att_static->att_type != MAILIMAP_MSG_ATT_BODYSTRUCTURE) {continue;}
+      listAttachments(item->att_data.att_static->att_data.att_bodystructure, "", attachments);
+    }
+  }
+  return attachments;
+}
+
+/* ----- listAttachments ----- */
+void Session::listAttachments(mailimap_body* body, string const& section, vector<Attachment>& list) {
+  if (!body) {return;}
+  // Children of a multipart are numbered from 1 below its own part number:
+  if (body->bd_type == MAILIMAP_BODY_MPART) {
+    int i = 0;
+    for(clistiter* cur = clist_begin(body->bd_data.bd_body_mpart->bd_list); cur != NULL; cur = clist_next(cur)) {
+      string child = (section.empty() ? "" : section + ".") + to_string(++i);
+      listAttachments((mailimap_body*)clist_content(cur), child, list);
+    }
+    return;
+  }
+
+  // A single part, the body of a message that is not a multipart is part 1:
+  auto part = body->bd_data.bd_body_1part;
+  Attachment attachment;
+  attachment.section = section.empty() ? "1" : section;
+  mailimap_body_fields* fields = nullptr;
+  if (part->bd_type == MAILIMAP_BODY_TYPE_1PART_BASIC) {
+    auto media = part->bd_data.bd_type_basic->bd_media_basic;
+    switch (media->med_type) {
+      case MAILIMAP_MEDIA_BASIC_APPLICATION: attachment.type = "application"; break;
+      case MAILIMAP_MEDIA_BASIC_AUDIO: attachment.type = "audio"; break;
+      case MAILIMAP_MEDIA_BASIC_IMAGE: attachment.type = "image"; break;
+      case MAILIMAP_MEDIA_BASIC_MESSAGE: attachment.type = "message"; break;
+      case MAILIMAP_MEDIA_BASIC_VIDEO: attachment.type = "video"; break;
+      default: attachment.type = media->med_basic_type ? media->med_basic_type : "application"; break;
+    }
+    attachment.type += "/"; attachment.type += media->med_subtype ? media->med_subtype : "octet-stream";
+    fields = part->bd_data.bd_type_basic->bd_fields;
+  } else if (part->bd_type == MAILIMAP_BODY_TYPE_1PART_TEXT) {
+    attachment.type = "text/"; attachment.type += part->bd_data.bd_type_text->bd_media_text;
+    fields = part->bd_data.bd_type_text->bd_fields;
+  } else {
+    attachment.type = "message/rfc822";
+    fields = part->bd_data.bd_type_msg->bd_fields;
+  }
+  transform(attachment.type.begin(), attachment.type.end(), attachment.type.begin(), ::tolower);
+
+  // The file name comes from the disposition, or else the (older) name parameter of the type:
+  auto find_param = [](mailimap_body_fld_param* params, char const* name) -> char const* {
+    if (!params || !params->pa_list) {return nullptr;}
+    for(clistiter* cur = clist_begin(params->pa_list); cur != NULL; cur = clist_next(cur)) {
+      auto param = (mailimap_single_body_fld_param*)clist_content(cur);
+      if (param->pa_name && param->pa_value && strcasecmp(param->pa_name, name) == 0) {return param->pa_value;}
+    }
+    return nullptr;
+  };
+  auto disposition = part->bd_ext_1part ? part->bd_ext_1part->bd_disposition : nullptr;
+  char const* filename = disposition ? find_param(disposition->dsp_attributes, "filename") : nullptr;
+  if (!filename && fields) {filename = find_param(fields->bd_parameter, "name");}
+  if (filename) {attachment.filename = MimePart::decodeHeader(filename);}
+
+  if (fields && fields->bd_encoding) {
+    switch (fields->bd_encoding->enc_type) {
+      case MAILIMAP_BODY_FLD_ENC_BASE64: attachment.encoding = "base64"; break;
+      case MAILIMAP_BODY_FLD_ENC_QUOTED_PRINTABLE: attachment.encoding = "quoted-printable"; break;
+      case MAILIMAP_BODY_FLD_ENC_OTHER: attachment.encoding = fields->bd_encoding->enc_value ? fields->bd_encoding->enc_value : ""; break;
+      default: break;
+    }
+  }
+  if (fields) {attachment.size = fields->bd_size;}
+
+  // Inline text (the message itself) is not an attachment:
+  bool is_attachment = disposition && disposition->dsp_type && strcasecmp(disposition->dsp_type, "attachment") == 0;
+  if (is_attachment || filename || attachment.type.compare(0, 5, "text/") != 0) {list.push_back(move(attachment));}
+}
+
+/* ----- newPartSection ----- */
+section_ptr Session::newPartSection(string const& section) {
+  // The part number "1.2" becomes the list of its numbers:
+  clist* ids = clist_new();
+  for (size_t start = 0; start < section.size();) {
+    size_t dot = section.find('.', start);
+    if (dot == string::npos) {dot = section.size();}
+    auto id = (uint32_t*)malloc(sizeof(uint32_t));
+    *id = strtoul(section.substr(start, dot - start).c_str(), nullptr, 10);
+    clist_append(ids, id);
+    start = dot + 1;
+  }
+  return section_ptr(mailimap_section_new_part(mailimap_section_part_new(ids)));
+}
+
+/* ----- saveAttachment ----- */
+uint64_t Session::saveAttachment(uint32_t uid, Attachment const& attachment, string const& path,
+                                 function<void(uint64_t, uint64_t)> progress) {
+  // Write to a temporary file next to path, renamed once complete:
+  string partial = path + ".part";
+  ofstream file(partial, ios::binary | ios::trunc);
+  if (!file) {throw runtime_error("Save Error: Unable to create " + partial + ".");}
+
+  // Fetch the part in fixed ranges and decode each as it arrives, so only one range is ever held:
+  MimeDecoder decoder(attachment.encoding);
+  string decoded;
+  uint64_t written = 0;
+  try {
+    for (uint32_t offset = 0;; offset += ATTACHMENT_CHUNK_SIZE) {
+      if (cancelled) {throw runtime_error("Save Error: Cancelled.");}
+      BodyRange range = fetchPartial(uid, newPartSection(attachment.section), offset, ATTACHMENT_CHUNK_SIZE, false);
+      decoder.decode(range.data, decoded);
+      if (range.complete()) {
+        string rest;
+        decoder.finish(rest);
+        decoded += rest;
+      }
+      if (!file.write(decoded.data(), decoded.size())) {throw runtime_error("Save Error: Unable to write " + partial + ".");}
+      written += decoded.size();
+      uint64_t fetched = offset + range.data.size();
+      if (progress) {ui_queue.post([progress, fetched, attachment]() {progress(fetched, attachment.size);});}
+      if (range.complete()) {break;}
+    }
+    file.close();
+    if (!file || rename(partial.c_str(), path.c_str()) != 0) {throw runtime_error("Save Error: Unable to write " + path + ".");}
+  } catch (...) {
+    file.close();
+    remove(partial.c_str());
+    throw;
+  }
+  return written;
+}
+
+/* ----- searchServer ----- */
+vector<uint32_t> Session::searchServer(string const& query, bool text, function<void(vector<uint32_t> const&)> hits) {
+  // Split the query into words, noting whether they can be sent as plain quoted strings:
+  vector<string> words;
+  bool ascii = true;
+  for (size_t start = 0, end; start < query.size(); start = end + 1) {
+    end = query.find_first_of(" \t", start);
+    if (end == string::npos) {end = query.size();}
+    if (end > start) {words.push_back(query.substr(start, end - start));}
+  }
+  if (words.empty()) {return {};}
+  for (auto const& word : words) {
+    for (unsigned char c : word) {ascii = ascii && c >= 0x20 && c < 0x80;}
+  }
+
+  // Run the search, as ESEARCH if possible (a compressed UID set instead of every UID for large results):
+  vector<uint32_t> uids;
+  if (ascii && mailimap_has_extension(imap_session.get(), (char*)"ESEARCH")) {uids = esearch(words, text);}
+  else {
+    auto key = newSearchKey(words, text);
+    search_result_ptr result;
+    check(metrics.time(Metrics::SEARCH, imap_session.get(), [&]() {
+      return mailimap_uid_search(imap_session.get(), ascii ? nullptr : "UTF-8", key.get(), out_ptr(result));
+    }), "Search Error: Unable to search mailbox", mailbox);
+    for(clistiter* cur = clist_begin(result.get()); cur != nullptr; cur = clist_next(cur)) {
+      uids.push_back(*(uint32_t*)clist_content(cur));
+    }
+  }
+  sort(uids.begin(), uids.end());
+  uids.erase(unique(uids.begin(), uids.end()), uids.end());
+  if (hits) {ui_queue.post([hits, uids]() {hits(uids);});}
+
+  // Fetch only the envelopes of hits we do not hold, they stream into the list chunk by chunk:
+  vector<uint32_t> missing;
+  {
+    auto guard = lock();
+    for (auto uid : uids) {
+      if (!store.valid(store.find(uid))) {missing.push_back(uid);}
+    }
+  }
+  fetchChunks(missing, true);
+  return uids;
+}
+
+/* ----- newSearchKey ----- */
+search_key_ptr Session::newSearchKey(vector<string> const& words, bool text) {
+  // Search keys own their strings, so every key gets a copy of its word:
+  search_key_ptr key(mailimap_search_key_new_multiple_empty()); // all keys must match
+  for (auto const& word : words) {
+    mailimap_search_key* word_key;
+    if (text) {word_key = mailimap_search_key_new_text(strdup(word.c_str()));}
+    else {
+      word_key = mailimap_search_key_new_or(mailimap_search_key_new_from(strdup(word.c_str())),
+                                            mailimap_search_key_new_subject(strdup(word.c_str())));
+    }
+    search_key_ptr owned(word_key);
+    check(mailimap_search_key_multiple_add(key.get(), word_key), "Search Key Error: Unable to add a word to a search key");
+    owned.release();
+  }
+  return key;
+}
+
+/* ----- esearch ----- */
+vector<uint32_t> Session::esearch(vector<string> const& words, bool text) {
+  // Build the same criteria as newSearchKey as a command line:
+  auto quote = quote_string;
+  string line = "UID SEARCH RETURN (ALL)";
+  for (auto const& word : words) {
+    if (text) {line += " TEXT " + quote(word);}
+    else {line += " OR FROM " + quote(word) + " SUBJECT " + quote(word);}
+  }
+
+  // The hits come as "ESEARCH (TAG "...") UID ALL <set>", without ALL if there are none:
+  vector<uint32_t> uids;
+  for (auto const& response : command(line)) {
+    if (response.compare(0, 8, "ESEARCH ") != 0) {continue;}
+    size_t all = response.find(" ALL ");
+    if (all != string::npos) {parseSet(string_view(response).substr(all + 5), uids);}
+  }
+  return uids;
+}
+
+/* ----- command ----- */
+vector<string> Session::command(string const& line) {
+  return exchange({line}, true, Metrics::COMMAND);
+}
+
+/* ----- pipeline ----- */
+vector<string> Session::pipeline(vector<string> const& lines) {
+  return exchange(lines, false, Metrics::STATUS);
+}
+
+/* ----- exchange ----- */
+vector<string> Session::exchange(vector<string> const& lines, bool strict, Metrics::Op op) {
+  Metrics::Scope scope(metrics, op, imap_session.get());
+  scope.setItems(lines.size());
+  mailstream* stream = imap_session->imap_stream;
+
+  // Tag the commands differently from libetpan's numeric tags, MP<first_tag + i> for line i:
+  uint32_t first_tag = raw_commands + 1;
+  raw_commands += lines.size();
+  size_t sent = 0, completed = 0;
+  auto send = [&]() {
+    // Send the next lines in one write, up to PIPELINE_DEPTH ahead of the responses:
+    string request;
+    for (; sent < lines.size() && sent < completed + PIPELINE_DEPTH; sent++) {
+      request += "MP" + to_string(first_tag + sent) + " " + lines[sent] + "\r\n";
+    }
+    if (request.empty()) {return;}
+    if (mailstream_write(stream, request.data(), request.size()) != (ssize_t)request.size() || mailstream_flush(stream) != 0) {
+      check(MAILIMAP_ERROR_STREAM, "Command Error: Unable to send command to mailbox", mailbox);
+    }
+  };
+
+  // Function to read a response line, turning every literal ({n} and n bytes) into a quoted string:
+  mmap_string_ptr buffer(mmap_string_new(""));
+  auto readLine = [&]() {
+    string line;
+    while (true) {
+      char* part = mailstream_read_line_remove_eol(stream, buffer.get());
+      if (!part) {check(MAILIMAP_ERROR_STREAM, "Command Error: Unable to send command to mailbox", mailbox);}
+      line += part;
+      size_t open = line.rfind('{');
+      if (line.empty() || line.back() != '}' || open == string::npos) {return line;}
+      string count = line.substr(open + 1, line.size() - open - 2);
+      if (!count.empty() && count.back() == '+') {count.pop_back();}
+      if (count.empty() || count.find_first_not_of("0123456789") != string::npos) {return line;}
+      string literal(stoul(count), '\0');
+      for (size_t got = 0; got < literal.size();) {
+        ssize_t r = mailstream_read(stream, &literal[got], literal.size() - got);
+        if (r <= 0) {check(MAILIMAP_ERROR_STREAM, "Command Error: Unable to send command to mailbox", mailbox);}
+        got += r;
+      }
+      line.erase(open);
+      line += quote_string(literal);
+    }
+  };
+
+  // Read the untagged responses up to the last tagged one (a refused command is only reported once all are done,
+  // so the connection stays in step):
+  vector<string> responses;
+  string refused;
+  send();
+  while (completed < lines.size()) {
+    string line = readLine();
+    if (line.compare(0, 2, "* ") == 0) {responses.push_back(line.substr(2));}
+    else if (line.compare(0, 2, "MP") == 0) {
+      size_t space = line.find(' ');
+      uint32_t tag = strtoul(line.c_str() + 2, nullptr, 10);
+      if (space == string::npos || tag < first_tag || tag - first_tag >= lines.size()) {continue;}
+      if (line.compare(space + 1, 2, "OK") != 0 && strict && refused.empty()) {
+        refused = "Command Error: The server refused \"" + lines[tag - first_tag] + "\": " + line.substr(space + 1);
+      }
+      completed++;
+      send();
+    }
+  }
+  if (!refused.empty()) {throw runtime_error(refused);}
+  return responses;
+}
+
+/* ----- parseList ----- */
+bool Session::parseList(string_view response, Folder& folder) {
+  // LIST (flags) "delimiter" name
+  if (response.compare(0, 5, "LIST ") != 0) {return false;}
+  response.remove_prefix(5);
+  size_t close = response.find(')');
+  if (response.empty() || response.front() != '(' || close == string_view::npos) {return false;}
+  string flags(response.substr(1, close - 1));
+  for (auto& c : flags) {c = tolower((unsigned char)c);}
+  folder.selectable = flags.find("\\noselect") == string::npos && flags.find("\\nonexistent") == string::npos;
+  response.remove_prefix(close + 1);
+  string delimiter;
+  if (!read_astring(response, delimiter)) {return false;}
+  folder.delimiter = delimiter.empty() ? 0 : delimiter[0];
+  return read_astring(response, folder.name) && !folder.name.empty();
+}
+
+/* ----- parseStatus ----- */
+bool Session::parseStatus(string_view response, string& name, MailboxStatus& status) {
+  // STATUS name (MESSAGES 12 UNSEEN 3 ...)
+  if (response.compare(0, 7, "STATUS ") != 0) {return false;}
+  response.remove_prefix(7);
+  if (!read_astring(response, name)) {return false;}
+  size_t open = response.find('('), close = response.find(')');
+  if (open == string_view::npos || close == string_view::npos || close < open) {return false;}
+  istringstream in(string(response.substr(open + 1, close - open - 1)));
+  string key;
+  uint64_t value;
+  while (in >> key >> value) {
+    if (strcasecmp(key.c_str(), "MESSAGES") == 0) {status.messages = value;}
+    else if (strcasecmp(key.c_str(), "UNSEEN") == 0) {status.unseen = value;}
+    else if (strcasecmp(key.c_str(), "UIDNEXT") == 0) {status.uidnext = value;}
+    else if (strcasecmp(key.c_str(), "UIDVALIDITY") == 0) {status.uidvalidity = value;}
+  }
+  return true;
+}
+
+/* ----- parseSet ----- */
+void Session::parseSet(string_view set, vector<uint32_t>& uids) {
+  // Ranges are separated by commas, the set ends at the first character that is not part of it:
+  uint32_t first = 0, value = 0;
+  bool range = false;
+  for (size_t i = 0; i <= set.size(); i++) {
+    char c = i < set.size() ? set[i] : ' ';
+    if (c >= '0' && c <= '9') {value = value * 10 + (c - '0'); continue;}
+    if (c == ':') {first = value; value = 0; range = true; continue;}
+    if (!range) {first = value;}
+    for (uint32_t uid = min(first, value); uid && uid <= max(first, value); uid++) {uids.push_back(uid);}
+    first = value = 0;
+    range = false;
+    if (c != ',') {return;}
+  }
+}
+
+/* ----- indexBody ----- */
+void Session::indexBody(uint32_t uid, string const& body) {
+  auto guard = lock();
+  if (index) {index->addBody(uid, body);}
+}
+
+/* ----- saveIndex ----- */
+void Session::saveIndex(bool force) {
+  if (!index || !index->getUnsaved()) {return;}
+  auto now = chrono::steady_clock::now();
+  if (!force && index->getUnsaved() < INDEX_SAVE_CHANGES && now - index_saved < chrono::seconds(INDEX_SAVE_INTERVAL)) {
+    return;
+  }
+  index->save();
+  index_saved = now;
+}
+
+/* ----- searchLocal ----- */
+vector<uint32_t> Session::searchLocal(string const& query) {
+  auto guard = lock();
+  return index ? index->search(query) : vector<uint32_t>();
+}
+
+/* ----- deleteMessages ----- */
+void Session::deleteMessages(vector<uint32_t> uids) {
+  if (uids.empty()) {return;}
+  sort(uids.begin(), uids.end());
+  uids.erase(unique(uids.begin(), uids.end()), uids.end());
+
+  // Declare and initialise a flag list holding the 'deleted' flag and a compressed set of all UIDs:
+  flag_list_ptr flag_list(mailimap_flag_list_new_empty());
+  flag_ptr del_flag(mailimap_flag_new_deleted());
+  auto set = compressed_set(uids.data(), uids.size());
+  check(mailimap_flag_list_add(flag_list.get(), del_flag.get()), "Flag List Error: Unable to add 'deleted' flag to flag list");
+  del_flag.release();
+
+  // Add the flag list silently (the server does not echo the new flags back), the store attribute owns it from here:
+  store_att_flags_ptr store(mailimap_store_att_flags_new_add_flags_silent(flag_list.get()));
+  flag_list.release();
+
+  // Attempt to flag all messages with a single UID STORE:
+  check(metrics.time(Metrics::STORE, imap_session.get(), [&]() {
+    return mailimap_uid_store(imap_session.get(), set.get(), store.get());
+  }, uids.size()), "Store Error: Unable to flag messages as deleted in mailbox", mailbox);
+
+  // Attempt to expunge: with UIDPLUS only our messages, otherwise everything flagged 'deleted':
+  check(metrics.time(Metrics::EXPUNGE, imap_session.get(), [&]() {
+    return mailimap_has_extension(imap_session.get(), (char*)"UIDPLUS") ? mailimap_uidplus_uid_expunge(imap_session.get(), set.get())
+                                                                        : mailimap_expunge(imap_session.get());
+  }, uids.size()), "Expunge Error: Unable to expunge messages from mailbox", mailbox);
+
+  // Sync the session, passing the UIDs we know are gone (with QRESYNC, reading the VANISHED responses to the expunge
+  // keeps the message count right):
+  vector<uint32_t> numbers;
+  vector<pair<uint32_t, uint32_t>> vanished;
+  readExpunged(numbers, vanished);
+  sync(uids);
 }
 
-/* ------ setMessageFields ----- */
-void Message::setMessageFields(mailimap_msg_att* msg_att) {
+/* ----- markSeen ----- */
+void Session::markSeen(uint32_t uid) {
+  uint32_t flags;
+  {
+    auto guard = lock();
+    auto message = store.find(uid);
+    if (!store.valid(message)) {return;}
+    flags = store.attributes(message).flags;
+  }
+  if (flags & MessageAttributes::SEEN) {return;}
+
+  // Declare and initialise a flag list holding the 'seen' flag, added silently as deleteMessages does:
+  flag_list_ptr flag_list(mailimap_flag_list_new_empty());
+  flag_ptr seen_flag(mailimap_flag_new_seen());
+  set_ptr set(mailimap_set_new_single(uid));
+  check(mailimap_flag_list_add(flag_list.get(), seen_flag.get()), "Flag List Error: Unable to add 'seen' flag to flag list");
+  seen_flag.release();
+  store_att_flags_ptr store_att(mailimap_store_att_flags_new_add_flags_silent(flag_list.get()));
+  flag_list.release();
+
+  // Attempt to flag the message:
+  check(metrics.time(Metrics::STORE, imap_session.get(), [&]() {
+    return mailimap_uid_store(imap_session.get(), set.get(), store_att.get());
+  }, 1), "Store Error: Unable to flag message as seen with UID", uid);
+
+  // Apply the flag to the store and the cache, unless a sync removed the message meanwhile:
+  SyncDelta delta;
+  {
+    auto guard = lock();
+    auto message = store.find(uid);
+    if (!store.valid(message)) {return;}
+    flags = store.attributes(message).flags | MessageAttributes::SEEN;
+    store.setFlags(uid, flags);
+    if (cache) {cache->setFlags(uid, flags);}
+    delta.changed.push_back(uid);
+  }
+  updateFolderStatus(selectedStatus(true));
+
+  // Update UI:
+  notify(delta);
+}
+
+/* ----- deleteAll ----- */
+void Session::deleteAll() {
+  auto guard = lock();
+  body_cache.clear();
+  store.clear();
+  threads.clear();
+}
+
+/* ----- parseEnvelope function ----- */
+Envelope Session::parseEnvelope(uint32_t uid, mailimap_msg_att* msg_att) {
+  Envelope envelope;
+  envelope.uid = uid;
   // Declare clist pointer:
   clistiter* cur;
   // For loop to run through mailimap_msg_att content to determine the appropriate fields to assign:
   for(cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
     auto item = (mailimap_msg_att_item*)clist_content(cur);
+    // FLAGS is the only dynamic item:
+    if (item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC) {
+      envelope.attributes.flags = parseFlags(item->att_data.att_dyn);
+      continue;
+    }
     // Check if att_type is not static, cotinue:
     if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {continue;}
+
+    // INTERNALDATE is kept as seconds since the epoch, so dates sort as numbers:
+    if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_INTERNALDATE) {
+      auto date = item->att_data.att_static->att_data.att_internal_date;
+      if (date) {envelope.attributes.date = epoch_seconds(date);}
+      continue;
+    }
+    if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_RFC822_SIZE) {
+      envelope.attributes.size = item->att_data.att_static->att_data.att_rfc822_size;
+      continue;
+    }
+
+    // The References header comes as "References: <a> <b>\r\n", possibly folded, or empty without one:
+    if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_BODY_SECTION) {
+      auto section = item->att_data.att_static->att_data.att_body_section;
+      if (!section->sec_body_part) {continue;}
+      string_view header(section->sec_body_part, section->sec_length);
+      size_t colon = header.find(':');
+      if (colon == string_view::npos) {continue;}
+      string references;
+      for (char c : header.substr(colon + 1)) {
+        if (c == '\r' || c == '\n' || c == '\t') {c = ' ';}
+        if (c != ' ' || (!references.empty() && references.back() != ' ')) {references += c;}
+      }
+      while (!references.empty() && references.back() == ' ') {references.pop_back();}
+      if (!references.empty()) {envelope.references = references;}
+      continue;
+    }
     
     // Check if att_data.att_static's att_type is MAILIMAP_MSG_ATT_ENVELOPE i.e. subject or sender:
     if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_ENVELOPE) {
       // Check if subject, if so so then assign to subject:
       if (item->att_data.att_static->att_data.att_env->env_subject) {
-	subject = item->att_data.att_static->att_data.att_env->env_subject;
+	envelope.subject = item->att_data.att_static->att_data.att_env->env_subject;
       }
-      // Check if sender, if so use setFrom function to assign to from:
+      // Check if sender, if so use appendFrom function to assign to from:
       if (item->att_data.att_static->att_data.att_env->env_from->frm_list) {
-	setFrom(item->att_data.att_static->att_data.att_env->env_from->frm_list);
+	appendFrom(envelope.from, item->att_data.att_static->att_data.att_env->env_from->frm_list);
       }
-    }
-    
-    // Check if att_type.att_static's att_type is MAILIMAP_MSG_ATT_BODY_SECTION i.e. body:
-    if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_BODY_SECTION) {
-      // Check if there is a body part, if so then assign to body:
-      if (item->att_data.att_static->att_data.att_body_section->sec_body_part) {
-	body = item->att_data.att_static->att_data.att_body_section->sec_body_part;
+      // Message-ID and In-Reply-To thread the message (References, if fetched, takes precedence):
+      if (item->att_data.att_static->att_data.att_env->env_message_id) {
+	envelope.message_id = item->att_data.att_static->att_data.att_env->env_message_id;
+      }
+      if (item->att_data.att_static->att_data.att_env->env_in_reply_to && envelope.references.empty()) {
+	envelope.references = item->att_data.att_static->att_data.att_env->env_in_reply_to;
       }
     }
   }
+  return envelope;
 }
 
-/* ----- setFrom ----- */
-void Message::setFrom(clist* frm_list) {
+/* ----- appendFrom function ----- */
+void Session::appendFrom(string& from, clist* frm_list) {
   // Declare variable to traverse list of (possibly multiple) senders:
   clistiter* cur;
   // For loop to run through mailimap_address content and 
@@ -293,50 +1677,24 @@ void Message::setFrom(clist* frm_list) {
   }
 }
 
-/* ----- deleteFromMailbox ----- */
-void Message::deleteFromMailbox() {
-  // Check to see if the mailbox is empty, i.e. this is a nullptr!
-  if (this==nullptr) {return;}
-
-  // Declare and initialise an empty flag_list:
-  auto flag_list = mailimap_flag_list_new_empty(); // mailimap_flag_list*
-  auto del_flag = mailimap_flag_new_deleted(); // mailimap_flag*
-  auto set = mailimap_set_new_single(uid); // mailimap_set*
-
-
-
-  // Define flag add error and attempt to add del_flag to flag list:
-  string del_flag_add_err = "Flag List Errror: Unable to add 'delete' flag to current message with UID: ";
-  del_flag_add_err += uid; del_flag_add_err += ".\n\nError code: ";
-  check_error(mailimap_flag_list_add(flag_list, del_flag), del_flag_add_err);
-
-  // Declare and define variable to store flaglist:
-  auto store = mailimap_store_att_flags_new_set_flags(flag_list); // mailimap_store_att_flags*
-  
-  // Define store error and attempt to store flaglist for set of messages:
-  string store_err = "Store Error: Unable to store flag list containing 'delete' flag for set containing message with UID: ";
-  store_err += uid; store_err += ".\n\nError code: ";
-  check_error(mailimap_uid_store(session->getIMAP(), set, store), store_err);
-  
-  // Define expunge error and attempt to expunge:
-  string  exp_err = "Expunge Error: Unable to expunge message with UID ";
-  exp_err += uid; exp_err += " mailbox "; exp_err += session->getMailbox(); exp_err += ".\n\nError code: ";
-  check_error(mailimap_expunge(session->getIMAP()), exp_err);
-  
-  // Delete everything but this message:
-  session->deleteAllBut(uid);
-
-  // Update UI:
-  session->updateUI();
-  
-  // Delete flaglist, del_flag, set, and store:
-  mailimap_set_free(set);
+/* ----------------- Message Functions ---------------- */
+/* ----- getBody ----- */
+string Message::getBody() const {
+  return session->fetchBody(uid);
+}
 
-  //mailimap_flag_free(del_flag);
-  //mailimap_flag_list_free(flag_list);
+/* ----- getAttachments ----- */
+vector<Attachment> Message::getAttachments() const {
+  return session->fetchAttachments(uid);
+}
 
-  mailimap_store_att_flags_free(store);
+/* ----- saveAttachment ----- */
+uint64_t Message::saveAttachment(Attachment const& attachment, string const& path) const {
+  return session->saveAttachment(uid, attachment, path);
+}
 
-  // Delete this message:
-  delete this;
+/* ----- deleteFromMailbox ----- */
+void Message::deleteFromMailbox() const {
+  // Delete through the session, which removes this message from its store and updates the UI:
+  session->deleteMessages({uid});
 }
@@ -1,107 +1,618 @@
 #ifndef IMAP_H
 #define IMAP_H
 #include "imaputils.hpp"
+#include "bodycache.hpp"
+#include "cache.hpp"
+#include "engine.hpp"
+#include "folders.hpp"
+#include "idle.hpp"
+#include "metrics.hpp"
+#include "mime.hpp"
+#include "search.hpp"
+#include "store.hpp"
+#include "threads.hpp"
+#include "traffic.hpp"
+#include "worker.hpp"
 #include <libetpan/libetpan.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <vector>
 
 namespace IMAP {
 
 class Session;
+
+/* -------------------- Struct: Attachment -------------------- */
+// Part of a message that can be saved as a file, as described by its BODYSTRUCTURE.
+struct Attachment {
+        std::string section; // part number for BODY[section], e.g. "2" or "1.3"
+        std::string type;    // lowercase, e.g. "application/pdf"
+        std::string filename;
+        std::string encoding; // Content-Transfer-Encoding, empty for none
+        uint32_t size = 0;    // encoded size in bytes
+};
   
 /* -------------------- Class: Message ------------------- */
+// View of a message held in a session's store: its fields point into the store, so a Message is only valid while
+// the store is unchanged (i.e. while holding the session's lock() on the UI thread).
 class Message {
 private:
-        // Constructor attributes:
         Session* session;
-        uint32_t const uid;
-        // Other attributes:
-        std::string from = "";
-        std::string subject;
-        std::string body;
-
-  /* ----- setMessageFields ----- */
-  // Function to set the message fields for a given set of message attributes:
-        void setMessageFields(mailimap_msg_att* msg_att);
-  
-  /* ----- setFrom ----- */
-  // Function to set the from field, called by setMessageFields (can process a list of senders!).
-        void setFrom(clist* frm_list);
+        uint32_t uid;
+        std::string_view from;
+        std::string_view subject;
+        MessageAttributes attributes;
 public:
   /* ----- CONSTRUCTOR ----- */
-        Message(Session* session, uint32_t uid) : session(session), uid(uid) {};
+        Message(Session* session, uint32_t uid, std::string_view from, std::string_view subject,
+                MessageAttributes const& attributes = {})
+          : session(session), uid(uid), from(from), subject(subject), attributes(attributes) {};
 
   /* ----- getBody ----- */
-  // Function to return the body of a message.
-        std::string getBody() const {return body;}
+  // Function to return the body of a message, fetched on demand through the session's body cache.
+        std::string getBody() const;
+
+  /* ----- getAttachments ----- */
+  // Function to list the attachments of a message from its BODYSTRUCTURE, without fetching any of them.
+        std::vector<Attachment> getAttachments() const;
+
+  /* ----- saveAttachment ----- */
+  // Function to stream one attachment to a file, see Session::saveAttachment.
+        uint64_t saveAttachment(Attachment const& attachment, std::string const& path) const;
 
   /* ----- getField ----- */
   // Function to return the appropriate field of a message.
-        std::string getField(std::string field) const {
+        std::string_view getField(std::string const& field) const {
           if (field == "Subject") {return subject;}
           else if (field == "From") {return from;}
-          else {return "";}
+          else {return {};}
         }
   
   /* ----- getUID ----- */
   // Function to return the UID of a message.
         uint32_t getUID() const {return uid;}
 
-  /* ----- setMessage ----- */
-  // Function to set the message attributes.
-        void setMessage();
-        
+  /* ----- getDate / getSize / getFlags ----- */
+  // Functions to return the INTERNALDATE (seconds since the epoch), RFC822.SIZE and flags (MessageAttributes::Flag
+  // bits) of a message.
+        int64_t getDate() const {return attributes.date;}
+        uint32_t getSize() const {return attributes.size;}
+        uint32_t getFlags() const {return attributes.flags;}
+
   /* ----- deleteFromMailbox ----- */
-  // Function to delete a this message from its mailbox.
-	void deleteFromMailbox();
+  // Function to delete a this message from its mailbox (which invalidates this view!).
+	void deleteFromMailbox() const;
   
 };
 
+/* -------------------- Struct: Envelope -------------------- */
+// Fields of a message as fetched from the server, before they are added to the session's store.
+struct Envelope {
+        uint32_t uid = 0;
+        std::string from;
+        std::string subject;
+        std::string message_id;
+        std::string references; // References header, or In-Reply-To where it was not fetched
+        MessageAttributes attributes; // INTERNALDATE, RFC822.SIZE and FLAGS
+};
+
+/* -------------------- Struct: BodyRange -------------------- */
+// Part of a message body as returned by fetchBodyRange: the bytes from offset on and the size of the whole body.
+struct BodyRange {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+        std::string data;
+        bool complete() const {return offset + data.size() >= size;}
+};
+
+/* -------------------- Struct: SyncDelta -------------------- */
+// UIDs added, removed and changed on the server since the previous sync of the session mailbox.
+struct SyncDelta {
+        std::vector<uint32_t> added;
+        std::vector<uint32_t> removed;
+        std::vector<uint32_t> changed;
+        bool empty() const {return added.empty() && removed.empty() && changed.empty();}
+};
+
   
 /* -------------------- Class: Session  -------------------- */
 class Session {
 private:
-         mailimap* imap_session;
-         Message** messages;
-         uint32_t num_msgs;
+         mailimap_ptr imap_session;
+         // Latencies and bytes of every command (declared first, so the pool and the I/O thread are gone before it):
+         Metrics metrics;
+         MessageStore store;
+         // Written by selectMailbox under store_mutex, read by the UI through getMailbox:
          std::string mailbox;
          bool logged_in = false;
+         // Credentials, kept to log in the extra connections of the pool:
+         std::string server;
+         size_t port = 143;
+         std::string userid;
+         std::string password;
+         size_t pool_size = 1;
+         // COMPRESS=DEFLATE is used if enabled and offered, the traffic of all connections is counted:
+         bool compression = true;
+         bool compressed = false;
+         TrafficCounter traffic;
+         unsigned poll_interval = 30;
+         // Watching the mailbox for changes on a dedicated connection, a sync is pending while sync_queued is set:
+         bool watching = false;
+         std::unique_ptr<Idler> idler;
+         // Or watching on a shared engine instead (not owned), as account watch_account:
+         AccountEngine* engine = nullptr;
+         uint64_t watch_account = 0;
+         std::atomic<bool> sync_queued{false};
+         BodyCache body_cache{DEFAULT_BODY_CACHE_BUDGET};
+         // Prefetching of bodies around the list cursor: a newer round (or a mailbox change) cancels the older one by
+         // bumping the generation, downloads are limited by a bucket of tokens (bytes) refilled at prefetch_rate:
+         std::atomic<uint64_t> prefetch_generation{0};
+         std::atomic<unsigned> prefetch_depth{DEFAULT_PREFETCH_DEPTH};
+         std::atomic<size_t> prefetch_rate{DEFAULT_PREFETCH_RATE};
+         double prefetch_tokens = 0;
+         std::chrono::steady_clock::time_point prefetch_refilled{};
+         std::string cache_dir;
+         std::unique_ptr<MessageCache> cache;
+         std::unique_ptr<SearchIndex> index;
+         std::chrono::steady_clock::time_point index_saved{};
+         // Mailboxes of the account with their counters, kept in cache_dir between runs:
+         FolderTree folders;
+         // Conversation threads of the held messages, computed by the server (THREAD=REFERENCES) if it offers to:
+         ThreadIndex threads;
+         bool server_threads = false;
+         // Order the list is shown in: envelopes are fetched in that order, by the server (SORT) if it offers to:
+         std::atomic<MessageStore::SortKey> sort_key{MessageStore::BY_UID};
+         std::atomic<bool> sort_descending{false};
+         bool server_sort = false;
+         // Sync state: next UID expected and, with CONDSTORE, the highest modification sequence seen. QRESYNC is
+         // enabled at login if offered, expunges are then reported as VANISHED UIDs:
+         uint32_t uidnext = 0;
+         uint64_t highest_modseq = 0;
+         bool qresync = false;
+         // Number of commands sent through command() and pipeline(), used for their tags:
+         uint32_t raw_commands = 0;
+         // Threading: store is only written on the I/O thread, under store_mutex:
+         std::mutex store_mutex;
+         std::atomic<bool> cancelled{false};
+         CallbackQueue ui_queue;
+         Worker io;
+
+  /* ----- DEFAULT_BODY_CACHE_BUDGET ----- */
+  // Default number of bytes of message bodies kept in memory.
+         static size_t const DEFAULT_BODY_CACHE_BUDGET = 32 * 1024 * 1024;
+
+  /* ----- DEFAULT_PREFETCH_DEPTH / DEFAULT_PREFETCH_RATE ----- */
+  // Default number of messages prefetched on each side of the list cursor, and bytes per second they may take.
+         static unsigned const DEFAULT_PREFETCH_DEPTH = 5;
+         static size_t const DEFAULT_PREFETCH_RATE = 512 * 1024;
+
+  /* ----- PREFETCH_BATCH / PREFETCH_MAX_BODY / PREFETCH_BURST / PREFETCH_SHARE ----- */
+  // Bodies requested by a single prefetch FETCH, the largest body worth prefetching (larger ones are read in ranges
+  // anyway), the seconds of downloads the token bucket holds and the part of the body cache a round may fill.
+         static size_t const PREFETCH_BATCH = 4;
+         static size_t const PREFETCH_MAX_BODY = 1024 * 1024;
+         static unsigned const PREFETCH_BURST = 2;
+         static size_t const PREFETCH_SHARE = 4;
+
+  /* ----- INDEX_SAVE_CHANGES / INDEX_SAVE_INTERVAL ----- */
+  // Changes to the search index, respectively seconds since it was last saved, after which a sync saves it (a save
+  // rewrites the whole file). It is always saved when the mailbox changes and when the session ends.
+         static size_t const INDEX_SAVE_CHANGES = 1000;
+         static unsigned const INDEX_SAVE_INTERVAL = 300;
+
+  /* ----- FETCH_CHUNK_SIZE ----- */
+  // Number of messages requested by a single pipelined FETCH command in getMessages.
+         static uint32_t const FETCH_CHUNK_SIZE = 500;
   
+  /* ----- ATTACHMENT_CHUNK_SIZE ----- */
+  // Number of bytes of an attachment requested at a time by saveAttachment.
+         static uint32_t const ATTACHMENT_CHUNK_SIZE = 256 * 1024;
+
   /* ----- fetchUID ----- */
   // Function to fetch the UID of a message, used in getMessages!
          uint32_t fetchUID(struct mailimap_msg_att* msg_att);
 
-  /* ----- getNumMessages ----- */
-  // Function to get the number of messages in the session mailbox.
-        uint32_t fetchNumMessages(std::string mb);
-  
+  /* ----- fetchModSeq ----- */
+  // Function to fetch the CONDSTORE modification sequence of a message (0 if there is none).
+         uint64_t fetchModSeq(struct mailimap_msg_att* msg_att);
+
+  /* ----- fetchStatus ----- */
+  // Function to get the message count, UIDNEXT, UIDVALIDITY and unseen count of a mailbox with a single STATUS
+  // (never the selected one, see selectedStatus).
+        MailboxStatus fetchStatus(std::string const& mb);
+
+  /* ----- fetchChangedFlags ----- */
+  // Function to fetch the UIDs and flags of messages changed since highest_modseq (CONDSTORE only), updating
+  // highest_modseq. Ascending by UID. With QRESYNC, the ranges of UIDs expunged since are appended to vanished if
+  // it is given (they may include UIDs the session never held).
+        std::vector<std::pair<uint32_t, uint32_t>> fetchChangedFlags(
+          std::vector<std::pair<uint32_t, uint32_t>>* vanished = nullptr);
+
+  /* ----- readExpunged ----- */
+  // Function to collect what the last command on the session connection reported expunged: the sequence numbers
+  // of EXPUNGE responses in order, and the UID ranges of VANISHED ones. libetpan only counts EXPUNGE into
+  // sel_exists, so the count is lowered by VANISHED (not EARLIER) UIDs here.
+        void readExpunged(std::vector<uint32_t>& numbers, std::vector<std::pair<uint32_t, uint32_t>>& vanished);
+
+  /* ----- selectedStatus ----- */
+  // Function to return the counters of the selected mailbox as SELECT and later commands reported them (STATUS
+  // must not be sent for it, RFC 3501 6.3.10). The unseen count is taken from the store if count_unseen is set and
+  // it holds the whole mailbox, else kept from the last STATUS.
+        MailboxStatus selectedStatus(bool count_unseen);
+
+  /* ----- parseFlags ----- */
+  // Function to read the FLAGS of a fetched message into MessageAttributes::Flag bits (keywords are ignored).
+        static uint32_t parseFlags(mailimap_msg_att_dynamic* dynamic);
+
+  /* ----- fetchUIDs ----- */
+  // Function to fetch the (ascending) UIDs of all messages in the session mailbox with a single UID SEARCH.
+        std::vector<uint32_t> fetchUIDs();
+
+  /* ----- parseEnvelope ----- */
+  // Function to extract the fields the list needs from the attributes of a fetched message.
+        static Envelope parseEnvelope(uint32_t uid, mailimap_msg_att* msg_att);
+
+  /* ----- appendFrom ----- */
+  // Function to append the senders to from, called by parseEnvelope (can process a list of senders!).
+        static void appendFrom(std::string& from, clist* frm_list);
+
+  /* ----- newListFetchType ----- */
+  // Function to create the fetch type holding everything the list needs (UID, envelope, INTERNALDATE, RFC822.SIZE
+  // and FLAGS, and the References header unless the server threads for us).
+        fetch_type_ptr newListFetchType();
+
+  /* ----- fetchMessageSet ----- */
+  // Function to fetch the messages in set (sequence numbers or UIDs) in one command over imap, appending the
+  // resulting envelopes to list, used in getMessages! Only touches imap and list, so pool
+  // connections can call it from their own threads.
+        void fetchMessageSet(mailimap* imap, mailimap_set* set, bool by_uid, mailimap_fetch_type* fetch_type, std::vector<Envelope>& list);
+
+  /* ----- fetchChunks ----- */
+  // Function to fetch the envelopes of ids (sequence numbers or UIDs) in chunks of FETCH_CHUNK_SIZE, in the order
+  // given, and add them with addMessages. With a pool size above 1 the chunks are shared out between the session connection
+  // and up to pool_size - 1 extra connections fetching in parallel.
+        void fetchChunks(std::vector<uint32_t> const& ids, bool by_uid);
+
+  /* ----- openExtraConnection / closeExtraConnection ----- */
+  // Functions to open an extra connection (for the pool or the idler) logged in with the session's credentials and
+  // with the session mailbox EXAMINEd (nullptr if that fails, e.g. because the server limits concurrent logins),
+  // compressed like the session connection if compress is set, and to close it again.
+        mailimap* openExtraConnection(bool compress = false);
+        void closeExtraConnection(mailimap* imap);
+
+  /* ----- startIdler ----- */
+  // Function to (re)start the idler on the session mailbox, or stop it if watching is off.
+        void startIdler();
+
+  /* ----- stopIdler ----- */
+  // Function to stop the idler or the engine account watching the session mailbox.
+        void stopIdler();
+
+  /* ----- newSearchKey ----- */
+  // Function to create a search key matching messages that contain every word in From or Subject (or anywhere in
+  // the message if text is set).
+        static search_key_ptr newSearchKey(std::vector<std::string> const& words, bool text);
+
+  /* ----- esearch ----- */
+  // Function to run the search of newSearchKey as UID SEARCH RETURN (ALL), whose ESEARCH response carries the hits
+  // as a compressed UID set (the words must be ASCII).
+        std::vector<uint32_t> esearch(std::vector<std::string> const& words, bool text);
+
+  /* ----- command ----- */
+  // Function to send a command libetpan has no function for over the session connection and return the untagged
+  // response lines (without "* "), throwing a runtime_error unless it completes with OK. Responses must not
+  // contain literals.
+        std::vector<std::string> command(std::string const& line);
+
+  /* ----- exchange ----- */
+  // Function behind command and pipeline: sends lines with at most PIPELINE_DEPTH of them awaiting their tagged
+  // response, and returns the untagged responses of all of them. Literals in responses are turned into quoted
+  // strings. Unless strict, commands the server refuses are skipped instead of throwing.
+        std::vector<std::string> exchange(std::vector<std::string> const& lines, bool strict, Metrics::Op op);
+
+  /* ----- PIPELINE_DEPTH ----- */
+  // Number of commands pipeline keeps in flight, so neither side blocks on a full socket buffer.
+         static size_t const PIPELINE_DEPTH = 64;
+
+  /* ----- parseList / parseStatus ----- */
+  // Functions to read an untagged LIST response (without "* ") into a folder, and a STATUS response into a name and
+  // counters. Return false for other responses.
+        static bool parseList(std::string_view response, Folder& folder);
+        static bool parseStatus(std::string_view response, std::string& name, MailboxStatus& status);
+
+  /* ----- fetchThreads ----- */
+  // Function to let the server thread the session mailbox with UID THREAD REFERENCES and take its structure over
+  // into threads.
+        void fetchThreads();
+
+  /* ----- displayOrder ----- */
+  // Function to put ids (ascending sequence numbers or UIDs) in the order the list is shown in, so fetchChunks fills
+  // the top of the list first: with UID SORT (or SORT) if the server offers it, ids missing from its answer last.
+        std::vector<uint32_t> displayOrder(std::vector<uint32_t> ids, bool by_uid);
+
+  /* ----- parseSet ----- */
+  // Function to append the UIDs of a sequence set such as "1:3,7,9:12" to uids.
+        static void parseSet(std::string_view set, std::vector<uint32_t>& uids);
+
+  /* ----- prefetchBatch ----- */
+  // Function to fetch the next batch of a prefetch round from uids[next] on (fetched bytes having been downloaded by
+  // the round so far), then queue the rest as another idle job. Does nothing once the round is cancelled.
+        void prefetchBatch(uint64_t generation, std::vector<uint32_t> const& uids, size_t next, size_t fetched);
+
+  /* ----- listAttachments ----- */
+  // Function to append the attachments found in a BODYSTRUCTURE to list, section being the part number of body.
+        static void listAttachments(mailimap_body* body, std::string const& section, std::vector<Attachment>& list);
+
+  /* ----- newPartSection ----- */
+  // Function to create the section of a part number such as "1.2".
+        static section_ptr newPartSection(std::string const& section);
+
+  /* ----- getCachedMessages ----- */
+  // Function to add the messages from the on-disk cache, then fetch only envelopes of UIDs it has not seen.
+        void getCachedMessages();
+
+  /* ----- addMessages ----- */
+  // Function to add newly fetched messages to the store and the on-disk cache and tell the UI about them.
+        void addMessages(std::vector<Envelope> const& chunk);
+
+  /* ----- saveIndex ----- */
+  // Function to save the search index if it has unsaved changes and force is set, there are INDEX_SAVE_CHANGES of
+  // them or it was last saved (or opened) INDEX_SAVE_INTERVAL seconds ago.
+        void saveIndex(bool force);
+
+  /* ----- indexBody ----- */
+  // Function to add a fetched body to the search index.
+        void indexBody(uint32_t uid, std::string const& body);
+
+  /* ----- updateFolderStatus / notifyFolders ----- */
+  // Functions to set the counters of the session mailbox in the folder tree, and to post updateFolders to the UI
+  // thread.
+        void updateFolderStatus(MailboxStatus const& status);
+        void notifyFolders();
+
+  /* ----- notify ----- */
+  // Function to post updateUI(delta) to the UI thread.
+        void notify(SyncDelta const& delta);
+
 
 public:
   /* ----- CONSTRUCTOR ----- */
-        Session(std::function<void()> updateUI);
+        Session(std::function<void(SyncDelta const&)> updateUI);
   
   /* ----- UPDATEUI ----- */
-        std::function<void()> updateUI;
+  // Called on the UI thread (see dispatch) with the delta whenever the messages of the session change,
+  // including once per chunk while getMessages is still loading.
+        std::function<void(SyncDelta const&)> updateUI;
+
+  /* ----- UPDATEFOLDERS ----- */
+  // Called on the UI thread (see dispatch) whenever the folder tree changes: after fetchFolders, or when a sync or
+  // selectMailbox changed the counters of the session mailbox.
+        std::function<void()> updateFolders;
+
+  /* ----- async ----- */
+  // Function to run op() on the session's I/O thread and return immediately. done(result) - or fail(error message)
+  // if op threw - is then run on the UI thread by dispatch. All Session functions below are blocking and must
+  // only be called from the I/O thread once the UI is running, i.e. through async.
+        template <typename Op, typename Done>
+        void async(Op op, Done done, std::function<void(std::string const&)> fail = {}) {
+          io.post([this, op, done, fail]() {
+            try {
+              if constexpr (std::is_void_v<decltype(op())>) {
+                op();
+                ui_queue.post(done);
+              }else {
+                auto result = op();
+                ui_queue.post([done, result]() {done(result);});
+              }
+            } catch (std::exception const& exception) {
+              std::string what = exception.what();
+              if (fail) {ui_queue.post([fail, what]() {fail(what);});}
+            }
+          });
+        }
+
+  /* ----- dispatch ----- */
+  // Function to run the callbacks posted by the I/O thread, to be called regularly from the UI thread.
+        void dispatch() {ui_queue.dispatch();}
+
+  /* ----- lock ----- */
+  // Function to lock the messages against changes by the I/O thread, while the UI reads them.
+        std::unique_lock<std::mutex> lock() {return std::unique_lock<std::mutex>(store_mutex);}
   
   /* ----- connect ----- */
   // Function to connect to specified server (143 is the standard unencrpyted imap port).
 	void connect(std::string const& server, size_t port = 143);
 
   /* ----- login ----- */
-  // Funcion to log in to server (connect first, then log in).
+  // Funcion to log in to server (connect first, then log in). Turns on COMPRESS=DEFLATE if the server offers it,
+  // unless disabled with setCompression.
 	void login(std::string const& userid, std::string const& password);
 
   /* ----- getMessages ----- */
-  // Function to fetch all messages within session's mailbox, terminated by a nullptr (as in class).
-        Message** getMessages();
+  // Function to fetch all messages within session's mailbox into the store, in UID order.
+        MessageStore const& getMessages();
+
+  /* ----- listMessages ----- */
+  // Function to return the store of messages currently held by the session (as getMessages) without contacting
+  // the server (hold lock() while using it from the UI thread).
+        MessageStore const& listMessages() const {return store;}
+
+  /* ----- listThreads ----- */
+  // Function to return the conversation threads of the messages held by the session, kept up to date with the store
+  // (hold lock() while using it from the UI thread).
+        ThreadIndex const& listThreads() const {return threads;}
+
+  /* ----- setSortOrder ----- */
+  // Function to tell the session the order the list is shown in, so envelopes still to be fetched arrive top first.
+  // The store keeps every order itself, this only changes the order of downloads.
+        void setSortOrder(MessageStore::SortKey key, bool descending) {sort_key = key; sort_descending = descending;}
+
+  /* ----- findMessage ----- */
+  // Function to return the message with the given UID held by the session, if any (hold lock() on the UI thread).
+        std::optional<Message> findMessage(uint32_t uid);
+
+  /* ----- sync ----- */
+  // Function to bring the session's messages up to date incrementally. A NOOP brings the message count (EXISTS),
+  // the expunges (EXPUNGE, or VANISHED with QRESYNC) and flag changes (FETCH) the server has to report; only
+  // messages added since the last sync are fetched and, if the server supports CONDSTORE, changed ones come from
+  // CHANGEDSINCE (with QRESYNC, the same command reports the UIDs expunged since). Should the count still not add
+  // up (expunges reported during other commands are lost), the UID lists are compared. UIDs the caller knows to be
+  // expunged (e.g. by its own EXPUNGE) can be passed to save that comparison. The delta is applied, passed to
+  // updateUI and returned.
+        SyncDelta sync(std::vector<uint32_t> const& expunged = {});
   
+  /* ----- fetchBody ----- */
+  // Function to return the body of the message with the given UID, from the body cache or the server.
+        std::string fetchBody(uint32_t uid);
+
+  /* ----- fetchBodyRange ----- */
+  // Function to return at most length bytes of the body of the message with the given UID from offset on, with a
+  // partial FETCH (BODY.PEEK[]<offset.length>) unless the whole body is cached, so the cost does not depend on the
+  // size of the message. A body that fits in one range is cached and indexed as fetchBody would.
+        BodyRange fetchBodyRange(uint32_t uid, uint32_t offset, uint32_t length);
+
+  /* ----- fetchPartial ----- */
+  // Function to fetch at most length bytes of section of the message with the given UID from offset on with
+  // BODY.PEEK[section]<offset.length>, and RFC822.SIZE if with_size is set. A short range is taken as the end of the
+  // section, i.e. its size is set from it; without with_size the size of a full range is UINT32_MAX, so it is only
+  // complete once a short range arrives. A message expunged meanwhile (no section in the response) throws EtpanError.
+  // The caches are not involved, so it works in any selected mailbox.
+        BodyRange fetchPartial(uint32_t uid, section_ptr section, uint32_t offset, uint32_t length, bool with_size);
+
+  /* ----- prefetchBodies ----- */
+  // Function to download the bodies of uids (most wanted first, e.g. the messages around the list cursor) in the
+  // background, so opening one of them needs no round trip. The downloads only run while the I/O thread has nothing
+  // else to do, PREFETCH_BATCH bodies per UID FETCH (BODY.PEEK[], so nothing is marked \Seen), and a newer call
+  // cancels what is left of an older one. Bodies already cached or larger than PREFETCH_MAX_BODY are skipped, and a
+  // round stops at a PREFETCH_SHARE-th of the body cache budget or when the rate set with setPrefetchRate is used up.
+  // Returns immediately, so it may be called from the UI thread.
+        void prefetchBodies(std::vector<uint32_t> uids);
+
+  /* ----- setPrefetchDepth / getPrefetchDepth ----- */
+  // Functions to set and return how many messages on each side of the cursor the list prefetches (0 turns
+  // prefetching off).
+        void setPrefetchDepth(unsigned depth) {prefetch_depth = depth;}
+        unsigned getPrefetchDepth() const {return prefetch_depth;}
+
+  /* ----- setPrefetchRate ----- */
+  // Function to set how many bytes per second prefetching may download (0 turns it off).
+        void setPrefetchRate(size_t bytes_per_second) {prefetch_rate = bytes_per_second;}
+
+  /* ----- fetchAttachments ----- */
+  // Function to list the attachments of the message with the given UID from its BODYSTRUCTURE (one FETCH, no part
+  // of the message itself is downloaded).
+        std::vector<Attachment> fetchAttachments(uint32_t uid);
+
+  /* ----- saveAttachment ----- */
+  // Function to stream an attachment to the file at path: only its part is fetched, in ranges of
+  // ATTACHMENT_CHUNK_SIZE bytes decoded one at a time, so memory use does not depend on its size. The file is written
+  // under a temporary name and only appears at path once complete. progress(fetched, size) is run on the UI thread
+  // (see dispatch) after every range. Returns the number of decoded bytes written.
+        uint64_t saveAttachment(uint32_t uid, Attachment const& attachment, std::string const& path,
+                                std::function<void(uint64_t, uint64_t)> progress = {});
+
+  /* ----- setBodyCacheBudget ----- */
+  // Function to set how many bytes of message bodies may be cached in memory.
+        void setBodyCacheBudget(size_t bytes) {body_cache.setBudget(bytes);}
+
+  /* ----- setCacheDirectory ----- */
+  // Function to enable the on-disk message cache, kept in one subdirectory of dir per mailbox, and load the folder
+  // tree kept there (call before selectMailbox).
+        void setCacheDirectory(std::string const& dir);
+
+  /* ----- setPoolSize ----- */
+  // Function to set how many connections getMessages may use to download the mailbox in parallel (1 by default,
+  // i.e. only the session connection). Extra connections are opened for the download and closed afterwards.
+        void setPoolSize(size_t n) {pool_size = std::max<size_t>(n, 1);}
+
+  /* ----- setCompression ----- */
+  // Function to allow or forbid COMPRESS=DEFLATE on the connections logged in from now on (allowed by default).
+        void setCompression(bool enable) {compression = enable;}
+
+  /* ----- isCompressed / getTraffic ----- */
+  // Functions to tell whether the session connection is compressed and to return the bytes counted on all the
+  // session's connections (safe to call from any thread).
+        bool isCompressed() const {return compressed;}
+        Traffic getTraffic() const {return traffic.get();}
+
+  /* ----- getMetrics ----- */
+  // Function to return the instrumentation of the session: every libetpan command with its latency, bytes and
+  // messages, the time spent parsing responses and merging them into the store. Safe to use from any thread, the UI
+  // records its own list rebuilds in it.
+        Metrics& getMetrics() {return metrics;}
+
+  /* ----- watch ----- */
+  // Function to start (or stop) watching the session mailbox on a dedicated connection, with IDLE if the server
+  // supports it and NOOP polling every poll_interval seconds otherwise. Changes are picked up by an incremental
+  // sync on the I/O thread and reach the UI through updateUI. The watch follows selectMailbox.
+        void watch(bool enable, unsigned poll_interval = 30);
+
+  /* ----- setEngine ----- */
+  // Function to watch on a shared AccountEngine (which must outlive the session) instead of a thread and connection
+  // of its own, so many sessions cost a single thread; the engine's poll interval applies. Call before watch().
+        void setEngine(AccountEngine* shared) {engine = shared;}
+
+  /* ----- searchLocal ----- */
+  // Function to return the ascending UIDs of held messages whose From, Subject or (fetched) body contain every word
+  // of query, the last word matching as a prefix. Runs on the local index only, so it is safe (and fast enough) to
+  // call from the UI thread.
+        std::vector<uint32_t> searchLocal(std::string const& query);
+
+  /* ----- searchServer ----- */
+  // Function to search the session mailbox on the server for messages containing every word of query in From or
+  // Subject (or anywhere if text is set), with ESEARCH if the server offers it. The ascending UIDs of the hits are
+  // passed to hits on the UI thread (see dispatch) and returned; then the envelopes of hits the session does not
+  // hold yet are fetched in chunks, each reaching the UI through updateUI as it arrives. Nothing else is fetched.
+        std::vector<uint32_t> searchServer(std::string const& query, bool text,
+                                           std::function<void(std::vector<uint32_t> const&)> hits = {});
+
+  /* ----- listMailboxes ----- */
+  // Function to list every mailbox of the account with a single LIST, sorted by name.
+        std::vector<Folder> listMailboxes();
+
+  /* ----- fetchFolders ----- */
+  // Function to refresh the folder tree: every mailbox with its message, unseen, UIDNEXT and UIDVALIDITY counters
+  // in one round trip with LIST-STATUS, or else a LIST followed by pipelined STATUS commands (two round trips
+  // however many folders there are). The selected mailbox is never asked for, its counters are the session's own.
+  // The tree is saved to the cache directory and returned.
+        std::vector<Folder> fetchFolders();
+
+  /* ----- listFolders ----- */
+  // Function to return the folder tree as last fetched (or loaded from the cache directory) without contacting the
+  // server (hold lock() while using it from the UI thread). Counters of the session mailbox follow its syncs.
+        FolderTree const& listFolders() const {return folders;}
+
+  /* ----- pipeline ----- */
+  // Function to send commands libetpan has no function for (e.g. many STATUS) without waiting for each answer, and
+  // return the untagged responses of all of them. Commands the server refuses are skipped.
+        std::vector<std::string> pipeline(std::vector<std::string> const& lines);
+
+  /* ----- cacheName ----- */
+  // Function to turn a mailbox name into a file or directory name (for its on-disk cache or an export).
+        static std::string cacheName(std::string const& mb);
+
   /* ----- selectMailbox ----- */
   // Function to select a mailbox (only one can be selected at any given time), can only be performed after login.
 	void selectMailbox(std::string const& mb);
   
-  /* ----- deleteAllBut ----- */
-  // Function to delete all messages within mailbox.
-        void deleteAllBut(uint32_t uid);
+  /* ----- deleteMessages ----- */
+  // Function to delete a set of messages from the mailbox with a constant number of round trips: one UID STORE
+  // over a compressed UID set, one UID EXPUNGE (or EXPUNGE if the server lacks UIDPLUS) and a sync. The
+  // messages are removed from the store by the sync!
+        void deleteMessages(std::vector<uint32_t> uids);
+
+  /* ----- markSeen ----- */
+  // Function to flag a message \Seen once it is opened (the body is only ever fetched with BODY.PEEK, so reading it
+  // does not), with a single UID STORE +FLAGS.SILENT. The store and the on-disk cache are updated and the change is
+  // notified, nothing is sent if the message is already seen.
+        void markSeen(uint32_t uid);
 
   /* ----- deleteAll ----- */
   // Function to delete all messages within mailbox.
@@ -109,16 +620,19 @@ public:
 
   
   /* ----- getMailbox ----- */
-  // Funcion to return session mailbox.
-       std::string getMailbox() const {return mailbox;}
+  // Funcion to return session mailbox (a copy taken under lock(), which must not be held by the caller).
+       std::string getMailbox() {
+         auto guard = lock();
+         return mailbox;
+       }
 
   /* ----- getNumMessages ----- */
   // Function to return the number of messages in the session mailbox..
-       uint32_t getNumMessages() const {return num_msgs;}
+       uint32_t getNumMessages() const {return store.size();}
   
   /* ----- getIMAP ----- */
   // Function to return session imap_session.
-        mailimap* getIMAP() const {return imap_session;}
+        mailimap* getIMAP() const {return imap_session.get();}
   
   /* ----- DESCTRUCTOR ----- */
 	~Session();
@@ -1,68 +1,244 @@
 #ifndef IMAPUTILS_H
 #define IMAPUTILS_H
 #include <libetpan/libetpan.h>
-#include <map>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
-std::map<int, std::string> const errors{
-		{MAILIMAP_NO_ERROR, "MAILIMAP_NO_ERROR"},
-		{MAILIMAP_NO_ERROR_AUTHENTICATED, "MAILIMAP_NO_ERROR_AUTHENTICATED"},
-		{MAILIMAP_NO_ERROR_NON_AUTHENTICATED, "MAILIMAP_NO_ERROR_NON_AUTHENTICATED"},
-		{MAILIMAP_ERROR_BAD_STATE, "MAILIMAP_ERROR_BAD_STATE"},
-		{MAILIMAP_ERROR_STREAM, "MAILIMAP_ERROR_STREAM"},
-		{MAILIMAP_ERROR_PARSE, "MAILIMAP_ERROR_PARSE"},
-		{MAILIMAP_ERROR_CONNECTION_REFUSED, "MAILIMAP_ERROR_CONNECTION_REFUSED"},
-		{MAILIMAP_ERROR_MEMORY, "MAILIMAP_ERROR_MEMORY"},
-		{MAILIMAP_ERROR_FATAL, "MAILIMAP_ERROR_FATAL"},
-		{MAILIMAP_ERROR_PROTOCOL, "MAILIMAP_ERROR_PROTOCOL"},
-		{MAILIMAP_ERROR_DONT_ACCEPT_CONNECTION, "MAILIMAP_ERROR_DONT_ACCEPT_CONNECTION"},
-		{MAILIMAP_ERROR_APPEND, "MAILIMAP_ERROR_APPEND"},
-		{MAILIMAP_ERROR_NOOP, "MAILIMAP_ERROR_NOOP"},
-		{MAILIMAP_ERROR_LOGOUT, "MAILIMAP_ERROR_LOGOUT"},
-		{MAILIMAP_ERROR_CAPABILITY, "MAILIMAP_ERROR_CAPABILITY"},
-		{MAILIMAP_ERROR_CHECK, "MAILIMAP_ERROR_CHECK"},
-		{MAILIMAP_ERROR_CLOSE, "MAILIMAP_ERROR_CLOSE"},
-		{MAILIMAP_ERROR_EXPUNGE, "MAILIMAP_ERROR_EXPUNGE"},
-		{MAILIMAP_ERROR_COPY, "MAILIMAP_ERROR_COPY"},
-		{MAILIMAP_ERROR_UID_COPY, "MAILIMAP_ERROR_UID_COPY"},
-		{MAILIMAP_ERROR_MOVE, "MAILIMAP_ERROR_MOVE"},
-		{MAILIMAP_ERROR_UID_MOVE, "MAILIMAP_ERROR_UID_MOVE"},
-		{MAILIMAP_ERROR_CREATE, "MAILIMAP_ERROR_CREATE"},
-		{MAILIMAP_ERROR_DELETE, "MAILIMAP_ERROR_DELETE"},
-		{MAILIMAP_ERROR_EXAMINE, "MAILIMAP_ERROR_EXAMINE"},
-		{MAILIMAP_ERROR_FETCH, "MAILIMAP_ERROR_FETCH"},
-		{MAILIMAP_ERROR_UID_FETCH, "MAILIMAP_ERROR_UID_FETCH"},
-		{MAILIMAP_ERROR_LIST, "MAILIMAP_ERROR_LIST"},
-		{MAILIMAP_ERROR_LOGIN, "MAILIMAP_ERROR_LOGIN"},
-		{MAILIMAP_ERROR_LSUB, "MAILIMAP_ERROR_LSUB"},
-		{MAILIMAP_ERROR_RENAME, "MAILIMAP_ERROR_RENAME"},
-		{MAILIMAP_ERROR_SEARCH, "MAILIMAP_ERROR_SEARCH"},
-		{MAILIMAP_ERROR_UID_SEARCH, "MAILIMAP_ERROR_UID_SEARCH"},
-		{MAILIMAP_ERROR_SELECT, "MAILIMAP_ERROR_SELECT"},
-		{MAILIMAP_ERROR_STATUS, "MAILIMAP_ERROR_STATUS"},
-		{MAILIMAP_ERROR_STORE, "MAILIMAP_ERROR_STORE"},
-		{MAILIMAP_ERROR_UID_STORE, "MAILIMAP_ERROR_UID_STORE"},
-		{MAILIMAP_ERROR_SUBSCRIBE, "MAILIMAP_ERROR_SUBSCRIBE"},
-		{MAILIMAP_ERROR_UNSUBSCRIBE, "MAILIMAP_ERROR_UNSUBSCRIBE"},
-		{MAILIMAP_ERROR_STARTTLS, "MAILIMAP_ERROR_STARTTLS"},
-		{MAILIMAP_ERROR_INVAL, "MAILIMAP_ERROR_INVAL"},
-		{MAILIMAP_ERROR_EXTENSION, "MAILIMAP_ERROR_EXTENSION"},
-		{MAILIMAP_ERROR_SASL, "MAILIMAP_ERROR_SASL"},
-		{MAILIMAP_ERROR_SSL, "MAILIMAP_ERROR_SSL"},
-		{MAILIMAP_ERROR_NEEDS_MORE_DATA, "MAILIMAP_ERROR_NEEDS_MORE_DATA"},
-		{MAILIMAP_ERROR_CUSTOM_COMMAND, "MAILIMAP_ERROR_CUSTOM_COMMAND"}};
-
-static void check_error(int r, std::string const& msg) {
-	if(r == MAILIMAP_NO_ERROR)
-		return;
-	if(r == MAILIMAP_NO_ERROR_AUTHENTICATED)
-		return;
-	if(r == MAILIMAP_NO_ERROR_NON_AUTHENTICATED)
+// Function to return the name of a libetpan return code, e.g. "MAILIMAP_ERROR_FETCH".
+static char const* error_name(int r) {
+#define ERROR_NAME(code) \
+	case code: return #code;
+	switch(r) {
+		ERROR_NAME(MAILIMAP_NO_ERROR)
+		ERROR_NAME(MAILIMAP_NO_ERROR_AUTHENTICATED)
+		ERROR_NAME(MAILIMAP_NO_ERROR_NON_AUTHENTICATED)
+		ERROR_NAME(MAILIMAP_ERROR_BAD_STATE)
+		ERROR_NAME(MAILIMAP_ERROR_STREAM)
+		ERROR_NAME(MAILIMAP_ERROR_PARSE)
+		ERROR_NAME(MAILIMAP_ERROR_CONNECTION_REFUSED)
+		ERROR_NAME(MAILIMAP_ERROR_MEMORY)
+		ERROR_NAME(MAILIMAP_ERROR_FATAL)
+		ERROR_NAME(MAILIMAP_ERROR_PROTOCOL)
+		ERROR_NAME(MAILIMAP_ERROR_DONT_ACCEPT_CONNECTION)
+		ERROR_NAME(MAILIMAP_ERROR_APPEND)
+		ERROR_NAME(MAILIMAP_ERROR_NOOP)
+		ERROR_NAME(MAILIMAP_ERROR_LOGOUT)
+		ERROR_NAME(MAILIMAP_ERROR_CAPABILITY)
+		ERROR_NAME(MAILIMAP_ERROR_CHECK)
+		ERROR_NAME(MAILIMAP_ERROR_CLOSE)
+		ERROR_NAME(MAILIMAP_ERROR_EXPUNGE)
+		ERROR_NAME(MAILIMAP_ERROR_COPY)
+		ERROR_NAME(MAILIMAP_ERROR_UID_COPY)
+		ERROR_NAME(MAILIMAP_ERROR_MOVE)
+		ERROR_NAME(MAILIMAP_ERROR_UID_MOVE)
+		ERROR_NAME(MAILIMAP_ERROR_CREATE)
+		ERROR_NAME(MAILIMAP_ERROR_DELETE)
+		ERROR_NAME(MAILIMAP_ERROR_EXAMINE)
+		ERROR_NAME(MAILIMAP_ERROR_FETCH)
+		ERROR_NAME(MAILIMAP_ERROR_UID_FETCH)
+		ERROR_NAME(MAILIMAP_ERROR_LIST)
+		ERROR_NAME(MAILIMAP_ERROR_LOGIN)
+		ERROR_NAME(MAILIMAP_ERROR_LSUB)
+		ERROR_NAME(MAILIMAP_ERROR_RENAME)
+		ERROR_NAME(MAILIMAP_ERROR_SEARCH)
+		ERROR_NAME(MAILIMAP_ERROR_UID_SEARCH)
+		ERROR_NAME(MAILIMAP_ERROR_SELECT)
+		ERROR_NAME(MAILIMAP_ERROR_STATUS)
+		ERROR_NAME(MAILIMAP_ERROR_STORE)
+		ERROR_NAME(MAILIMAP_ERROR_UID_STORE)
+		ERROR_NAME(MAILIMAP_ERROR_SUBSCRIBE)
+		ERROR_NAME(MAILIMAP_ERROR_UNSUBSCRIBE)
+		ERROR_NAME(MAILIMAP_ERROR_STARTTLS)
+		ERROR_NAME(MAILIMAP_ERROR_INVAL)
+		ERROR_NAME(MAILIMAP_ERROR_EXTENSION)
+		ERROR_NAME(MAILIMAP_ERROR_SASL)
+		ERROR_NAME(MAILIMAP_ERROR_SSL)
+		ERROR_NAME(MAILIMAP_ERROR_NEEDS_MORE_DATA)
+		ERROR_NAME(MAILIMAP_ERROR_CUSTOM_COMMAND)
+	}
+#undef ERROR_NAME
+	return "MAILIMAP_ERROR_UNKNOWN";
+}
+
+// Function to check whether a libetpan return code means success.
+static bool succeeded(int r) {
+	return r == MAILIMAP_NO_ERROR || r == MAILIMAP_NO_ERROR_AUTHENTICATED || r == MAILIMAP_NO_ERROR_NON_AUTHENTICATED;
+}
+
+// Error of a libetpan call, keeping its parts: what failed (a fixed description), what it failed on (e.g. a mailbox,
+// empty if nothing in particular) and the libetpan code. The message is only put together once a call has failed.
+class EtpanError : public std::runtime_error {
+	int code;
+	std::string context;
+	std::string subject;
+
+	static std::string format(int code, std::string_view context, std::string_view subject) {
+		std::string message(context);
+		if(!subject.empty()) {
+			message += ' ';
+			message += subject;
+		}
+		message += ".\n\nError code: ";
+		return message + error_name(code);
+	}
+
+public:
+	EtpanError(int code, std::string_view context, std::string_view subject)
+		: runtime_error(format(code, context, subject)), code(code), context(context), subject(subject) {}
+	int getCode() const { return code; }
+	std::string const& getContext() const { return context; }
+	std::string const& getSubject() const { return subject; }
+};
+
+// Function to throw an EtpanError unless r means success. subject is a string or a number (e.g. a UID), turned into
+// text only if r is an error, so checking a call that succeeds costs a comparison.
+template <typename Subject = std::string_view>
+static void check(int r, char const* context, Subject const& subject = {}) {
+	if(succeeded(r))
 		return;
+	if constexpr(std::is_arithmetic_v<Subject>)
+		throw EtpanError(r, context, std::to_string(subject));
+	else
+		throw EtpanError(r, context, subject);
+}
+
+// Owning pointers to libetpan structures, freed by their libetpan function when they go out of scope (on every path
+// out of a function, exceptions included). Ownership passed to libetpan is given up with release().
+template <auto Free>
+struct etpan_free {
+	template <typename T>
+	void operator()(T* p) const { Free(p); }
+};
+template <typename T, auto Free>
+using etpan_ptr = std::unique_ptr<T, etpan_free<Free>>;
+
+using mailimap_ptr = etpan_ptr<mailimap, mailimap_free>;
+using capability_data_ptr = etpan_ptr<mailimap_capability_data, mailimap_capability_data_free>;
+using set_ptr = etpan_ptr<mailimap_set, mailimap_set_free>;
+using section_ptr = etpan_ptr<mailimap_section, mailimap_section_free>;
+using fetch_att_ptr = etpan_ptr<mailimap_fetch_att, mailimap_fetch_att_free>;
+using fetch_type_ptr = etpan_ptr<mailimap_fetch_type, mailimap_fetch_type_free>;
+using fetch_list_ptr = etpan_ptr<clist, mailimap_fetch_list_free>;
+using search_key_ptr = etpan_ptr<mailimap_search_key, mailimap_search_key_free>;
+using search_result_ptr = etpan_ptr<clist, mailimap_search_result_free>;
+using list_result_ptr = etpan_ptr<clist, mailimap_list_result_free>;
+using status_att_list_ptr = etpan_ptr<mailimap_status_att_list, mailimap_status_att_list_free>;
+using mailbox_data_status_ptr = etpan_ptr<mailimap_mailbox_data_status, mailimap_mailbox_data_status_free>;
+using flag_ptr = etpan_ptr<mailimap_flag, mailimap_flag_free>;
+using flag_list_ptr = etpan_ptr<mailimap_flag_list, mailimap_flag_list_free>;
+using store_att_flags_ptr = etpan_ptr<mailimap_store_att_flags, mailimap_store_att_flags_free>;
+using mmap_string_ptr = etpan_ptr<MMAPString, mmap_string_free>;
+using qresync_vanished_ptr = etpan_ptr<mailimap_qresync_vanished, mailimap_qresync_vanished_free>;
 
-	throw std::runtime_error(msg + " " + errors.at(r));
+// Out-parameter for a libetpan call returning a new structure (e.g. the result list of mailimap_fetch): the owning
+// pointer takes it over when the call's full expression ends, and stays empty if the call failed.
+template <typename T, typename Deleter>
+class out_ptr_t {
+	std::unique_ptr<T, Deleter>& owner;
+	T* raw = nullptr;
+
+public:
+	explicit out_ptr_t(std::unique_ptr<T, Deleter>& owner) : owner(owner) {}
+	out_ptr_t(out_ptr_t const&) = delete;
+	~out_ptr_t() { owner.reset(raw); }
+	operator T**() { return &raw; }
+};
+template <typename T, typename Deleter>
+static out_ptr_t<T, Deleter> out_ptr(std::unique_ptr<T, Deleter>& owner) {
+	return out_ptr_t<T, Deleter>(owner);
+}
+
+// Function to add an attribute to a fetch type, which owns it from then on (freed here if adding fails).
+static void add_fetch_att(mailimap_fetch_type* fetch_type, fetch_att_ptr att) {
+	check(mailimap_fetch_type_new_fetch_att_list_add(fetch_type, att.get()),
+				"Fetch Type Error: Unable to add an attribute to a fetch type structure");
+	att.release();
+}
+
+// Function to create a fetch type holding the given attributes.
+static fetch_type_ptr new_fetch_type(std::initializer_list<mailimap_fetch_att*> atts) {
+	fetch_type_ptr fetch_type(mailimap_fetch_type_new_fetch_att_list_empty());
+	// Take every attribute over first, so none leaks if adding one fails:
+	std::vector<fetch_att_ptr> owned;
+	for(auto att : atts)
+		owned.emplace_back(att);
+	for(auto& att : owned)
+		add_fetch_att(fetch_type.get(), std::move(att));
+	return fetch_type;
+}
+
+// Function to build a set from n ascending UIDs, merging runs of consecutive UIDs into intervals (e.g. 1:4,7,9:12).
+static set_ptr compressed_set(uint32_t const* uids, size_t n) {
+	set_ptr set(mailimap_set_new_empty());
+	for(size_t first = 0, last = 0; first < n; first = ++last) {
+		while(last + 1 < n && uids[last + 1] == uids[last] + 1)
+			last++;
+		check(mailimap_set_add_interval(set.get(), uids[first], uids[last]), "Set Error: Unable to add an interval to a set");
+	}
+	return set;
+}
+
+
+// Function to write s as an IMAP quoted string, escaping quotes and backslashes.
+static std::string quote_string(std::string const& s) {
+	std::string quoted = "\"";
+	for(char c : s) {
+		if(c == '"' || c == '\\')
+			quoted += '\\';
+		quoted += c;
+	}
+	return quoted + "\"";
 }
 
+// Function to read an atom or a quoted string (NIL reads as empty) from the front of s into out, consuming it.
+// Returns false if s holds neither.
+static bool read_astring(std::string_view& s, std::string& out) {
+	while(!s.empty() && s.front() == ' ')
+		s.remove_prefix(1);
+	out.clear();
+	if(s.empty())
+		return false;
+	if(s.front() == '"') {
+		for(size_t i = 1; i < s.size(); i++) {
+			if(s[i] == '"') {
+				s.remove_prefix(i + 1);
+				return true;
+			}
+			if(s[i] == '\\' && i + 1 < s.size())
+				i++;
+			out += s[i];
+		}
+		return false;
+	}
+	size_t end = s.find_first_of(" ()");
+	if(end == 0)
+		return false;
+	if(end == std::string_view::npos)
+		end = s.size();
+	out = s.substr(0, end);
+	s.remove_prefix(end);
+	if(out == "NIL")
+		out.clear();
+	return true;
+}
 
+// Function to convert an IMAP date-time (e.g. an INTERNALDATE) to seconds since the epoch, applying its zone.
+static int64_t epoch_seconds(mailimap_date_time const* date) {
+	// Days since 1970-01-01 of the civil date (proleptic Gregorian, years starting in March):
+	int64_t y = date->dt_year - (date->dt_month <= 2);
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (date->dt_month + (date->dt_month > 2 ? -3 : 9)) + 2) / 5 + date->dt_day - 1;
+	int64_t days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+	// The zone is +hhmm (or -hhmm) as a number:
+	int zone = date->dt_zone < 0 ? -date->dt_zone : date->dt_zone;
+	int64_t offset = (zone / 100 * 60 + zone % 100) * 60;
+	return days * 86400 + date->dt_hour * 3600 + date->dt_min * 60 + date->dt_sec - (date->dt_zone < 0 ? -offset : offset);
+}
 
 #endif /* IMAPUTILS_H */
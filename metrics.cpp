@@ -0,0 +1,146 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+using namespace IMAP;
+using namespace std;
+
+/* ------------------- OpStats Functions ------------------- */
+/* ----- percentile ----- */
+uint64_t OpStats::percentile(double p) const {
+  if (!count) {return 0;}
+  uint64_t rank = max<uint64_t>(1, uint64_t(p * count + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if (seen >= rank) {return (uint64_t(2) << i) - 1;}
+  }
+  return (uint64_t(2) << (buckets.size() - 1)) - 1;
+}
+
+/* ------------------- Metrics Functions ------------------- */
+char const* const Metrics::NAMES[OP_COUNT] = {
+  "connect", "login", "capability", "compress", "select", "examine", "status", "search", "fetch list", "fetch body",
+  "fetch range", "fetch structure", "fetch changed", "store", "expunge", "noop", "command", "list", "thread",
+  "sort", "prefetch", "logout", "parse", "merge", "list rebuild",
+};
+
+/* ----- threadId ----- */
+uint32_t Metrics::threadId() {
+  static atomic<uint32_t> next{1};
+  thread_local uint32_t id = next++;
+  return id;
+}
+
+/* ----- record ----- */
+void Metrics::record(Op op, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end,
+                     uint64_t bytes_in, uint64_t bytes_out, uint64_t items) {
+  uint64_t micros = chrono::duration_cast<chrono::microseconds>(end - start).count();
+  Counters& c = counters[op];
+  c.count.fetch_add(1, memory_order_relaxed);
+  c.micros.fetch_add(micros, memory_order_relaxed);
+  c.bytes_in.fetch_add(bytes_in, memory_order_relaxed);
+  c.bytes_out.fetch_add(bytes_out, memory_order_relaxed);
+  c.items.fetch_add(items, memory_order_relaxed);
+  size_t bucket = micros ? min<size_t>(c.buckets.size() - 1, 63 - __builtin_clzll(micros)) : 0;
+  c.buckets[bucket].fetch_add(1, memory_order_relaxed);
+
+  if (!tracing.load(memory_order_relaxed)) {return;}
+  uint64_t offset = chrono::duration_cast<chrono::microseconds>(start - epoch).count();
+  lock_guard<mutex> lock(trace_mutex);
+  if (events.size() < MAX_EVENTS) {events.push_back({op, threadId(), offset, micros, bytes_in, bytes_out, items});}
+  else {dropped++;}
+}
+
+/* ----- get ----- */
+OpStats Metrics::get(Op op) const {
+  OpStats stats;
+  Counters const& c = counters[op];
+  stats.name = NAMES[op];
+  stats.count = c.count.load(memory_order_relaxed);
+  stats.micros = c.micros.load(memory_order_relaxed);
+  stats.bytes_in = c.bytes_in.load(memory_order_relaxed);
+  stats.bytes_out = c.bytes_out.load(memory_order_relaxed);
+  stats.items = c.items.load(memory_order_relaxed);
+  for (size_t i = 0; i < c.buckets.size(); i++) {stats.buckets[i] = c.buckets[i].load(memory_order_relaxed);}
+  return stats;
+}
+
+/* ----- snapshot ----- */
+vector<OpStats> Metrics::snapshot() const {
+  vector<OpStats> all;
+  for (int op = 0; op < OP_COUNT; op++) {
+    OpStats stats = get(Op(op));
+    if (stats.count) {all.push_back(stats);}
+  }
+  return all;
+}
+
+/* ----- reset ----- */
+void Metrics::reset() {
+  for (Counters& c : counters) {
+    c.count = 0;
+    c.micros = 0;
+    c.bytes_in = 0;
+    c.bytes_out = 0;
+    c.items = 0;
+    for (auto& bucket : c.buckets) {bucket = 0;}
+  }
+}
+
+/* ----- summary ----- */
+string Metrics::summary() const {
+  // The two slowest kinds of commands in total, then the local work:
+  vector<OpStats> commands;
+  uint64_t bytes_in = 0;
+  for (int op = CONNECT; op <= LOGOUT; op++) {
+    OpStats stats = get(Op(op));
+    bytes_in += stats.bytes_in;
+    if (stats.count) {commands.push_back(stats);}
+  }
+  sort(commands.begin(), commands.end(), [](OpStats const& a, OpStats const& b) {return a.micros > b.micros;});
+  ostringstream out;
+  char buffer[128];
+  for (size_t i = 0; i < min<size_t>(2, commands.size()); i++) {
+    snprintf(buffer, sizeof(buffer), "%s%s %llux %.0f ms (p99 %.0f ms)", i ? ", " : "", commands[i].name,
+             (unsigned long long) commands[i].count, commands[i].micros / 1e3, commands[i].percentile(0.99) / 1e3);
+    out << buffer;
+  }
+  snprintf(buffer, sizeof(buffer), "%sparse %.0f ms, list %.0f ms, %.1f MiB in", commands.empty() ? "" : ", ",
+           get(PARSE).micros / 1e3, get(LIST_REBUILD).micros / 1e3, bytes_in / 1048576.0);
+  out << buffer;
+  return out.str();
+}
+
+/* ----- startTrace ----- */
+void Metrics::startTrace(string const& path) {
+  lock_guard<mutex> lock(trace_mutex);
+  trace_path = path;
+  tracing = true;
+}
+
+/* ----- writeTrace ----- */
+bool Metrics::writeTrace() {
+  lock_guard<mutex> lock(trace_mutex);
+  if (trace_path.empty()) {return false;}
+  ofstream file(trace_path, ios::trunc);
+  if (!file) {return false;}
+  // Complete ("X") events in microseconds, one row per thread:
+  file << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":" << dropped << "},\"traceEvents\":[";
+  for (size_t i = 0; i < events.size(); i++) {
+    Event const& e = events[i];
+    file << (i ? ",\n" : "\n") << "{\"name\":\"" << NAMES[e.op] << "\",\"cat\":\""
+         << (e.op <= LOGOUT ? "imap" : "local") << "\",\"ph\":\"X\",\"ts\":" << e.start << ",\"dur\":" << e.duration
+         << ",\"pid\":1,\"tid\":" << e.thread << ",\"args\":{\"bytes_in\":" << e.bytes_in << ",\"bytes_out\":"
+         << e.bytes_out << ",\"items\":" << e.items << "}}";
+  }
+  file << "\n]}\n";
+  return bool(file);
+}
+
+/* ----- DESTRUCTOR ----- */
+Metrics::~Metrics() {
+  if (tracing) {writeTrace();}
+}
@@ -0,0 +1,150 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "traffic.hpp"
+#include <libetpan/libetpan.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Struct: OpStats -------------------- */
+// What Metrics counted for one kind of operation.
+struct OpStats {
+        char const* name = "";
+        uint64_t count = 0;
+        uint64_t micros = 0;    // total time
+        uint64_t bytes_in = 0;  // protocol bytes read and written on the operation's connection
+        uint64_t bytes_out = 0;
+        uint64_t items = 0;     // messages (or UIDs) handled
+        // Latency histogram: bucket i counts the operations that took [2^i, 2^(i+1)) microseconds (bucket 0 from 0):
+        std::array<uint64_t, 32> buckets{};
+
+  /* ----- percentile ----- */
+  // Function to return the p-th (0 to 1) percentile of the latencies in microseconds, as the upper end of its
+  // histogram bucket (so at most twice the real value).
+        uint64_t percentile(double p) const;
+};
+
+/* -------------------- Class: Metrics -------------------- */
+// Instrumentation of a session: for every kind of operation (IMAP commands, parsing their responses, merging them into
+// the store, rebuilding the list) a latency histogram and the bytes and items it handled. Recording an operation is
+// a handful of relaxed atomic additions, so it is always on and safe from any thread. Optionally every operation is
+// also kept for a trace in Chrome's trace event format (chrome://tracing, Perfetto), written when the Metrics go away.
+class Metrics {
+public:
+  /* ----- Op ----- */
+        enum Op {CONNECT, LOGIN, CAPABILITY, COMPRESS, SELECT, EXAMINE, STATUS, SEARCH, FETCH_LIST, FETCH_BODY,
+                 FETCH_RANGE, FETCH_STRUCTURE, FETCH_CHANGED, STORE, EXPUNGE, NOOP, COMMAND, LIST, THREAD, SORT,
+                 PREFETCH, LOGOUT, PARSE, MERGE, LIST_REBUILD, OP_COUNT};
+        static char const* const NAMES[OP_COUNT];
+
+  /* -------------------- Class: Scope -------------------- */
+  // Timer recording an operation when it goes out of scope, with the protocol bytes the connection imap (if any)
+  // transferred meanwhile. The connection must outlive the scope.
+        class Scope {
+        private:
+                Metrics& metrics;
+                Op op;
+                mailimap* imap;
+                Traffic before;
+                uint64_t items = 0;
+                std::chrono::steady_clock::time_point start;
+        public:
+                Scope(Metrics& metrics, Op op, mailimap* imap = nullptr)
+                  : metrics(metrics), op(op), imap(imap), before(TrafficCounter::connection(imap)),
+                    start(std::chrono::steady_clock::now()) {}
+                Scope(Scope const&) = delete;
+                Scope& operator=(Scope const&) = delete;
+                void setItems(uint64_t n) {items = n;}
+                ~Scope() {
+                  Traffic after = TrafficCounter::connection(imap);
+                  metrics.record(op, start, std::chrono::steady_clock::now(), after.plain_read - before.plain_read,
+                                 after.plain_written - before.plain_written, items);
+                }
+        };
+
+private:
+        struct Counters {
+          std::atomic<uint64_t> count{0};
+          std::atomic<uint64_t> micros{0};
+          std::atomic<uint64_t> bytes_in{0};
+          std::atomic<uint64_t> bytes_out{0};
+          std::atomic<uint64_t> items{0};
+          std::array<std::atomic<uint64_t>, 32> buckets{};
+        };
+        struct Event {
+          Op op;
+          uint32_t thread;
+          uint64_t start;
+          uint64_t duration;
+          uint64_t bytes_in;
+          uint64_t bytes_out;
+          uint64_t items;
+        };
+        std::array<Counters, OP_COUNT> counters;
+        std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        // Trace, only collected once startTrace was called:
+        std::atomic<bool> tracing{false};
+        std::string trace_path;
+        std::mutex trace_mutex;
+        std::vector<Event> events;
+        uint64_t dropped = 0;
+
+  /* ----- MAX_EVENTS ----- */
+  // Operations kept for the trace, later ones are only counted (a long session must not grow without bound).
+        static size_t const MAX_EVENTS = 1 << 20;
+
+  /* ----- threadId ----- */
+  // Function to return a small number identifying the calling thread in the trace.
+        static uint32_t threadId();
+
+public:
+        Metrics() = default;
+        Metrics(Metrics const&) = delete;
+        Metrics& operator=(Metrics const&) = delete;
+
+  /* ----- record ----- */
+  // Function to record an operation that ran from start to end.
+        void record(Op op, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end,
+                    uint64_t bytes_in = 0, uint64_t bytes_out = 0, uint64_t items = 0);
+
+  /* ----- time ----- */
+  // Function to return call() (e.g. a libetpan command over imap), recorded as an operation of kind op.
+        template <typename Call>
+        auto time(Op op, mailimap* imap, Call call, uint64_t items = 0) {
+          Scope scope(*this, op, imap);
+          scope.setItems(items);
+          return call();
+        }
+
+  /* ----- get / snapshot ----- */
+  // Functions to return the counts of one kind of operation, and of every kind that happened at least once.
+        OpStats get(Op op) const;
+        std::vector<OpStats> snapshot() const;
+
+  /* ----- reset ----- */
+  // Function to clear the counts (not the trace).
+        void reset();
+
+  /* ----- summary ----- */
+  // Function to return one short line for a status bar: the IMAP commands that took longest, parsing and list
+  // rebuilding time and the bytes read.
+        std::string summary() const;
+
+  /* ----- startTrace / writeTrace ----- */
+  // Functions to keep every operation from now on for a trace to be written to path, and to write it (returns false
+  // if that fails). The destructor writes it too.
+        void startTrace(std::string const& path);
+        bool writeTrace();
+
+  /* ----- DESTRUCTOR ----- */
+        ~Metrics();
+};
+}
+
+#endif /* METRICS_H */
@@ -0,0 +1,426 @@
+#include "mime.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iconv.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+using namespace IMAP;
+using namespace std;
+
+namespace {
+  // Value of every base64 character, -1 for bytes outside the alphabet:
+  struct Base64Table {
+    signed char values[256];
+    Base64Table() {
+      char const* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      memset(values, -1, sizeof(values));
+      for (int i = 0; i < 64; i++) {values[(unsigned char)alphabet[i]] = i;}
+    }
+  };
+  Base64Table const BASE64;
+
+  // Function to return the value of a hexadecimal digit, -1 if it is none:
+  int hexValue(char c) {
+    if (c >= '0' && c <= '9') {return c - '0';}
+    if (c >= 'A' && c <= 'F') {return c - 'A' + 10;}
+    if (c >= 'a' && c <= 'f') {return c - 'a' + 10;}
+    return -1;
+  }
+
+  // Functions to compare ASCII case-insensitively and to strip surrounding whitespace:
+  bool iequals(string_view a, string_view b) {
+    if (a.size() != b.size()) {return false;}
+    for (size_t i = 0; i < a.size(); i++) {
+      if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {return false;}
+    }
+    return true;
+  }
+  string_view trim(string_view s) {
+    size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == string_view::npos) {return {};}
+    return s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+  }
+
+#ifdef __SSE2__
+  // Function to select the bytes of v between lo and hi (ASCII only):
+  __m128i inRange(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+  }
+
+  // Function to decode 16 base64 characters into 12 bytes, returns false (writing nothing) unless all of them are in
+  // the alphabet:
+  bool decodeBase64Block(char const* in, char* out) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in));
+    __m128i upper = inRange(v, 'A', 'Z'), lower = inRange(v, 'a', 'z'), digit = inRange(v, '0', '9');
+    __m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+')), slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+    if (_mm_movemask_epi8(valid) != 0xffff) {return false;}
+    // Translate every class of characters by its offset to get the 6-bit values:
+    __m128i offset = _mm_or_si128(_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)), _mm_and_si128(lower, _mm_set1_epi8(-71))),
+                                  _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+                                               _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(19)), _mm_and_si128(slash, _mm_set1_epi8(16)))));
+    __m128i values = _mm_add_epi8(v, offset);
+#ifdef __SSSE3__
+    // Merge pairs of values into 12 bits, pairs of those into 24, then gather the three bytes of every 32-bit lane:
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    alignas(16) char bytes[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(bytes), packed);
+    memcpy(out, bytes, 12);
+#else
+    alignas(16) unsigned char s[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(s), values);
+    for (int q = 0; q < 4; q++) {
+      uint32_t word = uint32_t(s[4 * q]) << 18 | uint32_t(s[4 * q + 1]) << 12 | uint32_t(s[4 * q + 2]) << 6 | s[4 * q + 3];
+      out[3 * q] = char(word >> 16); out[3 * q + 1] = char(word >> 8); out[3 * q + 2] = char(word);
+    }
+#endif
+    return true;
+  }
+#endif
+}
+
+/* ----------------- MimePart Functions ---------------- */
+/* ----- parse ----- */
+MimePart MimePart::parse(string_view message) {
+  MimePart part;
+  parseInto(part, message, 0);
+  return part;
+}
+
+/* ----- parseInto ----- */
+void MimePart::parseInto(MimePart& part, string_view entity, int depth) {
+  // The headers end at the first empty line (an entity may have none at all):
+  size_t split = entity.size(), skip = 0;
+  size_t crlf = entity.find("\n\r\n"), lf = entity.find("\n\n");
+  if (entity.compare(0, 2, "\r\n") == 0) {split = 0; skip = 2;}
+  else if (entity.compare(0, 1, "\n") == 0) {split = 0; skip = 1;}
+  else if (crlf < lf) {split = crlf + 1; skip = 2;}
+  else if (lf != string_view::npos) {split = lf + 1; skip = 1;}
+  part.headers = entity.substr(0, split);
+  part.body = entity.substr(split + skip);
+
+  // Content-Type and friends, text/plain by default:
+  string_view content_type = header(part.headers, "Content-Type");
+  string_view mime_type = trim(content_type.substr(0, content_type.find(';')));
+  size_t slash = mime_type.find('/');
+  if (slash != string_view::npos) {
+    part.type = trim(mime_type.substr(0, slash));
+    part.subtype = trim(mime_type.substr(slash + 1));
+  }
+  part.charset = parameter(content_type, "charset");
+  part.encoding = header(part.headers, "Content-Transfer-Encoding");
+  part.filename = parameter(header(part.headers, "Content-Disposition"), "filename");
+  if (part.filename.empty()) {part.filename = parameter(content_type, "name");}
+  if (depth >= MAX_DEPTH) {return;}
+
+  // A message/rfc822 part holds a whole message:
+  if (part.is("message", "rfc822")) {
+    part.parts.emplace_back();
+    parseInto(part.parts.back(), part.body, depth + 1);
+    return;
+  }
+  if (!part.is("multipart")) {return;}
+
+  // Children are separated by lines "--boundary" (the line break before one belongs to it) and end at "--boundary--":
+  string_view boundary = parameter(content_type, "boundary");
+  if (boundary.empty()) {return;}
+  string_view body = part.body;
+  size_t begin = string_view::npos;
+  for (size_t pos = body.find(boundary); pos != string_view::npos; pos = body.find(boundary, pos + boundary.size())) {
+    if (pos < 2 || body[pos - 1] != '-' || body[pos - 2] != '-' || (pos > 2 && body[pos - 3] != '\n')) {continue;}
+    if (begin != string_view::npos) {
+      size_t end = pos - 2;
+      if (end > begin && body[end - 1] == '\n') {end--;}
+      if (end > begin && body[end - 1] == '\r') {end--;}
+      part.parts.emplace_back();
+      parseInto(part.parts.back(), body.substr(begin, end - begin), depth + 1);
+    }
+    size_t after = pos + boundary.size();
+    if (body.compare(after, 2, "--") == 0) {return;}
+    begin = body.find('\n', after);
+    if (begin == string_view::npos) {return;}
+    begin++;
+  }
+  // Without a closing delimiter the last child runs to the end:
+  if (begin != string_view::npos) {
+    part.parts.emplace_back();
+    parseInto(part.parts.back(), body.substr(begin), depth + 1);
+  }
+}
+
+/* ----- is ----- */
+bool MimePart::is(string_view type, string_view subtype) const {
+  return iequals(this->type, type) && (subtype.empty() || iequals(this->subtype, subtype));
+}
+
+/* ----- isAttachment ----- */
+bool MimePart::isAttachment() const {
+  string_view disposition = trim(header(headers, "Content-Disposition"));
+  return iequals(disposition.substr(0, 10), "attachment") || (!filename.empty() && !is("text"));
+}
+
+/* ----- findText ----- */
+MimePart const* MimePart::findText() const {
+  // Depth-first, so the first text of a multipart/alternative (normally the plain one) wins:
+  MimePart const* html = nullptr;
+  vector<MimePart const*> stack{this};
+  while (!stack.empty()) {
+    MimePart const* part = stack.back();
+    stack.pop_back();
+    for (auto child = part->parts.rbegin(); child != part->parts.rend(); ++child) {stack.push_back(&*child);}
+    if (!part->parts.empty() || !part->is("text") || part->isAttachment()) {continue;}
+    if (part->is("text", "plain")) {return part;}
+    if (!html && part->is("text", "html")) {html = part;}
+  }
+  return html;
+}
+
+/* ----- decode ----- */
+string MimePart::decode(bool vectorized) const {
+  string out(body.size(), '\0');
+  string_view transfer = trim(encoding);
+  if (iequals(transfer, "base64")) {out.resize(decodeBase64(body, &out[0], vectorized));}
+  else if (iequals(transfer, "quoted-printable")) {out.resize(decodeQuotedPrintable(body, &out[0], vectorized));}
+  else {out.assign(body);}
+  if (is("text")) {out = toUTF8(out, charset);}
+  return out;
+}
+
+/* ----- header ----- */
+string_view MimePart::header(string_view headers, string_view name) {
+  for (size_t pos = 0; pos < headers.size();) {
+    size_t eol = min(headers.find('\n', pos), headers.size());
+    if (eol - pos > name.size() && headers[pos + name.size()] == ':' && iequals(headers.substr(pos, name.size()), name)) {
+      // The value continues on lines starting with whitespace:
+      size_t end = eol;
+      while (end + 1 < headers.size() && (headers[end + 1] == ' ' || headers[end + 1] == '\t')) {
+        end = min(headers.find('\n', end + 1), headers.size());
+      }
+      size_t start = pos + name.size() + 1;
+      return trim(headers.substr(start, end - start));
+    }
+    pos = eol + 1;
+  }
+  return {};
+}
+
+/* ----- parameter ----- */
+string_view MimePart::parameter(string_view value, string_view name) {
+  for (size_t pos = value.find(';'); pos != string_view::npos;) {
+    size_t equals = value.find('=', pos + 1);
+    if (equals == string_view::npos) {return {};}
+    string_view key = trim(value.substr(pos + 1, equals - pos - 1));
+    size_t start = value.find_first_not_of(" \t\r\n", equals + 1);
+    if (start == string_view::npos) {return {};}
+    string_view found;
+    if (value[start] == '"') {
+      size_t close = value.find('"', start + 1);
+      found = value.substr(start + 1, close == string_view::npos ? string_view::npos : close - start - 1);
+      pos = close == string_view::npos ? close : value.find(';', close);
+    } else {
+      pos = value.find(';', start);
+      found = trim(value.substr(start, pos == string_view::npos ? pos : pos - start));
+    }
+    if (iequals(key, name)) {return found;}
+    // RFC 2231 extended value (charset'language'text), returned without its prefix:
+    if (key.size() == name.size() + 1 && key.back() == '*' && iequals(key.substr(0, name.size()), name)) {
+      size_t quote = found.find('\'', found.find('\'') + 1);
+      return quote == string_view::npos ? found : found.substr(quote + 1);
+    }
+  }
+  return {};
+}
+
+/* ----- decodeHeader ----- */
+string MimePart::decodeHeader(string_view value) {
+  string out;
+  bool after_word = false;
+  for (size_t pos = 0; pos <= value.size();) {
+    size_t start = value.find("=?", pos);
+    // Copy the text up to the next encoded-word unfolded, whitespace between two encoded-words is dropped:
+    string_view text = value.substr(pos, start == string_view::npos ? string_view::npos : start - pos);
+    if (!after_word || !trim(text).empty()) {
+      for (char c : text) {if (c != '\r' && c != '\n') {out += c;}}
+    }
+    if (start == string_view::npos) {break;}
+    // =?charset?B|Q?text?=
+    size_t mark = value.find('?', start + 2);
+    size_t end = mark == string_view::npos ? mark : value.find("?=", mark + 3);
+    if (end == string_view::npos || value[mark + 2] != '?') {
+      out += "=?";
+      pos = start + 2;
+      after_word = false;
+      continue;
+    }
+    string_view charset = value.substr(start + 2, mark - start - 2);
+    charset = charset.substr(0, charset.find('*'));
+    char kind = value[mark + 1];
+    string_view encoded = value.substr(mark + 3, end - mark - 3);
+    string decoded(encoded.size(), '\0');
+    if (kind == 'B' || kind == 'b') {decoded.resize(decodeBase64(encoded, &decoded[0]));}
+    else {
+      size_t n = 0;
+      for (size_t i = 0; i < encoded.size(); i++) {
+        if (encoded[i] == '_') {decoded[n++] = ' ';}
+        else if (encoded[i] == '=' && i + 2 < encoded.size() && hexValue(encoded[i + 1]) >= 0 && hexValue(encoded[i + 2]) >= 0) {
+          decoded[n++] = char(hexValue(encoded[i + 1]) << 4 | hexValue(encoded[i + 2]));
+          i += 2;
+        } else {decoded[n++] = encoded[i];}
+      }
+      decoded.resize(n);
+    }
+    out += toUTF8(decoded, charset);
+    pos = end + 2;
+    after_word = true;
+  }
+  return out;
+}
+
+/* ----- decodeBase64 ----- */
+size_t MimePart::decodeBase64(string_view in, char* out, bool vectorized) {
+  uint32_t bits = 0;
+  int count = 0;
+  return decodeBase64(in, out, bits, count, vectorized);
+}
+
+size_t MimePart::decodeBase64(string_view in, char* out, uint32_t& bits, int& count, bool vectorized) {
+  // Bits decoded but not written yet; at a multiple of 4 characters there are none left over, which is where whole
+  // blocks can be decoded at once:
+  size_t n = 0;
+  for (size_t i = 0; i < in.size();) {
+#ifdef __SSE2__
+    if (vectorized && count == 0) {
+      while (i + 16 <= in.size() && decodeBase64Block(in.data() + i, out + n)) {i += 16; n += 12;}
+      if (i == in.size()) {break;}
+    }
+#else
+    (void)vectorized;
+#endif
+    char c = in[i++];
+    int value = BASE64.values[(unsigned char)c];
+    if (value < 0) {
+      // Padding ends a group, anything else (line breaks) is skipped:
+      if (c == '=') {bits = 0; count = 0;}
+      continue;
+    }
+    bits = bits << 6 | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out[n++] = char(bits >> count);
+      bits &= (1u << count) - 1;
+    }
+  }
+  return n;
+}
+
+/* ----- decodeQuotedPrintable ----- */
+size_t MimePart::decodeQuotedPrintable(string_view in, char* out, bool vectorized) {
+  size_t n = 0;
+  for (size_t i = 0; i < in.size();) {
+    // Copy the run up to the next '=' as it is:
+    size_t next = i;
+#ifdef __SSE2__
+    if (vectorized) {
+      __m128i const equals = _mm_set1_epi8('=');
+      while (next + 16 <= in.size()) {
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in.data() + next)), equals));
+        if (mask) {next += __builtin_ctz(mask); break;}
+        next += 16;
+      }
+    }
+#else
+    (void)vectorized;
+#endif
+    while (next < in.size() && in[next] != '=') {next++;}
+    memcpy(out + n, in.data() + i, next - i);
+    n += next - i;
+    i = next;
+    if (i == in.size()) {break;}
+
+    // A soft line break, an encoded byte or a stray '=':
+    if (i + 1 < in.size() && in[i + 1] == '\n') {i += 2;}
+    else if (i + 2 < in.size() && in[i + 1] == '\r' && in[i + 2] == '\n') {i += 3;}
+    else if (i + 2 < in.size() && hexValue(in[i + 1]) >= 0 && hexValue(in[i + 2]) >= 0) {
+      out[n++] = char(hexValue(in[i + 1]) << 4 | hexValue(in[i + 2]));
+      i += 3;
+    } else {out[n++] = in[i++];}
+  }
+  return n;
+}
+
+/* ----- toUTF8 ----- */
+string MimePart::toUTF8(string_view text, string_view charset) {
+  charset = trim(charset);
+  if (charset.empty() || iequals(charset, "utf-8") || iequals(charset, "utf8") || iequals(charset, "us-ascii")) {
+    return string(text);
+  }
+  iconv_t converter = iconv_open("UTF-8", string(charset).c_str());
+  if (converter == (iconv_t)-1) {return string(text);}
+
+  string out(text.size() * 2 + 16, '\0');
+  char* in = const_cast<char*>(text.data());
+  size_t in_left = text.size();
+  size_t done = 0;
+  while (in_left > 0) {
+    char* dest = &out[done];
+    size_t out_left = out.size() - done;
+    size_t result = iconv(converter, &in, &in_left, &dest, &out_left);
+    done = dest - out.data();
+    if (result != (size_t)-1) {break;}
+    if (errno == E2BIG) {out.resize(out.size() * 2); continue;}
+    // An invalid or truncated sequence, replace its first byte:
+    if (done == out.size()) {out.resize(out.size() * 2);}
+    out[done++] = '?';
+    in++; in_left--;
+  }
+  iconv_close(converter);
+  out.resize(done);
+  return out;
+}
+
+/* ----------------- MimeDecoder Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+MimeDecoder::MimeDecoder(string_view encoding) : kind(IDENTITY) {
+  encoding = trim(encoding);
+  if (iequals(encoding, "base64")) {kind = BASE64;}
+  else if (iequals(encoding, "quoted-printable")) {kind = QUOTED_PRINTABLE;}
+}
+
+/* ----- decode ----- */
+void MimeDecoder::decode(string_view piece, string& out) {
+  if (kind == IDENTITY) {out.assign(piece); return;}
+  if (kind == BASE64) {
+    out.resize(piece.size());
+    out.resize(MimePart::decodeBase64(piece, &out[0], bits, count));
+    return;
+  }
+  // Quoted-printable: hold back an escape cut by the end of the piece ("=", "=4" or "=\r"):
+  string joined;
+  if (!carry.empty()) {
+    joined = carry + string(piece);
+    piece = joined;
+  }
+  size_t escape = piece.rfind('=');
+  size_t keep = escape != string_view::npos && piece.size() - escape < 3 ? escape : piece.size();
+  string held(piece.substr(keep));
+  out.resize(keep);
+  out.resize(MimePart::decodeQuotedPrintable(piece.substr(0, keep), &out[0]));
+  carry = move(held);
+}
+
+/* ----- finish ----- */
+void MimeDecoder::finish(string& out) {
+  out = move(carry);
+  carry.clear();
+}
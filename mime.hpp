@@ -0,0 +1,116 @@
+#ifndef MIME_H
+#define MIME_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Class: MimePart -------------------- */
+// Node of the MIME tree of a message. Parsing only splits the raw message into views (headers, still encoded body,
+// the Content-Type fields) and never copies or decodes anything, so the tree is only valid as long as the buffer it
+// was parsed from. Bodies are decoded on demand, one part at a time, with decode().
+class MimePart {
+private:
+  /* ----- MAX_DEPTH ----- */
+  // Deeper nesting (only seen in broken or hostile messages) is left unparsed.
+        static int const MAX_DEPTH = 32;
+
+  /* ----- parseInto ----- */
+  // Function to fill part from the entity (headers and body) it covers, recursing into multiparts.
+        static void parseInto(MimePart& part, std::string_view entity, int depth);
+
+public:
+        std::string_view headers;
+        std::string_view body; // transfer-encoded
+        std::string_view type = "text";
+        std::string_view subtype = "plain";
+        std::string_view charset;
+        std::string_view encoding;
+        std::string_view filename;
+        std::vector<MimePart> parts; // children of a multipart (or the message of a message/rfc822 part)
+
+  /* ----- parse ----- */
+  // Function to parse a raw message (headers and body as fetched with BODY[]) into its MIME tree.
+        static MimePart parse(std::string_view message);
+
+  /* ----- is ----- */
+  // Function to check the (case-insensitive) type and, unless empty, subtype of the part.
+        bool is(std::string_view type, std::string_view subtype = {}) const;
+
+  /* ----- isAttachment ----- */
+  // Function to check whether the part is a file rather than text to be shown inline.
+        bool isAttachment() const;
+
+  /* ----- findText ----- */
+  // Function to return the part to show as the text of the message: the first text/plain leaf that is not an
+  // attachment, else the first text/html one, nullptr if there is none.
+        MimePart const* findText() const;
+
+  /* ----- decode ----- */
+  // Function to return the body with its transfer encoding removed and, for text parts, converted to UTF-8. The
+  // scalar decoders are used if vectorized is false (see decodeBase64).
+        std::string decode(bool vectorized = true) const;
+
+  /* ----- header ----- */
+  // Function to return the value of the first header called name (still folded if it spans several lines), empty if
+  // missing.
+        static std::string_view header(std::string_view headers, std::string_view name);
+
+  /* ----- parameter ----- */
+  // Function to return a parameter (e.g. charset) of a structured header value, without quotes.
+        static std::string_view parameter(std::string_view value, std::string_view name);
+
+  /* ----- decodeHeader ----- */
+  // Function to decode the RFC 2047 encoded-words of a header value to UTF-8, unfolding it.
+        static std::string decodeHeader(std::string_view value);
+
+  /* ----- decodeBase64 / decodeQuotedPrintable ----- */
+  // Functions to decode a transfer encoding into out, which needs room for in.size() bytes, returning the number of
+  // bytes written. Characters outside the alphabet (line breaks) are skipped, respectively soft line breaks removed.
+  // Use SSE2 (and SSSE3 for base64 when built with it) unless vectorized is false.
+        static size_t decodeBase64(std::string_view in, char* out, bool vectorized = true);
+        static size_t decodeQuotedPrintable(std::string_view in, char* out, bool vectorized = true);
+
+  /* ----- decodeBase64 ----- */
+  // Function to decode base64 arriving in pieces: bits and count hold the group left incomplete by the previous
+  // piece (both 0 at the start).
+        static size_t decodeBase64(std::string_view in, char* out, uint32_t& bits, int& count, bool vectorized = true);
+
+  /* ----- toUTF8 ----- */
+  // Function to convert text from charset to UTF-8 with iconv, replacing invalid sequences by '?'. Text in an
+  // unknown charset is returned as it is.
+        static std::string toUTF8(std::string_view text, std::string_view charset);
+};
+
+/* -------------------- Class: MimeDecoder -------------------- */
+// Transfer decoder for a body that arrives in pieces (e.g. streamed to a file). The few characters at the end of a
+// piece that can only be decoded together with the next one are carried over, so memory use does not depend on the
+// size of the body.
+class MimeDecoder {
+private:
+        enum Kind {IDENTITY, BASE64, QUOTED_PRINTABLE};
+        Kind kind;
+        // Base64 group and quoted-printable escape left incomplete by the previous piece:
+        uint32_t bits = 0;
+        int count = 0;
+        std::string carry;
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // Decoder for a Content-Transfer-Encoding, anything but base64 and quoted-printable is passed through.
+        explicit MimeDecoder(std::string_view encoding);
+
+  /* ----- decode ----- */
+  // Function to decode the next piece into out (replacing its contents).
+        void decode(std::string_view piece, std::string& out);
+
+  /* ----- finish ----- */
+  // Function to write what is still carried over (a truncated escape, kept as it is) into out once the body ended.
+        void finish(std::string& out);
+};
+}
+
+#endif /* MIME_H */
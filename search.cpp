@@ -0,0 +1,313 @@
+#include "search.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace IMAP;
+using namespace std;
+
+namespace {
+  char const MAGIC[8] = {'M', 'P', 'K', 'I', 'N', 'D', 'E', 'X'};
+  uint32_t const VERSION = 1;
+  // Posting lists are purged once this many removed messages (and a quarter of the index) have piled up:
+  size_t const PURGE_THRESHOLD = 1024;
+
+  // Function to check whether a byte belongs to a token:
+  bool isTokenByte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+  }
+
+  // Functions to write and read a varint:
+  void putVarint(string& out, uint32_t value) {
+    while (value >= 0x80) {out += char(value | 0x80); value >>= 7;}
+    out += char(value);
+  }
+  uint32_t getVarint(unsigned char const*& p) {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+      unsigned char c = *p++;
+      value |= uint32_t(c & 0x7f) << shift;
+      if (!(c & 0x80)) {return value;}
+    }
+  }
+
+  // Functions to write and read the fields of the index file:
+  void write32(ostream& out, uint32_t value) {out.write(reinterpret_cast<char const*>(&value), sizeof(value));}
+  void writeString(ostream& out, string const& s) {write32(out, s.size()); out.write(s.data(), s.size());}
+  bool read32(istream& in, uint32_t& value) {return bool(in.read(reinterpret_cast<char*>(&value), sizeof(value)));}
+  bool readString(istream& in, string& s) {
+    uint32_t size;
+    if (!read32(in, size) || size > (1u << 30)) {return false;}
+    s.resize(size);
+    return bool(in.read(&s[0], size));
+  }
+  void writeSet(ostream& out, unordered_set<uint32_t> const& set) {
+    vector<uint32_t> uids(set.begin(), set.end());
+    sort(uids.begin(), uids.end());
+    string bytes;
+    uint32_t last = 0;
+    for (auto uid : uids) {putVarint(bytes, uid - last); last = uid;}
+    write32(out, uids.size());
+    writeString(out, bytes);
+  }
+  bool readSet(istream& in, unordered_set<uint32_t>& set) {
+    uint32_t count;
+    string bytes;
+    if (!read32(in, count) || !readString(in, bytes) || count > bytes.size()) {return false;}
+    auto p = reinterpret_cast<unsigned char const*>(bytes.data());
+    uint32_t last = 0;
+    set.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {set.insert(last += getVarint(p));}
+    return true;
+  }
+}
+
+/* ----------------- SearchIndex Functions ---------------- */
+/* ----- CONSTRUCTOR ----- */
+SearchIndex::SearchIndex(string path, uint32_t uidvalidity) : path(move(path)), uidvalidity(uidvalidity) {
+  if (!this->path.empty() && !load()) {
+    postings.clear(); documents.clear(); bodies.clear(); removed.clear();
+  }
+}
+
+/* ----- tokenize ----- */
+void SearchIndex::tokenize(string_view text, string& lowered, vector<string_view>& tokens) {
+  lowered.resize(text.size());
+  char* out = &lowered[0];
+  size_t start = SIZE_MAX; // start of the current token, SIZE_MAX between tokens
+  auto emit = [&](size_t end) {
+    if (end - start <= MAX_TOKEN) {tokens.emplace_back(out + start, end - start);}
+    start = SIZE_MAX;
+  };
+  size_t i = 0;
+#ifdef __SSE2__
+  // Classify and lowercase 16 bytes at a time, then walk the token boundaries in the resulting bit mask:
+  __m128i const A = _mm_set1_epi8('A' - 1), Z = _mm_set1_epi8('Z' + 1);
+  __m128i const a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);
+  __m128i const d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+  __m128i const case_bit = _mm_set1_epi8(0x20), zero = _mm_setzero_si128();
+  for (; i + 16 <= text.size(); i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(text.data() + i));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, A), _mm_cmplt_epi8(v, Z));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, a), _mm_cmplt_epi8(v, z));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, d0), _mm_cmplt_epi8(v, d9));
+    __m128i high = _mm_cmplt_epi8(v, zero); // bytes >= 0x80 are negative
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi8(v, _mm_and_si128(upper, case_bit)));
+    uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, high)));
+    // Bits at or above pos, flipped for the token we are in so the next set bit is the next boundary:
+    for (uint32_t pos = 0; pos < 16;) {
+      uint32_t boundaries = (start == SIZE_MAX ? mask : ~mask & 0xffff) >> pos;
+      if (!boundaries) {break;}
+      pos += __builtin_ctz(boundaries);
+      if (start == SIZE_MAX) {start = i + pos;}
+      else {emit(i + pos);}
+    }
+  }
+#endif
+  // Scalar fallback (and the tail):
+  for (; i < text.size(); i++) {
+    unsigned char c = text[i];
+    out[i] = (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+    bool token = isTokenByte(c);
+    if (token && start == SIZE_MAX) {start = i;}
+    else if (!token && start != SIZE_MAX) {emit(i);}
+  }
+  if (start != SIZE_MAX) {emit(text.size());}
+}
+
+/* ----- append ----- */
+void SearchIndex::append(Postings& list, uint32_t uid) {
+  if (uid > list.last) {
+    putVarint(list.bytes, uid - list.last);
+    list.last = uid;
+    list.count++;
+    return;
+  }
+  if (uid == list.last) {return;}
+  // Out of order (e.g. an older body fetched later): decode, insert and encode again.
+  vector<uint32_t> uids;
+  auto p = reinterpret_cast<unsigned char const*>(list.bytes.data());
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < list.count; i++) {uids.push_back(last += getVarint(p));}
+  auto it = lower_bound(uids.begin(), uids.end(), uid);
+  if (it != uids.end() && *it == uid) {return;}
+  uids.insert(it, uid);
+  list.bytes.clear();
+  last = 0;
+  for (auto u : uids) {putVarint(list.bytes, u - last); last = u;}
+  list.count++;
+}
+
+/* ----- decode ----- */
+void SearchIndex::decode(Postings const& list, vector<uint32_t>& uids) const {
+  auto p = reinterpret_cast<unsigned char const*>(list.bytes.data());
+  uint32_t uid = 0;
+  for (uint32_t i = 0; i < list.count; i++) {
+    uid += getVarint(p);
+    if (removed.empty() || !removed.count(uid)) {uids.push_back(uid);}
+  }
+}
+
+/* ----- addTokens ----- */
+void SearchIndex::addTokens(uint32_t uid, string_view text) {
+  string lowered;
+  vector<string_view> tokens;
+  tokenize(text, lowered, tokens);
+  // Each token once per message:
+  sort(tokens.begin(), tokens.end());
+  tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+  for (auto token : tokens) {
+    auto it = postings.find(token);
+    if (it == postings.end()) {it = postings.emplace(string(token), Postings()).first;}
+    append(it->second, uid);
+  }
+}
+
+/* ----- add ----- */
+void SearchIndex::add(uint32_t uid, string_view from, string_view subject) {
+  if (!documents.insert(uid).second) {return;}
+  removed.erase(uid);
+  addTokens(uid, from);
+  addTokens(uid, subject);
+  unsaved++;
+}
+
+/* ----- addBody ----- */
+void SearchIndex::addBody(uint32_t uid, string_view body) {
+  if (!documents.count(uid) || !bodies.insert(uid).second) {return;}
+  addTokens(uid, body);
+  unsaved++;
+}
+
+/* ----- remove ----- */
+void SearchIndex::remove(uint32_t uid) {
+  if (!documents.erase(uid)) {return;}
+  bodies.erase(uid);
+  removed.insert(uid);
+  unsaved++;
+  if (removed.size() > PURGE_THRESHOLD && removed.size() > documents.size() / 4) {purge();}
+}
+
+/* ----- purge ----- */
+void SearchIndex::purge() {
+  vector<uint32_t> uids;
+  for (auto it = postings.begin(); it != postings.end();) {
+    uids.clear();
+    decode(it->second, uids);
+    if (uids.empty()) {it = postings.erase(it); continue;}
+    Postings list;
+    for (auto uid : uids) {append(list, uid);}
+    it->second = move(list);
+    ++it;
+  }
+  removed.clear();
+}
+
+/* ----- search ----- */
+vector<uint32_t> SearchIndex::search(string_view query) const {
+  string lowered;
+  vector<string_view> tokens;
+  tokenize(query, lowered, tokens);
+  if (tokens.empty()) {return {};}
+  string_view prefix;
+  if (isTokenByte(query.back())) {prefix = tokens.back(); tokens.pop_back();}
+
+  // Intersect the exact terms, decoding the shortest list and streaming through the others:
+  vector<Postings const*> lists;
+  for (auto token : tokens) {
+    auto it = postings.find(token);
+    if (it == postings.end()) {return {};}
+    lists.push_back(&it->second);
+  }
+  sort(lists.begin(), lists.end(), [](Postings const* a, Postings const* b) {return a->count < b->count;});
+  vector<uint32_t> result;
+  if (!lists.empty()) {decode(*lists[0], result);}
+  for (size_t l = 1; l < lists.size() && !result.empty(); l++) {
+    auto p = reinterpret_cast<unsigned char const*>(lists[l]->bytes.data());
+    uint32_t uid = 0, left = lists[l]->count;
+    size_t kept = 0;
+    for (size_t i = 0; i < result.size(); i++) {
+      while (uid < result[i] && left) {uid += getVarint(p); left--;}
+      if (uid == result[i]) {result[kept++] = uid;}
+      else if (uid < result[i]) {break;} // list exhausted
+    }
+    result.resize(kept);
+  }
+  if (prefix.empty()) {return result;}
+
+  // The prefix term matches any token in its range: mark the messages of all their lists in a bitmap over UIDs,
+  // so a short prefix with thousands of tokens costs no sorting:
+  auto first = postings.lower_bound(prefix), last = first;
+  uint32_t max_uid = 0;
+  for (; last != postings.end() && last->first.compare(0, prefix.size(), prefix) == 0; ++last) {
+    max_uid = max(max_uid, last->second.last);
+  }
+  vector<uint64_t> bits(max_uid / 64 + 1);
+  for (auto it = first; it != last; ++it) {
+    auto p = reinterpret_cast<unsigned char const*>(it->second.bytes.data());
+    uint32_t uid = 0;
+    for (uint32_t i = 0; i < it->second.count; i++) {
+      uid += getVarint(p);
+      bits[uid / 64] |= uint64_t(1) << (uid % 64);
+    }
+  }
+  auto marked = [&bits, max_uid](uint32_t uid) {return uid <= max_uid && (bits[uid / 64] >> (uid % 64) & 1);};
+  if (!tokens.empty()) {
+    result.erase(remove_if(result.begin(), result.end(), [&](uint32_t uid) {return !marked(uid);}), result.end());
+    return result;
+  }
+  for (size_t word = 0; word < bits.size(); word++) {
+    for (uint64_t w = bits[word]; w; w &= w - 1) {
+      uint32_t uid = word * 64 + __builtin_ctzll(w);
+      if (removed.empty() || !removed.count(uid)) {result.push_back(uid);}
+    }
+  }
+  return result;
+}
+
+/* ----- load ----- */
+bool SearchIndex::load() {
+  ifstream in(path, ios::binary);
+  char magic[sizeof(MAGIC)];
+  uint32_t version, validity, count;
+  if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), MAGIC)) {return false;}
+  if (!read32(in, version) || version != VERSION || !read32(in, validity) || validity != uidvalidity) {return false;}
+  if (!readSet(in, documents) || !readSet(in, bodies) || !readSet(in, removed)) {return false;}
+  if (!read32(in, count)) {return false;}
+  for (uint32_t i = 0; i < count; i++) {
+    string token;
+    Postings list;
+    if (!readString(in, token) || !read32(in, list.last) || !read32(in, list.count) || !readString(in, list.bytes)) {return false;}
+    if (list.count > list.bytes.size()) {return false;}
+    postings.emplace(move(token), move(list));
+  }
+  return true;
+}
+
+/* ----- save ----- */
+void SearchIndex::save() {
+  if (path.empty() || !unsaved) {return;}
+  // Write a new file next to the old one and swap it in, so a crash never leaves a half-written index:
+  string tmp = path + ".tmp";
+  {
+    ofstream out(tmp, ios::binary | ios::trunc);
+    out.write(MAGIC, sizeof(MAGIC));
+    write32(out, VERSION);
+    write32(out, uidvalidity);
+    writeSet(out, documents);
+    writeSet(out, bodies);
+    writeSet(out, removed);
+    write32(out, postings.size());
+    for (auto const& [token, list] : postings) {
+      writeString(out, token);
+      write32(out, list.last);
+      write32(out, list.count);
+      writeString(out, list.bytes);
+    }
+    if (!out) {std::remove(tmp.c_str()); return;}
+  }
+  if (rename(tmp.c_str(), path.c_str()) == 0) {unsaved = 0;}
+}
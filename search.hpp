@@ -0,0 +1,101 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Class: SearchIndex -------------------- */
+// Local full-text index of a mailbox: an inverted index from token to the (ascending) UIDs of the messages containing
+// it, over From, Subject and every body the session has fetched. Posting lists are delta-encoded varints; removed
+// messages are dropped lazily through a tombstone set. The index can be persisted to a file, tagged with the
+// mailbox's UIDVALIDITY.
+class SearchIndex {
+private:
+  /* ----- Postings ----- */
+  // Posting list of a token: varint deltas between ascending UIDs.
+        struct Postings {
+          std::string bytes;
+          uint32_t last = 0;
+          uint32_t count = 0;
+        };
+
+        std::string path;
+        uint32_t uidvalidity;
+        std::map<std::string, Postings, std::less<>> postings;
+        // Messages whose envelope, respectively body, has been indexed, and removed messages still in postings:
+        std::unordered_set<uint32_t> documents;
+        std::unordered_set<uint32_t> bodies;
+        std::unordered_set<uint32_t> removed;
+        // Messages added, bodies added and messages removed since the index was last saved:
+        size_t unsaved = 0;
+
+  /* ----- MAX_TOKEN ----- */
+  // Longer runs (e.g. base64 data) are not indexed.
+        static size_t const MAX_TOKEN = 40;
+
+  /* ----- addTokens ----- */
+  // Function to add uid to the postings of every token of text.
+        void addTokens(uint32_t uid, std::string_view text);
+
+  /* ----- append / decode ----- */
+  // Functions to add a UID to a posting list and to decode one, skipping removed messages.
+        static void append(Postings& list, uint32_t uid);
+        void decode(Postings const& list, std::vector<uint32_t>& uids) const;
+
+  /* ----- purge ----- */
+  // Function to rewrite the posting lists without removed messages.
+        void purge();
+
+  /* ----- load ----- */
+  // Function to read the index from path, returns false (leaving it empty) if it is missing or does not match.
+        bool load();
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+  // Opens the index persisted at path for a mailbox with the given UIDVALIDITY (an empty index if there is none or
+  // path is empty, in which case it is never saved).
+        SearchIndex(std::string path, uint32_t uidvalidity);
+
+  /* ----- tokenize ----- */
+  // Function to split text into lowercased tokens (runs of ASCII letters and digits and of non-ASCII bytes, so
+  // UTF-8 words stay whole), appended to tokens as views into lowered. Uses SSE2 where available.
+        static void tokenize(std::string_view text, std::string& lowered, std::vector<std::string_view>& tokens);
+
+  /* ----- contains ----- */
+  // Function to check whether the envelope of uid has been indexed.
+        bool contains(uint32_t uid) const {return documents.count(uid) != 0;}
+
+  /* ----- add / addBody ----- */
+  // Functions to index the envelope fields, respectively the body, of a message.
+        void add(uint32_t uid, std::string_view from, std::string_view subject);
+        void addBody(uint32_t uid, std::string_view body);
+
+  /* ----- remove ----- */
+  // Function to drop a message from the index (e.g. after it has been expunged).
+        void remove(uint32_t uid);
+
+  /* ----- search ----- */
+  // Function to return the ascending UIDs of messages containing every token of query, the last token matching as
+  // a prefix (so results can follow typing).
+        std::vector<uint32_t> search(std::string_view query) const;
+
+  /* ----- save ----- */
+  // Function to write the index to its file if it changed, replacing the old file atomically.
+        void save();
+
+  /* ----- getUnsaved ----- */
+  // Function to return the number of changes (messages and bodies indexed or removed) since the last save.
+        size_t getUnsaved() const {return unsaved;}
+
+  /* ----- size ----- */
+  // Function to return the number of indexed messages.
+        size_t size() const {return documents.size();}
+};
+}
+
+#endif /* SEARCH_H */
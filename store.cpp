@@ -0,0 +1,305 @@
+#include "store.hpp"
+#include <algorithm>
+#include <cstring>
+
+using namespace IMAP;
+using namespace std;
+
+namespace {
+  // Stores with less garbage than this are never compacted:
+  size_t const COMPACT_THRESHOLD = 1024 * 1024;
+}
+
+/* ----------------- Arena Functions ---------------- */
+/* ----- store ----- */
+string_view Arena::store(string_view s) {
+  if (s.empty()) {return {};}
+  // Strings larger than a block get their own, inserted before the current block so it can still be filled:
+  if (s.size() > BLOCK_SIZE) {
+    auto block = make_unique<char[]>(s.size());
+    memcpy(block.get(), s.data(), s.size());
+    string_view copy(block.get(), s.size());
+    blocks.insert(blocks.empty() ? blocks.end() : blocks.end() - 1, move(block));
+    bytes += s.size();
+    return copy;
+  }
+  if (used + s.size() > BLOCK_SIZE) {
+    blocks.push_back(make_unique<char[]>(BLOCK_SIZE));
+    used = 0;
+  }
+  char* copy = blocks.back().get() + used;
+  memcpy(copy, s.data(), s.size());
+  used += s.size();
+  bytes += s.size();
+  return string_view(copy, s.size());
+}
+
+/* ----------------- MessageStore Functions ---------------- */
+/* ----- subjectKey ----- */
+string MessageStore::subjectKey(string_view subject) {
+  // Collapse white space and fold ASCII letters first, so the prefixes below are plain lowercase text:
+  string key;
+  for (char c : subject) {
+    if (c == '\t' || c == '\r' || c == '\n') {c = ' ';}
+    if (c == ' ' && (key.empty() || key.back() == ' ')) {continue;}
+    key += (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+  }
+  string_view s(key);
+  auto trim = [&s]() {
+    while (!s.empty() && s.front() == ' ') {s.remove_prefix(1);}
+    while (!s.empty() && s.back() == ' ') {s.remove_suffix(1);}
+  };
+  // Length of a "[...]" blob at the start of t, 0 if there is none:
+  auto blob = [](string_view t) -> size_t {
+    if (t.empty() || t.front() != '[') {return 0;}
+    size_t close = t.find(']');
+    return close == string_view::npos || t.find('[', 1) < close ? 0 : close + 1;
+  };
+  trim();
+  while (true) {
+    // A "(fwd)" trailer:
+    if (s.size() >= 5 && s.substr(s.size() - 5) == "(fwd)") {s.remove_suffix(5); trim(); continue;}
+    // "re:", "fw:", "fwd:", each possibly preceded by blobs and with one before the colon ("Re[2]:"):
+    string_view t = s;
+    for (size_t n; (n = blob(t));) {t.remove_prefix(n); while (!t.empty() && t.front() == ' ') {t.remove_prefix(1);}}
+    size_t prefix = t.substr(0, 2) == "re" ? 2 : t.substr(0, 3) == "fwd" ? 3 : t.substr(0, 2) == "fw" ? 2 : 0;
+    if (prefix) {
+      t.remove_prefix(prefix);
+      while (!t.empty() && t.front() == ' ') {t.remove_prefix(1);}
+      t.remove_prefix(blob(t));
+      if (!t.empty() && t.front() == ':') {s = t.substr(1); trim(); continue;}
+    }
+    // A leading blob, unless it is all there is ("[list] topic" sorts as "topic"):
+    size_t n = blob(s);
+    if (n && n < s.size()) {
+      string_view rest = s.substr(n);
+      while (!rest.empty() && rest.front() == ' ') {rest.remove_prefix(1);}
+      if (!rest.empty()) {s = rest; continue;}
+    }
+    break;
+  }
+  return string(s);
+}
+
+/* ----- senderKey ----- */
+string MessageStore::senderKey(string_view from) {
+  // The name before the first address, or that address if there is no name:
+  size_t open = from.find('<');
+  string_view name = from.substr(0, open);
+  size_t comma = name.rfind(',');
+  name = name.substr(0, comma);
+  while (!name.empty() && (name.front() == ' ' || name.front() == '"' || name.front() == '\'')) {name.remove_prefix(1);}
+  while (!name.empty() && (name.back() == ' ' || name.back() == '"' || name.back() == '\'')) {name.remove_suffix(1);}
+  if (name.empty() && open != string_view::npos) {
+    name = from.substr(open + 1);
+    name = name.substr(0, name.find('>'));
+  }
+  string key(name);
+  for (auto& c : key) {
+    if (c >= 'A' && c <= 'Z') {c = c - 'A' + 'a';}
+  }
+  return key;
+}
+
+/* ----- intern ----- */
+uint32_t MessageStore::intern(string_view sender) {
+  auto it = sender_ids.find(sender);
+  if (it != sender_ids.end()) {
+    sender_refs[it->second]++;
+    return it->second;
+  }
+  uint32_t id = sender_names.size();
+  sender_names.push_back(arena.store(sender));
+  sender_keys.push_back(arena.store(senderKey(sender)));
+  sender_refs.push_back(1);
+  sender_ids.emplace(sender_names.back(), id);
+  return id;
+}
+
+/* ----- add ----- */
+void MessageStore::add(uint32_t uid, string_view from, string_view subject, MessageAttributes const& attributes) {
+  if (slots.count(uid)) {return;}
+  // Reuse a freed slot if there is one:
+  uint32_t slot;
+  if (!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+    uids[slot] = uid;
+    senders[slot] = intern(from);
+    subjects[slot] = arena.store(subject);
+  }else {
+    slot = uids.size();
+    uids.push_back(uid);
+    senders.push_back(intern(from));
+    subjects.push_back(arena.store(subject));
+    subject_keys.emplace_back();
+    dates.push_back(0);
+    sizes.push_back(0);
+    flags.push_back(0);
+    generations.push_back(0);
+  }
+  // The sort keys are computed here once (a subject that is its own key is not stored twice):
+  string key = subjectKey(subject);
+  subject_keys[slot] = key == subject ? subjects[slot] : arena.store(key);
+  dates[slot] = attributes.date;
+  sizes[slot] = attributes.size;
+  flags[slot] = attributes.flags;
+  slots.emplace(uid, slot);
+  auto& order = orders[BY_UID];
+  if (!order.empty() && uids[order.back()] > uid) {sorted = false;}
+  order.push_back(slot);
+  pending.push_back(slot);
+}
+
+/* ----- less ----- */
+bool MessageStore::less(SortKey key, uint32_t a, uint32_t b) const {
+  switch (key) {
+    case BY_DATE: if (dates[a] != dates[b]) {return dates[a] < dates[b];} break;
+    case BY_SIZE: if (sizes[a] != sizes[b]) {return sizes[a] < sizes[b];} break;
+    case BY_FROM:
+      if (senders[a] != senders[b] && sender_keys[senders[a]] != sender_keys[senders[b]]) {
+        return sender_keys[senders[a]] < sender_keys[senders[b]];
+      }
+      break;
+    case BY_SUBJECT:
+      if (subject_keys[a] != subject_keys[b]) {return subject_keys[a] < subject_keys[b];}
+      break;
+    default: break;
+  }
+  return uids[a] < uids[b];
+}
+
+/* ----- sort ----- */
+void MessageStore::sort() {
+  if (!sorted) {
+    auto& order = orders[BY_UID];
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {return uids[a] < uids[b];});
+    sorted = true;
+  }
+  if (pending.empty()) {return;}
+  // A few new messages are inserted by binary search (a sync), many are sorted by themselves and merged into every
+  // other order (a download), so both cost a handful of comparisons per message already held:
+  size_t held = orders[BY_UID].size() - pending.size();
+  bool merge = pending.size() * 32 > held;
+  for (int key = BY_UID + 1; key < SORT_KEYS; key++) {
+    auto compare = [this, key](uint32_t a, uint32_t b) {return less(SortKey(key), a, b);};
+    auto& order = orders[key];
+    if (!merge) {
+      for (auto slot : pending) {order.insert(upper_bound(order.begin(), order.end(), slot, compare), slot);}
+      continue;
+    }
+    std::sort(pending.begin(), pending.end(), compare);
+    size_t middle = order.size();
+    order.insert(order.end(), pending.begin(), pending.end());
+    inplace_merge(order.begin(), order.begin() + middle, order.end(), compare);
+  }
+  pending.clear();
+}
+
+/* ----- setFlags ----- */
+void MessageStore::setFlags(uint32_t uid, uint32_t value) {
+  auto it = slots.find(uid);
+  if (it != slots.end()) {flags[it->second] = value;}
+}
+
+/* ----- position ----- */
+size_t MessageStore::position(uint32_t uid, SortKey key) const {
+  auto const& order = orders[key];
+  if (key == BY_UID) {
+    return lower_bound(order.begin(), order.end(), uid, [this](uint32_t slot, uint32_t uid) {return uids[slot] < uid;}) - order.begin();
+  }
+  // The message's own keys find it in the other orders:
+  auto it = slots.find(uid);
+  if (it == slots.end()) {return size();}
+  return lower_bound(order.begin(), order.end(), it->second, [this, key](uint32_t a, uint32_t b) {return less(key, a, b);})
+         - order.begin();
+}
+
+/* ----- remove ----- */
+void MessageStore::remove(vector<uint32_t> const& removed) {
+  bool any = false;
+  for (auto uid : removed) {
+    auto it = slots.find(uid);
+    if (it == slots.end()) {continue;}
+    uint32_t slot = it->second;
+    slots.erase(it);
+    // Free the slot, its strings stay in the arena until the next compaction:
+    garbage += subjects[slot].size();
+    if (subject_keys[slot].data() != subjects[slot].data()) {garbage += subject_keys[slot].size();}
+    if (--sender_refs[senders[slot]] == 0) {
+      garbage += sender_names[senders[slot]].size() + sender_keys[senders[slot]].size();
+    }
+    uids[slot] = 0;
+    subjects[slot] = {};
+    subject_keys[slot] = {};
+    generations[slot]++;
+    free_slots.push_back(slot);
+    any = true;
+  }
+  if (!any) {return;}
+  auto gone = [this](uint32_t slot) {return uids[slot] == 0;};
+  for (auto& order : orders) {order.erase(std::remove_if(order.begin(), order.end(), gone), order.end());}
+  pending.erase(std::remove_if(pending.begin(), pending.end(), gone), pending.end());
+  if (garbage > COMPACT_THRESHOLD && garbage > arena.getBytes() / 2) {compact();}
+}
+
+/* ----- compact ----- */
+void MessageStore::compact() {
+  // Copy the strings in use into a fresh arena, renumbering the senders still referred to:
+  Arena fresh;
+  vector<string_view> names, keys;
+  vector<uint32_t> refs;
+  vector<uint32_t> ids(sender_names.size(), UINT32_MAX);
+  sender_ids.clear();
+  for (uint32_t id = 0; id < sender_names.size(); id++) {
+    if (sender_refs[id] == 0) {continue;}
+    ids[id] = names.size();
+    names.push_back(fresh.store(sender_names[id]));
+    keys.push_back(fresh.store(sender_keys[id]));
+    refs.push_back(sender_refs[id]);
+    sender_ids.emplace(names.back(), ids[id]);
+  }
+  for (uint32_t slot = 0; slot < uids.size(); slot++) {
+    if (!uids[slot]) {continue;}
+    senders[slot] = ids[senders[slot]];
+    bool shared = subject_keys[slot].data() == subjects[slot].data();
+    subjects[slot] = fresh.store(subjects[slot]);
+    subject_keys[slot] = shared ? subjects[slot] : fresh.store(subject_keys[slot]);
+  }
+  sender_names.swap(names);
+  sender_keys.swap(keys);
+  sender_refs.swap(refs);
+  arena = move(fresh);
+  garbage = 0;
+}
+
+/* ----- clear ----- */
+void MessageStore::clear() {
+  // Keep the slots with new generations, so handles of the removed messages stay invalid:
+  free_slots.clear();
+  for (uint32_t slot = uids.size(); slot-- > 0;) {
+    uids[slot] = 0;
+    subjects[slot] = {};
+    subject_keys[slot] = {};
+    generations[slot]++;
+    free_slots.push_back(slot);
+  }
+  for (auto& order : orders) {order.clear();}
+  pending.clear(); sorted = true;
+  slots.clear();
+  sender_names.clear(); sender_keys.clear(); sender_refs.clear(); sender_ids.clear();
+  arena.clear();
+  garbage = 0;
+}
+
+/* ----- getBytes ----- */
+size_t MessageStore::getBytes() const {
+  size_t per_slot = 5 * sizeof(uint32_t) + sizeof(int64_t) + 2 * sizeof(string_view);
+  size_t bytes = uids.capacity() * per_slot + free_slots.capacity() * sizeof(uint32_t);
+  for (auto const& order : orders) {bytes += order.capacity() * sizeof(uint32_t);}
+  // Roughly a node and a bucket per hash table entry:
+  bytes += slots.size() * (sizeof(pair<uint32_t, uint32_t>) + 2 * sizeof(void*));
+  bytes += sender_ids.size() * (sizeof(pair<string_view, uint32_t>) + 2 * sizeof(void*));
+  bytes += sender_names.capacity() * (2 * sizeof(string_view) + sizeof(uint32_t));
+  return bytes + arena.getBytes();
+}
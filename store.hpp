@@ -0,0 +1,178 @@
+#ifndef STORE_H
+#define STORE_H
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Class: Arena -------------------- */
+// Append-only string storage in large blocks; stored strings never move, so views of them stay valid until clear().
+class Arena {
+private:
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t used = BLOCK_SIZE; // bytes used in the last block (full when there is none)
+        size_t bytes = 0; // bytes stored in total
+
+  /* ----- BLOCK_SIZE ----- */
+  // Size of a block, longer strings get a block of their own.
+        static size_t const BLOCK_SIZE = 64 * 1024;
+
+public:
+  /* ----- store ----- */
+  // Function to copy s into the arena and return a view of the copy.
+        std::string_view store(std::string_view s);
+
+  /* ----- clear ----- */
+  // Function to free all blocks, invalidating every view.
+        void clear() {blocks.clear(); used = BLOCK_SIZE; bytes = 0;}
+
+  /* ----- getBytes ----- */
+        size_t getBytes() const {return bytes;}
+};
+
+/* -------------------- Struct: MessageAttributes -------------------- */
+// What a message is shown and sorted by besides its envelope: INTERNALDATE, RFC822.SIZE and FLAGS.
+struct MessageAttributes {
+        enum Flag {SEEN = 1, ANSWERED = 2, FLAGGED = 4, DELETED = 8, DRAFT = 16};
+        int64_t date = 0;   // seconds since the epoch
+        uint32_t size = 0;  // bytes
+        uint32_t flags = 0; // Flag bits
+};
+
+/* -------------------- Class: MessageStore -------------------- */
+// The messages of a mailbox, stored as a structure of arrays: one dense array per field, indexed by slot, plus the
+// slots in UID order. Subjects live in an arena and senders are interned (a mailbox has far fewer senders than
+// messages), so a message costs a few dozen bytes plus its subject. Views returned by the store are valid until
+// the next change of the store.
+//
+// Sort keys are computed once when a message is added (the subject without Re:/Fwd: and case folded, the sender's
+// name or address case folded, the date as a number) and the slots are kept in every sort order, merged as messages
+// are added and filtered as they are removed. Switching the order of the list is a matter of reading another array;
+// no string is ever parsed again.
+class MessageStore {
+public:
+  /* ----- SortKey ----- */
+  // Orders the store keeps (ties in UID order); BY_UID is the order of at() and position() by default.
+        enum SortKey {BY_UID, BY_DATE, BY_FROM, BY_SUBJECT, BY_SIZE, SORT_KEYS};
+
+  /* ----- Handle ----- */
+  // Stable reference to a message: it keeps referring to the same message while others are added and removed,
+  // and becomes invalid (never referring to another message) once its message is removed.
+        struct Handle {
+          uint32_t slot = UINT32_MAX;
+          uint32_t generation = 0;
+        };
+
+private:
+        // Per slot:
+        std::vector<uint32_t> uids;
+        std::vector<uint32_t> senders; // index into sender_names
+        std::vector<std::string_view> subjects;
+        std::vector<std::string_view> subject_keys;
+        std::vector<int64_t> dates;
+        std::vector<uint32_t> sizes;
+        std::vector<uint32_t> flags;
+        std::vector<uint32_t> generations; // incremented when the slot is freed
+        std::vector<uint32_t> free_slots;
+        // Slots of the stored messages in every sort order (the list position of a message), and the slots added
+        // since the last sort() to be merged into the orders but BY_UID:
+        std::array<std::vector<uint32_t>, SORT_KEYS> orders;
+        std::vector<uint32_t> pending;
+        bool sorted = true; // BY_UID
+        // UID -> slot:
+        std::unordered_map<uint32_t, uint32_t> slots;
+        // Interned senders and the number of messages referring to each:
+        std::vector<std::string_view> sender_names;
+        std::vector<std::string_view> sender_keys;
+        std::vector<uint32_t> sender_refs;
+        std::unordered_map<std::string_view, uint32_t> sender_ids;
+        // Strings of removed messages still taking up arena space:
+        Arena arena;
+        size_t garbage = 0;
+
+  /* ----- intern ----- */
+  // Function to return the id of sender, storing it if it is new.
+        uint32_t intern(std::string_view sender);
+
+  /* ----- compact ----- */
+  // Function to rebuild the arena and sender table with only the strings still in use.
+        void compact();
+
+  /* ----- less ----- */
+  // Function to compare two slots in the order of key.
+        bool less(SortKey key, uint32_t a, uint32_t b) const;
+
+public:
+  /* ----- subjectKey / senderKey ----- */
+  // Functions to compute the sort key of a subject (without "Re:", "Fwd:" and "[list]" prefixes nor a "(fwd)"
+  // trailer, white space collapsed, ASCII letters lowercased) and of a sender as the session formats it
+  // ("Name, <a@b>; " sorts by the name, "<a@b>; " by the address).
+        static std::string subjectKey(std::string_view subject);
+        static std::string senderKey(std::string_view from);
+
+  /* ----- add ----- */
+  // Function to store a message (ignored if its UID is already stored). Call sort() before using positions again.
+        void add(uint32_t uid, std::string_view from, std::string_view subject, MessageAttributes const& attributes = {});
+
+  /* ----- sort ----- */
+  // Function to bring the sort orders up to date after adds: a few added messages are inserted by binary search, a
+  // large batch is sorted by itself and merged in; neither re-sorts what is already held.
+        void sort();
+
+  /* ----- setFlags ----- */
+  // Function to change the flags of a stored message (which are in no sort order).
+        void setFlags(uint32_t uid, uint32_t flags);
+
+  /* ----- remove ----- */
+  // Function to remove the messages with the given UIDs with a single pass over the positions.
+        void remove(std::vector<uint32_t> const& uids);
+
+  /* ----- clear ----- */
+  // Function to remove all messages.
+        void clear();
+
+  /* ----- size ----- */
+  // Function to return the number of stored messages.
+        size_t size() const {return orders[BY_UID].size();}
+
+  /* ----- at / find ----- */
+  // Functions to return the handle of the message at a list position in the order of key, or with a UID (an invalid
+  // handle if none).
+        Handle at(size_t pos, SortKey key = BY_UID) const {return {orders[key][pos], generations[orders[key][pos]]};}
+        Handle find(uint32_t uid) const {
+          auto it = slots.find(uid);
+          return it == slots.end() ? Handle{} : Handle{it->second, generations[it->second]};
+        }
+
+  /* ----- position ----- */
+  // Function to return the list position of uid in the order of key. If it is not stored, that is the position of the
+  // first message with a larger UID in UID order, and size() in the other orders.
+        size_t position(uint32_t uid, SortKey key = BY_UID) const;
+
+  /* ----- valid ----- */
+  // Function to check whether a handle still refers to a stored message.
+        bool valid(Handle h) const {return h.slot < generations.size() && generations[h.slot] == h.generation && uids[h.slot];}
+
+  /* ----- uid / from / subject ----- */
+  // Functions to return the fields of a message, the handle must be valid.
+        uint32_t uid(Handle h) const {return uids[h.slot];}
+        std::string_view from(Handle h) const {return sender_names[senders[h.slot]];}
+        std::string_view subject(Handle h) const {return subjects[h.slot];}
+        MessageAttributes attributes(Handle h) const {return {dates[h.slot], sizes[h.slot], flags[h.slot]};}
+
+  /* ----- uidAt ----- */
+  // Function to return the UID at a list position in the order of key.
+        uint32_t uidAt(size_t pos, SortKey key = BY_UID) const {return uids[orders[key][pos]];}
+
+  /* ----- getBytes ----- */
+  // Function to return the approximate memory used by the store.
+        size_t getBytes() const;
+};
+}
+
+#endif /* STORE_H */
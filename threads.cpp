@@ -0,0 +1,365 @@
+#include "threads.hpp"
+#include <algorithm>
+#include <strings.h>
+
+using namespace IMAP;
+using namespace std;
+
+/* ----------------- ThreadIndex Functions ---------------- */
+/* ----- parseReferences ----- */
+vector<string_view> ThreadIndex::parseReferences(string_view references) {
+  // Every <...> is an id, whatever is between them (folding, comments, garbage) is skipped:
+  vector<string_view> ids;
+  while (true) {
+    size_t open = references.find('<');
+    if (open == string_view::npos) {break;}
+    size_t close = references.find('>', open);
+    if (close == string_view::npos) {break;}
+    if (close > open + 1) {ids.push_back(references.substr(open, close - open + 1));}
+    references.remove_prefix(close + 1);
+  }
+  return ids;
+}
+
+/* ----- newNode ----- */
+uint32_t ThreadIndex::newNode() {
+  uint32_t node;
+  if (!free_nodes.empty()) {
+    node = free_nodes.back();
+    free_nodes.pop_back();
+  }else {
+    node = nodes.size();
+    nodes.emplace_back();
+  }
+  nodes[node].used = true;
+  return node;
+}
+
+/* ----- nodeFor ----- */
+uint32_t ThreadIndex::nodeFor(string_view id) {
+  auto it = ids.find(string(id));
+  if (it != ids.end()) {return it->second;}
+  uint32_t node = newNode();
+  nodes[node].id = id;
+  ids.emplace(nodes[node].id, node);
+  return node;
+}
+
+/* ----- freeNode ----- */
+void ThreadIndex::freeNode(uint32_t node) {
+  if (!nodes[node].id.empty()) {ids.erase(nodes[node].id);}
+  nodes[node] = Node();
+  free_nodes.push_back(node);
+}
+
+/* ----- rootOf ----- */
+uint32_t ThreadIndex::rootOf(uint32_t node) const {
+  while (nodes[node].parent != NONE) {node = nodes[node].parent;}
+  return node;
+}
+
+/* ----- isAncestor ----- */
+bool ThreadIndex::isAncestor(uint32_t ancestor, uint32_t node) const {
+  for (; node != NONE; node = nodes[node].parent) {
+    if (node == ancestor) {return true;}
+  }
+  return false;
+}
+
+/* ----- link ----- */
+void ThreadIndex::link(uint32_t parent, uint32_t child) {
+  nodes[child].parent = parent;
+  nodes[parent].children.push_back(child);
+  // A newer message raises newest up the thread until it meets a newer one:
+  uint32_t newest = nodes[child].newest;
+  for (uint32_t node = parent; node != NONE && nodes[node].newest < newest; node = nodes[node].parent) {
+    nodes[node].newest = newest;
+  }
+}
+
+/* ----- unlink ----- */
+void ThreadIndex::unlink(uint32_t child) {
+  uint32_t parent = nodes[child].parent;
+  if (parent == NONE) {return;}
+  auto& siblings = nodes[parent].children;
+  siblings.erase(find(siblings.begin(), siblings.end(), child));
+  nodes[child].parent = NONE;
+  updateNewest(parent);
+}
+
+/* ----- updateNewest ----- */
+void ThreadIndex::updateNewest(uint32_t node) {
+  for (; node != NONE; node = nodes[node].parent) {
+    uint32_t newest = nodes[node].uid;
+    for (auto child : nodes[node].children) {newest = max(newest, nodes[child].newest);}
+    if (newest == nodes[node].newest) {return;}
+    nodes[node].newest = newest;
+  }
+}
+
+/* ----- prune ----- */
+uint32_t ThreadIndex::prune(uint32_t node) {
+  while (node != NONE && nodes[node].used && nodes[node].uid == 0 && nodes[node].children.empty()) {
+    uint32_t parent = nodes[node].parent;
+    unlink(node);
+    freeNode(node);
+    node = parent;
+  }
+  return node;
+}
+
+/* ----- threadRows ----- */
+void ThreadIndex::threadRows(uint32_t root, vector<Row>& out, vector<uint32_t>& out_nodes) const {
+  // Depth first through the thread, replies in UID order (a placeholder by its newest message); placeholders are not
+  // shown, their replies take their place:
+  vector<pair<uint32_t, uint32_t>> stack{{root, 0}};
+  vector<uint32_t> children;
+  while (!stack.empty()) {
+    auto [node, depth] = stack.back();
+    stack.pop_back();
+    if (nodes[node].uid) {
+      out.push_back({nodes[node].uid, depth++});
+      out_nodes.push_back(node);
+    }
+    children = nodes[node].children;
+    sort(children.begin(), children.end(), [this](uint32_t a, uint32_t b) {return order(a) > order(b);});
+    for (auto child : children) {stack.emplace_back(child, depth);}
+  }
+}
+
+/* ----- firstMessage ----- */
+uint32_t ThreadIndex::firstMessage(uint32_t root) const {
+  // Down the first reply (skipping placeholders holding no message) until there is a message:
+  uint32_t node = root;
+  while (!nodes[node].uid) {
+    uint32_t first = NONE;
+    for (auto child : nodes[node].children) {
+      if (nodes[child].newest && (first == NONE || order(child) < order(first))) {first = child;}
+    }
+    node = first;
+  }
+  return node;
+}
+
+/* ----- rowOf ----- */
+size_t ThreadIndex::rowOf(uint32_t node) const {
+  if (node < node_rows.size() && node_rows[node] < rows_valid && row_nodes[node_rows[node]] == node) {
+    return node_rows[node];
+  }
+  // Renumber the rows that moved since the last call (usually only the last few threads, where new mail goes):
+  node_rows.resize(nodes.size());
+  for (; rows_valid < row_nodes.size(); rows_valid++) {node_rows[row_nodes[rows_valid]] = rows_valid;}
+  return node_rows[node];
+}
+
+/* ----- detach ----- */
+void ThreadIndex::detach(uint32_t node) {
+  uint32_t root = rootOf(node);
+  if (!roots.erase({nodes[root].newest, root}) || stale) {return;}
+  // The rows of a thread follow each other, from its first message on:
+  size_t start = rowOf(firstMessage(root)), count = 0;
+  vector<uint32_t> stack{root};
+  while (!stack.empty()) {
+    uint32_t current = stack.back();
+    stack.pop_back();
+    if (nodes[current].uid) {count++;}
+    stack.insert(stack.end(), nodes[current].children.begin(), nodes[current].children.end());
+  }
+  rows.erase(rows.begin() + start, rows.begin() + start + count);
+  row_nodes.erase(row_nodes.begin() + start, row_nodes.begin() + start + count);
+  rows_valid = min(rows_valid, start);
+}
+
+/* ----- attach ----- */
+void ThreadIndex::attach(uint32_t node) {
+  uint32_t root = rootOf(node);
+  if (!nodes[root].newest) {return;}
+  auto [it, inserted] = roots.insert({nodes[root].newest, root});
+  if (!inserted || stale) {return;}
+  // Before the rows of the next thread, at the end for the thread of new mail:
+  size_t at = ++it == roots.end() ? rows.size() : rowOf(firstMessage(it->second));
+  vector<Row> thread;
+  vector<uint32_t> thread_nodes;
+  threadRows(root, thread, thread_nodes);
+  rows.insert(rows.begin() + at, thread.begin(), thread.end());
+  row_nodes.insert(row_nodes.begin() + at, thread_nodes.begin(), thread_nodes.end());
+  rows_valid = min(rows_valid, at);
+}
+
+/* ----- add ----- */
+void ThreadIndex::add(uint32_t uid, string_view message_id, string_view references) {
+  if (messages.count(uid)) {return;}
+  auto refs = parseReferences(references);
+  refs.erase(std::remove(refs.begin(), refs.end(), message_id), refs.end());
+  // A message without Message-ID, or repeating one already held, gets a node of its own:
+  uint32_t node = message_id.empty() ? newNode() : nodeFor(message_id);
+  if (nodes[node].uid) {node = newNode();}
+
+  // Take the threads this message touches out of the order while they change:
+  detach(node);
+  for (auto ref : refs) {
+    auto it = ids.find(string(ref));
+    if (it != ids.end()) {detach(it->second);}
+  }
+  nodes[node].uid = uid;
+  messages[uid] = node;
+  updateNewest(node);
+
+  // Chain the references (each the parent of the next) where that adds a link without breaking one or making a loop:
+  vector<uint32_t> touched{node};
+  uint32_t previous = NONE;
+  for (auto ref : refs) {
+    uint32_t current = nodeFor(ref);
+    touched.push_back(current);
+    if (previous != NONE && nodes[current].parent == NONE && !isAncestor(current, previous)) {link(previous, current);}
+    previous = current;
+  }
+  // The last reference is the parent, whatever other messages claimed:
+  uint32_t old_parent = nodes[node].parent;
+  if (previous != NONE && previous != old_parent && !isAncestor(node, previous)) {
+    unlink(node);
+    link(previous, node);
+    touched.push_back(old_parent);
+  }
+
+  // Drop placeholders left without replies and put the threads back into the order:
+  for (auto t : touched) {
+    if (t != NONE && t != node) {t = prune(t);}
+    if (t != NONE) {attach(t);}
+  }
+}
+
+/* ----- remove ----- */
+void ThreadIndex::remove(uint32_t uid) {
+  auto it = messages.find(uid);
+  if (it == messages.end()) {return;}
+  uint32_t node = it->second;
+  messages.erase(it);
+  detach(node);
+  nodes[node].uid = 0;
+  updateNewest(node);
+  // Keep the node as a placeholder while it holds replies, otherwise drop it (and placeholders above it):
+  uint32_t left = prune(node);
+  if (left != NONE) {attach(left);}
+}
+
+/* ----- parseThread ----- */
+bool ThreadIndex::parseThread(string_view& s, int64_t parent, vector<pair<int64_t, int64_t>>& edges, int64_t& placeholders) {
+  // "(1 2 (3)(4 5))": members each the parent of the next, then nested threads below the last one; a thread
+  // starting with nested ones has no message at its top, the server leaves a placeholder:
+  s.remove_prefix(1);
+  int64_t last = parent;
+  bool members = false, nested = false;
+  while (true) {
+    while (!s.empty() && s.front() == ' ') {s.remove_prefix(1);}
+    if (s.empty()) {return false;}
+    if (s.front() == ')') {
+      s.remove_prefix(1);
+      return members || nested;
+    }
+    if (s.front() == '(') {
+      if (!members) {
+        edges.emplace_back(parent, --placeholders);
+        last = placeholders;
+        members = true;
+      }
+      if (!parseThread(s, last, edges, placeholders)) {return false;}
+      nested = true;
+      continue;
+    }
+    if (nested || s.front() < '0' || s.front() > '9') {return false;}
+    int64_t uid = 0;
+    while (!s.empty() && s.front() >= '0' && s.front() <= '9') {
+      uid = uid * 10 + (s.front() - '0');
+      if (uid > UINT32_MAX) {return false;}
+      s.remove_prefix(1);
+    }
+    edges.emplace_back(last, uid);
+    last = uid;
+    members = true;
+  }
+}
+
+/* ----- assign ----- */
+bool ThreadIndex::assign(string_view response) {
+  // Read the whole response before touching anything:
+  if (response.size() < 6 || strncasecmp(response.data(), "THREAD", 6) != 0) {return false;}
+  response.remove_prefix(6);
+  vector<pair<int64_t, int64_t>> edges;
+  int64_t placeholders = 0;
+  while (true) {
+    while (!response.empty() && response.front() == ' ') {response.remove_prefix(1);}
+    if (response.empty()) {break;}
+    if (response.front() != '(' || !parseThread(response, 0, edges, placeholders)) {return false;}
+  }
+
+  // Unthread everything, keeping the messages (with their Message-IDs) and dropping the placeholders:
+  roots.clear();
+  stale = true;
+  for (uint32_t node = 0; node < nodes.size(); node++) {
+    nodes[node].parent = NONE;
+    nodes[node].children.clear();
+    nodes[node].newest = nodes[node].uid;
+  }
+  free_nodes.clear();
+  for (uint32_t node = 0; node < nodes.size(); node++) {
+    if (nodes[node].uid == 0) {freeNode(node);}
+  }
+
+  // Link as the server says (UIDs we do not hold are left out, their replies start threads of their own):
+  vector<uint32_t> anonymous(-placeholders, NONE);
+  auto resolve = [&](int64_t key) {
+    if (key < 0) {
+      auto& node = anonymous[-key - 1];
+      if (node == NONE) {node = newNode();}
+      return node;
+    }
+    auto it = messages.find(uint32_t(key));
+    return it == messages.end() ? NONE : it->second;
+  };
+  for (auto const& edge : edges) {
+    if (edge.first == 0) {continue;}
+    uint32_t parent = resolve(edge.first), child = resolve(edge.second);
+    if (parent == NONE || child == NONE || nodes[child].parent != NONE || isAncestor(child, parent)) {continue;}
+    link(parent, child);
+  }
+  for (uint32_t node : anonymous) {
+    if (node != NONE) {prune(node);}
+  }
+  for (auto const& message : messages) {attach(message.second);}
+  return true;
+}
+
+/* ----- clear ----- */
+void ThreadIndex::clear() {
+  nodes.clear();
+  free_nodes.clear();
+  ids.clear();
+  messages.clear();
+  roots.clear();
+  rows.clear();
+  row_nodes.clear();
+  node_rows.clear();
+  rows_valid = 0;
+  stale = true;
+}
+
+/* ----- list ----- */
+vector<ThreadIndex::Row> const& ThreadIndex::list() const {
+  if (!stale) {return rows;}
+  rows.clear();
+  row_nodes.clear();
+  rows.reserve(messages.size());
+  row_nodes.reserve(messages.size());
+  for (auto const& root : roots) {threadRows(root.second, rows, row_nodes);}
+  rows_valid = 0;
+  stale = false;
+  return rows;
+}
+
+/* ----- position ----- */
+size_t ThreadIndex::position(uint32_t uid) const {
+  size_t count = list().size();
+  auto it = messages.find(uid);
+  return it == messages.end() ? count : rowOf(it->second);
+}
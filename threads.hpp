@@ -0,0 +1,145 @@
+#ifndef THREADS_H
+#define THREADS_H
+#include <cstdint>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace IMAP {
+
+/* -------------------- Class: ThreadIndex -------------------- */
+// Conversation threads of a mailbox after the REFERENCES algorithm (JWZ, RFC 5256): messages are linked to their
+// parents by Message-ID and References (or In-Reply-To), messages referenced but not held are placeholders that keep
+// their thread together. The index is maintained incrementally: adding or removing a message only walks its own
+// thread up to the root (and its references) and splices that thread's rows in the thread order, so it costs about
+// the same for 100 or 100k messages. Threads are ordered by their newest message, messages within a thread by UID. Base subjects are not merged (unlike RFC 5256's
+// last step), so unrelated mail with a common subject stays apart. Not thread-safe: the session changes it under its
+// lock().
+class ThreadIndex {
+public:
+  /* ----- Row ----- */
+  // A message in thread order with its depth in the thread (0 for a thread's first message).
+        struct Row {
+          uint32_t uid;
+          uint32_t depth;
+        };
+
+private:
+  /* ----- Node ----- */
+  // A message or placeholder; newest is the largest UID in its subtree (0 if it holds no message).
+        struct Node {
+          uint32_t uid = 0;
+          uint32_t parent = NONE;
+          uint32_t newest = 0;
+          std::vector<uint32_t> children;
+          std::string id; // Message-ID, empty for anonymous nodes
+          bool used = false; // false while on free_nodes
+        };
+
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        std::vector<Node> nodes;
+        std::vector<uint32_t> free_nodes;
+        std::unordered_map<std::string, uint32_t> ids;
+        std::unordered_map<uint32_t, uint32_t> messages; // UID -> node
+        // Roots of threads holding messages, by their newest message:
+        std::set<std::pair<uint32_t, uint32_t>> roots;
+        // Thread order (the rows of every root in turn) with the node of each row, kept up to date by detach and
+        // attach once listed, and rebuilt on demand after clear and assign (so a whole mailbox is threaded first):
+        mutable std::vector<Row> rows;
+        mutable std::vector<uint32_t> row_nodes;
+        mutable bool stale = true;
+        // Row of each node, up to date for the nodes of the rows before rows_valid:
+        mutable std::vector<uint32_t> node_rows;
+        mutable size_t rows_valid = 0;
+
+  /* ----- newNode / nodeFor / freeNode ----- */
+  // Functions to create an anonymous node, to return the node of a Message-ID (creating a placeholder), and to
+  // release a node that has neither message nor children.
+        uint32_t newNode();
+        uint32_t nodeFor(std::string_view id);
+        void freeNode(uint32_t node);
+
+  /* ----- rootOf / isAncestor ----- */
+  // Functions to return the root of a node's thread, and whether ancestor is node or above it.
+        uint32_t rootOf(uint32_t node) const;
+        bool isAncestor(uint32_t ancestor, uint32_t node) const;
+
+  /* ----- link / unlink ----- */
+  // Functions to make child a child of parent and to make it a root again, keeping newest up to date above them.
+        void link(uint32_t parent, uint32_t child);
+        void unlink(uint32_t child);
+
+  /* ----- updateNewest ----- */
+  // Function to recompute newest from node up to its root, stopping where nothing changes.
+        void updateNewest(uint32_t node);
+
+  /* ----- prune ----- */
+  // Function to free node and its ancestors while they are placeholders without children. Returns the first node
+  // left (NONE if none).
+        uint32_t prune(uint32_t node);
+
+  /* ----- order ----- */
+  // Function to return what a node is listed by among its siblings: its UID, or its newest message for a placeholder.
+        uint32_t order(uint32_t node) const {return nodes[node].uid ? nodes[node].uid : nodes[node].newest;}
+
+  /* ----- threadRows / firstMessage / rowOf ----- */
+  // Functions to append the rows of root's thread (and their nodes) in thread order, to return the node of the first
+  // of them, and to return the row of a listed node (bringing rows_valid up to it).
+        void threadRows(uint32_t root, std::vector<Row>& out, std::vector<uint32_t>& out_nodes) const;
+        uint32_t firstMessage(uint32_t root) const;
+        size_t rowOf(uint32_t node) const;
+
+  /* ----- detach / attach ----- */
+  // Functions to take the thread of node out of the root order and its rows out of the thread order before changing
+  // it, and to put them back after.
+        void detach(uint32_t node);
+        void attach(uint32_t node);
+
+  /* ----- parseThread ----- */
+  // Function to read one parenthesized thread of a THREAD response from s below parent (0 at the top) as edges
+  // between UIDs, placeholders (which the server leaves for missing parents) being numbered -1, -2...
+        static bool parseThread(std::string_view& s, int64_t parent, std::vector<std::pair<int64_t, int64_t>>& edges,
+                                int64_t& placeholders);
+
+public:
+  /* ----- parseReferences ----- */
+  // Function to split a References (or In-Reply-To) header into its message ids, in order.
+        static std::vector<std::string_view> parseReferences(std::string_view references);
+
+  /* ----- add ----- */
+  // Function to thread a message, references being its References header (or In-Reply-To if it has none).
+        void add(uint32_t uid, std::string_view message_id, std::string_view references);
+
+  /* ----- remove ----- */
+  // Function to take a message out of its thread (it stays as a placeholder while it holds replies).
+        void remove(uint32_t uid);
+
+  /* ----- assign ----- */
+  // Function to replace the structure with the one a server computed: the untagged response to UID THREAD
+  // REFERENCES ("THREAD (1 2 (3)(4))..."). Messages keep their Message-IDs, so later adds thread onto it. Returns
+  // false (leaving the index as it was) if the response cannot be read.
+        bool assign(std::string_view response);
+
+  /* ----- clear ----- */
+  // Function to remove all messages.
+        void clear();
+
+  /* ----- list ----- */
+  // Function to return the messages in thread order (only rebuilt after clear and assign).
+        std::vector<Row> const& list() const;
+
+  /* ----- position ----- */
+  // Function to return the position of uid in list(), its size if it is not threaded.
+        size_t position(uint32_t uid) const;
+
+  /* ----- size ----- */
+  // Function to return the number of threaded messages.
+        size_t size() const {return messages.size();}
+};
+}
+
+#endif /* THREADS_H */
@@ -0,0 +1,128 @@
+#include "traffic.hpp"
+#include <cstdlib>
+
+using namespace IMAP;
+using namespace std;
+
+/* ----------------- TrafficCounter Functions ---------------- */
+mailstream_low_driver TrafficCounter::driver = {
+  /* mailstream_read */ TrafficCounter::read,
+  /* mailstream_write */ TrafficCounter::write,
+  /* mailstream_close */ TrafficCounter::close,
+  /* mailstream_get_fd */ TrafficCounter::getFd,
+  /* mailstream_free */ TrafficCounter::free,
+  /* mailstream_cancel */ TrafficCounter::cancel,
+  /* mailstream_get_cancel */ TrafficCounter::getCancel,
+  /* mailstream_get_certificate_chain */ TrafficCounter::getCertificateChain,
+  /* mailstream_setup_idle */ TrafficCounter::setupIdle,
+  /* mailstream_unsetup_idle */ TrafficCounter::unsetupIdle,
+  /* mailstream_interrupt_idle */ TrafficCounter::interruptIdle,
+};
+
+/* ----- attach ----- */
+void TrafficCounter::attach(mailimap* imap) {
+  // Until the connection is compressed, what goes over the wire is what the protocol sees:
+  wrap(imap, true, true);
+}
+
+/* ----- compress ----- */
+bool TrafficCounter::compress(mailimap* imap) {
+  if (!mailimap_has_compress_deflate(imap)) {return false;}
+  // The counter below the deflate driver only sees wire bytes from now on:
+  mailstream_low* low = mailstream_get_low(imap->imap_stream);
+  Tap* below = low->driver == &driver ? static_cast<Tap*>(low->data) : nullptr;
+  if (below) {below->plain = false;}
+  if (mailimap_compress(imap) != MAILIMAP_NO_ERROR) {
+    if (below) {below->plain = true;}
+    return false;
+  }
+  Tap* above = wrap(imap, false, true);
+  above->below = below;
+  if (below) {
+    above->read = below->read;
+    above->written = below->written;
+  }
+  return true;
+}
+
+/* ----- get ----- */
+Traffic TrafficCounter::get() const {
+  Traffic traffic;
+  traffic.wire_read = wire_read;
+  traffic.wire_written = wire_written;
+  traffic.plain_read = plain_read;
+  traffic.plain_written = plain_written;
+  return traffic;
+}
+
+/* ----- connection ----- */
+Traffic TrafficCounter::connection(mailimap const* imap) {
+  Traffic traffic;
+  if (!imap || !imap->imap_stream) {return traffic;}
+  mailstream_low* low = mailstream_get_low(imap->imap_stream);
+  if (!low || low->driver != &driver) {return traffic;}
+  auto tap = static_cast<Tap*>(low->data);
+  traffic.plain_read = tap->read;
+  traffic.plain_written = tap->written;
+  Tap* wire = tap->below ? tap->below : tap;
+  traffic.wire_read = wire->read;
+  traffic.wire_written = wire->written;
+  return traffic;
+}
+
+/* ----- wrap ----- */
+TrafficCounter::Tap* TrafficCounter::wrap(mailimap* imap, bool wire, bool plain) {
+  mailstream_low* inner = mailstream_get_low(imap->imap_stream);
+  Tap* tap = new Tap{inner, this, wire, plain};
+  mailstream_low* low = mailstream_low_new(tap, &driver);
+  low->timeout = inner->timeout;
+  mailstream_set_low(imap->imap_stream, low);
+  return tap;
+}
+
+/* ----- read / write ----- */
+ssize_t TrafficCounter::read(mailstream_low* low, void* buffer, size_t count) {
+  auto tap = static_cast<Tap*>(low->data);
+  ssize_t r = mailstream_low_read(tap->inner, buffer, count);
+  if (r <= 0) {return r;}
+  tap->read += r;
+  if (tap->wire) {tap->counter->wire_read += r;}
+  if (tap->plain) {tap->counter->plain_read += r;}
+  return r;
+}
+
+ssize_t TrafficCounter::write(mailstream_low* low, void const* buffer, size_t count) {
+  auto tap = static_cast<Tap*>(low->data);
+  ssize_t r = mailstream_low_write(tap->inner, buffer, count);
+  if (r <= 0) {return r;}
+  tap->written += r;
+  if (tap->wire) {tap->counter->wire_written += r;}
+  if (tap->plain) {tap->counter->plain_written += r;}
+  return r;
+}
+
+/* ----- close / free ----- */
+int TrafficCounter::close(mailstream_low* low) {
+  return mailstream_low_close(static_cast<Tap*>(low->data)->inner);
+}
+
+void TrafficCounter::free(mailstream_low* low) {
+  // We own the wrapped stream, as libetpan's own layered drivers do:
+  auto tap = static_cast<Tap*>(low->data);
+  mailstream_low_free(tap->inner);
+  delete tap;
+  ::free(low);
+}
+
+/* ----- forwarding ----- */
+int TrafficCounter::getFd(mailstream_low* low) {return mailstream_low_get_fd(static_cast<Tap*>(low->data)->inner);}
+void TrafficCounter::cancel(mailstream_low* low) {mailstream_low_cancel(static_cast<Tap*>(low->data)->inner);}
+struct mailstream_cancel* TrafficCounter::getCancel(mailstream_low* low) {
+  return mailstream_low_get_cancel(static_cast<Tap*>(low->data)->inner);
+}
+carray* TrafficCounter::getCertificateChain(mailstream_low* low) {
+  return mailstream_low_get_certificate_chain(static_cast<Tap*>(low->data)->inner);
+}
+int TrafficCounter::setupIdle(mailstream_low* low) {return mailstream_low_setup_idle(static_cast<Tap*>(low->data)->inner);}
+int TrafficCounter::unsetupIdle(mailstream_low* low) {return mailstream_low_unsetup_idle(static_cast<Tap*>(low->data)->inner);}
+int TrafficCounter::interruptIdle(mailstream_low* low) {return mailstream_low_interrupt_idle(static_cast<Tap*>(low->data)->inner);}
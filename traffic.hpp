@@ -0,0 +1,95 @@
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+#include <libetpan/libetpan.h>
+#include <atomic>
+#include <cstdint>
+
+namespace IMAP {
+
+/* -------------------- Struct: Traffic -------------------- */
+// Bytes read and written by the connections of a session, on the wire and as seen by the protocol (the same unless
+// the connection is compressed).
+struct Traffic {
+        uint64_t wire_read = 0;
+        uint64_t wire_written = 0;
+        uint64_t plain_read = 0;
+        uint64_t plain_written = 0;
+
+  /* ----- ratio ----- */
+  // Function to return how many protocol bytes went through per byte on the wire (1 without compression).
+        double ratio() const {
+          uint64_t wire = wire_read + wire_written;
+          return wire ? double(plain_read + plain_written) / wire : 1.0;
+        }
+};
+
+/* -------------------- Class: TrafficCounter -------------------- */
+// Counts the traffic of any number of connections (possibly used from different threads) by slipping a counting
+// driver under libetpan's stream of each, and turns on RFC 4978 COMPRESS=DEFLATE on them. A compressed connection
+// has a counter below the deflate driver (wire bytes) and one above it (plain bytes).
+class TrafficCounter {
+private:
+        std::atomic<uint64_t> wire_read{0};
+        std::atomic<uint64_t> wire_written{0};
+        std::atomic<uint64_t> plain_read{0};
+        std::atomic<uint64_t> plain_written{0};
+
+  /* ----- Tap ----- */
+  // Data of a counting driver: the stream it wraps, which counters it feeds and the bytes that went through it (only
+  // touched by the thread using the connection). The tap above a deflate driver points to the one below it, and
+  // starts from the plain bytes that one counted before compression.
+        struct Tap {
+          mailstream_low* inner;
+          TrafficCounter* counter;
+          bool wire;
+          bool plain;
+          Tap* below = nullptr;
+          uint64_t read = 0;
+          uint64_t written = 0;
+        };
+        static mailstream_low_driver driver;
+
+  /* ----- wrap ----- */
+  // Function to put a counting driver on top of the low-level stream of imap, returning its data.
+        Tap* wrap(mailimap* imap, bool wire, bool plain);
+
+  /* ----- driver functions ----- */
+  // Functions of the counting driver, forwarding to the wrapped stream.
+        static ssize_t read(mailstream_low* low, void* buffer, size_t count);
+        static ssize_t write(mailstream_low* low, void const* buffer, size_t count);
+        static int close(mailstream_low* low);
+        static int getFd(mailstream_low* low);
+        static void free(mailstream_low* low);
+        static void cancel(mailstream_low* low);
+        static struct mailstream_cancel* getCancel(mailstream_low* low);
+        static carray* getCertificateChain(mailstream_low* low);
+        static int setupIdle(mailstream_low* low);
+        static int unsetupIdle(mailstream_low* low);
+        static int interruptIdle(mailstream_low* low);
+
+public:
+        TrafficCounter() = default;
+        TrafficCounter(TrafficCounter const&) = delete;
+        TrafficCounter& operator=(TrafficCounter const&) = delete;
+
+  /* ----- attach ----- */
+  // Function to count the traffic of a freshly connected imap (call once, right after connecting).
+        void attach(mailimap* imap);
+
+  /* ----- compress ----- */
+  // Function to turn on COMPRESS=DEFLATE on an attached, logged in imap. Returns false, leaving the connection as it
+  // was, if the server does not advertise it or libetpan was built without zlib.
+        bool compress(mailimap* imap);
+
+  /* ----- get ----- */
+  // Function to return the traffic counted so far.
+        Traffic get() const;
+
+  /* ----- connection ----- */
+  // Function to return the traffic of one attached imap so far (nothing for a null or unattached one). Only call it
+  // from the thread using the connection.
+        static Traffic connection(mailimap const* imap);
+};
+}
+
+#endif /* TRAFFIC_H */
@@ -0,0 +1,94 @@
+#include "worker.hpp"
+
+using namespace IMAP;
+using namespace std;
+
+/* ----------------- Worker Functions ---------------- */
+/* ----- run ----- */
+void Worker::run() {
+  unique_lock<std::mutex> lock(queue_mutex);
+  while (true) {
+    wake.wait(lock, [this]() {return stopping || !jobs.empty() || !idle_jobs.empty();});
+    if (stopping) {return;}
+    auto& queue = jobs.empty() ? idle_jobs : jobs;
+    auto job = move(queue.front());
+    queue.pop_front();
+    // Run the job without holding the lock, so more jobs can be queued meanwhile. A job reports its own errors, one
+    // that escapes (e.g. bad_alloc) is dropped rather than ending the program:
+    lock.unlock();
+    try {job();} catch (...) {}
+    lock.lock();
+  }
+}
+
+/* ----- post ----- */
+void Worker::post(function<void()> job) {
+  {
+    lock_guard<std::mutex> guard(queue_mutex);
+    jobs.push_back(move(job));
+  }
+  wake.notify_one();
+}
+
+/* ----- postIdle ----- */
+void Worker::postIdle(function<void()> job) {
+  {
+    lock_guard<std::mutex> guard(queue_mutex);
+    idle_jobs.push_back(move(job));
+  }
+  wake.notify_one();
+}
+
+/* ----- stop ----- */
+void Worker::stop() {
+  {
+    lock_guard<std::mutex> guard(queue_mutex);
+    stopping = true;
+    jobs.clear();
+    idle_jobs.clear();
+  }
+  wake.notify_one();
+  if (thread.joinable()) {thread.join();}
+}
+
+/* ----------------- WorkerPool Functions ---------------- */
+/* ----- run ----- */
+void WorkerPool::run() {
+  unique_lock<std::mutex> lock(queue_mutex);
+  while (true) {
+    idle++;
+    bool woken = wake.wait_for(lock, chrono::seconds(IDLE_TIMEOUT), [this]() {return stopping || !jobs.empty();});
+    idle--;
+    if (stopping || !woken) {break;}
+    auto job = move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    try {job();} catch (...) {}
+    lock.lock();
+  }
+  // The last thing a thread does is telling stop() it is gone (under the lock, so the pool outlives the notify):
+  threads--;
+  finished.notify_all();
+}
+
+/* ----- post ----- */
+void WorkerPool::post(function<void()> job) {
+  lock_guard<std::mutex> guard(queue_mutex);
+  if (stopping) {return;}
+  jobs.push_back(move(job));
+  // Wake an idle thread, or start one (they are detached, stop() waits for them to end):
+  if (idle > jobs.size() - 1) {wake.notify_one();}
+  else if (threads < max_threads) {
+    threads++;
+    std::thread(&WorkerPool::run, this).detach();
+  }
+}
+
+/* ----- stop ----- */
+void WorkerPool::stop() {
+  unique_lock<std::mutex> lock(queue_mutex);
+  stopping = true;
+  jobs.clear();
+  wake.notify_all();
+  finished.wait(lock, [this]() {return threads == 0;});
+}
@@ -0,0 +1,196 @@
+#ifndef WORKER_H
+#define WORKER_H
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace IMAP {
+
+/* -------------------- Class: Worker -------------------- */
+// A thread running queued jobs one at a time in order, used to keep every libetpan call of a session off the UI thread.
+// Idle jobs (e.g. prefetching) only run while no other job waits.
+class Worker {
+private:
+        std::mutex queue_mutex;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> jobs;
+        std::deque<std::function<void()>> idle_jobs;
+        bool stopping = false;
+        std::thread thread;
+
+  /* ----- run ----- */
+  // Function run by the thread: waits for jobs and runs them until stopped.
+        void run();
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+        Worker() : thread(&Worker::run, this) {}
+        Worker(Worker const&) = delete;
+        Worker& operator=(Worker const&) = delete;
+
+  /* ----- post ----- */
+  // Function to queue a job. Exceptions escaping it are dropped, so a job must catch those it needs to report.
+        void post(std::function<void()> job);
+
+  /* ----- postIdle ----- */
+  // Function to queue a job to run once no job posted with post waits, in order with the other idle jobs.
+        void postIdle(std::function<void()> job);
+
+  /* ----- submit ----- */
+  // Function to queue a job and return a future for its result (or exception).
+        template <typename F> auto submit(F f) -> std::future<decltype(f())> {
+          auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+          auto future = task->get_future();
+          post([task]() {(*task)();});
+          return future;
+        }
+
+  /* ----- stop ----- */
+  // Function to drop all queued jobs, wait for the running one to finish and end the thread.
+        void stop();
+
+  /* ----- DESTRUCTOR ----- */
+        ~Worker() {stop();}
+};
+
+/* -------------------- Class: WorkerPool -------------------- */
+// Threads running queued jobs in parallel, shared by many users (e.g. the accounts of an AccountEngine). Threads are
+// only started while jobs wait for one, up to max_threads, and end after IDLE_TIMEOUT without work, so an idle
+// pool holds no threads at all.
+class WorkerPool {
+private:
+        std::mutex queue_mutex;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        std::deque<std::function<void()>> jobs;
+        size_t max_threads;
+        size_t threads = 0;
+        size_t idle = 0;
+        bool stopping = false;
+
+  /* ----- IDLE_TIMEOUT ----- */
+  // Seconds a thread waits for a job before it ends.
+        static constexpr unsigned IDLE_TIMEOUT = 10;
+
+  /* ----- run ----- */
+  // Function run by every thread: runs jobs until stopped or idle for too long.
+        void run();
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+        explicit WorkerPool(size_t max_threads) : max_threads(std::max<size_t>(1, max_threads)) {}
+        WorkerPool(WorkerPool const&) = delete;
+        WorkerPool& operator=(WorkerPool const&) = delete;
+
+  /* ----- post ----- */
+  // Function to queue a job, starting a thread for it if none is idle and the pool is not full. Exceptions escaping
+  // it are dropped.
+        void post(std::function<void()> job);
+
+  /* ----- stop ----- */
+  // Function to drop all queued jobs and wait for the running ones to finish.
+        void stop();
+
+  /* ----- DESTRUCTOR ----- */
+        ~WorkerPool() {stop();}
+};
+
+/* -------------------- Class: BoundedQueue -------------------- */
+// Thread-safe queue between the stages of a pipeline, holding items of a total weight (e.g. bytes) of at most
+// capacity: push waits while it is full, pop while it is empty, so a fast stage cannot run away from a slow one.
+template <typename T>
+class BoundedQueue {
+private:
+        std::mutex queue_mutex;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+        std::deque<std::pair<T, size_t>> items;
+        size_t capacity;
+        size_t weight = 0;
+        bool closed = false;
+
+public:
+  /* ----- CONSTRUCTOR ----- */
+        explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+        BoundedQueue(BoundedQueue const&) = delete;
+        BoundedQueue& operator=(BoundedQueue const&) = delete;
+
+  /* ----- push ----- */
+  // Function to queue an item, waiting for room (an item heavier than capacity gets in once the queue is empty).
+  // Returns false, dropping the item, once the queue is closed.
+        bool push(T item, size_t item_weight = 1) {
+          std::unique_lock<std::mutex> guard(queue_mutex);
+          not_full.wait(guard, [&]() {return closed || items.empty() || weight + item_weight <= capacity;});
+          if (closed) {return false;}
+          weight += item_weight;
+          items.emplace_back(std::move(item), item_weight);
+          not_empty.notify_one();
+          return true;
+        }
+
+  /* ----- pop ----- */
+  // Function to take the oldest item, waiting for one. Returns false once the queue is closed and empty.
+        bool pop(T& item) {
+          std::unique_lock<std::mutex> guard(queue_mutex);
+          not_empty.wait(guard, [&]() {return closed || !items.empty();});
+          if (items.empty()) {return false;}
+          item = std::move(items.front().first);
+          weight -= items.front().second;
+          items.pop_front();
+          not_full.notify_all();
+          return true;
+        }
+
+  /* ----- close / cancel ----- */
+  // Functions to end the queue: after close, pop still returns the queued items, after cancel they are dropped.
+  // Either way push fails from now on and nobody waits any more.
+        void close() {
+          std::lock_guard<std::mutex> guard(queue_mutex);
+          closed = true;
+          not_full.notify_all();
+          not_empty.notify_all();
+        }
+        void cancel() {
+          std::lock_guard<std::mutex> guard(queue_mutex);
+          closed = true;
+          items.clear();
+          weight = 0;
+          not_full.notify_all();
+          not_empty.notify_all();
+        }
+};
+
+/* -------------------- Class: CallbackQueue -------------------- */
+// Thread-safe queue of callbacks posted from the I/O thread and run on the UI thread by dispatch().
+class CallbackQueue {
+private:
+        std::mutex queue_mutex;
+        std::deque<std::function<void()>> callbacks;
+
+public:
+  /* ----- post ----- */
+  // Function to queue a callback.
+        void post(std::function<void()> callback) {
+          std::lock_guard<std::mutex> guard(queue_mutex);
+          callbacks.push_back(std::move(callback));
+        }
+
+  /* ----- dispatch ----- */
+  // Function to run all queued callbacks. The queue is not touched while they run, so a callback may destroy it.
+        void dispatch() {
+          std::deque<std::function<void()>> ready;
+          {
+            std::lock_guard<std::mutex> guard(queue_mutex);
+            ready.swap(callbacks);
+          }
+          for (auto& callback : ready) {callback();}
+        }
+};
+}
+
+#endif /* WORKER_H */